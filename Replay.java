@@ -0,0 +1,164 @@
+import java.io.File;
+import java.io.IOException;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.util.Arrays;
+import org.gnu.mach.Mach;
+import org.gnu.mach.MachPort;
+import org.gnu.mach.MachMsg;
+import org.gnu.mach.MachMsgType;
+import org.gnu.mach.MsgCapture;
+import org.gnu.mach.TypeCheckException;
+import org.gnu.mach.Unsafe;
+import org.gnu.hurd.Hurd;
+
+/**
+ * Replay the RPC requests of a message capture against a server.
+ *
+ * Usage: {@code java Replay CAPTURE NODE [original|max|FACTOR]}
+ *
+ * The requests found in CAPTURE (as written by {@link MsgCapture}) are
+ * re-sent one after the other to the server behind NODE, each with a fresh
+ * reply port, and the time until each reply is received is measured.
+ * Requests are recognized as messages sent with a {@code MAKE_SEND_ONCE}
+ * reply port; port names in their bodies are replaced with
+ * {@code MACH_PORT_NULL}, and those with out-of-line data or too large
+ * for the buffer are skipped. The rights carried by the replies are
+ * released.
+ *
+ * By default the requests are paced as in the original capture. With
+ * {@code max} they are sent as fast as the server replies, and with a
+ * numeric FACTOR the original pace is sped up by that factor. Since
+ * requests are sent from a single thread, the replay falls behind the
+ * requested pace when the server is slower than that.
+ */
+public class Replay {
+    /* Only replay messages sent with a MAKE_SEND_ONCE reply port. */
+    private static boolean isRequest(MsgCapture.Record rec) {
+        if(rec.dir() != MsgCapture.DIR_SEND
+                || (rec.option() & Mach.RCV_MSG) == 0)
+            return false;
+
+        ByteBuffer raw = ByteBuffer.wrap(rec.data());
+        raw.order(ByteOrder.nativeOrder());
+        int localType = (raw.getInt(0) >> 8) & 0xff;
+        return localType == MachMsgType.MAKE_SEND_ONCE.name();
+    }
+
+    private static void sleepUntil(long deadline) {
+        long delay;
+        while((delay = deadline - System.nanoTime()) > 0)
+            try {
+                Thread.sleep(delay / 1000000, (int) (delay % 1000000));
+            } catch(InterruptedException exc) {}
+    }
+
+    public static void main(String argv[]) throws IOException {
+        if(argv.length < 2) {
+            System.err.println(
+                    "Usage: java Replay CAPTURE NODE [original|max|FACTOR]");
+            System.exit(1);
+        }
+
+        double factor = 1.0;
+        if(argv.length > 2) {
+            if(argv[2].equals("max"))
+                factor = 0;
+            else if(!argv[2].equals("original"))
+                factor = Double.parseDouble(argv[2]);
+        }
+
+        System.loadLibrary("hurd-java");
+
+        MachPort server = new Hurd().fileNameLookup(argv[1], 0, 0);
+        if(server == null) {
+            System.err.println("Replay: cannot open " + argv[1]);
+            System.exit(1);
+        }
+
+        MsgCapture.Reader reader = new MsgCapture.Reader(new File(argv[0]));
+        MachMsg msg = new MachMsg(64 * 1024);
+        long[] latencies = new long[1024];
+        int count = 0, errors = 0, skipped = 0;
+        long firstNanos = -1, start = System.nanoTime();
+
+        /* The reply port is reused for all the requests. */
+        MachPort reply = MachPort.allocateReplyPort();
+
+        MsgCapture.Record rec;
+        while((rec = reader.next()) != null) {
+            if(!isRequest(rec))
+                continue;
+
+            msg.clear();
+            try {
+                msg.putRawBody(rec.data());
+            } catch(TypeCheckException exc) {
+                skipped++;
+                continue;
+            }
+
+            if(firstNanos < 0)
+                firstNanos = rec.nanos();
+            if(factor > 0)
+                sleepUntil(start
+                           + (long) ((rec.nanos() - firstNanos) / factor));
+
+            msg.setRemotePort(server, MachMsgType.COPY_SEND);
+            msg.setLocalPort(reply, MachMsgType.MAKE_SEND_ONCE);
+
+            int err = -1;
+            long t0 = System.nanoTime();
+            try {
+                err = Mach.msg(msg.buf(), Mach.SEND_MSG | Mach.RCV_MSG,
+                               reply.name(), Mach.MSG_TIMEOUT_NONE,
+                               Mach.Port.NULL);
+                reply.releaseName();
+                if(err == 0) {
+                    msg.flip();
+                    /* Don't let discard() deallocate the reply port's name. */
+                    msg.buf().putInt(12, Mach.Port.NULL);
+                }
+            } catch(Unsafe e) {}
+            long t1 = System.nanoTime();
+
+            if(err != 0) {
+                /* A reply may still come in for this request: don't let
+                 * it be taken for the reply to the next one. */
+                if(!Mach.isSendError(err)) {
+                    msg.clear();
+                    reply.destroy();
+                    reply = MachPort.allocateReplyPort();
+                }
+                errors++;
+                continue;
+            }
+            msg.discard();
+            if(count == latencies.length)
+                latencies = Arrays.copyOf(latencies, 2 * count);
+            latencies[count++] = t1 - t0;
+        }
+        msg.clear();
+        reader.close();
+        reply.destroy();
+        server.deallocate();
+
+        System.out.println(String.format(
+                    "%d requests replayed, %d errors, %d skipped",
+                    count, errors, skipped));
+        if(count == 0)
+            return;
+
+        Arrays.sort(latencies, 0, count);
+        long total = 0;
+        for(int i = 0; i < count; i++)
+            total += latencies[i];
+        System.out.println(String.format(
+                    "latency (us): mean %d, p50 %d, p90 %d, p99 %d, max %d",
+                    total / count / 1000,
+                    latencies[count / 2] / 1000,
+                    latencies[count * 9 / 10] / 1000,
+                    latencies[count * 99 / 100] / 1000,
+                    latencies[count - 1] / 1000));
+    }
+}
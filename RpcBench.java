@@ -0,0 +1,95 @@
+import org.gnu.mach.KernelModel;
+import org.gnu.mach.Mach;
+import org.gnu.mach.MachMsg;
+import org.gnu.mach.MachMsgArena;
+import org.gnu.mach.MachMsgType;
+import org.gnu.mach.MachPort;
+import org.gnu.mach.MachServer;
+import org.gnu.mach.TypeCheckException;
+import org.gnu.mach.Unsafe;
+
+/**
+ * Measure the round trip time of a minimal RPC handled by a MachServer
+ * in the same process.
+ *
+ * With {@code -Dorg.gnu.mach.backend=java}, messages go through the Java
+ * kernel model instead of the real kernel, and no native code is needed.
+ * Comparing both runs tells apart the cost of the Java message handling
+ * from that of JNI and of the kernel. With {@code -Dwired=true}, the
+ * server's buffers come from a wired {@link MachMsgArena}.
+ */
+public class RpcBench {
+    private static final int ID = 1000;
+
+    private static final MachServer.Demuxer echo = new MachServer.Demuxer() {
+        public boolean demux(int port, MachMsg request, MachMsg reply)
+            throws TypeCheckException
+        {
+            if(request.getId() != ID)
+                return false;
+            int value = request.getInt();
+            reply.putInt(0);
+            reply.putInt(value + 1);
+            return true;
+        }
+    };
+
+    public static void main(String argv[]) throws TypeCheckException {
+        int count = (argv.length > 0) ? Integer.parseInt(argv[0]) : 100000;
+        if(!(Mach.backend() instanceof KernelModel))
+            System.loadLibrary("hurd-java");
+
+        MachPort port = MachPort.allocate();
+        if(port == MachPort.NULL) {
+            System.err.println("RpcBench: cannot allocate a port");
+            System.exit(1);
+        }
+        MachMsgArena arena = null;
+        MachServer server;
+        if(Boolean.getBoolean("wired")) {
+            arena = new MachMsgArena(256, 2, true);
+            if(!arena.isWired())
+                System.err.println("Could not wire the server's buffers.");
+            server = new MachServer(port, echo, arena);
+        } else
+            server = new MachServer(port, echo, 256);
+        Thread thread = new Thread(server);
+        thread.setDaemon(true);
+        thread.start();
+
+        MachMsg msg = new MachMsg(256);
+        MachPort reply = MachPort.allocateReplyPort();
+        long start = System.nanoTime();
+        for(int i = 0; i < count; i++) {
+            msg.clear();
+            msg.setRemotePort(port, MachMsgType.MAKE_SEND);
+            msg.setLocalPort(reply, MachMsgType.MAKE_SEND_ONCE);
+            msg.setId(ID);
+            msg.putInt(i);
+
+            int err = -1;
+            try {
+                err = Mach.msg(msg.buf(),
+                               Mach.SEND_MSG | Mach.RCV_MSG,
+                               reply.name(),
+                               Mach.MSG_TIMEOUT_NONE,
+                               Mach.Port.NULL);
+                reply.releaseName();
+                msg.flip();
+            } catch(Unsafe e) {}
+
+            if(err != 0 || msg.getInt() != 0 || msg.getInt() != i + 1) {
+                System.err.println(String.format("RPC %d failed: %#x", i, err));
+                return;
+            }
+        }
+        long end = System.nanoTime();
+
+        System.out.println(String.format("%s: %d round trips, %.2f us each",
+                    Mach.backend().getClass().getSimpleName(), count,
+                    (end - start) / 1000.0 / count));
+
+        server.stop();
+        msg.clear();
+    }
+}
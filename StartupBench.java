@@ -0,0 +1,69 @@
+import java.lang.management.ManagementFactory;
+import org.gnu.mach.Mach;
+import org.gnu.mach.MachPort;
+import org.gnu.mach.MachMsg;
+import org.gnu.mach.MachMsgType;
+import org.gnu.mach.TypeCheckException;
+import org.gnu.mach.Unsafe;
+import org.gnu.hurd.Hurd;
+
+/**
+ * Measure the time from JVM start to the first completed RPC.
+ *
+ * Translators are started on demand when a node is first accessed, so
+ * whatever happens between the JVM being spawned and the first reply being
+ * sent is directly visible to the user. This reports the time spent in the
+ * JVM itself, in loading the JNI library, and in the first io_write() RPC
+ * (a zero-length write to standard output).
+ */
+public class StartupBench {
+    private static int firstRpc(MachPort port) throws TypeCheckException {
+        MachMsg msg = new MachMsg(1000);
+        MachPort reply = MachPort.allocateReplyPort();
+
+        msg.setRemotePort(port, MachMsgType.COPY_SEND);
+        msg.setLocalPort(reply, MachMsgType.MAKE_SEND_ONCE);
+        msg.setId(21000);
+        msg.putBytes(new byte[0]);
+        msg.putLong(-1);
+
+        int err = -1;
+        try {
+            err = Mach.msg(msg.buf(),
+                           Mach.SEND_MSG | Mach.RCV_MSG,
+                           reply.name(),
+                           Mach.MSG_TIMEOUT_NONE,
+                           Mach.Port.NULL);
+            reply.releaseName();
+            msg.flip();
+        } catch(Unsafe e) {}
+
+        reply.deallocate();
+        msg.clear();
+        return err;
+    }
+
+    public static void main(String argv[]) throws TypeCheckException {
+        long mainMillis = System.currentTimeMillis();
+        long t0 = System.nanoTime();
+        long startMillis = ManagementFactory.getRuntimeMXBean().getStartTime();
+
+        System.loadLibrary("hurd-java");
+        long t1 = System.nanoTime();
+
+        MachPort stdoutp = new Hurd().getdport(1);
+        int err = firstRpc(stdoutp);
+        stdoutp.deallocate();
+        long t2 = System.nanoTime();
+
+        System.out.println("err = " + err);
+        System.out.println(String.format("jvm start to main:   %8d ms",
+                    mainMillis - startMillis));
+        System.out.println(String.format("loadLibrary:         %8d us",
+                    (t1 - t0) / 1000));
+        System.out.println(String.format("first rpc:           %8d us",
+                    (t2 - t1) / 1000));
+        System.out.println(String.format("jvm start to reply:  %8d ms",
+                    mainMillis - startMillis + (t2 - t0) / 1000000));
+    }
+}
@@ -0,0 +1,21 @@
+#include "hurd-java.h"
+
+/* Entry point called by the JVM when libhurd-java.so is loaded through
+ * System.loadLibrary(). Translators are started on demand by the file
+ * system, so we bind all the natives and resolve the class and method IDs
+ * we need here, once, instead of paying for it lazily on the first RPCs. */
+JNIEXPORT jint JNICALL
+JNI_OnLoad (JavaVM *vm, void *reserved)
+{
+    JNIEnv *env;
+
+    if((*vm)->GetEnv(vm, (void **) &env, JNI_VERSION_1_4) != JNI_OK)
+        return JNI_ERR;
+
+    if(mach_register_natives(env) < 0)
+        return JNI_ERR;
+    if(hurd_register_natives(env) < 0)
+        return JNI_ERR;
+
+    return JNI_VERSION_1_4;
+}
@@ -0,0 +1,14 @@
+#ifndef HURD_JAVA_H
+#define HURD_JAVA_H
+
+#include <jni.h>
+
+/* Each module of the JNI library registers its native methods with
+ * RegisterNatives() from JNI_OnLoad(), rather than letting the JVM look
+ * up every Java_org_gnu_* symbol by name on first use. The functions below
+ * return 0 on success, or a negative value with a Java exception pending. */
+
+int mach_register_natives (JNIEnv *env);
+int hurd_register_natives (JNIEnv *env);
+
+#endif
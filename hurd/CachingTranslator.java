@@ -0,0 +1,1352 @@
+package org.gnu.hurd;
+
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.util.ArrayDeque;
+import java.util.Arrays;
+import java.util.HashMap;
+import java.util.LinkedHashMap;
+import java.util.Map;
+import org.gnu.mach.BlockCache;
+import org.gnu.mach.Mach;
+import org.gnu.mach.MachMsg;
+import org.gnu.mach.MachMsgType;
+import org.gnu.mach.MachPort;
+import org.gnu.mach.MachServer;
+import org.gnu.mach.TypeCheckException;
+import org.gnu.mach.Unsafe;
+import org.gnu.mach.rpc.RpcClient;
+import org.gnu.mach.rpc.RpcException;
+
+/**
+ * Translator caching the contents of a slower io/fs server.
+ *
+ * A {@link CachingTranslator} sits in front of the root directory of
+ * another filesystem, the backend, and hands out its own ports for every
+ * file opened through it. The data returned by {@code io_read} is kept in
+ * a {@link BlockCache} by file and block, the results of {@code io_stat}
+ * by file, and those of {@code dir_lookup} by directory, client open,
+ * name and flags, so that repeated reads, stats and opens are answered
+ * without a round trip to the backend. Requests we don't cache are
+ * passed on to the backend with {@link MachMsg#forward}.
+ *
+ * A file is only cached if the backend accepted a
+ * {@code file_notice_changes} (for directories, {@code dir_notice_changes})
+ * request for it: the {@code file_changed} and {@code dir_changed}
+ * notifications then invalidate the cached data as the file changes
+ * under us. Writes made through us invalidate the file as well. Files
+ * the backend won't report changes for are passed through unchanged.
+ *
+ * For cached files, the file pointer is kept here, so that plain
+ * {@code read()} calls, which use the current position, can be answered
+ * from the cache; writes at the current position are sent to the backend
+ * at an explicit offset, and the pointer is moved by the amount of data
+ * sent. Files opened with {@code O_APPEND} keep the backend's pointer.
+ *
+ * The backend checks the access of our clients, not ours: for each set
+ * of uids and gids passed to {@code fsys_getroot}, the backend's root is
+ * opened again with {@code io_restrict_auth}, and the files looked up from
+ * there carry the same ids. Since {@code io_restrict_auth} only keeps the
+ * ids we have ourselves, the translator should run as root, or else its
+ * clients get at most its own access. Nodes are never shared between
+ * credential sets, so neither is the cached data, and the lookup results
+ * are only reused for the same open of a directory. Lookups which create
+ * or truncate files are never cached.
+ *
+ * Requests which would hand out ports to the backend, and with them a way
+ * around the cache and its invalidation, are never passed on:
+ * {@code io_duplicate} and {@code io_restrict_auth} are answered with
+ * ports of ours, and the others, such as {@code io_reauthenticate},
+ * {@code io_map} or {@code file_getcontrol}, are refused. Only requests
+ * of the io and fs interfaces are passed on.
+ *
+ * Requests are received by a single thread, which answers the hits
+ * itself. The requests which need the backend, cache misses and lookups,
+ * are handed to a few worker threads along with their reply port, so that
+ * a slow backend call only holds up the client waiting for it. The state
+ * is guarded by the translator's lock, which is never held across a call
+ * to the backend.
+ */
+public class CachingTranslator implements MachServer.Demuxer,
+                                          StatsTranslator.Source
+{
+    /* From <hurd/hurd_types.h> */
+    private static final int FS_TRANS_SET = 4;
+    private static final int FS_RETRY_NORMAL = 1;
+    private static final int RETRY_NAME_SIZE = 1024;
+    private static final int FILE_CHANGED_NULL = 0;
+    private static final int DIR_CHANGED_NULL = 0;
+
+    /* Layout of io_statbuf_t (struct stat64), in ints. */
+    private static final int STAT_INTS = 32;
+    private static final int STAT_MODE = 7;
+    private static final int STAT_SIZE = 11;
+    private static final int S_IFMT = 0170000;
+    private static final int S_IFDIR = 0040000;
+
+    /* Type descriptor of an off_t, and of the data of io_write. */
+    private static final int INTEGER_64_TYPE = 0x1001400b;
+    private static final int BIT_INLINE = 0x10000000;
+    private static final int BIT_LONGFORM = 0x20000000;
+
+    private static final int BUFFER_SIZE = 8192;
+
+    /** Largest io_read() reply payload, leaving room for the header. */
+    private static final int MAX_READ = BUFFER_SIZE - 64;
+
+    /** Default size of the cached blocks. */
+    public static final int DEFAULT_BLOCK_SIZE = 2048;
+
+    /** Number of lookup results kept. */
+    private static final int MAX_LOOKUPS = 4096;
+
+    /** Number of credential sets whose root directory is kept. */
+    private static final int MAX_ROOTS = 64;
+
+    /** Number of threads making the calls to the backend. */
+    private static final int WORKERS = 4;
+
+    /**
+     * A backend file. It is shared by all the opens of the same backend
+     * port, and by the lookup results which returned it.
+     */
+    private static class Node {
+        final MachPort backend;
+        int users;
+        boolean cacheable;
+        boolean directory;
+        MachPort notify;
+        int notifyName;
+
+        /* Key of the file's blocks in the cache, changed to invalidate
+         * them. */
+        int cacheId;
+        byte[] stat;
+        int lookupGen;
+
+        Node(MachPort backend) {
+            this.backend = backend;
+        }
+    }
+
+    /** An open of a node, as one of our ports. */
+    private static class Open {
+        final MachPort port;
+        final Node node;
+        final long serial;
+        final int flags;
+        final boolean local;
+        long offset;
+
+        Open(MachPort port, Node node, long serial, int flags,
+             boolean local)
+        {
+            this.port = port;
+            this.node = node;
+            this.serial = serial;
+            this.flags = flags;
+            this.local = local;
+        }
+    }
+
+    /** The uids and gids of a client, in the form MIG sends them. */
+    private static class Creds {
+        final byte[] uids;
+        final byte[] gids;
+
+        Creds(byte[] uids, byte[] gids) {
+            this.uids = uids;
+            this.gids = gids;
+        }
+
+        public boolean equals(Object obj) {
+            if(!(obj instanceof Creds))
+                return false;
+            Creds c = (Creds) obj;
+            return Arrays.equals(uids, c.uids) && Arrays.equals(gids, c.gids);
+        }
+
+        public int hashCode() {
+            return Arrays.hashCode(uids) * 31 + Arrays.hashCode(gids);
+        }
+    }
+
+    private static class LookupKey {
+        final long serial;
+        final byte[] name;
+        final int flags;
+
+        LookupKey(long serial, byte[] name, int flags) {
+            this.serial = serial;
+            this.name = name;
+            this.flags = flags;
+        }
+
+        public boolean equals(Object obj) {
+            if(!(obj instanceof LookupKey))
+                return false;
+            LookupKey k = (LookupKey) obj;
+            return serial == k.serial && flags == k.flags
+                && Arrays.equals(name, k.name);
+        }
+
+        public int hashCode() {
+            return (int) (serial ^ (serial >>> 32)) * 31 * 31
+                 + Arrays.hashCode(name) * 31 + flags;
+        }
+    }
+
+    private static class Lookup {
+        final Node node;
+        final int gen;
+
+        Lookup(Node node, int gen) {
+            this.node = node;
+            this.gen = gen;
+        }
+    }
+
+    /**
+     * A request which may need the backend. The server thread first tries
+     * to {@link #answer} it with what we have; if something is missing,
+     * the request is handed to a worker, which {@link #fetch}es it from
+     * the backend and tries again.
+     */
+    private abstract class Pending {
+        final int id;
+        final Node node;
+        MachPort replyPort;
+        MachMsgType replyType;
+
+        /* What answer() found missing, a block of the node or else its
+         * attributes, as of the node's cache ID. */
+        long missBlock = -1;
+        int missId;
+
+        /* What fetch() got: the attributes, and the last block with its
+         * number. The request is answered from them even if the cache
+         * does not keep them, so that every fetch brings it closer. */
+        byte[] fetchedStat;
+        long fetchedBlock = -1;
+        byte[] fetchedData;
+
+        Pending(int id, Node node) {
+            this.id = id;
+            this.node = node;
+        }
+
+        /** Note that a block, or the attributes if -1, are missing. */
+        void miss(long block) {
+            missBlock = block;
+            missId = node.cacheId;
+        }
+
+        /**
+         * Append the results to the reply, with the lock held. Returns
+         * {@code false}, leaving the reply alone, if something must be
+         * fetched first.
+         */
+        abstract boolean answer(MachMsg reply) throws TypeCheckException;
+
+        /** Get what's missing from the backend, without the lock. */
+        void fetch() throws RpcException {
+            if(missBlock < 0) {
+                fetchedStat = backendStat(node.backend);
+            } else {
+                fetchedData = io.read(node.backend,
+                                      missBlock * cache.blockSize(),
+                                      cache.blockSize());
+                fetchedBlock = missBlock;
+            }
+        }
+
+        /** Cache what was fetched, unless the file changed meanwhile. */
+        void store() {
+            byte[] data = (missBlock < 0) ? fetchedStat : fetchedData;
+            if(data == null || missId != node.cacheId)
+                return;
+            if(missBlock < 0)
+                node.stat = data;
+            else
+                cache.put(((long) missId << 32) | (missBlock & 0xffffffffL),
+                          data, 0, Math.min(data.length, cache.blockSize()));
+        }
+
+        /** Release what was fetched, if the request can't be answered. */
+        void abandon() {
+        }
+    }
+
+    private final MachPort portSet;
+    private final MachPort control;
+    private final int controlName;
+    private final MachServer server;
+    private final RpcClient client = RpcClient.getDefault();
+    private final Io io = new IoProxy();
+    private final BlockCache cache;
+    private final MachPort backendRoot;
+    private Thread thread;
+
+    /* Requests waiting for a worker. */
+    private final ArrayDeque<Pending> pending = new ArrayDeque<Pending>();
+    private boolean stopped;
+
+    private final Map<Integer, Open> opens = new HashMap<Integer, Open>();
+    private final Map<Integer, Node> notifies = new HashMap<Integer, Node>();
+    private final LinkedHashMap<Creds, Node> roots =
+        new LinkedHashMap<Creds, Node>(16, 0.75f, true) {
+            static final long serialVersionUID = 1L;
+
+            protected boolean removeEldestEntry(Map.Entry<Creds, Node> eldest)
+            {
+                if(size() <= MAX_ROOTS)
+                    return false;
+                release(eldest.getValue());
+                return true;
+            }
+        };
+    private final LinkedHashMap<LookupKey, Lookup> lookups =
+        new LinkedHashMap<LookupKey, Lookup>(16, 0.75f, true) {
+            static final long serialVersionUID = 1L;
+
+            protected boolean removeEldestEntry(
+                    Map.Entry<LookupKey, Lookup> eldest)
+            {
+                if(size() <= MAX_LOOKUPS)
+                    return false;
+                release(eldest.getValue().node);
+                return true;
+            }
+        };
+
+    private int nextCacheId;
+    private long nextSerial;
+    private long lookupHits;
+    private long lookupMisses;
+    private long statHits;
+    private long statMisses;
+    private long invalidations;
+
+    /**
+     * Create a caching translator.
+     *
+     * @param backendRoot   The root directory of the backend. We take over
+     *                      the caller's reference. Clients only get
+     *                      ports to it restricted to their own ids.
+     * @param blockSize     The size of the cached blocks, and of the reads
+     *                      sent to the backend. The backend must return
+     *                      that much data in-line.
+     * @param blocks        The number of blocks in the cache, enough for
+     *                      at least two of the largest reads.
+     */
+    public CachingTranslator(MachPort backendRoot, int blockSize, int blocks)
+    {
+        if(blockSize <= 0 || blockSize > MAX_READ
+                || blocks < MAX_READ / blockSize + 2)
+            throw new IllegalArgumentException();
+
+        cache = new BlockCache(blockSize, blocks);
+        portSet = MachPort.allocate(MachPort.Right.PORT_SET);
+        control = MachPort.allocate();
+        if(portSet == MachPort.NULL || control == MachPort.NULL)
+            throw new IllegalStateException("cannot allocate ports");
+        controlName = join(control);
+        server = new MachServer(portSet, this, BUFFER_SIZE);
+        server.setFailureCode(Errno.EIO);
+        this.backendRoot = backendRoot;
+    }
+
+    /** Create a caching translator with blocks of the default size. */
+    public CachingTranslator(MachPort backendRoot, int blocks) {
+        this(backendRoot, DEFAULT_BLOCK_SIZE, blocks);
+    }
+
+    /**
+     * Move a receive right into our port set and return its name, which
+     * is used as the key of the object it stands for.
+     */
+    private int join(MachPort port) {
+        int name = Mach.Port.NULL;
+        try {
+            name = port.name();
+            int set = portSet.name();
+            Mach.Port.moveMember(Mach.taskSelf(), name, set);
+            portSet.releaseName();
+            port.releaseName();
+        } catch(Unsafe exc) {}
+        return name;
+    }
+
+    /** Start serving requests in daemon threads. */
+    private synchronized void start() {
+        if(thread != null)
+            return;
+
+        thread = new Thread(new Runnable() {
+            public void run() {
+                server.run();
+                shutdown();
+            }
+        }, "CachingTranslator");
+        thread.setDaemon(true);
+        thread.start();
+
+        for(int i = 0; i < WORKERS; i++) {
+            Thread worker = new Thread(new Runnable() {
+                public void run() {
+                    work();
+                }
+            }, "CachingTranslator-" + i);
+            worker.setDaemon(true);
+            worker.start();
+        }
+    }
+
+    /**
+     * Attach this translator to {@code path} as an active translator.
+     * The node goes back to its previous contents when this process exits.
+     *
+     * @return 0 on success, or an error code.
+     */
+    public int attach(String path) {
+        MachPort node = new Hurd().fileNameLookup(path, Hurd.O_NOTRANS, 0);
+        if(node == null)
+            return Errno.ENOENT;
+
+        int err = attach(node);
+        node.deallocate();
+        return err;
+    }
+
+    /**
+     * Attach this translator as an active translator to a node opened
+     * with {@code O_NOTRANS}. We keep the caller's reference to
+     * {@code node}.
+     *
+     * @return 0 on success, or an error code.
+     */
+    public int attach(MachPort node) {
+        start();
+
+        MachMsg msg = client.begin();
+        int err = 0;
+        try {
+            msg.setRemotePort(node, MachMsgType.COPY_SEND);
+            msg.setId(MsgIds.FILE_SET_TRANSLATOR);
+            msg.putInt(0);                      /* passive_flags */
+            msg.putInt(FS_TRANS_SET);           /* active_flags */
+            msg.putInt(0);                      /* oldtrans_flags */
+            msg.putBytes(new byte[0]);          /* passive */
+            msg.putPort(MachMsgType.MAKE_SEND, control);
+            client.call(msg);
+        } catch(RpcException exc) {
+            err = exc.code();
+        }
+        msg.clear();
+
+        if(err != 0)
+            stop();
+        return err;
+    }
+
+    /** Stop serving requests. The ports are released once the loop exits. */
+    public void stop() {
+        server.stop();
+    }
+
+    private synchronized void shutdown() {
+        stopped = true;
+        notifyAll();
+        for(Pending p : pending) {
+            p.replyPort.deallocate();
+            if(p.node != null)
+                release(p.node);
+        }
+        pending.clear();
+
+        for(Open open : opens.values()) {
+            open.port.destroy();
+            release(open.node);
+        }
+        opens.clear();
+        for(Lookup lookup : lookups.values())
+            release(lookup.node);
+        lookups.clear();
+        for(Node node : roots.values())
+            release(node);
+        roots.clear();
+        backendRoot.deallocate();
+        cache.clear();
+
+        control.destroy();
+        try {
+            Mach.Port.modRefs(Mach.taskSelf(), portSet.clear(),
+                              Mach.Port.RIGHT_PORT_SET, -1);
+        } catch(Unsafe exc) {}
+    }
+
+    public synchronized void report(StringBuilder out) {
+        out.append("blocks ").append(cache.size()).append('\n');
+        out.append("block_hits ").append(cache.hits()).append('\n');
+        out.append("block_misses ").append(cache.misses()).append('\n');
+        out.append("block_evictions ").append(cache.evictions()).append('\n');
+        out.append("stat_hits ").append(statHits).append('\n');
+        out.append("stat_misses ").append(statMisses).append('\n');
+        out.append("lookup_hits ").append(lookupHits).append('\n');
+        out.append("lookup_misses ").append(lookupMisses).append('\n');
+        out.append("invalidations ").append(invalidations).append('\n');
+        out.append("opens ").append(opens.size()).append('\n');
+        out.append("pending ").append(pending.size()).append('\n');
+    }
+
+    /* Nodes and opens */
+
+    /**
+     * Wrap a backend port, which we take over, and ask the backend to
+     * report the changes to the file. This calls the backend, so it is
+     * done without the lock, and the node must then be {@link #register}ed
+     * before use. The change notifications wait on the port until then.
+     */
+    private Node newNode(MachPort backend) {
+        Node node = new Node(backend);
+        try {
+            node.stat = backendStat(backend);
+        } catch(RpcException exc) {
+            return node;
+        }
+        int mode = ByteBuffer.wrap(node.stat).order(ByteOrder.nativeOrder())
+                             .getInt(STAT_MODE * 4);
+        node.directory = (mode & S_IFMT) == S_IFDIR;
+
+        node.notify = MachPort.allocate();
+        if(node.notify == MachPort.NULL) {
+            node.stat = null;
+            return node;
+        }
+        MachMsg msg = client.begin();
+        try {
+            msg.setRemotePort(backend, MachMsgType.COPY_SEND);
+            msg.setId(node.directory ? MsgIds.DIR_NOTICE_CHANGES
+                                     : MsgIds.FILE_NOTICE_CHANGES);
+            msg.putPort(MachMsgType.MAKE_SEND, node.notify);
+            client.call(msg);
+            node.cacheable = true;
+        } catch(RpcException exc) {
+            node.notify.destroy();
+            node.notify = null;
+            node.stat = null;
+        }
+        msg.clear();
+        return node;
+    }
+
+    /**
+     * Start serving the change notifications of a new node. The node is
+     * returned with no users.
+     */
+    private Node register(Node node) {
+        node.cacheId = nextCacheId++;
+        if(node.notify != null) {
+            node.notifyName = join(node.notify);
+            notifies.put(node.notifyName, node);
+        }
+        return node;
+    }
+
+    /** Destroy a new node which won't be registered. */
+    private static void drop(Node node) {
+        if(node.notify != null)
+            node.notify.destroy();
+        node.backend.deallocate();
+    }
+
+    /** Drop a use of a node, and the node itself if it was the last. */
+    private void release(Node node) {
+        if(--node.users > 0)
+            return;
+
+        if(node.notify != null) {
+            notifies.remove(node.notifyName);
+            node.notify.destroy();
+        }
+        node.backend.deallocate();
+    }
+
+    /**
+     * Create a new port for an open of {@code node}, and arrange for it to
+     * be destroyed once the client is done with it. If no port can be
+     * allocated, return {@link MachPort#NULL}, and drop the node if it has
+     * no users.
+     */
+    private MachPort newOpen(Node node, int flags) {
+        MachPort port = MachPort.allocate();
+        if(port == MachPort.NULL) {
+            if(node.users == 0) {
+                node.users = 1;
+                release(node);
+            }
+            return MachPort.NULL;
+        }
+        int name = join(port);
+        try {
+            /* The send right is made when the reply is sent, hence the
+             * make-send count of 1. */
+            Mach.Port.requestNotification(Mach.taskSelf(), name,
+                    Mach.NOTIFY_NO_SENDERS, 1, name,
+                    MachMsgType.MAKE_SEND_ONCE.name(), new int[1]);
+        } catch(Unsafe exc) {}
+
+        boolean local = node.cacheable && (flags & Hurd.O_APPEND) == 0;
+        opens.put(name, new Open(port, node, nextSerial++, flags, local));
+        node.users++;
+        return port;
+    }
+
+    /**
+     * Check a no-senders notification for one of our ports against the
+     * port's make-send count, as libports does: if send rights were made
+     * after it was generated, request another one and return
+     * {@code false}.
+     */
+    private static boolean noSenders(int name, int mscount) {
+        int[] status = new int[Mach.Port.STATUS_MAX];
+        try {
+            if(Mach.Port.getReceiveStatus(Mach.taskSelf(), name, status)
+                    != Mach.KERN_SUCCESS)
+                return true;
+            if(status[Mach.Port.STATUS_MSCOUNT] == mscount)
+                return true;
+            Mach.Port.requestNotification(Mach.taskSelf(), name,
+                    Mach.NOTIFY_NO_SENDERS, status[Mach.Port.STATUS_MSCOUNT],
+                    name, MachMsgType.MAKE_SEND_ONCE.name(), new int[1]);
+        } catch(Unsafe exc) {}
+        return false;
+    }
+
+    /** Forget the cached data and attributes of a file. */
+    private void invalidate(Node node) {
+        node.cacheId = nextCacheId++;
+        node.stat = null;
+        invalidations++;
+    }
+
+    /* Backend calls */
+
+    /** Get another port to a backend file, restricted to some ids. */
+    private MachPort restrictAuth(MachPort backend, Creds creds)
+        throws RpcException
+    {
+        MachMsg msg = client.begin();
+        try {
+            msg.setRemotePort(backend, MachMsgType.COPY_SEND);
+            msg.setId(MsgIds.IO_RESTRICT_AUTH);
+            msg.putBytes(MachMsgType.INTEGER_32.withNumber(
+                             creds.uids.length / 4), creds.uids);
+            msg.putBytes(MachMsgType.INTEGER_32.withNumber(
+                             creds.gids.length / 4), creds.gids);
+            client.call(msg);
+            MachPort port = msg.getPort(MachMsgType.PORT_SEND);
+            if(port == null)
+                throw new RpcException(Mach.MIG_TYPE_ERROR);
+            return port;
+        } catch(TypeCheckException exc) {
+            throw new RpcException(Mach.MIG_TYPE_ERROR);
+        } finally {
+            msg.clear();
+        }
+    }
+
+    /** Read the uids and gids of an fsys_getroot or io_restrict_auth. */
+    private static Creds getCreds(MachMsg request) throws TypeCheckException {
+        byte[] uids = request.getBytes(MachMsgType.INTEGER_32);
+        byte[] gids = request.getBytes(MachMsgType.INTEGER_32);
+        return new Creds(uids, gids);
+    }
+
+
+    private byte[] backendStat(MachPort backend) throws RpcException {
+        MachMsg msg = client.begin();
+        try {
+            msg.setRemotePort(backend, MachMsgType.COPY_SEND);
+            msg.setId(MsgIds.IO_STAT);
+            client.call(msg);
+            return msg.getBytes(MachMsgType.INTEGER_32, STAT_INTS);
+        } catch(TypeCheckException exc) {
+            throw new RpcException(Mach.MIG_TYPE_ERROR);
+        } finally {
+            msg.clear();
+        }
+    }
+
+    /* Cache access, with the lock held */
+
+    /**
+     * Get the attributes of the file of a request, or {@code null} if
+     * they must be fetched.
+     */
+    private byte[] stat(Pending p) {
+        if(p.node.stat != null) {
+            statHits++;
+            return p.node.stat;
+        }
+        /* The file may have changed since they were fetched for this
+         * request, but not before it came in. */
+        if(p.fetchedStat != null)
+            return p.fetchedStat;
+        statMisses++;
+        p.miss(-1);
+        return null;
+    }
+
+    private static long size(byte[] stat) {
+        return ByteBuffer.wrap(stat).order(ByteOrder.nativeOrder())
+                         .getLong(STAT_SIZE * 4);
+    }
+
+    /**
+     * Read from the file of a request, one block at a time. Returns
+     * {@code null} if the first block must be fetched, and stops short
+     * before any other missing block.
+     */
+    private byte[] read(Pending p, long pos, int amount) {
+        Node node = p.node;
+        int blockSize = cache.blockSize();
+        byte[] out = new byte[amount];
+        int n = 0;
+        while(n < amount) {
+            long block = (pos + n) / blockSize;
+            int offset = (int) ((pos + n) % blockSize);
+            long key = ((long) node.cacheId << 32) | (block & 0xffffffffL);
+
+            int b = cache.lookup(key);
+            int length;
+            if(b != BlockCache.NONE) {
+                length = cache.length(b);
+            } else if(n > 0) {
+                break;
+            } else if(p.fetchedData != null && p.fetchedBlock == block) {
+                /* Fetched for this request, but evicted or left out of
+                 * the cache since. */
+                length = Math.min(p.fetchedData.length, blockSize);
+            } else {
+                p.miss(block);
+                return null;
+            }
+
+            if(offset >= length)
+                break;
+            int count = Math.min(length - offset, amount - n);
+            if(b != BlockCache.NONE)
+                cache.get(b, offset, out, n, count);
+            else
+                System.arraycopy(p.fetchedData, offset, out, n, count);
+            n += count;
+
+            /* A short block is the end of the file. */
+            if(length < blockSize)
+                break;
+        }
+        return Arrays.copyOf(out, n);
+    }
+
+    /* Workers */
+
+    /**
+     * Answer a request if we can, or else take its reply port and queue
+     * it for a worker.
+     */
+    private void defer(Pending p, MachMsg request, MachMsg reply)
+        throws TypeCheckException
+    {
+        if(p.answer(reply))
+            return;
+
+        p.replyType = request.replyType();
+        p.replyPort = request.takeReplyPort();
+        if(p.replyPort == null) {
+            p.abandon();
+            return;
+        }
+        if(p.node != null)
+            p.node.users++;
+        pending.add(p);
+        notify();
+    }
+
+    private void waitUninterruptibly() {
+        try {
+            wait();
+        } catch(InterruptedException exc) {
+            /* ignore */
+        }
+    }
+
+    /* Body of the worker threads. */
+    private void work() {
+        MachMsg reply = new MachMsg(BUFFER_SIZE);
+        while(true) {
+            Pending p;
+            synchronized(this) {
+                while(pending.isEmpty() && !stopped)
+                    waitUninterruptibly();
+                if(stopped)
+                    break;
+                p = pending.poll();
+            }
+
+            /* A request may miss both the attributes and a block. */
+            boolean done = false;
+            while(!done) {
+                int err = 0;
+                try {
+                    p.fetch();
+                } catch(RpcException exc) {
+                    err = exc.code();
+                }
+
+                synchronized(this) {
+                    if(stopped)
+                        err = Errno.EIO;
+                    if(err == 0) {
+                        p.store();
+                        reply.clear();
+                        reply.setId(MsgIds.reply(p.id));
+                        try {
+                            done = p.answer(reply);
+                        } catch(TypeCheckException exc) {
+                            err = Mach.MIG_TYPE_ERROR;
+                        }
+                    }
+                    if(err != 0) {
+                        p.abandon();
+                        reply.clear();
+                        reply.setId(MsgIds.reply(p.id));
+                        reply.putInt(err);
+                        done = true;
+                    }
+                    if(done && p.node != null)
+                        release(p.node);
+                }
+            }
+            sendReply(p, reply);
+        }
+        reply.clear();
+    }
+
+    /** Send the reply to a request which was handed to a worker. */
+    private static void sendReply(Pending p, MachMsg reply) {
+        reply.setRemotePort(p.replyPort, p.replyType);
+        try {
+            int err = Mach.msg(reply.buf(), Mach.SEND_MSG, Mach.Port.NULL,
+                               Mach.MSG_TIMEOUT_NONE, Mach.Port.NULL);
+            if(err == Mach.MSG_SUCCESS) {
+                /* The header rights went with the reply. */
+                ByteBuffer buf = reply.buf();
+                buf.putInt(8, Mach.Port.NULL);
+                buf.putInt(12, Mach.Port.NULL);
+            }
+        } catch(Unsafe exc) {}
+        reply.clear();
+    }
+
+    /* Request handling */
+
+    public synchronized boolean demux(int port, MachMsg request,
+                                      MachMsg reply)
+        throws TypeCheckException
+    {
+        int id = request.getId();
+        if(port == controlName)
+            return demuxControl(id, request, reply);
+
+        Node changed = notifies.get(port);
+        if(changed != null)
+            return demuxNotify(changed, id, request, reply);
+
+        Open open = opens.get(port);
+        if(open == null)
+            return false;
+
+        switch(id) {
+            case Mach.NOTIFY_NO_SENDERS:
+                if(!noSenders(port, request.getInt()))
+                    return true;
+                opens.remove(port);
+                open.port.destroy();
+                release(open.node);
+                return true;
+
+            case MsgIds.IO_READ:
+                if(ioRead(open, request, reply))
+                    return true;
+                break;
+
+            case MsgIds.IO_SEEK:
+                if(!open.local)
+                    break;
+                ioSeek(open, request, reply);
+                return true;
+
+            case MsgIds.IO_READABLE:
+                if(!open.local)
+                    break;
+                ioReadable(open, request, reply);
+                return true;
+
+            case MsgIds.IO_STAT:
+                if(!open.node.cacheable)
+                    break;
+                defer(new Pending(id, open.node) {
+                    boolean answer(MachMsg reply)
+                        throws TypeCheckException
+                    {
+                        byte[] stat = stat(this);
+                        if(stat == null)
+                            return false;
+                        reply.putInt(0);
+                        reply.putBytes(
+                                MachMsgType.INTEGER_32.withNumber(STAT_INTS),
+                                stat);
+                        return true;
+                    }
+                }, request, reply);
+                return true;
+
+            case MsgIds.IO_WRITE:
+                ioWrite(open, request);
+                break;
+
+            case MsgIds.DIR_LOOKUP:
+                dirLookup(open, request, reply);
+                return true;
+
+            case MsgIds.IO_DUPLICATE:
+                /* Another right to the same port shares the file pointer,
+                 * as it should. */
+                reply.putInt(0);
+                reply.putPort(MachMsgType.MAKE_SEND, open.port);
+                return true;
+
+            case MsgIds.IO_RESTRICT_AUTH:
+                ioRestrictAuth(open, request, reply);
+                return true;
+
+            case MsgIds.IO_REAUTHENTICATE:
+                MachPort rendezvous = request.getPort(MachMsgType.PORT_SEND);
+                if(rendezvous != null)
+                    rendezvous.deallocate();
+                reply.putInt(Errno.EOPNOTSUPP);
+                return true;
+
+            case MsgIds.IO_ASYNC:
+            case MsgIds.IO_GET_ICKY_ASYNC_ID:
+            case MsgIds.IO_MAP:
+            case MsgIds.IO_MAP_CNTL:
+            case MsgIds.IO_IDENTITY:
+            case MsgIds.FILE_GETCONTROL:
+            case MsgIds.FILE_GET_STORAGE_INFO:
+            case MsgIds.FILE_GETLINKNODE:
+            case MsgIds.DIR_MKFILE:
+            case MsgIds.FILE_GET_TRANSLATOR_CNTL:
+            case MsgIds.FILE_REPARENT:
+                /* The ports these return would lead around us. */
+                reply.putInt(Errno.EOPNOTSUPP);
+                return true;
+        }
+
+        if((id < MsgIds.FILE_EXEC || id >= MsgIds.FILE_EXEC + 100)
+                && (id < MsgIds.IO_WRITE || id >= MsgIds.IO_WRITE + 100))
+            return false;
+
+        /* Anything else is the backend's business. If it could not be
+         * passed on, the request is left with its reply port. */
+        if(request.forward(open.node.backend, MachMsgType.COPY_SEND)
+                != Mach.MSG_SUCCESS)
+            reply.putInt(Errno.EIO);
+        return true;
+    }
+
+    /**
+     * Answer an io_read() request from the cache. Returns {@code false}
+     * if it should be passed on to the backend instead.
+     */
+    private boolean ioRead(final Open open, MachMsg request, MachMsg reply)
+        throws TypeCheckException
+    {
+        final long offset = request.getLong();
+        final int amount = Math.max(0, Math.min(request.getInt(), MAX_READ));
+        if(!open.node.cacheable || (offset == -1 && !open.local))
+            return false;
+
+        defer(new Pending(MsgIds.IO_READ, open.node) {
+            boolean answer(MachMsg reply) {
+                long pos = (offset == -1) ? open.offset : offset;
+                if(pos < 0) {
+                    reply.putInt(Errno.EINVAL);
+                    return true;
+                }
+
+                byte[] data = read(this, pos, amount);
+                if(data == null)
+                    return false;
+                if(offset == -1)
+                    open.offset += data.length;
+
+                reply.putInt(0);
+                reply.putBytes(data);
+                return true;
+            }
+        }, request, reply);
+        return true;
+    }
+
+    private void ioSeek(final Open open, MachMsg request, MachMsg reply)
+        throws TypeCheckException
+    {
+        final long offset = request.getLong();
+        final int whence = request.getInt();
+
+        defer(new Pending(MsgIds.IO_SEEK, open.node) {
+            boolean answer(MachMsg reply) {
+                long base;
+                switch(whence) {
+                    case 0: base = 0; break;
+                    case 1: base = open.offset; break;
+                    case 2:
+                        byte[] stat = stat(this);
+                        if(stat == null)
+                            return false;
+                        base = size(stat);
+                        break;
+                    default:
+                        reply.putInt(Errno.EINVAL);
+                        return true;
+                }
+                if(base + offset < 0) {
+                    reply.putInt(Errno.EINVAL);
+                    return true;
+                }
+
+                open.offset = base + offset;
+                reply.putInt(0);
+                reply.putLong(open.offset);
+                return true;
+            }
+        }, request, reply);
+    }
+
+    private void ioReadable(final Open open, MachMsg request, MachMsg reply)
+        throws TypeCheckException
+    {
+        defer(new Pending(MsgIds.IO_READABLE, open.node) {
+            boolean answer(MachMsg reply) {
+                byte[] stat = stat(this);
+                if(stat == null)
+                    return false;
+                long left = size(stat) - open.offset;
+                reply.putInt(0);
+                reply.putInt((int) Math.max(0, Math.min(left,
+                                                        Integer.MAX_VALUE)));
+                return true;
+            }
+        }, request, reply);
+    }
+
+    /**
+     * Prepare an io_write() request to be passed on to the backend: give
+     * it an explicit offset if we keep the file pointer, and invalidate
+     * the file. The data is left in place, in-line or not.
+     */
+    private void ioWrite(Open open, MachMsg request)
+        throws TypeCheckException
+    {
+        if(open.node.cacheable)
+            invalidate(open.node);
+        if(!open.local)
+            return;
+
+        try {
+            ByteBuffer buf = request.buf();
+            int header = buf.getInt(24);
+            int pos, length;
+            if((header & BIT_LONGFORM) != 0) {
+                length = buf.getInt(32);
+                pos = 36;
+            } else {
+                length = (header >> 16) & 0x0fff;
+                pos = 28;
+            }
+            pos += ((header & BIT_INLINE) != 0) ? (length + 3) & ~3 : 4;
+
+            if(pos + 12 > buf.limit() || buf.getInt(pos) != INTEGER_64_TYPE)
+                throw new TypeCheckException("Type check error (io_write)");
+            if(buf.getLong(pos + 4) == -1) {
+                buf.putLong(pos + 4, open.offset);
+                open.offset += length;
+            }
+        } catch(Unsafe exc) {}
+    }
+
+    private void dirLookup(final Open open, MachMsg request, MachMsg reply)
+        throws TypeCheckException
+    {
+        final byte[] name = request.getBytes(MachMsgType.STRING_C,
+                                             RETRY_NAME_SIZE);
+        final int flags = request.getInt();
+        final int mode = request.getInt();
+        final Node dir = open.node;
+
+        int len = 0;
+        while(len < name.length && name[len] != 0)
+            len++;
+        LookupKey k = null;
+        if(dir.cacheable
+                && (flags & (Hurd.O_CREAT | Hurd.O_EXCL | Hurd.O_TRUNC)) == 0)
+            k = new LookupKey(open.serial, Arrays.copyOf(name, len), flags);
+        final LookupKey key = k;
+
+        defer(new Pending(MsgIds.DIR_LOOKUP, dir) {
+            /* The results of the backend's dir_lookup, once fetched. */
+            boolean looked;
+            int gen;
+            int retry;
+            byte[] retryName;
+            MachPort result;
+            Node found;
+
+            boolean answer(MachMsg reply) throws TypeCheckException {
+                if(!looked) {
+                    if(key != null) {
+                        Lookup hit = lookups.get(key);
+                        if(hit != null && hit.gen == dir.lookupGen) {
+                            lookupHits++;
+                            putOpen(reply, hit.node, flags);
+                            return true;
+                        }
+                        if(hit != null) {
+                            lookups.remove(key);
+                            release(hit.node);
+                        }
+                        lookupMisses++;
+                    }
+                    gen = dir.lookupGen;
+                    return false;
+                }
+
+                /* Other kinds of retries lead out of the backend: hand its
+                 * port over as is. */
+                if(found == null) {
+                    putRetry(reply);
+                    reply.putPort(MachMsgType.MOVE_SEND,
+                                  (result != null) ? result : MachPort.NULL);
+                    result = null;
+                    return true;
+                }
+
+                MachPort port = newOpen(register(found), flags);
+                if(port == MachPort.NULL) {
+                    found = null;
+                    reply.putInt(Errno.ENOMEM);
+                    return true;
+                }
+                putRetry(reply);
+                reply.putPort(MachMsgType.MAKE_SEND, port);
+                if(key != null && retryName[0] == 0 && found.cacheable
+                        && gen == dir.lookupGen) {
+                    Lookup old = lookups.put(key, new Lookup(found, gen));
+                    found.users++;
+                    if(old != null)
+                        release(old.node);
+                }
+                found = null;
+                return true;
+            }
+
+            private void putRetry(MachMsg reply) throws TypeCheckException {
+                reply.putInt(0);
+                reply.putInt(retry);
+                reply.putBytes(
+                        MachMsgType.STRING_C.withNumber(RETRY_NAME_SIZE),
+                        retryName);
+            }
+
+            void fetch() throws RpcException {
+                MachMsg msg = client.begin();
+                try {
+                    msg.setRemotePort(dir.backend, MachMsgType.COPY_SEND);
+                    msg.setId(MsgIds.DIR_LOOKUP);
+                    msg.putBytes(
+                            MachMsgType.STRING_C.withNumber(RETRY_NAME_SIZE),
+                            name);
+                    msg.putInt(flags);
+                    msg.putInt(mode);
+                    client.call(msg);
+                    retry = msg.getInt();
+                    retryName = msg.getBytes(MachMsgType.STRING_C,
+                                             RETRY_NAME_SIZE);
+                    result = msg.getPort(MachMsgType.PORT_SEND);
+                } catch(TypeCheckException exc) {
+                    throw new RpcException(Mach.MIG_TYPE_ERROR);
+                } finally {
+                    msg.clear();
+                }
+
+                if(retry == FS_RETRY_NORMAL && result != null) {
+                    found = newNode(result);
+                    result = null;
+                }
+                looked = true;
+            }
+
+            void abandon() {
+                if(result != null)
+                    result.deallocate();
+                if(found != null)
+                    drop(found);
+            }
+        }, request, reply);
+    }
+
+    private void ioRestrictAuth(final Open open, MachMsg request,
+                                MachMsg reply)
+        throws TypeCheckException
+    {
+        final Creds creds = getCreds(request);
+
+        defer(new Pending(MsgIds.IO_RESTRICT_AUTH, open.node) {
+            Node restricted;
+
+            boolean answer(MachMsg reply) throws TypeCheckException {
+                if(restricted == null)
+                    return false;
+                MachPort port = newOpen(register(restricted), open.flags);
+                restricted = null;
+                if(port == MachPort.NULL) {
+                    reply.putInt(Errno.ENOMEM);
+                    return true;
+                }
+                reply.putInt(0);
+                reply.putPort(MachMsgType.MAKE_SEND, port);
+                return true;
+            }
+
+            void fetch() throws RpcException {
+                restricted = newNode(restrictAuth(open.node.backend, creds));
+            }
+
+            void abandon() {
+                if(restricted != null)
+                    drop(restricted);
+            }
+        }, request, reply);
+    }
+
+    /**
+     * Append a successful {@code fsys_getroot} or {@code dir_lookup}
+     * result, a new open of {@code node}.
+     */
+    private void putOpen(MachMsg reply, Node node, int flags)
+        throws TypeCheckException
+    {
+        MachPort port = newOpen(node, flags);
+        if(port == MachPort.NULL) {
+            reply.putInt(Errno.ENOMEM);
+            return;
+        }
+        reply.putInt(0);
+        reply.putInt(FS_RETRY_NORMAL);
+        reply.putBytes(MachMsgType.STRING_C.withNumber(RETRY_NAME_SIZE),
+                       new byte[RETRY_NAME_SIZE]);
+        reply.putPort(MachMsgType.MAKE_SEND, port);
+    }
+
+    private boolean demuxNotify(Node node, int id, MachMsg request,
+                                MachMsg reply)
+        throws TypeCheckException
+    {
+        switch(id) {
+            case MsgIds.FILE_CHANGED:
+                request.getInt();                       /* tickno */
+                if(request.getInt() != FILE_CHANGED_NULL)
+                    invalidate(node);
+                reply.putInt(0);
+                return true;
+
+            case MsgIds.DIR_CHANGED:
+                request.getInt();                       /* tickno */
+                if(request.getInt() != DIR_CHANGED_NULL) {
+                    node.lookupGen++;
+                    invalidate(node);
+                }
+                reply.putInt(0);
+                return true;
+
+            default:
+                return false;
+        }
+    }
+
+    private boolean demuxControl(int id, MachMsg request, MachMsg reply)
+        throws TypeCheckException
+    {
+        switch(id) {
+            case MsgIds.FSYS_GETROOT:
+                /* We don't need dotdot_node. */
+                MachPort dotdot = request.getPort(MachMsgType.PORT_SEND);
+                if(dotdot != null)
+                    dotdot.deallocate();
+                fsysGetroot(getCreds(request), request.getInt(), request,
+                            reply);
+                return true;
+
+            case MsgIds.FSYS_GOAWAY:
+                reply.putInt(0);
+                stop();
+                return true;
+
+            default:
+                return false;
+        }
+    }
+
+    /**
+     * Open the root directory for a client with the given ids. Each set of
+     * ids has its own port to the backend's root, opened on first use.
+     */
+    private void fsysGetroot(final Creds creds, final int flags,
+                             MachMsg request, MachMsg reply)
+        throws TypeCheckException
+    {
+        defer(new Pending(MsgIds.FSYS_GETROOT, null) {
+            Node opened;
+
+            boolean answer(MachMsg reply) throws TypeCheckException {
+                Node root = roots.get(creds);
+                if(root == null) {
+                    if(opened == null)
+                        return false;
+                    root = register(opened);
+                    root.users++;
+                    roots.put(creds, root);
+                    opened = null;
+                }
+                putOpen(reply, root, flags);
+
+                /* Another client with the same ids may have been
+                 * faster. */
+                abandon();
+                return true;
+            }
+
+            void fetch() throws RpcException {
+                opened = newNode(restrictAuth(backendRoot, creds));
+            }
+
+            void abandon() {
+                if(opened != null)
+                    drop(opened);
+                opened = null;
+            }
+        }, request, reply);
+    }
+}
@@ -0,0 +1,33 @@
+package org.gnu.hurd;
+
+/**
+ * Error codes, from {@code <errno.h>}.
+ *
+ * On the Hurd, {@code errno} values live in their own Mach error subsystem
+ * and are returned as is by the RPCs, in the same space as the
+ * {@code kern_return_t} and MIG error codes.
+ */
+public class Errno {
+    private static final int BASE = 0x40000000;
+
+    public static final int EPERM = BASE | 1;
+    public static final int ENOENT = BASE | 2;
+    public static final int EIO = BASE | 5;
+    public static final int EBADF = BASE | 9;
+    public static final int ENOMEM = BASE | 12;
+    public static final int EACCES = BASE | 13;
+    public static final int EBUSY = BASE | 16;
+    public static final int EEXIST = BASE | 17;
+    public static final int ENOTDIR = BASE | 20;
+    public static final int EISDIR = BASE | 21;
+    public static final int EINVAL = BASE | 22;
+    public static final int ENOSPC = BASE | 28;
+    public static final int ESPIPE = BASE | 29;
+    public static final int EROFS = BASE | 30;
+    public static final int EAGAIN = BASE | 35;
+    public static final int EOPNOTSUPP = BASE | 45;
+    public static final int ETIMEDOUT = BASE | 60;
+    public static final int EIEIO = BASE | 104;
+
+    private Errno() {}
+}
@@ -1,8 +1,55 @@
 #include <hurd.h>
 #include "Hurd.h"
+#include "hurd-java.h"
 
 JNIEXPORT jint JNICALL
 Java_org_gnu_hurd_Hurd_unsafeGetdport(JNIEnv *env, jobject obj, jint fd)
 {
     return getdport(fd);
 }
+
+JNIEXPORT jint JNICALL
+Java_org_gnu_hurd_Hurd_unsafeFileNameLookup(JNIEnv *env, jobject obj,
+        jstring path, jint flags, jint mode)
+{
+    const char *cpath;
+    file_t file;
+
+    cpath = (*env)->GetStringUTFChars(env, path, NULL);
+    if(cpath == NULL)
+        return MACH_PORT_NULL;
+
+    file = file_name_lookup(cpath, flags, mode);
+    (*env)->ReleaseStringUTFChars(env, path, cpath);
+    return file;
+}
+
+JNIEXPORT jint JNICALL
+Java_org_gnu_hurd_Hurd_unsafeGetBootstrap(JNIEnv *env, jobject obj)
+{
+    mach_port_t bootstrap;
+
+    if(task_get_bootstrap_port(mach_task_self(), &bootstrap) != KERN_SUCCESS)
+        return MACH_PORT_NULL;
+    return bootstrap;
+}
+
+static JNINativeMethod hurd_methods[] = {
+    { "unsafeGetdport", "(I)I", Java_org_gnu_hurd_Hurd_unsafeGetdport },
+    { "unsafeFileNameLookup", "(Ljava/lang/String;II)I",
+        Java_org_gnu_hurd_Hurd_unsafeFileNameLookup },
+    { "unsafeGetBootstrap", "()I", Java_org_gnu_hurd_Hurd_unsafeGetBootstrap },
+};
+
+int
+hurd_register_natives (JNIEnv *env)
+{
+    jclass cls = (*env)->FindClass(env, "org/gnu/hurd/Hurd");
+    if(cls == NULL)
+        return -1;
+
+    int err = (*env)->RegisterNatives(env, cls, hurd_methods,
+            sizeof hurd_methods / sizeof hurd_methods[0]);
+    (*env)->DeleteLocalRef(env, cls);
+    return err;
+}
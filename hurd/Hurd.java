@@ -1,4 +1,5 @@
 package org.gnu.hurd;
+import org.gnu.mach.Mach;
 import org.gnu.mach.MachPort;
 import org.gnu.mach.Unsafe;
 
@@ -6,12 +7,37 @@ import org.gnu.mach.Unsafe;
  * Ambient authority of a Hurd process.
  */
 public class Hurd {
+    /* Open flags, from <fcntl.h>. */
+    public static final int O_READ = 0x0001;
+    public static final int O_WRITE = 0x0002;
+    public static final int O_EXEC = 0x0004;
+    public static final int O_CREAT = 0x0010;
+    public static final int O_EXCL = 0x0020;
+    public static final int O_NOLINK = 0x0040;
+    public static final int O_NOTRANS = 0x0080;
+    public static final int O_APPEND = 0x0100;
+    public static final int O_TRUNC = 0x00010000;
+
     /**
      * Return the io server port for file descriptor FD.
      * This adds a Mach user reference to the returned port.
      */
     private native int unsafeGetdport(int fd) throws Unsafe;
 
+    /**
+     * Look up a file name and return the port for the opened file, or
+     * MACH_PORT_NULL on failure.
+     */
+    private native int unsafeFileNameLookup(String path, int flags, int mode)
+        throws Unsafe;
+
+    /**
+     * Return this task's bootstrap port, or MACH_PORT_NULL if it has none.
+     * The bootstrap port of a translator is the one it must call
+     * fsys_startup() on.
+     */
+    private native int unsafeGetBootstrap() throws Unsafe;
+
     /**
      * Return a MachPort object for file descriptor FD.
      */
@@ -22,5 +48,36 @@ public class Hurd {
             return null;
         }
     }
+
+    /**
+     * Return a MachPort object for this task's bootstrap port, or
+     * {@code null} if it has none.
+     */
+    public MachPort getBootstrap() {
+        try {
+            int name = unsafeGetBootstrap();
+            return (name != Mach.Port.NULL) ? new MachPort(name) : null;
+        } catch(Unsafe e) {
+            return null;
+        }
+    }
+
+    /**
+     * Open a file by name and return a MachPort object for it, or
+     * {@code null} if the lookup failed.
+     *
+     * @param path      The file name to look up.
+     * @param flags     Open flags, as for {@code open()}.
+     * @param mode      Creation mode, if {@code flags} includes
+     *                  {@code O_CREAT}.
+     */
+    public MachPort fileNameLookup(String path, int flags, int mode) {
+        try {
+            int name = unsafeFileNameLookup(path, flags, mode);
+            return (name != Mach.Port.NULL) ? new MachPort(name) : null;
+        } catch(Unsafe e) {
+            return null;
+        }
+    }
 };
 
@@ -0,0 +1,31 @@
+package org.gnu.hurd;
+
+import org.gnu.mach.MachPort;
+import org.gnu.mach.rpc.MsgId;
+import org.gnu.mach.rpc.RpcException;
+
+/**
+ * Part of the Hurd's io interface, from {@code <hurd/io.defs>}.
+ *
+ * The stubs {@code IoProxy} and {@code IoSkeleton} are generated from
+ * this interface by {@link org.gnu.mach.rpc.RpcProcessor}. Data returned
+ * out-of-line, which servers do for large reads, is not supported and
+ * fails with {@link org.gnu.mach.Mach#MIG_TYPE_ERROR}.
+ */
+public interface Io {
+    /** Write data at an offset, or at the current position if -1. */
+    @MsgId(MsgIds.IO_WRITE)
+    int write(MachPort io, byte[] data, long offset) throws RpcException;
+
+    /** Read up to {@code amount} bytes at an offset, or -1. */
+    @MsgId(MsgIds.IO_READ)
+    byte[] read(MachPort io, long offset, int amount) throws RpcException;
+
+    /** Change the current position and return the new one. */
+    @MsgId(MsgIds.IO_SEEK)
+    long seek(MachPort io, long offset, int whence) throws RpcException;
+
+    /** The number of bytes which can be read without blocking. */
+    @MsgId(MsgIds.IO_READABLE)
+    int readable(MachPort io) throws RpcException;
+}
@@ -0,0 +1,63 @@
+package org.gnu.hurd;
+
+/**
+ * Message IDs of the Hurd interfaces.
+ *
+ * These are the {@code msgh_id} values MIG assigns to the routines of the
+ * Hurd's RPC interfaces, as computed from the subsystem base and the
+ * position of each routine in the corresponding {@code .defs} file. The
+ * reply to a request uses the request's ID plus 100.
+ */
+public class MsgIds {
+    /* <hurd/io.defs>, subsystem io 21000 */
+    public static final int IO_WRITE = 21000;
+    public static final int IO_READ = 21001;
+    public static final int IO_SEEK = 21002;
+    public static final int IO_READABLE = 21003;
+    public static final int IO_SET_ALL_OPENMODES = 21004;
+    public static final int IO_GET_OPENMODES = 21005;
+    public static final int IO_SET_SOME_OPENMODES = 21006;
+    public static final int IO_CLEAR_SOME_OPENMODES = 21007;
+    public static final int IO_ASYNC = 21008;
+    public static final int IO_MOD_OWNER = 21009;
+    public static final int IO_GET_OWNER = 21010;
+    public static final int IO_GET_ICKY_ASYNC_ID = 21011;
+    public static final int IO_SELECT = 21012;
+    public static final int IO_STAT = 21013;
+    public static final int IO_REAUTHENTICATE = 21014;
+    public static final int IO_RESTRICT_AUTH = 21015;
+    public static final int IO_DUPLICATE = 21016;
+    public static final int IO_MAP = 21018;
+    public static final int IO_MAP_CNTL = 21019;
+    public static final int IO_IDENTITY = 21029;
+
+    /* <hurd/fs.defs>, subsystem fs 20000 */
+    public static final int FILE_EXEC = 20000;
+    public static final int FILE_NOTICE_CHANGES = 20010;
+    public static final int FILE_GETCONTROL = 20011;
+    public static final int FILE_SYNC = 20013;
+    public static final int FILE_GET_STORAGE_INFO = 20015;
+    public static final int FILE_GETLINKNODE = 20016;
+    public static final int DIR_LOOKUP = 20018;
+    public static final int DIR_MKFILE = 20025;
+    public static final int DIR_NOTICE_CHANGES = 20026;
+    public static final int FILE_SET_TRANSLATOR = 20027;
+    public static final int FILE_GET_TRANSLATOR_CNTL = 20029;
+    public static final int FILE_REPARENT = 20031;
+
+    /* <hurd/fsys.defs>, subsystem fsys 22000 */
+    public static final int FSYS_STARTUP = 22000;
+    public static final int FSYS_GOAWAY = 22001;
+    public static final int FSYS_GETROOT = 22002;
+
+    /* <hurd/fs_notify.defs>, subsystem fs_notify 20500 */
+    public static final int DIR_CHANGED = 20500;
+    public static final int FILE_CHANGED = 20501;
+
+    /** The ID of the reply to a request. */
+    public static int reply(int id) {
+        return id + 100;
+    }
+
+    private MsgIds() {}
+}
@@ -0,0 +1,572 @@
+package org.gnu.hurd;
+
+import java.io.UnsupportedEncodingException;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.util.Arrays;
+import java.util.HashMap;
+import java.util.Map;
+import java.util.concurrent.ConcurrentSkipListMap;
+import org.gnu.mach.DirectMemory;
+import org.gnu.mach.Mach;
+import org.gnu.mach.MachMsg;
+import org.gnu.mach.MachMsgType;
+import org.gnu.mach.MachPort;
+import org.gnu.mach.MachServer;
+import org.gnu.mach.MsgStats;
+import org.gnu.mach.MsgStatsMXBean;
+import org.gnu.mach.TypeCheckException;
+import org.gnu.mach.Unsafe;
+
+/**
+ * Translator exposing the runtime statistics of this process as a file.
+ *
+ * Each open of the node takes a text snapshot of the counters kept by the
+ * native {@code mach_msg()} wrapper and by {@link MsgStats}, of the port
+ * names in use, and of the registered {@link Source}s, such as server
+ * queue depths or pool usage. The snapshot can then be read with
+ * {@code cat}, without attaching a debugger or a JMX client.
+ *
+ * The translator is either attached to an existing node at run time with
+ * {@link #attach}, the same way {@code settrans -a} does, or, when this
+ * process was itself started as the node's translator, set up with
+ * {@link #startup}. Only the io operations needed to read a regular file
+ * are implemented; the node is read-only.
+ */
+public class StatsTranslator implements MachServer.Demuxer {
+    /**
+     * Something which contributes lines to the statistics snapshot.
+     */
+    public static interface Source {
+        /** Append the current statistics of this source to {@code out}. */
+        void report(StringBuilder out);
+    }
+
+    private static final Map<String, Source> sources =
+        new ConcurrentSkipListMap<String, Source>();
+
+    /** Add a section to the snapshot, replacing any of the same name. */
+    public static void addSource(String name, Source source) {
+        sources.put(name, source);
+    }
+
+    /** Remove a section from the snapshot. */
+    public static void removeSource(String name) {
+        sources.remove(name);
+    }
+
+    /** Report the number of messages queued on a receive right. */
+    public static void watchQueue(String name, final MachPort port) {
+        addSource(name, new Source() {
+            public void report(StringBuilder out) {
+                out.append("queued ").append(MachServer.queueDepth(port))
+                   .append('\n');
+            }
+        });
+    }
+
+    /* From <hurd/hurd_types.h> */
+    private static final int FS_TRANS_SET = 4;
+    private static final int FS_RETRY_NORMAL = 1;
+    private static final int RETRY_NAME_SIZE = 1024;
+
+    /* Layout of io_statbuf_t (struct stat64), in ints. */
+    private static final int STAT_INTS = 32;
+    private static final int STAT_MODE = 7;
+    private static final int STAT_NLINK = 8;
+    private static final int STAT_SIZE = 11;
+    private static final int STAT_MTIME = 15;
+    private static final int STAT_BLKSIZE = 19;
+    private static final int S_IFREG_0444 = 0100444;
+
+    private static final int BUFFER_SIZE = 8192;
+
+    /** Largest io_read() reply payload, leaving room for the header. */
+    private static final int MAX_READ = BUFFER_SIZE - 64;
+
+    /**
+     * An open of the node. The protid port it was handed out as is a
+     * member of our port set, and the snapshot is taken once, so that
+     * successive reads see consistent data.
+     */
+    private static class Open {
+        final MachPort port;
+        final byte[] data;
+        long offset;
+
+        Open(MachPort port, byte[] data) {
+            this.port = port;
+            this.data = data;
+        }
+    }
+
+    private final MachPort portSet;
+    private final MachPort control;
+    private final int controlName;
+    private final Map<Integer, Open> opens = new HashMap<Integer, Open>();
+    private final MachServer server;
+    private MachPort realnode;
+    private Thread thread;
+
+    public StatsTranslator() {
+        portSet = MachPort.allocate(MachPort.Right.PORT_SET);
+        control = MachPort.allocate();
+        if(portSet == MachPort.NULL || control == MachPort.NULL)
+            throw new IllegalStateException("cannot allocate ports");
+        controlName = join(control);
+        server = new MachServer(portSet, this, BUFFER_SIZE);
+        server.setFailureCode(Errno.EIO);
+    }
+
+    /**
+     * Move a receive right into our port set and return its name, which
+     * is used as the key of the object it stands for.
+     */
+    private int join(MachPort port) {
+        int name = Mach.Port.NULL;
+        try {
+            name = port.name();
+            int set = portSet.name();
+            Mach.Port.moveMember(Mach.taskSelf(), name, set);
+            portSet.releaseName();
+            port.releaseName();
+        } catch(Unsafe exc) {}
+        return name;
+    }
+
+    /**
+     * Send an RPC and wait for the reply. Returns the reply's return code,
+     * with {@code msg} positioned on the results.
+     */
+    private static int call(MachMsg msg) {
+        MachPort reply = MachPort.allocateReplyPort();
+        msg.setLocalPort(reply, MachMsgType.MAKE_SEND_ONCE);
+
+        int err = Mach.MSG_SUCCESS;
+        try {
+            err = Mach.msg(msg.buf(), Mach.SEND_MSG | Mach.RCV_MSG,
+                           reply.name(), Mach.MSG_TIMEOUT_NONE,
+                           Mach.Port.NULL);
+            reply.releaseName();
+            if(err == Mach.MSG_SUCCESS) {
+                msg.flip();
+                err = msg.getInt();
+            }
+        } catch(Unsafe exc) {
+        } catch(TypeCheckException exc) {
+            err = Mach.MIG_TYPE_ERROR;
+        }
+
+        reply.destroy();
+        return err;
+    }
+
+    /** Start serving requests in a daemon thread. */
+    private synchronized void start() {
+        if(thread != null)
+            return;
+
+        thread = new Thread(new Runnable() {
+            public void run() {
+                server.run();
+                shutdown();
+            }
+        }, "StatsTranslator");
+        thread.setDaemon(true);
+        thread.start();
+    }
+
+    /**
+     * Attach this translator to {@code path} as an active translator.
+     * The node goes back to its previous contents when this process exits.
+     *
+     * @return 0 on success, or an error code.
+     */
+    public int attach(String path) {
+        MachPort node = new Hurd().fileNameLookup(path, Hurd.O_NOTRANS, 0);
+        if(node == null)
+            return Errno.ENOENT;
+
+        start();
+
+        MachMsg msg = new MachMsg(256);
+        int err;
+        try {
+            msg.setRemotePort(node, MachMsgType.COPY_SEND);
+            msg.setId(MsgIds.FILE_SET_TRANSLATOR);
+            msg.putInt(0);                      /* passive_flags */
+            msg.putInt(FS_TRANS_SET);           /* active_flags */
+            msg.putInt(0);                      /* oldtrans_flags */
+            msg.putBytes(new byte[0]);          /* passive */
+            msg.putPort(MachMsgType.MAKE_SEND, control);
+            err = call(msg);
+        } catch(TypeCheckException exc) {
+            err = Mach.MIG_TYPE_ERROR;
+        }
+        msg.clear();
+        node.deallocate();
+
+        if(err != 0)
+            stop();
+        return err;
+    }
+
+    /**
+     * Complete the startup handshake of a translator started by the
+     * filesystem, by calling fsys_startup() on the bootstrap port.
+     *
+     * @return 0 on success, or an error code.
+     */
+    public int startup() {
+        MachPort bootstrap = new Hurd().getBootstrap();
+        if(bootstrap == null)
+            return Errno.EINVAL;
+
+        start();
+
+        MachMsg msg = new MachMsg(256);
+        int err;
+        try {
+            msg.setRemotePort(bootstrap, MachMsgType.COPY_SEND);
+            msg.setId(MsgIds.FSYS_STARTUP);
+            msg.putInt(Hurd.O_READ);            /* openflags */
+            msg.putPort(MachMsgType.MAKE_SEND, control);
+            err = call(msg);
+            if(err == 0)
+                realnode = msg.getPort(MachMsgType.PORT_SEND);
+        } catch(TypeCheckException exc) {
+            err = Mach.MIG_TYPE_ERROR;
+        }
+        msg.clear();
+        bootstrap.deallocate();
+
+        if(err != 0)
+            stop();
+        return err;
+    }
+
+    /** Stop serving requests. The ports are destroyed once the loop exits. */
+    public void stop() {
+        server.stop();
+    }
+
+    private synchronized void shutdown() {
+        for(Open open : opens.values())
+            open.port.destroy();
+        opens.clear();
+        control.destroy();
+        try {
+            Mach.Port.modRefs(Mach.taskSelf(), portSet.clear(),
+                              Mach.Port.RIGHT_PORT_SET, -1);
+        } catch(Unsafe exc) {}
+        if(realnode != null)
+            realnode.deallocate();
+    }
+
+    /* Request handling */
+
+    public boolean demux(int port, MachMsg request, MachMsg reply)
+        throws TypeCheckException
+    {
+        int id = request.getId();
+        if(port == controlName)
+            return demuxControl(id, request, reply);
+
+        Open open;
+        synchronized(this) {
+            open = opens.get(port);
+        }
+        if(open == null)
+            return false;
+
+        switch(id) {
+            case Mach.NOTIFY_NO_SENDERS:
+                synchronized(this) {
+                    opens.remove(port);
+                }
+                open.port.destroy();
+                return true;
+
+            case MsgIds.IO_READ:
+                ioRead(open, request, reply);
+                return true;
+
+            case MsgIds.IO_SEEK:
+                ioSeek(open, request, reply);
+                return true;
+
+            case MsgIds.IO_READABLE:
+                reply.putInt(0);
+                reply.putInt((int) Math.max(0, open.data.length - open.offset));
+                return true;
+
+            case MsgIds.IO_GET_OPENMODES:
+                reply.putInt(0);
+                reply.putInt(Hurd.O_READ);
+                return true;
+
+            case MsgIds.IO_STAT:
+                ioStat(open, reply);
+                return true;
+
+            case MsgIds.IO_WRITE:
+                reply.putInt(Errno.EBADF);
+                return true;
+
+            case MsgIds.DIR_LOOKUP:
+                reply.putInt(Errno.ENOTDIR);
+                return true;
+
+            default:
+                return false;
+        }
+    }
+
+    private boolean demuxControl(int id, MachMsg request, MachMsg reply)
+        throws TypeCheckException
+    {
+        switch(id) {
+            case MsgIds.FSYS_GETROOT:
+                /* We don't need dotdot_node, and ignore the uids and
+                 * flags: anyone may read the node. */
+                MachPort dotdot = request.getPort(MachMsgType.PORT_SEND);
+                if(dotdot != null)
+                    dotdot.deallocate();
+
+                MachPort port = open();
+                if(port == MachPort.NULL) {
+                    reply.putInt(Errno.ENOMEM);
+                    return true;
+                }
+                reply.putInt(0);
+                reply.putInt(FS_RETRY_NORMAL);
+                reply.putBytes(
+                        MachMsgType.STRING_C.withNumber(RETRY_NAME_SIZE),
+                        new byte[RETRY_NAME_SIZE]);
+                reply.putPort(MachMsgType.MAKE_SEND, port);
+                return true;
+
+            case MsgIds.FSYS_GOAWAY:
+                reply.putInt(0);
+                stop();
+                return true;
+
+            default:
+                return false;
+        }
+    }
+
+    /**
+     * Create a new protid port holding a fresh snapshot, and arrange for
+     * it to be destroyed once the client is done with it. Returns
+     * {@link MachPort#NULL} if no port can be allocated.
+     */
+    private MachPort open() {
+        byte[] data;
+        try {
+            data = snapshot().getBytes("UTF-8");
+        } catch(UnsupportedEncodingException exc) {
+            data = new byte[0];
+        }
+
+        MachPort port = MachPort.allocate();
+        if(port == MachPort.NULL)
+            return MachPort.NULL;
+        int name = join(port);
+        try {
+            /* The send right is made when the reply is sent, hence the
+             * make-send count of 1. */
+            Mach.Port.requestNotification(Mach.taskSelf(), name,
+                    Mach.NOTIFY_NO_SENDERS, 1, name,
+                    MachMsgType.MAKE_SEND_ONCE.name(), new int[1]);
+        } catch(Unsafe exc) {}
+
+        synchronized(this) {
+            opens.put(name, new Open(port, data));
+        }
+        return port;
+    }
+
+    private static void ioRead(Open open, MachMsg request, MachMsg reply)
+        throws TypeCheckException
+    {
+        long offset = request.getLong();
+        int amount = request.getInt();
+
+        long pos = (offset == -1) ? open.offset : offset;
+        if(pos < 0) {
+            reply.putInt(Errno.EINVAL);
+            return;
+        }
+        /* Reading past the end, after io_seek, returns no data. */
+        if(pos > open.data.length)
+            pos = open.data.length;
+
+        int n = (int) Math.max(0, Math.min(Math.min(amount, MAX_READ),
+                                           open.data.length - pos));
+        byte[] data = Arrays.copyOfRange(open.data, (int) pos, (int) pos + n);
+        if(offset == -1)
+            open.offset += n;
+
+        reply.putInt(0);
+        reply.putBytes(data);
+    }
+
+    private static void ioSeek(Open open, MachMsg request, MachMsg reply)
+        throws TypeCheckException
+    {
+        long offset = request.getLong();
+        int whence = request.getInt();
+
+        long base;
+        switch(whence) {
+            case 0: base = 0; break;
+            case 1: base = open.offset; break;
+            case 2: base = open.data.length; break;
+            default:
+                reply.putInt(Errno.EINVAL);
+                return;
+        }
+        if(base + offset < 0) {
+            reply.putInt(Errno.EINVAL);
+            return;
+        }
+
+        open.offset = base + offset;
+        reply.putInt(0);
+        reply.putLong(open.offset);
+    }
+
+    private static void ioStat(Open open, MachMsg reply)
+        throws TypeCheckException
+    {
+        ByteBuffer st = ByteBuffer.allocate(STAT_INTS * 4);
+        st.order(ByteOrder.nativeOrder());
+        st.putInt(STAT_MODE * 4, S_IFREG_0444);
+        st.putInt(STAT_NLINK * 4, 1);
+        st.putLong(STAT_SIZE * 4, open.data.length);
+        st.putInt(STAT_MTIME * 4,
+                  (int) (System.currentTimeMillis() / 1000));
+        st.putInt(STAT_BLKSIZE * 4, BUFFER_SIZE);
+
+        reply.putInt(0);
+        reply.putBytes(MachMsgType.INTEGER_32.withNumber(STAT_INTS),
+                       st.array());
+    }
+
+    /* Snapshot */
+
+    /** Build the text presented to readers of the node. */
+    public static String snapshot() {
+        StringBuilder out = new StringBuilder();
+        out.append("time ").append(System.currentTimeMillis()).append('\n');
+
+        reportNative(out);
+        reportPorts(out);
+        reportDirectMemory(out);
+
+        MsgStatsMXBean stats = MsgStats.get();
+        if(stats.isEnabled()) {
+            out.append("\n[messages]\n");
+            reportEntries(out, stats);
+        }
+
+        for(Map.Entry<String, Source> e : sources.entrySet()) {
+            out.append('\n').append('[').append(e.getKey()).append("]\n");
+            e.getValue().report(out);
+        }
+        return out.toString();
+    }
+
+    private static void reportNative(StringBuilder out) {
+        long[] s = Mach.NativeStats.snapshot();
+        out.append("\n[mach_msg]\n");
+        out.append("calls ").append(s[Mach.NativeStats.CALLS]).append('\n');
+        out.append("kernel_nsecs ").append(s[Mach.NativeStats.KERNEL_NSECS])
+           .append('\n');
+        out.append("bytes_sent ").append(s[Mach.NativeStats.BYTES_SENT])
+           .append('\n');
+        out.append("bytes_received ")
+           .append(s[Mach.NativeStats.BYTES_RECEIVED]).append('\n');
+        out.append("send_retries ").append(s[Mach.NativeStats.SEND_RETRIES])
+           .append('\n');
+        out.append("rcv_retries ").append(s[Mach.NativeStats.RCV_RETRIES])
+           .append('\n');
+        out.append("errors ").append(s[Mach.NativeStats.ERRORS]).append('\n');
+    }
+
+    private static void reportPorts(StringBuilder out) {
+        int[] names = null;
+        try {
+            names = Mach.Port.names(Mach.taskSelf());
+        } catch(Unsafe exc) {}
+        if(names == null)
+            return;
+
+        int send = 0, receive = 0, sendOnce = 0, portSet = 0, dead = 0;
+        for(int i = 1; i < names.length; i += 2) {
+            int type = names[i];
+            if((type & Mach.Port.TYPE_SEND) != 0) send++;
+            if((type & Mach.Port.TYPE_RECEIVE) != 0) receive++;
+            if((type & Mach.Port.TYPE_SEND_ONCE) != 0) sendOnce++;
+            if((type & Mach.Port.TYPE_PORT_SET) != 0) portSet++;
+            if((type & Mach.Port.TYPE_DEAD_NAME) != 0) dead++;
+        }
+
+        out.append("\n[ports]\n");
+        out.append("names ").append(names.length / 2).append('\n');
+        out.append("send ").append(send).append('\n');
+        out.append("receive ").append(receive).append('\n');
+        out.append("send_once ").append(sendOnce).append('\n');
+        out.append("port_set ").append(portSet).append('\n');
+        out.append("dead_name ").append(dead).append('\n');
+    }
+
+    private static void reportDirectMemory(StringBuilder out) {
+        out.append("\n[direct_memory]\n");
+        out.append("used ").append(DirectMemory.used()).append('\n');
+        out.append("peak ").append(DirectMemory.peak()).append('\n');
+        out.append("limit ").append(DirectMemory.getLimit()).append('\n');
+        out.append("failures ").append(DirectMemory.failures()).append('\n');
+        out.append("out_of_line_mapped ")
+           .append(DirectMemory.outOfLineMapped()).append('\n');
+        out.append("pinned ").append(DirectMemory.pinned()).append('\n');
+        out.append("wired ").append(DirectMemory.wired()).append('\n');
+        out.append("wire_failures ").append(DirectMemory.wireFailures())
+           .append('\n');
+        out.append("# class_max buffers bytes\n");
+        for(int c = 0; c < DirectMemory.CLASSES; c++) {
+            long n = DirectMemory.classBuffers(c);
+            if(n == 0)
+                continue;
+            long max = DirectMemory.classSize(c);
+            out.append("class ")
+               .append((max == Long.MAX_VALUE) ? "-" : String.valueOf(max))
+               .append(' ').append(n)
+               .append(' ').append(DirectMemory.classBytes(c)).append('\n');
+        }
+    }
+
+    private static void reportEntries(StringBuilder out,
+                                      MsgStatsMXBean stats)
+    {
+        out.append("# id calls errors sent received avg_us\n");
+        for(MsgStatsMXBean.Entry e : stats.getMessageIds())
+            reportEntry(out, "msg", e);
+        for(MsgStatsMXBean.Entry e : stats.getDispatchIds())
+            reportEntry(out, "dispatch", e);
+    }
+
+    private static void reportEntry(StringBuilder out, String kind,
+                                    MsgStatsMXBean.Entry e)
+    {
+        long avg = (e.getCalls() > 0)
+            ? e.getTotalNanos() / e.getCalls() / 1000 : 0;
+        out.append(kind).append(' ').append(e.getKey())
+           .append(' ').append(e.getCalls())
+           .append(' ').append(e.getErrors())
+           .append(' ').append(e.getBytesSent())
+           .append(' ').append(e.getBytesReceived())
+           .append(' ').append(avg).append('\n');
+    }
+}
@@ -0,0 +1,334 @@
+package org.gnu.hurd;
+
+import java.util.Arrays;
+import java.util.Iterator;
+import java.util.Map;
+import java.util.TreeMap;
+import org.gnu.mach.MachMsg;
+import org.gnu.mach.MachMsgType;
+import org.gnu.mach.MachPort;
+import org.gnu.mach.rpc.RpcClient;
+import org.gnu.mach.rpc.RpcException;
+
+/**
+ * Write-back buffering for a file port.
+ *
+ * Each {@code io_write} is a round trip to the file server, which makes
+ * many small writes expensive. A {@link WriteBehindFile} instead stores
+ * the data written with {@link #write} in a set of dirty ranges and
+ * returns at once; a background thread writes them to the file with
+ * positional {@code io_write} calls. Writes to adjacent or overlapping
+ * parts of the file are merged into the same range, newer data replacing
+ * older, so that the file server sees fewer and larger writes.
+ *
+ * The ranges are written one at a time, in the order of their offsets,
+ * and a write which overlaps a range being written goes into a new range
+ * which is only written once the previous one is done, so the file ends
+ * up as if the writes had been made in order. {@link #flush} waits for
+ * all the dirty data to be written, and {@link #sync} also calls
+ * {@code file_sync}. {@link #read} flushes first, so that it sees the
+ * data written so far.
+ *
+ * As with the page cache of other systems, an error returned by the file
+ * server for a buffered write can only be reported later: it is thrown by
+ * the next call to {@link #write}, {@link #flush}, {@link #sync} or
+ * {@link #close}.
+ */
+public class WriteBehindFile {
+    /** Default amount of dirty data above which writers wait. */
+    public static final int DEFAULT_MAX_DIRTY = 4 << 20;
+
+    /**
+     * How long the flusher waits for more writes to merge before writing
+     * out all the dirty ranges, in ms.
+     */
+    private static final long DELAY = 5;
+
+    private final MachPort file;
+    private final RpcClient client;
+    private final Io io;
+    private final int maxChunk;
+    private final long maxDirty;
+
+    /* Dirty ranges by offset, none of them overlapping. */
+    private final TreeMap<Long, byte[]> dirty = new TreeMap<Long, byte[]>();
+    private long dirtyBytes;
+    private boolean writing;
+    private boolean urgent;
+    private boolean closed;
+    private int error;
+    private Thread flusher;
+
+    private long writes;
+    private long flushes;
+
+    /**
+     * Buffer writes to a file.
+     *
+     * @param file      The file port. We take over the caller's reference,
+     *                  which is released by {@link #close}.
+     * @param maxDirty  The amount of dirty data above which
+     *                  {@link #write} waits for the flusher.
+     */
+    public WriteBehindFile(MachPort file, long maxDirty) {
+        this.file = file;
+        this.maxDirty = maxDirty;
+        client = RpcClient.getDefault();
+        io = new IoProxy(client);
+
+        /* Leave room for the header and the other arguments. */
+        maxChunk = client.bufferSize() - 64;
+    }
+
+    public WriteBehindFile(MachPort file) {
+        this(file, DEFAULT_MAX_DIRTY);
+    }
+
+    /** The number of writes made by the application. */
+    public synchronized long writes() {
+        return writes;
+    }
+
+    /** The number of io_write calls sent to the file server. */
+    public synchronized long flushes() {
+        return flushes;
+    }
+
+    /** The amount of data not yet written to the file. */
+    public synchronized long dirtyBytes() {
+        return dirtyBytes;
+    }
+
+    private void checkError() throws RpcException {
+        if(error != 0) {
+            int code = error;
+            error = 0;
+            throw new RpcException(code);
+        }
+    }
+
+    /**
+     * Write data at an offset. This returns as soon as the data has been
+     * buffered, unless there is already too much dirty data.
+     *
+     * @throws RpcException if an earlier buffered write failed.
+     */
+    public synchronized void write(byte[] data, long offset)
+        throws RpcException
+    {
+        if(closed)
+            throw new IllegalStateException("file closed");
+        if(offset < 0)
+            throw new IllegalArgumentException();
+        checkError();
+
+        while(dirtyBytes >= maxDirty && error == 0) {
+            urgent = true;
+            notifyAll();
+            waitUninterruptibly();
+        }
+        checkError();
+
+        if(data.length > 0)
+            insert(offset, data);
+        writes++;
+
+        if(flusher == null) {
+            flusher = new Thread(new Runnable() {
+                public void run() {
+                    flushLoop();
+                }
+            }, "WriteBehindFile");
+            flusher.setDaemon(true);
+            flusher.start();
+        }
+        notifyAll();
+    }
+
+    /** Merge a write into the dirty ranges. */
+    private void insert(long start, byte[] data) {
+        long end = start + data.length;
+        long newStart = start, newEnd = end;
+
+        /* Merge with the ranges which overlap the new data, and with the
+         * adjacent ones as long as the result fits in a single write. */
+        Map.Entry<Long, byte[]> before = dirty.floorEntry(start);
+        if(before != null) {
+            long beforeEnd = before.getKey() + before.getValue().length;
+            if(beforeEnd > start || (beforeEnd == start
+                        && before.getValue().length + data.length
+                           <= maxChunk))
+                newStart = before.getKey();
+        }
+
+        Map<Long, byte[]> merged = dirty.subMap(newStart, true, end, true);
+        for(Map.Entry<Long, byte[]> e : merged.entrySet()) {
+            long eEnd = e.getKey() + e.getValue().length;
+            if(e.getKey() == end && newEnd - newStart + e.getValue().length
+                                        > maxChunk)
+                continue;
+            newEnd = Math.max(newEnd, eEnd);
+        }
+
+        byte[] range = new byte[(int) (newEnd - newStart)];
+        Iterator<Map.Entry<Long, byte[]>> it =
+            dirty.subMap(newStart, true, newEnd, false).entrySet().iterator();
+        while(it.hasNext()) {
+            Map.Entry<Long, byte[]> e = it.next();
+            byte[] old = e.getValue();
+            System.arraycopy(old, 0, range, (int) (e.getKey() - newStart),
+                             old.length);
+            dirtyBytes -= old.length;
+            it.remove();
+        }
+        System.arraycopy(data, 0, range, (int) (start - newStart),
+                         data.length);
+        dirty.put(newStart, range);
+        dirtyBytes += range.length;
+    }
+
+    private void waitUninterruptibly() {
+        try {
+            wait();
+        } catch(InterruptedException exc) {
+            /* ignore */
+        }
+    }
+
+    /* Body of the flusher thread. */
+    private void flushLoop() {
+        while(true) {
+            synchronized(this) {
+                while(dirty.isEmpty() && !closed)
+                    waitUninterruptibly();
+                if(dirty.isEmpty())
+                    return;
+
+                /* Give the application a chance to extend the ranges. */
+                if(!urgent && !closed && dirtyBytes < maxDirty / 2) {
+                    try {
+                        wait(DELAY);
+                    } catch(InterruptedException exc) {
+                        /* ignore */
+                    }
+                }
+            }
+
+            /* Then write out the whole batch, including the ranges added
+             * meanwhile, without waiting again. */
+            while(true) {
+                long offset;
+                byte[] data;
+                synchronized(this) {
+                    Map.Entry<Long, byte[]> e = dirty.pollFirstEntry();
+                    if(e == null)
+                        break;
+                    offset = e.getKey();
+                    data = e.getValue();
+                    dirtyBytes -= data.length;
+                    writing = true;
+                }
+
+                int err = writeRange(offset, data);
+
+                synchronized(this) {
+                    if(err != 0 && error == 0)
+                        error = err;
+                    writing = false;
+                    if(dirty.isEmpty())
+                        urgent = false;
+                    notifyAll();
+                }
+            }
+        }
+    }
+
+    /** Write a range to the file, in chunks. Returns an error code. */
+    private int writeRange(long offset, byte[] data) {
+        int done = 0;
+        while(done < data.length) {
+            int n = Math.min(maxChunk, data.length - done);
+            int written;
+            try {
+                written = io.write(file,
+                                   Arrays.copyOfRange(data, done, done + n),
+                                   offset + done);
+            } catch(RpcException exc) {
+                return exc.code();
+            }
+            synchronized(this) {
+                flushes++;
+            }
+            if(written <= 0)
+                return Errno.EIO;
+            done += written;
+        }
+        return 0;
+    }
+
+    /**
+     * Wait until all the data written so far has been written to the file.
+     *
+     * @throws RpcException if a buffered write failed.
+     */
+    public synchronized void flush() throws RpcException {
+        urgent = true;
+        notifyAll();
+        while((!dirty.isEmpty() || writing) && error == 0)
+            waitUninterruptibly();
+        checkError();
+    }
+
+    /**
+     * Flush the buffered data and ask the file server to write the file
+     * to stable storage, with {@code file_sync}.
+     */
+    public void sync() throws RpcException {
+        flush();
+
+        MachMsg msg = client.begin();
+        try {
+            msg.setRemotePort(file, MachMsgType.COPY_SEND);
+            msg.setId(MsgIds.FILE_SYNC);
+            msg.putInt(1);                      /* wait */
+            msg.putInt(0);                      /* omit_metadata */
+            client.call(msg);
+        } finally {
+            msg.clear();
+        }
+    }
+
+    /** Flush the buffered data and read from the file. */
+    public byte[] read(long offset, int amount) throws RpcException {
+        flush();
+        return io.read(file, offset, amount);
+    }
+
+    /**
+     * Flush the buffered data, stop the flusher and release the file
+     * port. The port is released even if the flush fails.
+     */
+    public void close() throws RpcException {
+        try {
+            flush();
+        } finally {
+            Thread thread;
+            synchronized(this) {
+                closed = true;
+                dirty.clear();
+                dirtyBytes = 0;
+                notifyAll();
+                thread = flusher;
+            }
+            if(thread != null)
+                while(true)
+                    try {
+                        thread.join();
+                        break;
+                    } catch(InterruptedException exc) {
+                        /* ignore */
+                    }
+            file.deallocate();
+        }
+    }
+}
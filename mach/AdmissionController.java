@@ -0,0 +1,145 @@
+package org.gnu.mach;
+
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.util.concurrent.atomic.AtomicLong;
+
+/**
+ * Load shedding for server loops.
+ *
+ * When a server falls behind, requests pile up in its port queues until
+ * the clients give up on them, and the time spent handling requests
+ * nobody waits for anymore only makes things worse. An
+ * {@link AdmissionController} installed on a {@link MachServer} watches
+ * two signals: the number of messages queued on the port a request
+ * arrived on, sampled every few requests, and a moving average of the
+ * handlers' latency. While either is above its threshold, new requests
+ * are answered straight away with an error reply, usually
+ * {@code EAGAIN}, and the handler is not run. Only requests which carry
+ * a reply port can be shed this way: kernel notifications and other
+ * one-way messages, which would be lost for good, are always handled.
+ *
+ * The error reply is copied from a prototype body built once, so
+ * rejecting a request costs little more than receiving it. One request
+ * out of {@link #PROBE_INTERVAL} is still let through while shedding, so
+ * that the latency average keeps tracking the actual state of the server.
+ *
+ * The statistics are updated without locking by all the threads running
+ * the server, and are only approximate.
+ */
+public class AdmissionController {
+    /** Number of requests between two queue depth samples. */
+    public static final int SAMPLE_INTERVAL = 16;
+
+    /** While shedding, one request out of this many is handled anyway. */
+    public static final int PROBE_INTERVAL = 32;
+
+    private final int maxQueueDepth;
+    private final long maxLatency;
+    private final byte[] prototype;
+
+    private volatile long latency;
+    private volatile int queueDepth;
+    private volatile boolean shedding;
+    private int requests;
+
+    private final AtomicLong admitted = new AtomicLong();
+    private final AtomicLong rejected = new AtomicLong();
+
+    /**
+     * Create an admission controller.
+     *
+     * @param maxQueueDepth The number of queued messages above which
+     *                      requests are rejected, or 0 to ignore the
+     *                      queue depth.
+     * @param maxLatency    The average handler latency, in nanoseconds,
+     *                      above which requests are rejected, or 0 to
+     *                      ignore the latency.
+     * @param retCode       The return code of the error replies.
+     */
+    public AdmissionController(int maxQueueDepth, long maxLatency,
+                               int retCode)
+    {
+        this.maxQueueDepth = maxQueueDepth;
+        this.maxLatency = maxLatency;
+
+        /* Same layout as a reply built with putInt(retCode). */
+        ByteBuffer body = ByteBuffer.allocate(32);
+        body.order(ByteOrder.nativeOrder());
+        body.position(24);
+        MachMsgType.INTEGER_32.put(body, 1);
+        body.putInt(retCode);
+        prototype = body.array();
+    }
+
+    /**
+     * Decide whether to handle a request.
+     *
+     * @param port  The receive right the request arrived on.
+     */
+    boolean admit(int port) {
+        int n = requests++;
+        if(maxQueueDepth > 0 && n % SAMPLE_INTERVAL == 0) {
+            queueDepth = sampleQueueDepth(port);
+            update();
+        }
+
+        if(shedding && n % PROBE_INTERVAL != 0) {
+            rejected.incrementAndGet();
+            return false;
+        }
+        admitted.incrementAndGet();
+        return true;
+    }
+
+    /** Record the time taken by the handler of an admitted request. */
+    void completed(long nanos) {
+        long avg = latency;
+        latency = avg + ((nanos - avg) >> 3);
+        update();
+    }
+
+    private void update() {
+        shedding = (maxQueueDepth > 0 && queueDepth > maxQueueDepth)
+                || (maxLatency > 0 && latency > maxLatency);
+    }
+
+    private static int sampleQueueDepth(int port) {
+        int[] status = new int[Mach.Port.STATUS_MAX];
+        try {
+            if(Mach.Port.getReceiveStatus(Mach.taskSelf(), port, status) != 0)
+                return 0;
+        } catch(Unsafe exc) {}
+        return status[Mach.Port.STATUS_MSGCOUNT];
+    }
+
+    /** Append the error reply's body to a message. */
+    void putReply(MachMsg reply) throws Unsafe {
+        reply.buf().put(prototype, 24, 8);
+    }
+
+    /** Whether requests are currently being rejected. */
+    public boolean isShedding() {
+        return shedding;
+    }
+
+    /** The moving average of the handler latency, in nanoseconds. */
+    public long latency() {
+        return latency;
+    }
+
+    /** The last sampled queue depth. */
+    public int queueDepth() {
+        return queueDepth;
+    }
+
+    /** The number of requests handled. */
+    public long admitted() {
+        return admitted.get();
+    }
+
+    /** The number of requests rejected. */
+    public long rejected() {
+        return rejected.get();
+    }
+}
@@ -0,0 +1,187 @@
+package org.gnu.mach;
+
+import java.nio.ByteBuffer;
+import java.util.HashMap;
+
+/**
+ * Fixed-size blocks of data kept off-heap, with LRU replacement.
+ *
+ * A {@link BlockCache} allocates one direct buffer, accounted for by
+ * {@link DirectMemory}, and divides it into blocks, each stored under a
+ * {@code long} key chosen by the user, such as a file identifier and a
+ * block number. As in {@link MachMsgArena}, the blocks are designated by
+ * {@code int} handles and the bookkeeping lives in parallel arrays: a
+ * doubly-linked list through {@code int} arrays orders the blocks from
+ * the most to the least recently used, and a full cache replaces the
+ * block at the tail.
+ *
+ * There is no way to remove blocks by key prefix; to invalidate all the
+ * blocks of a file, switch to a new key for it, and let the stale blocks
+ * age out. The cache is not synchronized.
+ */
+public class BlockCache {
+    /** Returned by {@link #lookup} when the key is not in the cache. */
+    public static final int NONE = -1;
+
+    private final ByteBuffer arena;
+    private final int blockSize;
+    private final long[] keys;
+    private final int[] lengths;
+    private final int[] prev;
+    private final int[] next;
+    private final HashMap<Long, Integer> index;
+    private int head = NONE;
+    private int tail = NONE;
+    private int count;
+
+    private long hits;
+    private long misses;
+    private long evictions;
+
+    /**
+     * Create a cache.
+     *
+     * @param blockSize The size of each block.
+     * @param blocks    The number of blocks.
+     */
+    public BlockCache(int blockSize, int blocks) {
+        if(blockSize <= 0 || blocks <= 0
+                || (long) blockSize * blocks > Integer.MAX_VALUE)
+            throw new IllegalArgumentException();
+
+        this.blockSize = blockSize;
+        arena = DirectMemory.allocate(blockSize * blocks);
+        keys = new long[blocks];
+        lengths = new int[blocks];
+        prev = new int[blocks];
+        next = new int[blocks];
+        index = new HashMap<Long, Integer>(2 * blocks);
+    }
+
+    /** The size of each block. */
+    public int blockSize() {
+        return blockSize;
+    }
+
+    /** The number of blocks. */
+    public int capacity() {
+        return keys.length;
+    }
+
+    /** The number of blocks in use. */
+    public int size() {
+        return count;
+    }
+
+    /** The number of successful lookups. */
+    public long hits() {
+        return hits;
+    }
+
+    /** The number of failed lookups. */
+    public long misses() {
+        return misses;
+    }
+
+    /** The number of blocks replaced to make room for new ones. */
+    public long evictions() {
+        return evictions;
+    }
+
+    private void unlink(int block) {
+        if(prev[block] != NONE)
+            next[prev[block]] = next[block];
+        else
+            head = next[block];
+        if(next[block] != NONE)
+            prev[next[block]] = prev[block];
+        else
+            tail = prev[block];
+    }
+
+    private void pushFront(int block) {
+        prev[block] = NONE;
+        next[block] = head;
+        if(head != NONE)
+            prev[head] = block;
+        head = block;
+        if(tail == NONE)
+            tail = block;
+    }
+
+    /**
+     * Find the block stored under {@code key} and mark it as the most
+     * recently used. Returns {@link #NONE} if there is none.
+     */
+    public int lookup(long key) {
+        Integer block = index.get(key);
+        if(block == null) {
+            misses++;
+            return NONE;
+        }
+
+        hits++;
+        if(block != head) {
+            unlink(block);
+            pushFront(block);
+        }
+        return block;
+    }
+
+    /** The number of valid bytes in a block. */
+    public int length(int block) {
+        return lengths[block];
+    }
+
+    /** Copy bytes out of a block. */
+    public void get(int block, int offset, byte[] dst, int dstOffset,
+                    int length)
+    {
+        if(offset < 0 || length < 0 || offset + length > lengths[block])
+            throw new IndexOutOfBoundsException();
+
+        ByteBuffer b = arena.duplicate();
+        b.position(block * blockSize + offset);
+        b.get(dst, dstOffset, length);
+    }
+
+    /**
+     * Store up to one block of data under {@code key}, replacing any
+     * block already stored under it, or else the least recently used
+     * block if the cache is full. Returns the block.
+     */
+    public int put(long key, byte[] data, int offset, int length) {
+        if(length < 0 || length > blockSize)
+            throw new IllegalArgumentException();
+
+        Integer old = index.get(key);
+        int block;
+        if(old != null) {
+            block = old;
+            unlink(block);
+        } else if(count < keys.length)
+            block = count++;
+        else {
+            block = tail;
+            unlink(block);
+            index.remove(keys[block]);
+            evictions++;
+        }
+
+        ByteBuffer b = arena.duplicate();
+        b.position(block * blockSize);
+        b.put(data, offset, length);
+        keys[block] = key;
+        lengths[block] = length;
+        index.put(key, block);
+        pushFront(block);
+        return block;
+    }
+
+    /** Drop all the blocks. */
+    public void clear() {
+        index.clear();
+        head = tail = NONE;
+        count = 0;
+    }
+}
@@ -0,0 +1,317 @@
+package org.gnu.mach;
+
+import java.lang.ref.PhantomReference;
+import java.lang.ref.ReferenceQueue;
+import java.nio.ByteBuffer;
+import java.util.concurrent.ConcurrentHashMap;
+import java.util.concurrent.atomic.AtomicLong;
+import java.util.concurrent.atomic.AtomicLongArray;
+
+/**
+ * Accounting and limits for the native memory held by message buffers.
+ *
+ * All the direct buffers of {@link MachMsg} and {@link MachMsgArena} are
+ * allocated through this class, which keeps track of the current and
+ * peak amount of memory they hold, overall and by size class. Buffers are
+ * accounted for until they are collected. The out-of-line regions mapped
+ * into our address space by received messages are counted separately, as
+ * a running total, since they are not deallocated by {@link MachMsg}.
+ *
+ * A limit can be set with {@link #setLimit} or the
+ * {@code org.gnu.mach.directLimit} property (in bytes). When an allocation
+ * would exceed it, the caller gets a {@link DirectMemoryLimitException}
+ * at once, or, if {@link #setMaxWait} ({@code org.gnu.mach.directWait})
+ * is set, after waiting up to that many milliseconds for buffers to be
+ * collected; waiting callers trigger a garbage collection at most once a
+ * second between them. A server can catch the exception and shed load,
+ * instead of running the JVM out of direct memory altogether.
+ *
+ * Wired arenas (see {@link MachMsgArena#MachMsgArena(int, int, boolean)})
+ * take their memory from the kernel rather than from the JVM. It counts
+ * against the same limit and is reported separately by {@link #pinned}
+ * and {@link #wired}.
+ */
+public final class DirectMemory {
+    /** Number of size classes. */
+    public static final int CLASSES = 14;
+
+    /** The smallest size class holds buffers of up to this size. */
+    private static final int MIN_CLASS_SIZE = 256;
+
+    /** How often waiting allocations check for collected buffers. */
+    private static final long POLL_MILLIS = 10;
+
+    /** Minimum interval between two collections requested by us. */
+    private static final long GC_INTERVAL_MILLIS = 1000;
+
+    private static final AtomicLong used = new AtomicLong();
+    private static final AtomicLong peak = new AtomicLong();
+    private static final AtomicLong failures = new AtomicLong();
+    private static final AtomicLong outOfLineMapped = new AtomicLong();
+    private static final AtomicLong lastGc = new AtomicLong();
+    private static final AtomicLong pinned = new AtomicLong();
+    private static final AtomicLong wired = new AtomicLong();
+    private static final AtomicLong wireFailures = new AtomicLong();
+    private static final AtomicLongArray classBytes =
+        new AtomicLongArray(CLASSES);
+    private static final AtomicLongArray classBuffers =
+        new AtomicLongArray(CLASSES);
+
+    private static volatile long limit =
+        Long.getLong("org.gnu.mach.directLimit", 0);
+    private static volatile long maxWait =
+        Long.getLong("org.gnu.mach.directWait", 0);
+
+    /** Tracks a buffer until it is collected. */
+    private static final class Tracker extends PhantomReference<ByteBuffer> {
+        final int size;
+
+        Tracker(ByteBuffer buf, int size) {
+            super(buf, queue);
+            this.size = size;
+        }
+    }
+
+    private static final ReferenceQueue<ByteBuffer> queue =
+        new ReferenceQueue<ByteBuffer>();
+
+    /* Keeps the trackers reachable until they are enqueued. */
+    private static final ConcurrentHashMap<Tracker, Boolean> trackers =
+        new ConcurrentHashMap<Tracker, Boolean>();
+
+    private static final Object lock = new Object();
+
+    private DirectMemory() {}
+
+    /** The size class of a buffer of the given size. */
+    public static int sizeClass(long size) {
+        int c = 0;
+        while(c < CLASSES - 1 && size > classSize(c))
+            c++;
+        return c;
+    }
+
+    /**
+     * The largest buffer size in a size class; the last class has no
+     * upper bound.
+     */
+    public static long classSize(int c) {
+        return (c < CLASSES - 1) ? (long) MIN_CLASS_SIZE << c
+                                 : Long.MAX_VALUE;
+    }
+
+    /**
+     * Allocate a direct buffer, waiting for memory to be freed or failing
+     * if that would exceed the limit.
+     */
+    static ByteBuffer allocate(int size) {
+        reserve(size);
+        ByteBuffer buf;
+        try {
+            buf = ByteBuffer.allocateDirect(size);
+        } catch(OutOfMemoryError err) {
+            release(size);
+            throw err;
+        }
+        trackers.put(new Tracker(buf, size), Boolean.TRUE);
+        return buf;
+    }
+
+    /**
+     * Allocate prefaulted memory from the kernel, which stays accounted
+     * for until it is released with {@link #freePinned}.
+     */
+    static ByteBuffer allocatePinned(int size) {
+        reserve(size);
+        ByteBuffer buf = Mach.backend.vmAllocate(size);
+        if(buf == null) {
+            release(size);
+            throw new OutOfMemoryError("vm_allocate failed");
+        }
+        pinned.addAndGet(size);
+        return buf;
+    }
+
+    /**
+     * Try to wire memory from {@link #allocatePinned}. This needs the
+     * privileged host port; without it, the memory stays merely
+     * prefaulted and {@code false} is returned.
+     */
+    static boolean wire(ByteBuffer buf) {
+        if(Mach.backend.vmWire(buf) != 0) {
+            wireFailures.incrementAndGet();
+            return false;
+        }
+        wired.addAndGet(buf.capacity());
+        return true;
+    }
+
+    /** Give memory from {@link #allocatePinned} back to the kernel. */
+    static void freePinned(ByteBuffer buf, boolean isWired) {
+        int size = buf.capacity();
+        Mach.backend.vmDeallocate(buf);
+        if(isWired)
+            wired.addAndGet(-size);
+        pinned.addAndGet(-size);
+        release(size);
+    }
+
+    private static boolean tryReserve(long size) {
+        while(true) {
+            long cur = used.get();
+            long max = limit;
+            if(max > 0 && cur + size > max)
+                return false;
+            if(used.compareAndSet(cur, cur + size)) {
+                cur += size;
+                long p;
+                while(cur > (p = peak.get()) && !peak.compareAndSet(p, cur))
+                    ;
+                int c = sizeClass(size);
+                classBytes.addAndGet(c, size);
+                classBuffers.incrementAndGet(c);
+                return true;
+            }
+        }
+    }
+
+    private static void reserve(long size) {
+        drain();
+        if(tryReserve(size))
+            return;
+
+        long wait = maxWait;
+        if(wait <= 0) {
+            failures.incrementAndGet();
+            throw new DirectMemoryLimitException(size, used.get(), limit);
+        }
+
+        /* Give the collector a chance to free unreachable buffers, but
+         * don't let every waiting allocation ask for a full collection. */
+        long now = System.currentTimeMillis();
+        long last = lastGc.get();
+        if(now - last >= GC_INTERVAL_MILLIS && lastGc.compareAndSet(last, now))
+            System.gc();
+
+        long deadline = now + wait;
+        while(true) {
+            drain();
+            if(tryReserve(size))
+                return;
+
+            long left = deadline - System.currentTimeMillis();
+            if(left <= 0)
+                break;
+            synchronized(lock) {
+                try {
+                    lock.wait(Math.min(left, POLL_MILLIS));
+                } catch(InterruptedException exc) {
+                    Thread.currentThread().interrupt();
+                    break;
+                }
+            }
+        }
+
+        failures.incrementAndGet();
+        throw new DirectMemoryLimitException(size, used.get(), limit);
+    }
+
+    private static void release(long size) {
+        used.addAndGet(-size);
+        int c = sizeClass(size);
+        classBytes.addAndGet(c, -size);
+        classBuffers.decrementAndGet(c);
+        synchronized(lock) {
+            lock.notifyAll();
+        }
+    }
+
+    /** Account for the buffers which have been collected. */
+    private static void drain() {
+        Tracker t;
+        while((t = (Tracker) queue.poll()) != null) {
+            trackers.remove(t);
+            release(t.size);
+        }
+    }
+
+    /** Record out-of-line memory mapped by a received message. */
+    static void recordOutOfLine(long bytes) {
+        outOfLineMapped.addAndGet(bytes);
+    }
+
+    /* Configuration */
+
+    /** Set the limit in bytes, or 0 for none. */
+    public static void setLimit(long bytes) {
+        limit = bytes;
+        synchronized(lock) {
+            lock.notifyAll();
+        }
+    }
+
+    public static long getLimit() {
+        return limit;
+    }
+
+    /** Set how long allocations may wait for memory, in milliseconds. */
+    public static void setMaxWait(long millis) {
+        maxWait = millis;
+    }
+
+    public static long getMaxWait() {
+        return maxWait;
+    }
+
+    /* Statistics */
+
+    /** Bytes currently held by message buffers. */
+    public static long used() {
+        drain();
+        return used.get();
+    }
+
+    /** Highest value reached by {@link #used}. */
+    public static long peak() {
+        return peak.get();
+    }
+
+    /** Number of allocations refused because of the limit. */
+    public static long failures() {
+        return failures.get();
+    }
+
+    /**
+     * Total bytes of out-of-line memory mapped by received messages since
+     * startup. This is a cumulative count, not the amount currently held:
+     * the regions are released by whoever consumes them.
+     */
+    public static long outOfLineMapped() {
+        return outOfLineMapped.get();
+    }
+
+    /** Bytes held by wired arenas, whether or not wiring succeeded. */
+    public static long pinned() {
+        return pinned.get();
+    }
+
+    /** Bytes of {@link #pinned} memory actually wired. */
+    public static long wired() {
+        return wired.get();
+    }
+
+    /** Number of arenas which could not be wired. */
+    public static long wireFailures() {
+        return wireFailures.get();
+    }
+
+    /** Bytes currently held by buffers of a size class. */
+    public static long classBytes(int c) {
+        return classBytes.get(c);
+    }
+
+    /** Number of live buffers of a size class. */
+    public static long classBuffers(int c) {
+        return classBuffers.get(c);
+    }
+}
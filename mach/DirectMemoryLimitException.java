@@ -0,0 +1,14 @@
+package org.gnu.mach;
+
+/**
+ * Thrown when a message buffer can't be allocated without exceeding the
+ * limit set with {@link DirectMemory#setLimit}.
+ */
+public class DirectMemoryLimitException extends RuntimeException {
+    static final long serialVersionUID = 4195038807735632711L;
+
+    public DirectMemoryLimitException(long size, long used, long limit) {
+        super(String.format("cannot allocate %d bytes: %d of %d in use",
+                            size, used, limit));
+    }
+}
@@ -0,0 +1,1079 @@
+package org.gnu.mach;
+
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.util.ArrayDeque;
+import java.util.ArrayList;
+import java.util.HashMap;
+import java.util.List;
+import java.util.Map;
+import java.util.concurrent.TimeUnit;
+import java.util.concurrent.locks.Condition;
+import java.util.concurrent.locks.ReentrantLock;
+
+/**
+ * Model of the Mach IPC kernel, implemented in Java.
+ *
+ * This {@link Mach.Backend} keeps a port name space for a single task,
+ * with send, receive, send-once and dead-name rights, user reference
+ * counts, port sets, message queues with a queue limit, sequence numbers,
+ * blocking sends and receives with timeouts, and the no-senders,
+ * send-once, dead-name and port-deleted notifications. Messages are
+ * copied in and out of the caller's buffer in the same typed format as
+ * the kernel uses, so that {@link MachMsg}, {@link MachPort} and servers
+ * built on them run unmodified on any JVM.
+ *
+ * The model is meant for tests and benchmarks, and to isolate the cost of
+ * the JNI layer by comparing backends. It does not support out-of-line
+ * data, for which there is no address space to map, nor other tasks:
+ * {@link #taskSelf} is the only task name accepted. A single lock
+ * protects the whole model.
+ */
+public class KernelModel extends Mach.Backend {
+    /** The name returned by {@link #taskSelf}. */
+    public static final int TASK_SELF = 1;
+
+    /** Default queue limit, {@code MACH_PORT_QLIMIT_DEFAULT}. */
+    public static final int QLIMIT_DEFAULT = 5;
+
+    private static final int HEADER_SIZE = 24;
+    private static final int BITS_COMPLEX = 0x80000000;
+    private static final int TYPE_INLINE = 0x10000000;
+    private static final int TYPE_PORT_NAME = 15;
+
+    /* Received dispositions, MACH_MSG_TYPE_PORT_*. */
+    private static final int PORT_RECEIVE = 16;
+    private static final int PORT_SEND = 17;
+    private static final int PORT_SEND_ONCE = 18;
+
+    /* Sent dispositions, MACH_MSG_TYPE_{MOVE,COPY,MAKE}_*. */
+    private static final int MOVE_RECEIVE = 16;
+    private static final int MOVE_SEND = 17;
+    private static final int MOVE_SEND_ONCE = 18;
+    private static final int COPY_SEND = 19;
+    private static final int MAKE_SEND = 20;
+    private static final int MAKE_SEND_ONCE = 21;
+
+    /** A port. */
+    private final class KPort {
+        final ArrayDeque<KMsg> queue = new ArrayDeque<KMsg>();
+        final Condition notEmpty = lock.newCondition();
+        final Condition notFull = lock.newCondition();
+        boolean active = true;
+        KSet set;
+
+        /** Name of the entry for our receive and send rights, if any. */
+        int name;
+
+        int seqno;
+        int mscount;
+        int srights;
+        int sorights;
+        int qlimit = QLIMIT_DEFAULT;
+
+        KRight nsRequest;
+        int nsSync;
+    }
+
+    /** A port set. */
+    private final class KSet {
+        final List<KPort> members = new ArrayList<KPort>();
+        final Condition notEmpty = lock.newCondition();
+        boolean active = true;
+        int name;
+        int next;
+    }
+
+    /**
+     * A right held by the kernel, in a queued message or a notification
+     * request. A {@code null} port stands for a dead name.
+     */
+    private static final class KRight {
+        final KPort port;
+        final int type;
+
+        KRight(KPort port, int type) {
+            this.port = port;
+            this.type = type;
+        }
+    }
+
+    /** Marks a failed copyin. */
+    private static final KRight INVALID = new KRight(null, 0);
+
+    /** A queued message. */
+    private static final class KMsg {
+        final byte[] data;
+        final KRight dest;
+        final KRight reply;
+        final KRight[] rights;
+
+        KMsg(byte[] data, KRight dest, KRight reply, KRight[] rights) {
+            this.data = data;
+            this.dest = dest;
+            this.reply = reply;
+            this.rights = rights;
+        }
+    }
+
+    /** An entry in the name space. */
+    private static final class Entry {
+        int type;
+        KPort port;
+        KSet set;
+        int urefs;
+        KRight dnRequest;
+    }
+
+    private final ReentrantLock lock = new ReentrantLock();
+    private final Map<Integer, Entry> names = new HashMap<Integer, Entry>();
+    private int nextName = 0x10;
+
+    /* Counters for stats(), in the Mach.NativeStats layout. */
+    private final long[] counters = new long[Mach.NativeStats.MAX];
+
+    /* Name space */
+
+    private int newName(Entry e) {
+        int name = nextName++;
+        names.put(name, e);
+        return name;
+    }
+
+    private void removeEntry(int name, Entry e) {
+        names.remove(name);
+        if(e.dnRequest != null) {
+            KRight n = e.dnRequest;
+            e.dnRequest = null;
+            notify(n, Mach.NOTIFY_PORT_DELETED, name);
+        }
+    }
+
+    /** Drop an entry whose rights have all gone. */
+    private void trim(int name, Entry e) {
+        if(e.type == 0) {
+            if(e.port != null && e.port.name == name)
+                e.port.name = Mach.Port.NULL;
+            removeEntry(name, e);
+        }
+    }
+
+    private static int receivedType(int disposition) {
+        switch(disposition) {
+            case MOVE_RECEIVE:
+                return PORT_RECEIVE;
+            case MOVE_SEND_ONCE:
+            case MAKE_SEND_ONCE:
+                return PORT_SEND_ONCE;
+            default:
+                return PORT_SEND;
+        }
+    }
+
+    /**
+     * Take a right out of the name space according to a message
+     * disposition. Returns {@code null} for {@code MACH_PORT_NULL} and
+     * {@link #INVALID} if the name does not denote a suitable right.
+     */
+    private KRight copyin(int name, int disposition) {
+        if(name == Mach.Port.NULL)
+            return null;
+        if(disposition < MOVE_RECEIVE || disposition > MAKE_SEND_ONCE)
+            return INVALID;
+        if(name == Mach.Port.DEAD)
+            return new KRight(null, receivedType(disposition));
+
+        Entry e = names.get(name);
+        if(e == null)
+            return INVALID;
+        KPort p = e.port;
+
+        switch(disposition) {
+            case MOVE_RECEIVE:
+                if((e.type & Mach.Port.TYPE_RECEIVE) == 0)
+                    return INVALID;
+                if(p.set != null)
+                    leaveSet(p);
+                e.type &= ~Mach.Port.TYPE_RECEIVE;
+                trim(name, e);
+                return new KRight(p, PORT_RECEIVE);
+
+            case COPY_SEND:
+            case MOVE_SEND:
+                if((e.type & Mach.Port.TYPE_DEAD_NAME) != 0) {
+                    if(disposition == MOVE_SEND && --e.urefs == 0) {
+                        e.type = 0;
+                        removeEntry(name, e);
+                    }
+                    return new KRight(null, PORT_SEND);
+                }
+                if((e.type & Mach.Port.TYPE_SEND) == 0)
+                    return INVALID;
+                if(disposition == COPY_SEND || e.urefs > 1)
+                    p.srights++;
+                if(disposition == MOVE_SEND && --e.urefs == 0) {
+                    e.type &= ~Mach.Port.TYPE_SEND;
+                    trim(name, e);
+                }
+                return new KRight(p, PORT_SEND);
+
+            case MAKE_SEND:
+                if((e.type & Mach.Port.TYPE_RECEIVE) == 0)
+                    return INVALID;
+                p.mscount++;
+                p.srights++;
+                return new KRight(p, PORT_SEND);
+
+            case MAKE_SEND_ONCE:
+                if((e.type & Mach.Port.TYPE_RECEIVE) == 0)
+                    return INVALID;
+                p.sorights++;
+                return new KRight(p, PORT_SEND_ONCE);
+
+            case MOVE_SEND_ONCE:
+                if((e.type & Mach.Port.TYPE_DEAD_NAME) != 0) {
+                    e.type = 0;
+                    removeEntry(name, e);
+                    return new KRight(null, PORT_SEND_ONCE);
+                }
+                if((e.type & Mach.Port.TYPE_SEND_ONCE) == 0)
+                    return INVALID;
+                e.type = 0;
+                removeEntry(name, e);
+                return new KRight(p, PORT_SEND_ONCE);
+        }
+        return INVALID;
+    }
+
+    /** Put a right into the name space and return its name. */
+    private int copyout(KRight r) {
+        if(r == null)
+            return Mach.Port.NULL;
+        KPort p = r.port;
+        if(p == null || (!p.active && r.type != PORT_RECEIVE)) {
+            if(p != null)
+                release(r);
+            return Mach.Port.DEAD;
+        }
+
+        Entry e;
+        switch(r.type) {
+            case PORT_SEND:
+                e = (p.name != Mach.Port.NULL) ? names.get(p.name) : null;
+                if(e == null) {
+                    e = new Entry();
+                    e.port = p;
+                    p.name = newName(e);
+                }
+                if((e.type & Mach.Port.TYPE_SEND) != 0) {
+                    /* Merged into the right we already hold. */
+                    p.srights--;
+                    e.urefs++;
+                } else {
+                    e.type |= Mach.Port.TYPE_SEND;
+                    e.urefs = 1;
+                }
+                return p.name;
+
+            case PORT_SEND_ONCE:
+                e = new Entry();
+                e.type = Mach.Port.TYPE_SEND_ONCE;
+                e.port = p;
+                return newName(e);
+
+            case PORT_RECEIVE:
+                e = (p.name != Mach.Port.NULL) ? names.get(p.name) : null;
+                if(e == null) {
+                    e = new Entry();
+                    e.port = p;
+                    p.name = newName(e);
+                }
+                e.type |= Mach.Port.TYPE_RECEIVE;
+                return p.name;
+        }
+        return Mach.Port.NULL;
+    }
+
+    /** Destroy a right held by the kernel. */
+    private void release(KRight r) {
+        if(r == null || r.port == null)
+            return;
+        KPort p = r.port;
+
+        switch(r.type) {
+            case PORT_SEND:
+                p.srights--;
+                checkNoSenders(p);
+                break;
+
+            case PORT_SEND_ONCE:
+                if(p.active) {
+                    /* The right is used up by the notification. */
+                    enqueue(p, notification(r, Mach.NOTIFY_SEND_ONCE,
+                                            HEADER_SIZE));
+                } else {
+                    p.sorights--;
+                }
+                break;
+
+            case PORT_RECEIVE:
+                destroyPort(p);
+                break;
+        }
+    }
+
+    /* Notifications */
+
+    private static byte[] notification(int id, int size) {
+        ByteBuffer b = ByteBuffer.allocate(size);
+        b.order(ByteOrder.nativeOrder());
+        b.putInt(4, size);
+        b.putInt(20, id);
+        return b.array();
+    }
+
+    private static KMsg notification(KRight to, int id, int size) {
+        return new KMsg(notification(id, size), to, null, null);
+    }
+
+    /** Send a notification carrying a single 32-bit value. */
+    private void notify(KRight to, int id, int value) {
+        int itemType = (id == Mach.NOTIFY_NO_SENDERS)
+            ? MachMsgType.INTEGER_32.name() : TYPE_PORT_NAME;
+
+        byte[] data = notification(id, HEADER_SIZE + 8);
+        ByteBuffer b = ByteBuffer.wrap(data).order(ByteOrder.nativeOrder());
+        b.putInt(24, itemType | (32 << 8) | (1 << 16) | TYPE_INLINE);
+        b.putInt(28, value);
+        enqueue(to.port, new KMsg(data, to, null, null));
+    }
+
+    private void checkNoSenders(KPort p) {
+        if(p.srights == 0 && p.nsRequest != null && p.mscount >= p.nsSync) {
+            KRight n = p.nsRequest;
+            p.nsRequest = null;
+            notify(n, Mach.NOTIFY_NO_SENDERS, p.mscount);
+        }
+    }
+
+    /* Ports and port sets */
+
+    private void leaveSet(KPort p) {
+        p.set.members.remove(p);
+        p.set = null;
+        p.notEmpty.signalAll();
+    }
+
+    private void destroyPort(KPort p) {
+        if(!p.active)
+            return;
+        p.active = false;
+        if(p.set != null)
+            leaveSet(p);
+
+        /* Our send and send-once rights become dead names. */
+        List<Integer> dead = new ArrayList<Integer>();
+        for(Map.Entry<Integer, Entry> me : names.entrySet())
+            if(me.getValue().port == p)
+                dead.add(me.getKey());
+        for(int name : dead) {
+            Entry e = names.get(name);
+            e.type &= ~Mach.Port.TYPE_RECEIVE;
+            if((e.type & (Mach.Port.TYPE_SEND | Mach.Port.TYPE_SEND_ONCE))
+                    == 0) {
+                e.type = 0;
+                removeEntry(name, e);
+                continue;
+            }
+            if((e.type & Mach.Port.TYPE_SEND_ONCE) != 0)
+                e.urefs = 1;
+            e.type = Mach.Port.TYPE_DEAD_NAME;
+            e.port = null;
+            if(e.dnRequest != null) {
+                KRight n = e.dnRequest;
+                e.dnRequest = null;
+                notify(n, Mach.NOTIFY_DEAD_NAME, name);
+            }
+        }
+        p.name = Mach.Port.NULL;
+
+        while(!p.queue.isEmpty())
+            destroyMsg(p.queue.poll());
+        if(p.nsRequest != null) {
+            release(p.nsRequest);
+            p.nsRequest = null;
+        }
+
+        p.notEmpty.signalAll();
+        p.notFull.signalAll();
+    }
+
+    private void destroyMsg(KMsg m) {
+        release(m.dest);
+        release(m.reply);
+        if(m.rights != null)
+            for(KRight r : m.rights)
+                release(r);
+    }
+
+    private void enqueue(KPort p, KMsg m) {
+        if(!p.active) {
+            destroyMsg(m);
+            return;
+        }
+        p.queue.add(m);
+        p.notEmpty.signalAll();
+        if(p.set != null)
+            p.set.notEmpty.signalAll();
+    }
+
+    /**
+     * Wait on a condition until a deadline, or indefinitely if it is
+     * negative. Returns 0, or the given error code if the deadline passed
+     * or the wait was interrupted and {@code interruptible} is set.
+     *
+     * Otherwise, interrupts are remembered and the wait goes on; the
+     * interrupt status is only set again on return, and cleared on entry,
+     * so that callers waiting in a loop don't spin on it.
+     */
+    private static int await(Condition c, long deadline, boolean interruptible,
+                             int timedOut, int interrupted) {
+        boolean wasInterrupted = !interruptible && Thread.interrupted();
+        try {
+            while(true) {
+                try {
+                    if(deadline < 0) {
+                        c.await();
+                        return 0;
+                    }
+                    long left = deadline - System.nanoTime();
+                    if(left <= 0)
+                        return timedOut;
+                    c.awaitNanos(left);
+                    return 0;
+                } catch(InterruptedException exc) {
+                    if(interruptible)
+                        return interrupted;
+                    wasInterrupted = true;
+                }
+            }
+        } finally {
+            if(wasInterrupted)
+                Thread.currentThread().interrupt();
+        }
+    }
+
+    private static long deadline(boolean enabled, long timeout) {
+        return enabled ? System.nanoTime()
+                         + TimeUnit.MILLISECONDS.toNanos(timeout) : -1;
+    }
+
+    /* Message transfer */
+
+    private int send(ByteBuffer buf, int option, long timeout) {
+        final int size = buf.position();
+        if(size < HEADER_SIZE || (size & 3) != 0)
+            return Mach.SEND_MSG_TOO_SMALL;
+
+        int bits = buf.getInt(0);
+        int remoteType = bits & 0xff;
+        int localType = (bits >> 8) & 0xff;
+        int remote = buf.getInt(8);
+        int local = buf.getInt(12);
+        long deadline = deadline((option & Mach.SEND_TIMEOUT) != 0, timeout);
+
+        /* Check the header and wait for room in the destination queue. */
+        while(true) {
+            if(remoteType < MOVE_RECEIVE || remoteType > MAKE_SEND_ONCE
+                    || remoteType == MOVE_RECEIVE)
+                return Mach.SEND_INVALID_HEADER;
+            if(local != Mach.Port.NULL && (localType < MOVE_SEND
+                                           || localType > MAKE_SEND_ONCE))
+                return Mach.SEND_INVALID_HEADER;
+
+            Entry dest = names.get(remote);
+            if(dest == null || dest.port == null || !dest.port.active)
+                return Mach.SEND_INVALID_DEST;
+            if(!checkRight(dest, remoteType))
+                return Mach.SEND_INVALID_DEST;
+            if(local != Mach.Port.NULL && local != Mach.Port.DEAD
+                    && !checkRight(names.get(local), localType))
+                return Mach.SEND_INVALID_REPLY;
+
+            KPort p = dest.port;
+            if(receivedType(remoteType) == PORT_SEND_ONCE
+                    || p.queue.size() < p.qlimit)
+                break;
+
+            int err = await(p.notFull, deadline,
+                            (option & Mach.SEND_INTERRUPT) != 0,
+                            Mach.SEND_TIMED_OUT, Mach.SEND_INTERRUPTED);
+            if(err != 0)
+                return err;
+        }
+
+        final byte[] data = new byte[size];
+        ByteBuffer copy = buf.duplicate();
+        copy.clear();
+        copy.get(data);
+
+        /* Copy in the rights carried by the body. */
+        KRight[] rights = null;
+        if((bits & BITS_COMPLEX) != 0) {
+            ByteBuffer body = ByteBuffer.wrap(data).order(buf.order());
+            body.position(HEADER_SIZE);
+            final List<KRight> list = new ArrayList<KRight>();
+            final int[] err = new int[1];
+
+            MachMsgType.scanItems(body, new MachMsgType.ItemVisitor() {
+                void portItem(ByteBuffer b, int index, int type) {
+                    /* Rewrite the type descriptor as the receiver will
+                     * see it. */
+                    int header = b.getInt(index);
+                    if((header & 0x20000000) != 0)
+                        b.putShort(index + 4, (short) receivedType(type));
+                    else
+                        b.putInt(index, (header & ~0xff) | receivedType(type));
+                }
+                void port(ByteBuffer b, int index, int type) {
+                    if(err[0] != 0)
+                        return;
+                    KRight r = copyin(b.getInt(index), type);
+                    if(r == INVALID) {
+                        err[0] = Mach.SEND_INVALID_RIGHT;
+                        return;
+                    }
+                    list.add(r);
+                    b.putInt(index, Mach.Port.NULL);
+                }
+                void outOfLine(ByteBuffer b, int index, int headerSize,
+                               int type) {
+                    err[0] = Mach.SEND_INVALID_MEMORY;
+                }
+            });
+
+            rights = list.toArray(new KRight[list.size()]);
+            if(err[0] != 0) {
+                abortSend(rights, remote, remoteType, local, localType);
+                return err[0];
+            }
+        }
+
+        /* The header rights may have been moved out by the body, which the
+         * kernel, copying in the header first, reports on the body. */
+        Entry e = names.get(remote);
+        if(e == null || e.port == null || !checkRight(e, remoteType)
+                || (local != Mach.Port.NULL && local != Mach.Port.DEAD
+                    && !checkRight(names.get(local), localType))) {
+            abortSend(rights, remote, remoteType, local, localType);
+            return Mach.SEND_INVALID_RIGHT;
+        }
+
+        KRight dest = copyin(remote, remoteType);
+        KRight reply = copyin(local, localType);
+        enqueue(dest.port, new KMsg(data, dest, reply, rights));
+
+        counters[Mach.NativeStats.BYTES_SENT] += size;
+        return Mach.MSG_SUCCESS;
+    }
+
+    /**
+     * Destroy the header rights of a message whose body failed to be
+     * copied in, along with the body rights copied in so far, as
+     * {@code ipc_kmsg_clean_partial()} does.
+     */
+    private void abortSend(KRight[] rights, int remote, int remoteType,
+                           int local, int localType) {
+        if(rights != null)
+            for(KRight r : rights)
+                release(r);
+        release(copyin(remote, remoteType));
+        release(copyin(local, localType));
+    }
+
+    private static boolean checkRight(Entry e, int disposition) {
+        if(e == null)
+            return false;
+        switch(disposition) {
+            case MOVE_RECEIVE:
+            case MAKE_SEND:
+            case MAKE_SEND_ONCE:
+                return (e.type & Mach.Port.TYPE_RECEIVE) != 0;
+            case MOVE_SEND:
+            case COPY_SEND:
+                return (e.type & (Mach.Port.TYPE_SEND
+                                  | Mach.Port.TYPE_DEAD_NAME)) != 0;
+            case MOVE_SEND_ONCE:
+                return (e.type & (Mach.Port.TYPE_SEND_ONCE
+                                  | Mach.Port.TYPE_DEAD_NAME)) != 0;
+        }
+        return false;
+    }
+
+    private int receive(ByteBuffer buf, int option, int rcvName,
+                        long timeout) {
+        Entry e = names.get(rcvName);
+        if(e == null || (e.type & (Mach.Port.TYPE_RECEIVE
+                                   | Mach.Port.TYPE_PORT_SET)) == 0)
+            return Mach.RCV_INVALID_NAME;
+        KPort port = ((e.type & Mach.Port.TYPE_RECEIVE) != 0) ? e.port : null;
+        KSet set = e.set;
+        if(port != null && port.set != null)
+            return Mach.RCV_IN_SET;
+
+        long deadline = deadline((option & Mach.RCV_TIMEOUT) != 0, timeout);
+        KPort from;
+        while(true) {
+            from = null;
+            if(port != null) {
+                if(!port.active)
+                    return Mach.RCV_PORT_DIED;
+                if(port.set != null)
+                    return Mach.RCV_PORT_CHANGED;
+                if(!port.queue.isEmpty())
+                    from = port;
+            } else {
+                if(!set.active)
+                    return Mach.RCV_PORT_DIED;
+                int n = set.members.size();
+                for(int i = 0; i < n && from == null; i++) {
+                    KPort m = set.members.get((set.next + i) % n);
+                    if(!m.queue.isEmpty()) {
+                        from = m;
+                        set.next = (set.next + i + 1) % n;
+                    }
+                }
+            }
+            if(from != null)
+                break;
+
+            Condition c = (port != null) ? port.notEmpty : set.notEmpty;
+            int err = await(c, deadline, (option & Mach.RCV_INTERRUPT) != 0,
+                            Mach.RCV_TIMED_OUT, Mach.RCV_INTERRUPTED);
+            if(err != 0)
+                return err;
+        }
+
+        KMsg m = from.queue.peek();
+        if(m.data.length > buf.capacity()) {
+            if((option & Mach.RCV_LARGE) != 0) {
+                buf.putInt(4, m.data.length);
+                return Mach.RCV_TOO_LARGE;
+            }
+            from.queue.poll();
+            from.notFull.signalAll();
+            destroyMsg(m);
+            return Mach.RCV_TOO_LARGE;
+        }
+        from.queue.poll();
+        from.notFull.signalAll();
+
+        ByteBuffer copy = buf.duplicate();
+        copy.clear();
+        copy.put(m.data);
+
+        /* The destination right is used up by the delivery. */
+        if(m.dest.type == PORT_SEND_ONCE) {
+            from.sorights--;
+        } else {
+            from.srights--;
+            checkNoSenders(from);
+        }
+
+        int bits = buf.getInt(0) & BITS_COMPLEX;
+        if(m.reply != null)
+            bits |= m.reply.type;
+        bits |= m.dest.type << 8;
+        buf.putInt(0, bits);
+        buf.putInt(4, m.data.length);
+        buf.putInt(8, copyout(m.reply));
+        buf.putInt(12, from.name);
+        buf.putInt(16, from.seqno++);
+
+        if(m.rights != null && m.rights.length > 0) {
+            ByteBuffer body = buf.duplicate();
+            body.order(buf.order());
+            body.limit(m.data.length);
+            body.position(HEADER_SIZE);
+            final KRight[] rights = m.rights;
+
+            MachMsgType.scanItems(body, new MachMsgType.ItemVisitor() {
+                int i = 0;
+                void port(ByteBuffer b, int index, int type) {
+                    if(i < rights.length)
+                        b.putInt(index, copyout(rights[i++]));
+                }
+            });
+        }
+
+        counters[Mach.NativeStats.BYTES_RECEIVED] += m.data.length;
+        return Mach.MSG_SUCCESS;
+    }
+
+    /* Mach.Backend implementation */
+
+    public int msg(ByteBuffer msg, int option, int rcvName, long timeout,
+                   int notify) {
+        long start = System.nanoTime();
+        lock.lock();
+        try {
+            int ret = Mach.MSG_SUCCESS;
+            if((option & Mach.SEND_MSG) != 0)
+                ret = send(msg, option, timeout);
+            if(ret == Mach.MSG_SUCCESS && (option & Mach.RCV_MSG) != 0)
+                ret = receive(msg, option, rcvName, timeout);
+
+            counters[Mach.NativeStats.CALLS]++;
+            counters[Mach.NativeStats.KERNEL_NSECS] +=
+                System.nanoTime() - start;
+            if(ret != Mach.MSG_SUCCESS) {
+                counters[Mach.NativeStats.ERRORS]++;
+                if(Mach.isSendError(ret))
+                    counters[Mach.NativeStats.SEND_ERRORS + (ret & 0x1f)]++;
+                else if((ret & ~0x3fff) == 0x10004000)
+                    counters[Mach.NativeStats.RCV_ERRORS + (ret & 0x1f)]++;
+                else
+                    counters[Mach.NativeStats.OTHER_ERRORS]++;
+            }
+            return ret;
+        } finally {
+            lock.unlock();
+        }
+    }
+
+    public int replyPort() {
+        return allocate(TASK_SELF, Mach.Port.RIGHT_RECEIVE);
+    }
+
+    public int taskSelf() {
+        return TASK_SELF;
+    }
+
+    public void stats(long[] stats) {
+        lock.lock();
+        try {
+            System.arraycopy(counters, 0, stats, 0,
+                             Math.min(stats.length, counters.length));
+        } finally {
+            lock.unlock();
+        }
+    }
+
+    /* There is no paging in the model: memory is simply zeroed, which
+     * touches every page, and wiring always succeeds. */
+
+    public ByteBuffer vmAllocate(int size) {
+        return ByteBuffer.allocateDirect(size);
+    }
+
+    public int vmWire(ByteBuffer buf) {
+        return Mach.KERN_SUCCESS;
+    }
+
+    public int vmDeallocate(ByteBuffer buf) {
+        return Mach.KERN_SUCCESS;
+    }
+
+    /* Out-of-line memory is never transferred by the model. */
+    public int vmDeallocateRegion(long address, long size) {
+        return Mach.KERN_SUCCESS;
+    }
+
+    public int allocate(int task, int right) {
+        if(task != TASK_SELF)
+            return Mach.Port.NULL;
+
+        lock.lock();
+        try {
+            Entry e = new Entry();
+            int name;
+            switch(right) {
+                case Mach.Port.RIGHT_RECEIVE:
+                    e.type = Mach.Port.TYPE_RECEIVE;
+                    e.port = new KPort();
+                    name = newName(e);
+                    e.port.name = name;
+                    return name;
+
+                case Mach.Port.RIGHT_PORT_SET:
+                    e.type = Mach.Port.TYPE_PORT_SET;
+                    e.set = new KSet();
+                    name = newName(e);
+                    e.set.name = name;
+                    return name;
+
+                case Mach.Port.RIGHT_DEAD_NAME:
+                    e.type = Mach.Port.TYPE_DEAD_NAME;
+                    e.urefs = 1;
+                    return newName(e);
+            }
+            return Mach.Port.NULL;
+        } finally {
+            lock.unlock();
+        }
+    }
+
+    public int deallocate(int task, int name) {
+        if(task != TASK_SELF)
+            return Mach.KERN_INVALID_TASK;
+        if(name == Mach.Port.NULL || name == Mach.Port.DEAD)
+            return Mach.KERN_SUCCESS;
+
+        lock.lock();
+        try {
+            Entry e = names.get(name);
+            if(e == null)
+                return Mach.KERN_INVALID_NAME;
+            if((e.type & Mach.Port.TYPE_SEND_ONCE) != 0)
+                return modRefsLocked(name, e, Mach.Port.RIGHT_SEND_ONCE, -1);
+            if((e.type & Mach.Port.TYPE_DEAD_NAME) != 0)
+                return modRefsLocked(name, e, Mach.Port.RIGHT_DEAD_NAME, -1);
+            if((e.type & Mach.Port.TYPE_SEND) != 0)
+                return modRefsLocked(name, e, Mach.Port.RIGHT_SEND, -1);
+            return Mach.KERN_INVALID_RIGHT;
+        } finally {
+            lock.unlock();
+        }
+    }
+
+    public int modRefs(int task, int name, int right, int delta) {
+        if(task != TASK_SELF)
+            return Mach.KERN_INVALID_TASK;
+
+        lock.lock();
+        try {
+            Entry e = names.get(name);
+            if(e == null)
+                return Mach.KERN_INVALID_NAME;
+            return modRefsLocked(name, e, right, delta);
+        } finally {
+            lock.unlock();
+        }
+    }
+
+    private int modRefsLocked(int name, Entry e, int right, int delta) {
+        int bit = 1 << (16 + right);
+        if((e.type & bit) == 0)
+            return (delta == 0) ? Mach.KERN_SUCCESS : Mach.KERN_INVALID_RIGHT;
+        if(delta == 0)
+            return Mach.KERN_SUCCESS;
+
+        switch(right) {
+            case Mach.Port.RIGHT_RECEIVE:
+                if(delta != -1)
+                    return Mach.KERN_INVALID_VALUE;
+                destroyPort(e.port);
+                return Mach.KERN_SUCCESS;
+
+            case Mach.Port.RIGHT_PORT_SET:
+                if(delta != -1)
+                    return Mach.KERN_INVALID_VALUE;
+                KSet set = e.set;
+                set.active = false;
+                for(KPort p : set.members) {
+                    p.set = null;
+                    p.notEmpty.signalAll();
+                }
+                set.members.clear();
+                set.notEmpty.signalAll();
+                e.type = 0;
+                removeEntry(name, e);
+                return Mach.KERN_SUCCESS;
+
+            case Mach.Port.RIGHT_SEND_ONCE:
+                if(delta != -1)
+                    return Mach.KERN_INVALID_VALUE;
+                KPort p = e.port;
+                e.type = 0;
+                removeEntry(name, e);
+                release(new KRight(p, PORT_SEND_ONCE));
+                return Mach.KERN_SUCCESS;
+
+            case Mach.Port.RIGHT_SEND:
+            case Mach.Port.RIGHT_DEAD_NAME:
+                if(e.urefs + delta < 0)
+                    return Mach.KERN_INVALID_VALUE;
+                e.urefs += delta;
+                if(e.urefs == 0) {
+                    e.type &= ~bit;
+                    KPort sp = e.port;
+                    trim(name, e);
+                    if(right == Mach.Port.RIGHT_SEND) {
+                        sp.srights--;
+                        checkNoSenders(sp);
+                    }
+                }
+                return Mach.KERN_SUCCESS;
+        }
+        return Mach.KERN_INVALID_VALUE;
+    }
+
+    public int[] names(int task) {
+        if(task != TASK_SELF)
+            return null;
+
+        lock.lock();
+        try {
+            int[] pairs = new int[2 * names.size()];
+            int i = 0;
+            for(Map.Entry<Integer, Entry> me : names.entrySet()) {
+                pairs[i++] = me.getKey();
+                pairs[i++] = me.getValue().type;
+            }
+            return pairs;
+        } finally {
+            lock.unlock();
+        }
+    }
+
+    public int getRefs(int task, int name, int right, int[] refs) {
+        if(task != TASK_SELF)
+            return Mach.KERN_INVALID_TASK;
+
+        lock.lock();
+        try {
+            Entry e = names.get(name);
+            if(e == null)
+                return Mach.KERN_INVALID_NAME;
+            if((e.type & (1 << (16 + right))) == 0)
+                refs[0] = 0;
+            else if(right == Mach.Port.RIGHT_SEND
+                    || right == Mach.Port.RIGHT_DEAD_NAME)
+                refs[0] = e.urefs;
+            else
+                refs[0] = 1;
+            return Mach.KERN_SUCCESS;
+        } finally {
+            lock.unlock();
+        }
+    }
+
+    public int moveMember(int task, int member, int after) {
+        if(task != TASK_SELF)
+            return Mach.KERN_INVALID_TASK;
+
+        lock.lock();
+        try {
+            Entry e = names.get(member);
+            if(e == null)
+                return Mach.KERN_INVALID_NAME;
+            if((e.type & Mach.Port.TYPE_RECEIVE) == 0)
+                return Mach.KERN_INVALID_RIGHT;
+
+            KSet set = null;
+            if(after != Mach.Port.NULL) {
+                Entry s = names.get(after);
+                if(s == null)
+                    return Mach.KERN_INVALID_NAME;
+                if((s.type & Mach.Port.TYPE_PORT_SET) == 0)
+                    return Mach.KERN_INVALID_RIGHT;
+                set = s.set;
+            }
+
+            KPort p = e.port;
+            if(p.set != null)
+                leaveSet(p);
+            if(set != null) {
+                p.set = set;
+                set.members.add(p);
+                /* Wake up receivers on the port, which must now fail, and
+                 * on the set, which may have a message to pick up. */
+                p.notEmpty.signalAll();
+                if(!p.queue.isEmpty())
+                    set.notEmpty.signalAll();
+            }
+            return Mach.KERN_SUCCESS;
+        } finally {
+            lock.unlock();
+        }
+    }
+
+    public int requestNotification(int task, int name, int variant,
+            int sync, int notify, int notifyType, int[] previous) {
+        if(task != TASK_SELF)
+            return Mach.KERN_INVALID_TASK;
+
+        lock.lock();
+        try {
+            Entry e = names.get(name);
+            if(e == null)
+                return Mach.KERN_INVALID_NAME;
+
+            KRight old;
+            switch(variant) {
+                case Mach.NOTIFY_NO_SENDERS:
+                    if((e.type & Mach.Port.TYPE_RECEIVE) == 0)
+                        return Mach.KERN_INVALID_RIGHT;
+                    break;
+                case Mach.NOTIFY_DEAD_NAME:
+                    if((e.type & (Mach.Port.TYPE_SEND
+                                  | Mach.Port.TYPE_SEND_ONCE
+                                  | Mach.Port.TYPE_DEAD_NAME)) == 0)
+                        return Mach.KERN_INVALID_RIGHT;
+                    break;
+                default:
+                    return Mach.KERN_INVALID_VALUE;
+            }
+
+            KRight n = copyin(notify, notifyType);
+            if(n == INVALID)
+                return Mach.KERN_INVALID_CAPABILITY;
+
+            if(variant == Mach.NOTIFY_NO_SENDERS) {
+                KPort p = e.port;
+                old = p.nsRequest;
+                p.nsRequest = n;
+                p.nsSync = sync;
+                if(n != null)
+                    checkNoSenders(p);
+            } else {
+                old = e.dnRequest;
+                e.dnRequest = null;
+                if((e.type & Mach.Port.TYPE_DEAD_NAME) != 0) {
+                    if(n != null)
+                        notify(n, Mach.NOTIFY_DEAD_NAME, name);
+                } else {
+                    e.dnRequest = n;
+                }
+            }
+
+            if(previous != null && previous.length > 0)
+                previous[0] = copyout(old);
+            else
+                release(old);
+            return Mach.KERN_SUCCESS;
+        } finally {
+            lock.unlock();
+        }
+    }
+
+    public int getReceiveStatus(int task, int name, int[] status) {
+        if(task != TASK_SELF)
+            return Mach.KERN_INVALID_TASK;
+
+        lock.lock();
+        try {
+            Entry e = names.get(name);
+            if(e == null)
+                return Mach.KERN_INVALID_NAME;
+            if((e.type & Mach.Port.TYPE_RECEIVE) == 0)
+                return Mach.KERN_INVALID_RIGHT;
+
+            KPort p = e.port;
+            status[Mach.Port.STATUS_PSET] =
+                (p.set != null) ? p.set.name : Mach.Port.NULL;
+            status[Mach.Port.STATUS_SEQNO] = p.seqno;
+            status[Mach.Port.STATUS_MSCOUNT] = p.mscount;
+            status[Mach.Port.STATUS_QLIMIT] = p.qlimit;
+            status[Mach.Port.STATUS_MSGCOUNT] = p.queue.size();
+            status[Mach.Port.STATUS_SORIGHTS] = p.sorights;
+            status[Mach.Port.STATUS_SRIGHTS] = (p.srights > 0) ? 1 : 0;
+            status[Mach.Port.STATUS_PDREQUEST] = 0;
+            status[Mach.Port.STATUS_NSREQUEST] =
+                (p.nsRequest != null) ? 1 : 0;
+            return Mach.KERN_SUCCESS;
+        } finally {
+            lock.unlock();
+        }
+    }
+}
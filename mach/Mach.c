@@ -1,53 +1,541 @@
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
 #include <mach.h>
 #include "Mach.h"
 #include "Mach$Port.h"
+#include "hurd-java.h"
+
+/* Method ID for java.nio.Buffer.position(), resolved at load time. */
+static jmethodID mid_position;
+
+/* Native message statistics.
+ *
+ * Some costs are invisible from Java: how long we actually spend in the
+ * kernel, and how often mach_msg() is interrupted and restarted. We count
+ * them per thread so that the message path never takes a lock or does an
+ * atomic read-modify-write. The counters of all threads are only summed up
+ * when Java asks for a snapshot. The layout must match Mach.NativeStats. */
+enum {
+    STAT_CALLS,
+    STAT_KERNEL_NSECS,
+    STAT_BYTES_SENT,
+    STAT_BYTES_RECEIVED,
+    STAT_SEND_RETRIES,
+    STAT_RCV_RETRIES,
+    STAT_ERRORS,
+    STAT_SEND_ERRORS,           /* Indexed by (MACH_SEND_* & 0x1f). */
+    STAT_RCV_ERRORS = STAT_SEND_ERRORS + 32,
+    STAT_OTHER_ERRORS = STAT_RCV_ERRORS + 32,
+    STAT_MAX
+};
+
+struct msg_stats {
+    jlong v[STAT_MAX];
+    struct msg_stats *next, **prevp;
+};
+
+/* Only the owner thread writes to its counters, but they can be read
+ * concurrently by a snapshot, hence the relaxed atomic accesses. */
+#define STAT_ADD(s, i, n) \
+    __atomic_store_n(&(s)->v[i], \
+            __atomic_load_n(&(s)->v[i], __ATOMIC_RELAXED) + (n), \
+            __ATOMIC_RELAXED)
+
+#define IS_SEND_ERROR(ret) (((ret) & ~0x1f) == MACH_SEND_IN_PROGRESS - 1)
+#define IS_RCV_ERROR(ret) (((ret) & ~0x1f) == MACH_RCV_IN_PROGRESS - 1)
+
+static __thread struct msg_stats *thread_stats;
+static pthread_key_t stats_key;
+
+/* Counters of live threads, and totals of the threads which exited. */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct msg_stats *stats_list;
+static jlong retired_stats[STAT_MAX];
+
+static void
+stats_release (void *arg)
+{
+    struct msg_stats *s = arg;
+    int i;
+
+    pthread_mutex_lock(&stats_lock);
+    for(i = 0; i < STAT_MAX; i++)
+        retired_stats[i] += s->v[i];
+    if(s->next)
+        s->next->prevp = s->prevp;
+    *s->prevp = s->next;
+    pthread_mutex_unlock(&stats_lock);
+
+    free(s);
+}
+
+static struct msg_stats *
+stats_get (void)
+{
+    struct msg_stats *s = thread_stats;
+
+    if(s == NULL) {
+        s = calloc(1, sizeof *s);
+        if(s == NULL)
+            return NULL;
+
+        pthread_mutex_lock(&stats_lock);
+        s->next = stats_list;
+        if(s->next)
+            s->next->prevp = &s->next;
+        s->prevp = &stats_list;
+        stats_list = s;
+        pthread_mutex_unlock(&stats_lock);
+
+        pthread_setspecific(stats_key, s);
+        thread_stats = s;
+    }
+
+    return s;
+}
+
+static jlong
+now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Same as mach_msg(), but count the time spent in the kernel and the
+ * retries after interruptions, which we do ourselves for that purpose. */
+static mach_msg_return_t
+counted_mach_msg (mach_msg_header_t *msg, mach_msg_option_t option,
+        mach_msg_size_t send_size, mach_msg_size_t rcv_size,
+        mach_port_t rcv_name, mach_msg_timeout_t timeout, mach_port_t notify)
+{
+    struct msg_stats *s = stats_get();
+    mach_msg_return_t ret;
+    jlong start;
+
+    if(s == NULL)
+        return mach_msg(msg, option, send_size, rcv_size, rcv_name,
+                timeout, notify);
+
+    start = now();
+
+    ret = mach_msg_trap(msg, option, send_size, rcv_size, rcv_name,
+            timeout, notify);
+    while(ret == MACH_SEND_INTERRUPTED && !(option & MACH_SEND_INTERRUPT)) {
+        STAT_ADD(s, STAT_SEND_RETRIES, 1);
+        ret = mach_msg_trap(msg, option, send_size, rcv_size, rcv_name,
+                timeout, notify);
+    }
+    while(ret == MACH_RCV_INTERRUPTED && !(option & MACH_RCV_INTERRUPT)) {
+        STAT_ADD(s, STAT_RCV_RETRIES, 1);
+        ret = mach_msg_trap(msg, option & ~MACH_SEND_MSG, 0, rcv_size,
+                rcv_name, timeout, notify);
+    }
+
+    STAT_ADD(s, STAT_KERNEL_NSECS, now() - start);
+    STAT_ADD(s, STAT_CALLS, 1);
+
+    if(option & MACH_SEND_MSG
+            && (ret == MACH_MSG_SUCCESS || IS_RCV_ERROR(ret)))
+        STAT_ADD(s, STAT_BYTES_SENT, send_size);
+    if(option & MACH_RCV_MSG && ret == MACH_MSG_SUCCESS)
+        STAT_ADD(s, STAT_BYTES_RECEIVED, msg->msgh_size);
+
+    if(ret != MACH_MSG_SUCCESS) {
+        STAT_ADD(s, STAT_ERRORS, 1);
+        if(IS_SEND_ERROR(ret))
+            STAT_ADD(s, STAT_SEND_ERRORS + (ret & 0x1f), 1);
+        else if(IS_RCV_ERROR(ret))
+            STAT_ADD(s, STAT_RCV_ERRORS + (ret & 0x1f), 1);
+        else
+            STAT_ADD(s, STAT_OTHER_ERRORS, 1);
+    }
+
+    return ret;
+}
 
 JNIEXPORT jint JNICALL
-Java_org_gnu_mach_Mach_replyPort (JNIEnv *env, jclass cls)
+Java_org_gnu_mach_Mach_nativeReplyPort (JNIEnv *env, jclass cls)
 {
     return mach_reply_port();
 }
 
 JNIEXPORT jint JNICALL
-Java_org_gnu_mach_Mach_msg (JNIEnv *env, jclass cls, jobject msg, jint option,
-        jint rcvName, jlong timeout, jint notify)
+Java_org_gnu_mach_Mach_nativeMsg (JNIEnv *env, jclass cls, jobject msg,
+        jint option, jint rcvName, jlong timeout, jint notify)
 {
-    static jmethodID mid_position = NULL;
-    if(mid_position == NULL) {
-        jclass cls = (*env)->GetObjectClass(env, msg);
-        mid_position = (*env)->GetMethodID(env, cls, "position", "()I");
-    }
-
     void *msgAddr = (*env)->GetDirectBufferAddress(env, msg);
     jlong msgSize = (*env)->GetDirectBufferCapacity(env, msg);
     jint msgPos = (*env)->CallIntMethod(env, msg, mid_position);
     assert(msgAddr); /* XXX exception. */
 
-    return mach_msg(msgAddr, option, msgPos, msgSize, rcvName, timeout, notify);
+    return counted_mach_msg(msgAddr, option, msgPos, msgSize, rcvName,
+            timeout, notify);
+}
+
+JNIEXPORT void JNICALL
+Java_org_gnu_mach_Mach_nativeStats (JNIEnv *env, jclass cls, jlongArray arr)
+{
+    jlong total[STAT_MAX];
+    struct msg_stats *s;
+    jsize n;
+    int i;
+
+    pthread_mutex_lock(&stats_lock);
+    for(i = 0; i < STAT_MAX; i++)
+        total[i] = retired_stats[i];
+    for(s = stats_list; s; s = s->next)
+        for(i = 0; i < STAT_MAX; i++)
+            total[i] += __atomic_load_n(&s->v[i], __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&stats_lock);
+
+    n = (*env)->GetArrayLength(env, arr);
+    (*env)->SetLongArrayRegion(env, arr, 0, n < STAT_MAX ? n : STAT_MAX,
+            total);
 }
 
 JNIEXPORT jint JNICALL
-Java_org_gnu_mach_Mach_taskSelf (JNIEnv *env, jclass cls)
+Java_org_gnu_mach_Mach_nativeTaskSelf (JNIEnv *env, jclass cls)
 {
     return mach_task_self();
 }
 
+/* Wired memory for message buffers.
+ *
+ * The region comes straight from vm_allocate() so that it is page-aligned
+ * and owned by us rather than by the JVM, and each page is touched right
+ * away so that the first message doesn't take the zero-fill faults. */
+JNIEXPORT jobject JNICALL
+Java_org_gnu_mach_Mach_nativeVmAllocate (JNIEnv *env, jclass cls, jint size)
+{
+    vm_address_t addr = 0;
+    vm_size_t off;
+
+    if(vm_allocate(mach_task_self(), &addr, size, TRUE) != KERN_SUCCESS)
+        return NULL;
+
+    for(off = 0; off < (vm_size_t) size; off += vm_page_size)
+        ((volatile char *) addr)[off] = 0;
+
+    return (*env)->NewDirectByteBuffer(env, (void *) addr, size);
+}
+
+/* On the Hurd, mlock() wires the pages with vm_wire(), using the
+ * privileged host port when we have it. Without it this fails with EPERM
+ * and the pages are only prefaulted. */
+JNIEXPORT jint JNICALL
+Java_org_gnu_mach_Mach_nativeVmWire (JNIEnv *env, jclass cls, jobject buf)
+{
+    void *addr = (*env)->GetDirectBufferAddress(env, buf);
+    jlong size = (*env)->GetDirectBufferCapacity(env, buf);
+    assert(addr);
+
+    return mlock(addr, size) ? errno : 0;
+}
+
+/* Deallocating the region also unwires it. */
+JNIEXPORT jint JNICALL
+Java_org_gnu_mach_Mach_nativeVmDeallocate (JNIEnv *env, jclass cls,
+        jobject buf)
+{
+    void *addr = (*env)->GetDirectBufferAddress(env, buf);
+    jlong size = (*env)->GetDirectBufferCapacity(env, buf);
+    assert(addr);
+
+    return vm_deallocate(mach_task_self(), (vm_address_t) addr, size);
+}
+
+JNIEXPORT jint JNICALL
+Java_org_gnu_mach_Mach_nativeVmDeallocateRegion (JNIEnv *env, jclass cls,
+        jlong address, jlong size)
+{
+    return vm_deallocate(mach_task_self(), (vm_address_t) address, size);
+}
+
 JNIEXPORT jint JNICALL
-Java_org_gnu_mach_Mach_00024Port_allocate (JNIEnv *env, jclass cls, jint task, jint right)
+Java_org_gnu_mach_Mach_00024Port_nativeAllocate (JNIEnv *env, jclass cls, jint task, jint right)
 {
     mach_port_t name;
     kern_return_t err;
 
     err = mach_port_allocate(task, right, &name);
-    assert(err == KERN_SUCCESS);
+    if(err != KERN_SUCCESS)
+        return MACH_PORT_NULL;
 
     return name;
 }
 
 JNIEXPORT jint JNICALL
-Java_org_gnu_mach_Mach_00024Port_deallocate (JNIEnv *env, jclass cls, jint task, jint name)
+Java_org_gnu_mach_Mach_00024Port_nativeDeallocate (JNIEnv *env, jclass cls, jint task, jint name)
 {
     return mach_port_deallocate(task, name);
 }
 
+JNIEXPORT jint JNICALL
+Java_org_gnu_mach_Mach_00024Port_nativeModRefs (JNIEnv *env, jclass cls, jint task,
+        jint name, jint right, jint delta)
+{
+    return mach_port_mod_refs(task, name, right, delta);
+}
+
+/* Batch versions of the above.
+ *
+ * These still make one kernel call per right, but a single JNI
+ * transition for the whole array. The result of each call is stored into
+ * the errors array, and the number of failures is returned. If the arrays
+ * can't be accessed, -1 is returned and an OutOfMemoryError is pending. */
+
+JNIEXPORT jint JNICALL
+Java_org_gnu_mach_Mach_00024Port_nativeAllocateN (JNIEnv *env, jclass cls,
+        jint task, jint right, jintArray names, jintArray errors)
+{
+    jsize i, n = (*env)->GetArrayLength(env, names);
+    jint *nv = (*env)->GetIntArrayElements(env, names, NULL);
+    jint *ev = nv ? (*env)->GetIntArrayElements(env, errors, NULL) : NULL;
+    mach_port_t name;
+    jint failed = 0;
+
+    if(ev == NULL) {
+        if(nv != NULL)
+            (*env)->ReleaseIntArrayElements(env, names, nv, JNI_ABORT);
+        return -1;
+    }
+
+    for(i = 0; i < n; i++) {
+        ev[i] = mach_port_allocate(task, right, &name);
+        nv[i] = (ev[i] == KERN_SUCCESS) ? name : MACH_PORT_NULL;
+        if(ev[i] != KERN_SUCCESS)
+            failed++;
+    }
+
+    (*env)->ReleaseIntArrayElements(env, errors, ev, 0);
+    (*env)->ReleaseIntArrayElements(env, names, nv, 0);
+    return failed;
+}
+
+JNIEXPORT jint JNICALL
+Java_org_gnu_mach_Mach_00024Port_nativeDeallocateN (JNIEnv *env, jclass cls,
+        jint task, jintArray names, jintArray errors)
+{
+    jsize i, n = (*env)->GetArrayLength(env, names);
+    jint *nv = (*env)->GetIntArrayElements(env, names, NULL);
+    jint *ev = nv ? (*env)->GetIntArrayElements(env, errors, NULL) : NULL;
+    jint failed = 0;
+
+    if(ev == NULL) {
+        if(nv != NULL)
+            (*env)->ReleaseIntArrayElements(env, names, nv, JNI_ABORT);
+        return -1;
+    }
+
+    for(i = 0; i < n; i++) {
+        ev[i] = mach_port_deallocate(task, nv[i]);
+        if(ev[i] != KERN_SUCCESS)
+            failed++;
+    }
+
+    (*env)->ReleaseIntArrayElements(env, errors, ev, 0);
+    (*env)->ReleaseIntArrayElements(env, names, nv, JNI_ABORT);
+    return failed;
+}
+
+JNIEXPORT jint JNICALL
+Java_org_gnu_mach_Mach_00024Port_nativeModRefsN (JNIEnv *env, jclass cls,
+        jint task, jintArray names, jint right, jint delta,
+        jintArray errors)
+{
+    jsize i, n = (*env)->GetArrayLength(env, names);
+    jint *nv = (*env)->GetIntArrayElements(env, names, NULL);
+    jint *ev = nv ? (*env)->GetIntArrayElements(env, errors, NULL) : NULL;
+    jint failed = 0;
+
+    if(ev == NULL) {
+        if(nv != NULL)
+            (*env)->ReleaseIntArrayElements(env, names, nv, JNI_ABORT);
+        return -1;
+    }
+
+    for(i = 0; i < n; i++) {
+        ev[i] = mach_port_mod_refs(task, nv[i], right, delta);
+        if(ev[i] != KERN_SUCCESS)
+            failed++;
+    }
+
+    (*env)->ReleaseIntArrayElements(env, errors, ev, 0);
+    (*env)->ReleaseIntArrayElements(env, names, nv, JNI_ABORT);
+    return failed;
+}
+
+JNIEXPORT jintArray JNICALL
+Java_org_gnu_mach_Mach_00024Port_nativeNames (JNIEnv *env, jclass cls, jint task)
+{
+    mach_port_array_t names;
+    mach_port_type_array_t types;
+    mach_msg_type_number_t nnames, ntypes, i;
+    kern_return_t err;
+    jintArray result;
+
+    err = mach_port_names(task, &names, &nnames, &types, &ntypes);
+    if(err != KERN_SUCCESS)
+        return NULL;
+    assert(nnames == ntypes);
+
+    result = (*env)->NewIntArray(env, 2 * nnames);
+    for(i = 0; result != NULL && i < nnames; i++) {
+        jint pair[2] = { names[i], types[i] };
+        (*env)->SetIntArrayRegion(env, result, 2 * i, 2, pair);
+    }
+
+    vm_deallocate(mach_task_self(), (vm_address_t) names,
+            nnames * sizeof *names);
+    vm_deallocate(mach_task_self(), (vm_address_t) types,
+            ntypes * sizeof *types);
+    return result;
+}
+
+JNIEXPORT jint JNICALL
+Java_org_gnu_mach_Mach_00024Port_nativeGetRefs (JNIEnv *env, jclass cls, jint task,
+        jint name, jint right, jintArray refs)
+{
+    mach_port_urefs_t urefs;
+    kern_return_t err;
+
+    err = mach_port_get_refs(task, name, right, &urefs);
+    if(err == KERN_SUCCESS) {
+        jint val = urefs;
+        (*env)->SetIntArrayRegion(env, refs, 0, 1, &val);
+    }
+    return err;
+}
+
+JNIEXPORT jint JNICALL
+Java_org_gnu_mach_Mach_00024Port_nativeMoveMember (JNIEnv *env, jclass cls,
+        jint task, jint member, jint after)
+{
+    return mach_port_move_member(task, member, after);
+}
+
+JNIEXPORT jint JNICALL
+Java_org_gnu_mach_Mach_00024Port_nativeRequestNotification (JNIEnv *env, jclass cls,
+        jint task, jint name, jint variant, jint sync, jint notify,
+        jint notifyType, jintArray previous)
+{
+    mach_port_t prev;
+    kern_return_t err;
+
+    err = mach_port_request_notification(task, name, variant, sync, notify,
+            notifyType, &prev);
+    if(err == KERN_SUCCESS) {
+        jint val = prev;
+        (*env)->SetIntArrayRegion(env, previous, 0, 1, &val);
+    }
+    return err;
+}
+
+JNIEXPORT jint JNICALL
+Java_org_gnu_mach_Mach_00024Port_nativeGetReceiveStatus (JNIEnv *env, jclass cls,
+        jint task, jint name, jintArray status)
+{
+    mach_port_status_t st;
+    kern_return_t err;
+
+    err = mach_port_get_receive_status(task, name, &st);
+    if(err == KERN_SUCCESS) {
+        jint val[] = {
+            st.mps_pset, st.mps_seqno, st.mps_mscount, st.mps_qlimit,
+            st.mps_msgcount, st.mps_sorights, st.mps_srights,
+            st.mps_pdrequest, st.mps_nsrequest,
+        };
+        (*env)->SetIntArrayRegion(env, status, 0, 9, val);
+    }
+    return err;
+}
+
+static JNINativeMethod mach_methods[] = {
+    { "nativeReplyPort", "()I", Java_org_gnu_mach_Mach_nativeReplyPort },
+    { "nativeMsg", "(Ljava/nio/ByteBuffer;IIJI)I",
+        Java_org_gnu_mach_Mach_nativeMsg },
+    { "nativeTaskSelf", "()I", Java_org_gnu_mach_Mach_nativeTaskSelf },
+    { "nativeStats", "([J)V", Java_org_gnu_mach_Mach_nativeStats },
+    { "nativeVmAllocate", "(I)Ljava/nio/ByteBuffer;",
+        Java_org_gnu_mach_Mach_nativeVmAllocate },
+    { "nativeVmWire", "(Ljava/nio/ByteBuffer;)I",
+        Java_org_gnu_mach_Mach_nativeVmWire },
+    { "nativeVmDeallocate", "(Ljava/nio/ByteBuffer;)I",
+        Java_org_gnu_mach_Mach_nativeVmDeallocate },
+    { "nativeVmDeallocateRegion", "(JJ)I",
+        Java_org_gnu_mach_Mach_nativeVmDeallocateRegion },
+};
+
+static JNINativeMethod port_methods[] = {
+    { "nativeAllocate", "(II)I",
+        Java_org_gnu_mach_Mach_00024Port_nativeAllocate },
+    { "nativeDeallocate", "(II)I",
+        Java_org_gnu_mach_Mach_00024Port_nativeDeallocate },
+    { "nativeModRefs", "(IIII)I",
+        Java_org_gnu_mach_Mach_00024Port_nativeModRefs },
+    { "nativeAllocateN", "(II[I[I)I",
+        Java_org_gnu_mach_Mach_00024Port_nativeAllocateN },
+    { "nativeDeallocateN", "(I[I[I)I",
+        Java_org_gnu_mach_Mach_00024Port_nativeDeallocateN },
+    { "nativeModRefsN", "(I[III[I)I",
+        Java_org_gnu_mach_Mach_00024Port_nativeModRefsN },
+    { "nativeNames", "(I)[I", Java_org_gnu_mach_Mach_00024Port_nativeNames },
+    { "nativeGetRefs", "(III[I)I",
+        Java_org_gnu_mach_Mach_00024Port_nativeGetRefs },
+    { "nativeMoveMember", "(III)I",
+        Java_org_gnu_mach_Mach_00024Port_nativeMoveMember },
+    { "nativeRequestNotification", "(IIIIII[I)I",
+        Java_org_gnu_mach_Mach_00024Port_nativeRequestNotification },
+    { "nativeGetReceiveStatus", "(II[I)I",
+        Java_org_gnu_mach_Mach_00024Port_nativeGetReceiveStatus },
+};
+
+#define NMETHODS(methods) (sizeof (methods) / sizeof (methods)[0])
+
+static int
+register_class (JNIEnv *env, const char *name, JNINativeMethod *methods,
+        jint n)
+{
+    jclass cls = (*env)->FindClass(env, name);
+    if(cls == NULL)
+        return -1;
+
+    int err = (*env)->RegisterNatives(env, cls, methods, n);
+    (*env)->DeleteLocalRef(env, cls);
+    return err;
+}
+
+int
+mach_register_natives (JNIEnv *env)
+{
+    jclass cls = (*env)->FindClass(env, "java/nio/Buffer");
+    if(cls == NULL)
+        return -1;
+    mid_position = (*env)->GetMethodID(env, cls, "position", "()I");
+    (*env)->DeleteLocalRef(env, cls);
+    if(mid_position == NULL)
+        return -1;
+
+    if(pthread_key_create(&stats_key, stats_release) != 0) {
+        /* Unlike the JNI calls, this leaves no exception pending. */
+        jclass err = (*env)->FindClass(env, "java/lang/InternalError");
+        if(err != NULL)
+            (*env)->ThrowNew(env, err, "pthread_key_create failed");
+        return -1;
+    }
+
+    if(register_class(env, "org/gnu/mach/Mach",
+                mach_methods, NMETHODS(mach_methods)) < 0)
+        return -1;
+    if(register_class(env, "org/gnu/mach/Mach$Port",
+                port_methods, NMETHODS(port_methods)) < 0)
+        return -1;
+
+    return 0;
+}
@@ -32,13 +32,261 @@ public class Mach {
     public static final int RCV_INTERRUPT   = 0x00000400;
     public static final int RCV_LARGE       = 0x00000800;
 
+    /* Return codes from <mach/message.h> and <mach/mig_errors.h>. */
+    public static final int MSG_SUCCESS         = 0x00000000;
+    public static final int SEND_INVALID_DATA   = 0x10000002;
+    public static final int SEND_INVALID_DEST   = 0x10000003;
+    public static final int SEND_TIMED_OUT      = 0x10000004;
+    public static final int SEND_INTERRUPTED    = 0x10000007;
+    public static final int SEND_MSG_TOO_SMALL  = 0x10000008;
+    public static final int SEND_INVALID_REPLY  = 0x10000009;
+    public static final int SEND_INVALID_RIGHT  = 0x1000000a;
+    public static final int SEND_INVALID_MEMORY = 0x1000000c;
+    public static final int SEND_INVALID_TYPE   = 0x1000000f;
+    public static final int SEND_INVALID_HEADER = 0x10000010;
+    public static final int RCV_INVALID_NAME    = 0x10004002;
+    public static final int RCV_TIMED_OUT       = 0x10004003;
+    public static final int RCV_TOO_LARGE       = 0x10004004;
+    public static final int RCV_INTERRUPTED     = 0x10004005;
+    public static final int RCV_PORT_CHANGED    = 0x10004006;
+    public static final int RCV_PORT_DIED       = 0x10004009;
+    public static final int RCV_IN_SET          = 0x1000400a;
+    public static final int MIG_TYPE_ERROR      = -300;
+    public static final int MIG_REPLY_MISMATCH  = -301;
+    public static final int MIG_REMOTE_ERROR    = -302;
+    public static final int MIG_BAD_ID          = -303;
+    public static final int MIG_BAD_ARGUMENTS   = -304;
+
+    /* Return codes from <mach/kern_return.h>. */
+    public static final int KERN_SUCCESS            = 0;
+    public static final int KERN_NO_SPACE           = 3;
+    public static final int KERN_INVALID_ARGUMENT   = 4;
+    public static final int KERN_INVALID_NAME       = 15;
+    public static final int KERN_INVALID_TASK       = 16;
+    public static final int KERN_INVALID_RIGHT      = 17;
+    public static final int KERN_INVALID_VALUE      = 18;
+    public static final int KERN_UREFS_OVERFLOW     = 19;
+    public static final int KERN_INVALID_CAPABILITY = 20;
+
+    /* Notification message IDs, from <mach/notify.h>. */
+    public static final int NOTIFY_FIRST            = 0100;
+    public static final int NOTIFY_PORT_DELETED     = 0101;
+    public static final int NOTIFY_PORT_DESTROYED   = 0105;
+    public static final int NOTIFY_NO_SENDERS       = 0106;
+    public static final int NOTIFY_SEND_ONCE        = 0107;
+    public static final int NOTIFY_DEAD_NAME        = 0110;
+    public static final int NOTIFY_LAST             = 0115;
+
+    /**
+     * Whether a mach_msg() return code is a send error, in which case
+     * nothing was received either.
+     */
+    public static boolean isSendError(int ret) {
+        return (ret & ~0x3fff) == 0x10000000;
+    }
+
+    /** Whether a return code is a mach_msg() send or receive error. */
+    public static boolean isMsgError(int ret) {
+        return (ret & ~0x7fff) == 0x10000000;
+    }
+
+    /**
+     * Implementation of the system calls and port operations.
+     *
+     * All the static methods of {@link Mach} and {@link Mach.Port} go
+     * through the current backend. The default one calls into the kernel
+     * through JNI; {@link KernelModel} is an alternative implemented in
+     * Java, which is selected with {@code -Dorg.gnu.mach.backend=java} and
+     * lets the rest of the library run, be tested and be benchmarked
+     * without the Hurd or any native code.
+     */
+    public static abstract class Backend {
+        public abstract int msg(ByteBuffer msg, int option, int rcvName,
+                                long timeout, int notify);
+        public abstract int replyPort();
+        public abstract int taskSelf();
+        public abstract void stats(long[] stats);
+
+        public abstract int allocate(int task, int right);
+        public abstract int deallocate(int task, int name);
+        public abstract int modRefs(int task, int name, int right,
+                                    int delta);
+        public abstract int[] names(int task);
+        public abstract int getRefs(int task, int name, int right,
+                                    int[] refs);
+        public abstract int moveMember(int task, int member, int after);
+        public abstract int requestNotification(int task, int name,
+                int variant, int sync, int notify, int notifyType,
+                int[] previous);
+        public abstract int getReceiveStatus(int task, int name,
+                                             int[] status);
+
+        /* Batch operations, see Port.allocateN() and friends. By default
+         * they just loop over the single operations. */
+
+        public int allocateN(int task, int right, int[] names,
+                             int[] errors) {
+            int failed = 0;
+            for(int i = 0; i < names.length; i++) {
+                names[i] = allocate(task, right);
+                errors[i] = (names[i] != Port.NULL) ? KERN_SUCCESS
+                                                    : KERN_NO_SPACE;
+                if(errors[i] != KERN_SUCCESS)
+                    failed++;
+            }
+            return failed;
+        }
+
+        public int deallocateN(int task, int[] names, int[] errors) {
+            int failed = 0;
+            for(int i = 0; i < names.length; i++) {
+                errors[i] = deallocate(task, names[i]);
+                if(errors[i] != KERN_SUCCESS)
+                    failed++;
+            }
+            return failed;
+        }
+
+        public int modRefsN(int task, int[] names, int right, int delta,
+                            int[] errors) {
+            int failed = 0;
+            for(int i = 0; i < names.length; i++) {
+                errors[i] = modRefs(task, names[i], right, delta);
+                if(errors[i] != KERN_SUCCESS)
+                    failed++;
+            }
+            return failed;
+        }
+
+        /**
+         * Allocate page-aligned memory outside of the Java heap and of the
+         * JVM's direct memory, with all its pages already faulted in.
+         * Returns {@code null} on failure.
+         */
+        public abstract ByteBuffer vmAllocate(int size);
+
+        /** Wire memory from {@link #vmAllocate}; returns 0 or an error. */
+        public abstract int vmWire(ByteBuffer buf);
+
+        /** Release memory from {@link #vmAllocate}, unwiring it. */
+        public abstract int vmDeallocate(ByteBuffer buf);
+
+        /**
+         * Release a region of our address space given by its address,
+         * such as the out-of-line memory of a received message.
+         */
+        public abstract int vmDeallocateRegion(long address, long size);
+    }
+
+    /** The backend making the actual system calls. */
+    private static class NativeBackend extends Backend {
+        public int msg(ByteBuffer msg, int option, int rcvName, long timeout,
+                       int notify) {
+            return nativeMsg(msg, option, rcvName, timeout, notify);
+        }
+        public int replyPort() { return nativeReplyPort(); }
+        public int taskSelf() { return nativeTaskSelf(); }
+        public void stats(long[] stats) { nativeStats(stats); }
+
+        public int allocate(int task, int right) {
+            return Port.nativeAllocate(task, right);
+        }
+        public int deallocate(int task, int name) {
+            return Port.nativeDeallocate(task, name);
+        }
+        public int modRefs(int task, int name, int right, int delta) {
+            return Port.nativeModRefs(task, name, right, delta);
+        }
+        public int[] names(int task) {
+            return Port.nativeNames(task);
+        }
+        public int getRefs(int task, int name, int right, int[] refs) {
+            return Port.nativeGetRefs(task, name, right, refs);
+        }
+        public int moveMember(int task, int member, int after) {
+            return Port.nativeMoveMember(task, member, after);
+        }
+        public int requestNotification(int task, int name, int variant,
+                int sync, int notify, int notifyType, int[] previous) {
+            return Port.nativeRequestNotification(task, name, variant, sync,
+                                                  notify, notifyType,
+                                                  previous);
+        }
+        public int getReceiveStatus(int task, int name, int[] status) {
+            return Port.nativeGetReceiveStatus(task, name, status);
+        }
+        public int allocateN(int task, int right, int[] names,
+                             int[] errors) {
+            return Port.nativeAllocateN(task, right, names, errors);
+        }
+        public int deallocateN(int task, int[] names, int[] errors) {
+            return Port.nativeDeallocateN(task, names, errors);
+        }
+        public int modRefsN(int task, int[] names, int right, int delta,
+                            int[] errors) {
+            return Port.nativeModRefsN(task, names, right, delta, errors);
+        }
+
+        public ByteBuffer vmAllocate(int size) {
+            return nativeVmAllocate(size);
+        }
+        public int vmWire(ByteBuffer buf) { return nativeVmWire(buf); }
+        public int vmDeallocate(ByteBuffer buf) {
+            return nativeVmDeallocate(buf);
+        }
+        public int vmDeallocateRegion(long address, long size) {
+            return nativeVmDeallocateRegion(address, size);
+        }
+    }
+
+    static Backend backend;
+
+    /** Return the current backend. */
+    public static Backend backend() {
+        return backend;
+    }
+
+    /**
+     * Replace the backend. This must be done before any port is allocated
+     * or message sent, since port names from different backends can't be
+     * mixed.
+     */
+    public static void setBackend(Backend newBackend) throws Unsafe {
+        backend = newBackend;
+    }
+
+    static {
+        if("java".equals(System.getProperty("org.gnu.mach.backend")))
+            backend = new KernelModel();
+        else
+            backend = new NativeBackend();
+
+        if(Boolean.getBoolean("org.gnu.mach.stats"))
+            MsgStats.enable();
+
+        /* Optionally hook up JDK Flight Recorder events. This is loaded by
+         * name since org.gnu.mach.jfr is only built with recent JDKs. */
+        if(Boolean.getBoolean("org.gnu.mach.jfr")) {
+            try {
+                Class.forName("org.gnu.mach.jfr.JfrObserver")
+                     .getMethod("install").invoke(null);
+            } catch(Exception exc) {
+                System.err.println("Mach: " + exc);
+            }
+        }
+    }
+
     /**
      * Create a reply port.
      *
      * This is a wrapper around the mach_reply_port() system call, which
      * creates a new MachPort object with the returned name.
      */
-    public static native int replyPort() throws Unsafe;
+    public static int replyPort() throws Unsafe {
+        return backend.replyPort();
+    }
+
+    private static native int nativeReplyPort();
 
     /**
      * Native call to mach_msg().
@@ -53,9 +301,22 @@ public class Mach {
      *
      * XXX repomper la doc du manuel.
      */
-    public static native int
+    public static int
         msg(ByteBuffer msg, int option, int rcvName, long timeout, int notify)
-        throws Unsafe;
+        throws Unsafe
+    {
+        MsgObserver[] observers = MsgObserver.observers;
+        if(observers != null)
+            return MsgObserver.msg(observers, msg, option, rcvName, timeout,
+                                   notify);
+
+        return backend.msg(msg, option, rcvName, timeout, notify);
+    }
+
+    /** The actual mach_msg() system call, without instrumentation. */
+    private static native int
+        nativeMsg(ByteBuffer msg, int option, int rcvName, long timeout,
+                  int notify);
 
     /**
      * This system call returns the calling thread's task port.
@@ -79,7 +340,63 @@ public class Mach {
      * the reception of the send right, MACH_PORT_NULL if the task port is
      * currently null, MACH_PORT_DEAD if the task port is currently dead.
      */
-    public static native int taskSelf() throws Unsafe;
+    public static int taskSelf() throws Unsafe {
+        return backend.taskSelf();
+    }
+
+    private static native int nativeTaskSelf();
+
+    /**
+     * Counters maintained by the native message path.
+     *
+     * These account for the costs which can't be observed from Java: the
+     * time actually spent in the kernel, and the number of times
+     * {@code mach_msg()} was interrupted and restarted. The counters are
+     * kept per thread without any locking and only summed up when a
+     * {@link #snapshot} is taken. Comparing {@link #KERNEL_NSECS} with
+     * the latencies seen by {@link MsgObserver} tells apart the time spent
+     * in the kernel from the JNI and Java overhead.
+     *
+     * The snapshot is a {@code long} array indexed by the constants below,
+     * which must be kept in sync with {@code Mach.c}.
+     */
+    public static class NativeStats {
+        public static final int CALLS = 0;
+        public static final int KERNEL_NSECS = 1;
+        public static final int BYTES_SENT = 2;
+        public static final int BYTES_RECEIVED = 3;
+        public static final int SEND_RETRIES = 4;
+        public static final int RCV_RETRIES = 5;
+        public static final int ERRORS = 6;
+
+        /** Errors by code: {@code SEND_ERRORS + (MACH_SEND_* & 0x1f)}. */
+        public static final int SEND_ERRORS = 7;
+
+        /** Errors by code: {@code RCV_ERRORS + (MACH_RCV_* & 0x1f)}. */
+        public static final int RCV_ERRORS = SEND_ERRORS + 32;
+
+        /** Any other errors. */
+        public static final int OTHER_ERRORS = RCV_ERRORS + 32;
+
+        /** Length of the snapshot arrays. */
+        public static final int MAX = OTHER_ERRORS + 1;
+
+        /** Take a snapshot of the counters summed over all threads. */
+        public static long[] snapshot() {
+            long[] stats = new long[MAX];
+            backend.stats(stats);
+            return stats;
+        }
+    }
+
+    private static native void nativeStats(long[] stats);
+
+    /* Memory for wired message buffers, see DirectMemory.allocatePinned. */
+    private static native ByteBuffer nativeVmAllocate(int size);
+    private static native int nativeVmWire(ByteBuffer buf);
+    private static native int nativeVmDeallocate(ByteBuffer buf);
+    private static native int nativeVmDeallocateRegion(long address,
+                                                       long size);
 
     /**
      * Task operations on ports.
@@ -97,8 +414,176 @@ public class Mach {
         public static final int RIGHT_PORT_SET = 3;
         public static final int RIGHT_DEAD_NAME = 4;
 
-        public static native int allocate(int task, int right) throws Unsafe;
-        public static native int deallocate(int task, int name) throws Unsafe;
+        /* Port type bits, as returned by names(). */
+        public static final int TYPE_SEND = 1 << (16 + RIGHT_SEND);
+        public static final int TYPE_RECEIVE = 1 << (16 + RIGHT_RECEIVE);
+        public static final int TYPE_SEND_ONCE = 1 << (16 + RIGHT_SEND_ONCE);
+        public static final int TYPE_PORT_SET = 1 << (16 + RIGHT_PORT_SET);
+        public static final int TYPE_DEAD_NAME = 1 << (16 + RIGHT_DEAD_NAME);
+
+        /**
+         * Allocate a port right. Returns {@link #NULL} on failure.
+         */
+        public static int allocate(int task, int right) throws Unsafe {
+            return backend.allocate(task, right);
+        }
+
+        public static int deallocate(int task, int name) throws Unsafe {
+            return backend.deallocate(task, name);
+        }
+
+        /**
+         * Change the number of user references a task has for a right.
+         * This is the way to destroy a receive right, with a {@code delta}
+         * of -1 and {@link #RIGHT_RECEIVE}.
+         */
+        public static int modRefs(int task, int name, int right, int delta)
+            throws Unsafe
+        {
+            return backend.modRefs(task, name, right, delta);
+        }
+
+        /* Batch operations
+         *
+         * These fill the whole array at once, with a single transition
+         * into native code. The result of the operation on names[i] is
+         * stored into errors[i], which must be at least as long, and the
+         * number of failures is returned. */
+
+        private static void checkLength(int[] names, int[] errors) {
+            if(errors.length < names.length)
+                throw new IllegalArgumentException("errors array too short");
+        }
+
+        /**
+         * Allocate {@code names.length} port rights. The names of the
+         * rights which could not be allocated are set to {@link #NULL}.
+         */
+        public static int allocateN(int task, int right, int[] names,
+                                    int[] errors)
+            throws Unsafe
+        {
+            checkLength(names, errors);
+            return backend.allocateN(task, right, names, errors);
+        }
+
+        /** Deallocate a send right, as {@link #deallocate}, per name. */
+        public static int deallocateN(int task, int[] names, int[] errors)
+            throws Unsafe
+        {
+            checkLength(names, errors);
+            return backend.deallocateN(task, names, errors);
+        }
+
+        /** Change the user references of each name, as {@link #modRefs}. */
+        public static int modRefsN(int task, int[] names, int right,
+                                   int delta, int[] errors)
+            throws Unsafe
+        {
+            checkLength(names, errors);
+            return backend.modRefsN(task, names, right, delta, errors);
+        }
+
+        /**
+         * List the port names in use in a task's name space.
+         *
+         * This is a wrapper around mach_port_names(). The result holds
+         * pairs of a port name followed by its port type bits, or is
+         * {@code null} if the call failed.
+         */
+        public static int[] names(int task) throws Unsafe {
+            return backend.names(task);
+        }
+
+        /**
+         * Get the number of user references a task has for a given right.
+         * The count is stored into {@code refs[0]}.
+         */
+        public static int getRefs(int task, int name, int right, int[] refs)
+            throws Unsafe
+        {
+            return backend.getRefs(task, name, right, refs);
+        }
+
+        /**
+         * Move a receive right into a port set, or out of any port set if
+         * {@code after} is {@link #NULL}.
+         */
+        public static int moveMember(int task, int member, int after)
+            throws Unsafe
+        {
+            return backend.moveMember(task, member, after);
+        }
+
+        /**
+         * Request a notification about a port.
+         *
+         * This is a wrapper around mach_port_request_notification(). The
+         * previously registered notification port, if any, is stored into
+         * {@code previous[0]}.
+         *
+         * @param variant   The notification message ID, one of the
+         *                  {@code Mach.NOTIFY_*} constants.
+         * @param sync      Make-send count for no-senders notifications.
+         * @param notify    The port the notification will be sent to.
+         * @param notifyType How the notify right is passed; typically
+         *                  {@code MachMsgType.MAKE_SEND_ONCE.name()}.
+         */
+        public static int requestNotification(int task, int name,
+                int variant, int sync, int notify, int notifyType,
+                int[] previous)
+            throws Unsafe
+        {
+            return backend.requestNotification(task, name, variant, sync,
+                                               notify, notifyType, previous);
+        }
+
+        /* Indices into the status array filled in by getReceiveStatus(). */
+        public static final int STATUS_PSET = 0;
+        public static final int STATUS_SEQNO = 1;
+        public static final int STATUS_MSCOUNT = 2;
+        public static final int STATUS_QLIMIT = 3;
+        public static final int STATUS_MSGCOUNT = 4;
+        public static final int STATUS_SORIGHTS = 5;
+        public static final int STATUS_SRIGHTS = 6;
+        public static final int STATUS_PDREQUEST = 7;
+        public static final int STATUS_NSREQUEST = 8;
+        public static final int STATUS_MAX = 9;
+
+        /**
+         * Get the status of a receive right, such as the number of
+         * messages queued on it. This is a wrapper around
+         * mach_port_get_receive_status(); the fields of
+         * {@code mach_port_status_t} are stored into {@code status},
+         * indexed by the {@code STATUS_*} constants.
+         */
+        public static int getReceiveStatus(int task, int name, int[] status)
+            throws Unsafe
+        {
+            return backend.getReceiveStatus(task, name, status);
+        }
+
+        /* The actual system calls, used by the native backend. */
+        private static native int nativeAllocate(int task, int right);
+        private static native int nativeDeallocate(int task, int name);
+        private static native int nativeModRefs(int task, int name,
+                                                int right, int delta);
+        private static native int nativeAllocateN(int task, int right,
+                                                  int[] names, int[] errors);
+        private static native int nativeDeallocateN(int task, int[] names,
+                                                    int[] errors);
+        private static native int nativeModRefsN(int task, int[] names,
+                int right, int delta, int[] errors);
+        private static native int[] nativeNames(int task);
+        private static native int nativeGetRefs(int task, int name,
+                                                int right, int[] refs);
+        private static native int nativeMoveMember(int task, int member,
+                                                   int after);
+        private static native int nativeRequestNotification(int task,
+                int name, int variant, int sync, int notify, int notifyType,
+                int[] previous);
+        private static native int nativeGetReceiveStatus(int task, int name,
+                                                         int[] status);
     }
 }
 
@@ -1,5 +1,6 @@
 package org.gnu.mach;
 
+import java.util.Arrays;
 import java.util.Collection;
 import java.util.ArrayList;
 import java.nio.ByteOrder;
@@ -68,6 +69,13 @@ public class MachMsg {
          */
         private MachPort port;
 
+        /**
+         * Alternatively, table and handle of the port name we manage, with
+         * the same semantics as {@link #port}.
+         */
+        private MachPortTable table;
+        private int handle;
+
         /** Initialize for a given index in {@link MachMsg#buf}. */
         public HeaderPort(int index) {
             this.index = index;
@@ -85,13 +93,17 @@ public class MachMsg {
                 port.releaseName();
                 port = null;
             }
+            if(table != null) {
+                table.releaseName(handle);
+                table = null;
+            }
         }
 
         /** Set to MACH_PORT_NULL. */
         public void clear() {
             try {
                 /* A port name which was never accessed must be deallocated. */
-                if(port == null) {
+                if(port == null && table == null) {
                     int name = buf.getInt(index);
                     if(name != Mach.Port.NULL)
                         new MachPort(name).deallocate();
@@ -128,12 +140,62 @@ public class MachMsg {
             } catch(Unsafe exc) {}
         }
 
+        /** Same as {@link #set(MachPort,MachMsgType)}, for a table entry. */
+        public void set(MachPortTable newTable, int newHandle,
+                        MachMsgType type) {
+            if(!type.isPort())
+                throw new IllegalArgumentException();
+
+            clear();
+            if(newHandle == MachPortTable.NONE)
+                return;
+
+            try {
+                if(type.isDeallocatedPort()) {
+                    buf.putInt(index, newTable.clear(newHandle));
+                } else {
+                    buf.putInt(index, newTable.name(newHandle));
+                    table = newTable;
+                    handle = newHandle;
+                }
+            } catch(Unsafe exc) {}
+        }
+
+        /**
+         * Read the port name from the buffer and add it to a table. The
+         * same handle is returned by subsequent calls, and an external
+         * reference to the port name is held until {@link #clear} is
+         * called.
+         */
+        public int get(MachPortTable t) {
+            if(port != null)
+                throw new IllegalStateException(
+                        "port already returned as a MachPort");
+            if(table == null) {
+                int name = buf.getInt(index);
+                if(name == Mach.Port.NULL)
+                    return MachPortTable.NONE;
+                try {
+                    handle = t.add(name);
+                    t.name(handle);
+                    table = t;
+                } catch(Unsafe exc) {}
+            } else if(table != t) {
+                throw new IllegalStateException(
+                        "port already added to another table");
+            }
+            return handle;
+        }
+
         /**
          * Read the port name from the buffer and return a corresponding
          * MachPort object. An external reference to the port name will be held
          * until {@link #clear} is called.
          */
         public MachPort get() {
+            if(table != null)
+                throw new IllegalStateException(
+                        "port already returned as a table handle");
             if(port == null) {
                 int name = buf.getInt(index);
                 if(name != Mach.Port.NULL) {
@@ -153,19 +215,56 @@ public class MachMsg {
     private MachMsgType remoteType, localType;
     private boolean complex;
 
-    /* Extra ports referenced by this message. */
+    /* Whether the buffer holds a received message, see flip(). */
+    private boolean received;
+
+    /* Extra ports referenced by this message, allocated on first use. */
     private Collection<MachPort> refPorts;
 
+    private void addRef(MachPort port) {
+        if(refPorts == null)
+            refPorts = new ArrayList<MachPort>(4);
+        refPorts.add(port);
+    }
+
+    /* Extra table entries referenced by this message, likewise. */
+    private MachPortTable[] refTables;
+    private int[] refHandles;
+    private int refCount;
+
+    private void addRef(MachPortTable table, int handle) {
+        if(refTables == null) {
+            refTables = new MachPortTable[4];
+            refHandles = new int[4];
+        } else if(refCount == refHandles.length) {
+            refTables = Arrays.copyOf(refTables, 2 * refCount);
+            refHandles = Arrays.copyOf(refHandles, 2 * refCount);
+        }
+        refTables[refCount] = table;
+        refHandles[refCount] = handle;
+        refCount++;
+    }
+
     /**
      * Allocate a new message buffer.
      */
     public MachMsg(int size) {
-        buf = ByteBuffer.allocateDirect(size);
+        this(DirectMemory.allocate(size));
+    }
+
+    /**
+     * Create a message over an existing direct buffer, such as a slice of
+     * a {@link MachMsgArena}.
+     */
+    MachMsg(ByteBuffer buffer) {
+        buf = buffer;
         buf.order(ByteOrder.nativeOrder());
         remotePort = new HeaderPort(8);
         localPort = new HeaderPort(12);
-        refPorts = new ArrayList<MachPort>();
         clear();
+
+        if(PortAuditor.tracking)
+            PortAuditor.track(this);
     }
 
     @SuppressWarnings("unused")
@@ -181,10 +280,17 @@ public class MachMsg {
      * been received to release overwritten port references.
      */
     private void releaseNames() throws Unsafe {
-        for(MachPort port : refPorts)
-            port.releaseName();
+        if(refPorts != null) {
+            for(MachPort port : refPorts)
+                port.releaseName();
+            refPorts.clear();
+        }
 
-        refPorts.clear();
+        for(int i = 0; i < refCount; i++) {
+            refTables[i].releaseName(refHandles[i]);
+            refTables[i] = null;
+        }
+        refCount = 0;
     }
 
     /**
@@ -197,6 +303,7 @@ public class MachMsg {
         localPort.clear();
         localType = null;
         complex = false;
+        received = false;
 
         /* FIXME: if a received message was not read completely, we leak the
          * remaining port rights and out-of-line memory. */
@@ -227,6 +334,45 @@ public class MachMsg {
         buf.clear();
         buf.limit(buf.getInt(4));
         buf.position(24);
+        received = true;
+
+        if((buf.getInt(0) & MSGH_BITS_COMPLEX) != 0) {
+            long ool = MachMsgType.outOfLineBytes(buf);
+            if(ool > 0)
+                DirectMemory.recordOutOfLine(ool);
+        }
+    }
+
+    /**
+     * Release the port rights and out-of-line memory carried by the items
+     * of a received message which have not been read yet, and clear the
+     * message. Use this rather than {@link #clear} to drop a received
+     * message whose contents are not wanted.
+     */
+    public synchronized MachMsg discard() {
+        if(received && (buf.getInt(0) & MSGH_BITS_COMPLEX) != 0) {
+            ByteBuffer body = buf.duplicate();
+            body.order(buf.order());
+            destroyPorts(body);
+            MachMsgType.deallocateOutOfLine(body);
+        }
+        return clear();
+    }
+
+    /**
+     * Collect the port names this message holds rights for: those in the
+     * header and, for a received message, those in the items which have
+     * not been read yet. Used by {@link PortAuditor}.
+     */
+    synchronized void collectPortNames(Collection<Integer> names) {
+        for(int index = 8; index <= 12; index += 4) {
+            int name = buf.getInt(index);
+            if(name != Mach.Port.NULL && name != Mach.Port.DEAD)
+                names.add(name);
+        }
+
+        if(received)
+            MachMsgType.collectPortNames(buf, names);
     }
 
     /** Rewrite the header's {@code msgh_bits} field. */
@@ -245,6 +391,30 @@ public class MachMsg {
         return this;
     }
 
+    /** Set the header's {@code msgh_remote_port} field to a table entry. */
+    public synchronized MachMsg setRemotePort(MachPortTable table, int handle,
+                                              MachMsgType type) {
+        remotePort.set(table, handle, type);
+        remoteType = type;
+        putBits();
+        return this;
+    }
+
+    /**
+     * Get the header's {@code msgh_remote_port} field, as a handle in
+     * {@code table}. The type is checked as for
+     * {@link #getRemotePort(MachMsgType)}.
+     */
+    public synchronized int getRemotePort(MachMsgType type, MachPortTable table)
+        throws TypeCheckException
+    {
+        int typeVal = MSGH_BITS_REMOTE(buf.getInt(0));
+        if(typeVal != type.name())
+            throw new TypeCheckException();
+
+        return remotePort.get(table);
+    }
+
     /**
      * Get the header's {@code msgh_remote_port} field.
      *
@@ -272,6 +442,15 @@ public class MachMsg {
         return this;
     }
 
+    /** Set the header's {@code msgh_local_port} field to a table entry. */
+    public synchronized MachMsg setLocalPort(MachPortTable table, int handle,
+                                             MachMsgType type) {
+        localPort.set(table, handle, type);
+        localType = type;
+        putBits();
+        return this;
+    }
+
     /**
      * Get the header's {@code msgh_local_port} field.
      *
@@ -302,6 +481,285 @@ public class MachMsg {
         return buf.getInt(20);
     }
 
+    /**
+     * How long {@link #forward(MachPort, MachMsgType)} waits for room in
+     * the destination's queue, in milliseconds.
+     */
+    public static final long FORWARD_TIMEOUT = 100;
+
+    /**
+     * Forward a received message to another port, waiting at most
+     * {@link #FORWARD_TIMEOUT} for room in its queue.
+     *
+     * @see #forward(MachPort, MachMsgType, long)
+     */
+    public int forward(MachPort dest, MachMsgType type) {
+        return forward(dest, type, FORWARD_TIMEOUT);
+    }
+
+    /**
+     * Forward a received message to another port.
+     *
+     * The message must have been {@link #flip flipped}, its reply port
+     * must not have been taken with {@link #getRemotePort}, and none of its
+     * port items must have been read, since the rights would then belong
+     * to {@link MachPort} objects. The header is rewritten in place so that
+     * the message goes to {@code dest} and the reply right is moved along
+     * with it: the reply will go straight back to the original sender. The
+     * body is sent again as it was received, whatever plain data has been
+     * read from it. Its port rights are moved and its out-of-line regions
+     * are marked for deallocation, so forwarding costs a single
+     * {@code mach_msg()} call and no copy of the body.
+     *
+     * On success, the message is cleared. If the message could not be
+     * queued in time, or was rejected before the kernel took any right
+     * from it, the rights and memory carried by the body are released,
+     * and the message is left as a received message with an empty body
+     * and its reply port, so that the server loop sends the reply built
+     * by the caller, which should report the error. After errors in the
+     * body, the kernel has destroyed the header rights and the items it
+     * had copied in, and the message is cleared; the sender gets a
+     * send-once notification instead of a reply.
+     *
+     * @param dest      The port to forward the message to.
+     * @param type      How to send {@code dest}, usually
+     *                  {@link MachMsgType#COPY_SEND}.
+     * @param timeout   How long to wait for room in the destination's
+     *                  queue, in milliseconds.
+     * @return The return code of {@code mach_msg()}.
+     */
+    public synchronized int forward(MachPort dest, MachMsgType type,
+                                    long timeout) {
+        if(!received)
+            throw new IllegalStateException("message was not received");
+        if(remotePort.port != null || remotePort.table != null)
+            throw new IllegalStateException("reply port already taken");
+
+        int bits = buf.getInt(0);
+        if((bits & MSGH_BITS_COMPLEX) != 0) {
+            ByteBuffer read = buf.duplicate();
+            read.order(buf.order());
+            read.limit(buf.position());
+            read.position(24);
+            if(MachMsgType.hasPorts(read))
+                throw new IllegalStateException("port items already read");
+        }
+
+        /* Move the reply right to the local field, and release any name
+         * of our receive right held there without deallocating it. */
+        int replyName = buf.getInt(8);
+        int replyBits = MSGH_BITS_REMOTE(bits);
+        buf.putInt(8, Mach.Port.NULL);
+        try { localPort.flip(); } catch(Unsafe exc) {}
+        buf.putInt(12, replyName);
+        if(replyBits == MachMsgType.PORT_SEND_ONCE.name())
+            localType = MachMsgType.MOVE_SEND_ONCE;
+        else if(replyBits == MachMsgType.PORT_SEND.name())
+            localType = MachMsgType.MOVE_SEND;
+        else
+            localType = null;
+
+        remotePort.set(dest, type);
+        remoteType = type;
+        complex = (bits & MSGH_BITS_COMPLEX) != 0;
+        putBits();
+
+        ByteBuffer body = buf.duplicate();
+        body.order(buf.order());
+        body.position(24);
+        if(complex)
+            MachMsgType.prepareForward(body);
+
+        int err = Mach.MSG_SUCCESS;
+        buf.position(buf.limit());
+        try {
+            err = Mach.msg(buf, Mach.SEND_MSG | Mach.SEND_TIMEOUT,
+                           Mach.Port.NULL, timeout, Mach.Port.NULL);
+        } catch(Unsafe exc) {}
+
+        if(err == Mach.MSG_SUCCESS) {
+            /* Everything went with the message. */
+            buf.putInt(8, Mach.Port.NULL);
+            buf.putInt(12, Mach.Port.NULL);
+        } else if(err == Mach.SEND_TIMED_OUT || err == Mach.SEND_INTERRUPTED
+                  || beforeCopyin(err)) {
+            /* The message was not sent, or was handed back to us, so we
+             * still hold all its rights. */
+            unforward(body, type, replyBits);
+            return err;
+        } else {
+            /* The kernel destroyed the header rights along with the items
+             * it had copied in before the faulty one, and left us the
+             * others. There is no telling them apart from here, so leak
+             * the latter rather than release rights which may be gone and
+             * whose names may have been reused. */
+            buf.putInt(12, Mach.Port.NULL);
+        }
+        received = false;
+        clear();
+        return err;
+    }
+
+    /**
+     * Whether a send error is raised before the kernel copies in any right
+     * from the message, so that the sender still holds them all.
+     */
+    private static boolean beforeCopyin(int err) {
+        switch(err) {
+            case Mach.SEND_INVALID_DATA:
+            case Mach.SEND_INVALID_DEST:
+            case Mach.SEND_MSG_TOO_SMALL:
+            case Mach.SEND_INVALID_REPLY:
+            case Mach.SEND_INVALID_HEADER:
+                return true;
+        }
+        return false;
+    }
+
+    /**
+     * Undo a failed {@link #forward}: release what the body carries, and
+     * make the message a received message holding only its reply port.
+     */
+    private void unforward(ByteBuffer body, MachMsgType type, int replyBits) {
+        if(complex) {
+            destroyPorts(body);
+            MachMsgType.deallocateOutOfLine(body);
+        }
+
+        /* A message handed back by the kernel carries a new reference to
+         * a copied or made send right, and is tagged PORT_SEND. */
+        int destName = buf.getInt(8);
+        boolean handedBack = MSGH_BITS_REMOTE(buf.getInt(0)) != type.name();
+        try {
+            if(remotePort.port != null) {
+                if(handedBack && destName != Mach.Port.NULL)
+                    Mach.Port.deallocate(Mach.taskSelf(), destName);
+                remotePort.flip();
+            } else if(destName != Mach.Port.NULL) {
+                /* A moved right was given up by its MachPort object. */
+                Mach.Port.deallocate(Mach.taskSelf(), destName);
+            }
+        } catch(Unsafe exc) {}
+        remoteType = null;
+
+        int replyName = buf.getInt(12);
+        buf.putInt(8, replyName);
+        buf.putInt(12, Mach.Port.NULL);
+        localType = null;
+        complex = false;
+        buf.putInt(0, MSGH_BITS(replyName != Mach.Port.NULL ? replyBits : 0,
+                                0));
+        buf.putInt(4, 24);
+        buf.limit(24);
+        buf.position(24);
+    }
+
+    /**
+     * The disposition with which to send the reply to a received message:
+     * {@link MachMsgType#MOVE_SEND_ONCE} or {@link MachMsgType#MOVE_SEND},
+     * or {@code null} if it has no reply port.
+     */
+    public synchronized MachMsgType replyType() {
+        int bits = MSGH_BITS_REMOTE(buf.getInt(0));
+        if(bits == MachMsgType.PORT_SEND_ONCE.name())
+            return MachMsgType.MOVE_SEND_ONCE;
+        if(bits == MachMsgType.PORT_SEND.name())
+            return MachMsgType.MOVE_SEND;
+        return null;
+    }
+
+    /**
+     * Take the reply port of a received message, so that the reply can be
+     * sent later, maybe by another thread, with the disposition given by
+     * {@link #replyType}, which must be asked first. The message is left
+     * without a reply port, so that {@link MachServer} sends no reply to
+     * it.
+     *
+     * @return The reply port, or {@code null} if there is none.
+     */
+    public synchronized MachPort takeReplyPort() {
+        if(!received)
+            throw new IllegalStateException("message was not received");
+
+        MachPort port = remotePort.get();
+        if(port == null)
+            return null;
+        remotePort.clear();
+        remoteType = null;
+        buf.putInt(0, buf.getInt(0) & ~0xff);
+        return port;
+    }
+
+    /** Deallocate the port rights carried by the items of a message. */
+    private static void destroyPorts(ByteBuffer body) {
+        MachMsgType.scanItems(body, new MachMsgType.ItemVisitor() {
+            void port(ByteBuffer b, int index, int type) {
+                int name = b.getInt(index);
+                if(name == Mach.Port.NULL || name == Mach.Port.DEAD)
+                    return;
+                try {
+                    if(type == MachMsgType.PORT_RECEIVE.name())
+                        Mach.Port.modRefs(Mach.taskSelf(), name,
+                                          Mach.Port.RIGHT_RECEIVE, -1);
+                    else
+                        Mach.Port.deallocate(Mach.taskSelf(), name);
+                } catch(Unsafe exc) {}
+            }
+        });
+    }
+
+
+    /**
+     * Load the body of a raw message, such as one read from a
+     * {@link MsgCapture} file.
+     *
+     * The message must have just been {@link #clear cleared}. The
+     * {@code msgh_id} field and the complex bit are taken from the raw
+     * message, but the header's ports are left alone and should be set with
+     * {@link #setRemotePort} and {@link #setLocalPort}. Port names carried
+     * by the body are meaningless outside of the task they come from, so
+     * they are replaced with {@code MACH_PORT_NULL}. Raw messages with
+     * out-of-line items, or which don't fit in the buffer, are rejected.
+     */
+    public synchronized MachMsg putRawBody(byte[] raw)
+        throws TypeCheckException
+    {
+        if(buf.position() != 24)
+            throw new IllegalStateException("message is not empty");
+        if(raw.length < 24)
+            throw new TypeCheckException("raw message too short");
+        if(raw.length - 24 > buf.remaining())
+            throw new TypeCheckException("raw message too large");
+
+        ByteBuffer rawBuf = ByteBuffer.wrap(raw);
+        rawBuf.order(ByteOrder.nativeOrder());
+        rawBuf.position(24);
+        buf.put(rawBuf);
+
+        final boolean[] outOfLine = { false };
+        ByteBuffer body = buf.duplicate();
+        body.order(buf.order());
+        body.flip();
+        body.position(24);
+        MachMsgType.scanItems(body, new MachMsgType.ItemVisitor() {
+            void port(ByteBuffer b, int index, int type) {
+                b.putInt(index, Mach.Port.NULL);
+            }
+            void outOfLine(ByteBuffer b, int index, int size, int type) {
+                outOfLine[0] = true;
+            }
+        });
+        if(outOfLine[0]) {
+            buf.position(24);
+            throw new TypeCheckException(
+                    "raw messages with out-of-line data are not supported");
+        }
+
+        complex = (rawBuf.getInt(0) & MSGH_BITS_COMPLEX) != 0;
+        putBits();
+        setId(rawBuf.getInt(20));
+        return this;
+    }
 
     /* Writing data items */
 
@@ -391,6 +849,72 @@ public class MachMsg {
         });
     }
 
+    /**
+     * Append a port data item to this message.
+     *
+     * As for the header's ports, the port name is either acquired with
+     * {@link MachPort#name()} and kept until the message is cleared or
+     * flipped, or, for the {@code MOVE_*} types, taken over from
+     * {@code port} with {@link MachPort#clear()}.
+     */
+    public synchronized MachMsg putPort(final MachMsgType type,
+                                        final MachPort port)
+        throws TypeCheckException
+    {
+        atomicPut(type, true, new PutOperation() {
+            public void operate() {
+                int name = Mach.Port.NULL;
+                try {
+                    if(port == MachPort.NULL) {
+                        name = Mach.Port.NULL;
+                    } else if(type.isDeallocatedPort()) {
+                        name = port.clear();
+                    } else {
+                        name = port.name();
+                        addRef(port);
+                    }
+                } catch(Unsafe exc) {}
+                buf.putInt(name);
+            }
+        });
+
+        complex = true;
+        putBits();
+        return this;
+    }
+
+    /**
+     * Append a port data item designated by a table handle to this
+     * message, with the same semantics as
+     * {@link #putPort(MachMsgType,MachPort)}.
+     */
+    public synchronized MachMsg putPort(final MachMsgType type,
+                                        final MachPortTable table,
+                                        final int handle)
+        throws TypeCheckException
+    {
+        atomicPut(type, true, new PutOperation() {
+            public void operate() {
+                int name = Mach.Port.NULL;
+                try {
+                    if(handle == MachPortTable.NONE) {
+                        name = Mach.Port.NULL;
+                    } else if(type.isDeallocatedPort()) {
+                        name = table.clear(handle);
+                    } else {
+                        name = table.name(handle);
+                        addRef(table, handle);
+                    }
+                } catch(Unsafe exc) {}
+                buf.putInt(name);
+            }
+        });
+
+        complex = true;
+        putBits();
+        return this;
+    }
+
     /* Convenience versions using predefined types */
 
     /** Append a {@code MACH_MSG_TYPE_CHAR} data item to this message. */
@@ -592,11 +1116,38 @@ public class MachMsg {
         });
 
         MachPort port = null;
-        try { port = new MachPort(name); } catch(Unsafe exc) {}
+        try {
+            if(type == MachMsgType.PORT_SEND)
+                port = MachPort.received(name);
+            else
+                port = new MachPort(name);
+        } catch(Unsafe exc) {}
 
         return port;
     }
 
+    /**
+     * Read a port from this message and add it to a table. Returns the
+     * new handle, or {@link MachPortTable#NONE} for {@code MACH_PORT_NULL}.
+     */
+    public int getPort(MachMsgType.Template type, MachPortTable table)
+        throws TypeCheckException
+    {
+        /* NB: the same as above applies. */
+
+        int name = atomicGet(type, 1, true, new GetOperation<Integer>() {
+            public Integer operate() { return buf.getInt(); }
+        });
+
+        if(name == Mach.Port.NULL)
+            return MachPortTable.NONE;
+        try {
+            return table.add(name);
+        } catch(Unsafe exc) {
+            return MachPortTable.NONE;
+        }
+    }
+
     /** Read a port array from this message. */
     public MachPort[] getPorts(MachMsgType.Template type)
         throws TypeCheckException
@@ -616,7 +1167,9 @@ public class MachMsg {
         MachPort[] ports = new MachPort[names.length];
         try { 
             for(int i = 0; i < names.length; i++)
-                ports[i] = new MachPort(names[i]);
+                ports[i] = (type == MachMsgType.PORT_SEND)
+                         ? MachPort.received(names[i])
+                         : new MachPort(names[i]);
         } catch(Unsafe exc) {}
 
         return ports;
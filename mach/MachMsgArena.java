@@ -0,0 +1,175 @@
+package org.gnu.mach;
+
+import java.nio.ByteBuffer;
+
+/**
+ * Message buffers carved out of a single off-heap arena.
+ *
+ * A {@link MachMsgArena} allocates one large direct buffer and divides it
+ * into fixed-size slots. Each slot is used through a {@link MachMsg} view
+ * over its slice of the arena, which is created the first time the slot
+ * is used and kept for the lifetime of the arena. Slots are designated by
+ * {@code int} handles, in the same way as {@link MachPortTable} entries,
+ * and the free slots are chained through an {@code int} array.
+ *
+ * This is meant for servers and proxies which keep a large number of
+ * messages in flight: compared with one {@link MachMsg} per message, there
+ * is a single direct buffer to allocate and account for, and no message
+ * object is ever collected.
+ *
+ * For servers which care more about stable latency than about memory, a
+ * wired arena takes its memory directly from the kernel, faults all of
+ * its pages in up front and wires them if we hold the privileged host
+ * port, so that handling a message never waits for a page fault. Such an
+ * arena must be released explicitly with {@link #close}.
+ */
+public class MachMsgArena {
+    /** Returned by {@link #acquire} when all the slots are in use. */
+    public static final int NONE = -1;
+
+    private final ByteBuffer arena;
+    private final boolean pinned;
+    private final boolean wired;
+    private final int slotSize;
+    private final MachMsg[] msgs;
+    private final int[] next;
+    private final boolean[] used;
+    private int freeList;
+    private int inUse;
+    private boolean closed;
+
+    /**
+     * Create an arena.
+     *
+     * @param slotSize  The size of each message buffer, which is rounded
+     *                  up to a multiple of 8 bytes.
+     * @param slots     The number of message buffers.
+     */
+    public MachMsgArena(int slotSize, int slots) {
+        this(slotSize, slots, false);
+    }
+
+    /**
+     * Create an arena, possibly wired.
+     *
+     * @param slotSize  The size of each message buffer, which is rounded
+     *                  up to a multiple of 8 bytes.
+     * @param slots     The number of message buffers.
+     * @param wire      Whether to prefault and wire the arena. Check
+     *                  {@link #isWired} to find out if wiring succeeded.
+     */
+    public MachMsgArena(int slotSize, int slots, boolean wire) {
+        slotSize = (slotSize + 7) & ~7;
+        if(slotSize <= 0 || slots <= 0
+                || (long) slotSize * slots > Integer.MAX_VALUE)
+            throw new IllegalArgumentException();
+
+        this.slotSize = slotSize;
+        pinned = wire;
+        if(wire) {
+            arena = DirectMemory.allocatePinned(slotSize * slots);
+            wired = DirectMemory.wire(arena);
+        } else {
+            arena = DirectMemory.allocate(slotSize * slots);
+            wired = false;
+        }
+        msgs = new MachMsg[slots];
+        next = new int[slots];
+        used = new boolean[slots];
+        for(int i = 0; i < slots; i++)
+            next[i] = i + 1;
+        next[slots - 1] = NONE;
+        freeList = 0;
+    }
+
+    /** The size of each message buffer. */
+    public int slotSize() {
+        return slotSize;
+    }
+
+    /** The number of message buffers. */
+    public int capacity() {
+        return msgs.length;
+    }
+
+    /** Whether the arena's memory is wired. */
+    public boolean isWired() {
+        return wired;
+    }
+
+    /** The number of message buffers currently acquired. */
+    public synchronized int inUse() {
+        return inUse;
+    }
+
+    /**
+     * Take a free slot, or return {@link #NONE} if there is none left or
+     * the arena has been closed. The slot's message is cleared.
+     */
+    public synchronized int acquire() {
+        int slot = freeList;
+        if(slot == NONE)
+            return NONE;
+
+        freeList = next[slot];
+        used[slot] = true;
+        inUse++;
+        if(msgs[slot] == null) {
+            arena.limit((slot + 1) * slotSize);
+            arena.position(slot * slotSize);
+            msgs[slot] = new MachMsg(arena.slice());
+            arena.clear();
+        }
+        return slot;
+    }
+
+    /** Return the message of an acquired slot. */
+    public synchronized MachMsg get(int slot) {
+        if(slot < 0 || slot >= msgs.length || !used[slot])
+            throw new IllegalArgumentException("invalid slot " + slot);
+        return msgs[slot];
+    }
+
+    /**
+     * Clear the message of a slot, releasing any port references it holds,
+     * and give the slot back to the arena.
+     */
+    public void release(int slot) {
+        MachMsg msg;
+        synchronized(this) {
+            msg = get(slot);
+            /* Claim the release first, so that a second one for the same
+             * slot fails here rather than linking it twice. */
+            used[slot] = false;
+        }
+
+        msg.clear();
+
+        synchronized(this) {
+            next[slot] = freeList;
+            freeList = slot;
+            inUse--;
+        }
+    }
+
+    /**
+     * Release the memory of a wired arena. All the slots must have been
+     * released, and their messages must not be used afterwards. For other
+     * arenas, the memory is released when the arena is collected and this
+     * does nothing.
+     */
+    public void close() throws Unsafe {
+        if(!pinned)
+            return;
+
+        synchronized(this) {
+            if(closed)
+                return;
+            if(inUse > 0)
+                throw new IllegalStateException(inUse + " slots in use");
+            closed = true;
+            freeList = NONE;
+        }
+        DirectMemory.freePinned(arena, wired);
+    }
+}
@@ -1,5 +1,6 @@
 package org.gnu.mach;
 import java.nio.ByteBuffer;
+import java.util.Collection;
 
 /**
  * Type descriptor for data items.
@@ -64,13 +65,13 @@ public class MachMsgType {
     public final int number() { return number; }
 
     /** Get this type descriptor's inline bit. */
-    public final boolean inl() { return longform; }
+    public final boolean inl() { return inl; }
 
     /** Get this type descriptor's longform bit. */
     public final boolean longform() { return longform; }
 
     /** Get this type descriptor's deallocate bit. */
-    public final boolean deallocate() { return longform; }
+    public final boolean deallocate() { return deallocate; }
 
     /**
      * Whether this is a port type.
@@ -185,6 +186,177 @@ public class MachMsgType {
         return new MachMsgType(name, size, number, inl, longform, deallocate);
     }
 
+    /**
+     * Callback for {@link #scanItems}.
+     *
+     * The methods are given the absolute index in the buffer of the item's
+     * data (for inline ports) or type descriptor (for out-of-line items),
+     * and may modify the buffer in place at that index.
+     */
+    static abstract class ItemVisitor {
+        /** Called for each inline port item, before its port names, with
+         * the index of its type descriptor. */
+        void portItem(ByteBuffer buf, int index, int type) {}
+
+        /** Called for each port name carried inline. */
+        void port(ByteBuffer buf, int index, int type) {}
+
+        /** Called for each out-of-line item; the pointer follows the
+         * type descriptor, which is {@code headerSize} bytes long. */
+        void outOfLine(ByteBuffer buf, int index, int headerSize, int type) {}
+    }
+
+    /**
+     * Walk the data items between the position and the limit of the given
+     * buffer, without altering its position, and report the port names and
+     * out-of-line items to the visitor. The scan stops at the first item
+     * which does not fit in the buffer.
+     */
+    static void scanItems(ByteBuffer msg, ItemVisitor visitor) {
+        ByteBuffer buf = msg.duplicate();
+        buf.order(msg.order());
+
+        while(true) {
+            /* FIXME: hardcoded for 32 bits architectures, as align() is. */
+            int pos = (buf.position() + 3) & ~3;
+            if(pos + 4 > buf.limit())
+                break;
+            buf.position(pos);
+
+            int header = buf.getInt();
+            boolean inl = (header & BIT_INLINE) != 0;
+            boolean longform = (header & BIT_LONGFORM) != 0;
+
+            int name, size, number;
+            if(longform) {
+                if(buf.remaining() < 8)
+                    break;
+                name = buf.getShort() & 0xffff;
+                size = buf.getShort() & 0xffff;
+                number = buf.getInt();
+            } else {
+                name = header & 0xff;
+                size = (header >> 8) & 0xff;
+                number = (header >> 16) & 0x0fff;
+            }
+
+            /* Out-of-line data: skip the pointer. */
+            if(!inl) {
+                if(buf.remaining() < 4)
+                    break;
+                visitor.outOfLine(buf, pos, buf.position() - pos, name);
+                buf.getInt();
+                continue;
+            }
+
+            long bytes = ((long) size * number + 7) / 8;
+            if(bytes > buf.remaining())
+                break;
+
+            if(name >= MOVE_RECEIVE.name() && name <= MAKE_SEND_ONCE.name()
+                    && size == 32) {
+                visitor.portItem(buf, pos, name);
+                for(int i = 0; i < number; i++)
+                    visitor.port(buf, buf.position() + 4 * i, name);
+            }
+            buf.position(buf.position() + (int) bytes);
+        }
+    }
+
+    /**
+     * Prepare the data items of a received message to be sent again. The
+     * port items already carry the {@code MOVE_*} types they were received
+     * as; the out-of-line items are marked for deallocation, so that their
+     * memory is moved to the destination rather than copied.
+     */
+    static void prepareForward(ByteBuffer msg) {
+        scanItems(msg, new ItemVisitor() {
+            void outOfLine(ByteBuffer buf, int index, int headerSize,
+                           int type) {
+                buf.putInt(index, buf.getInt(index) | BIT_DEALLOCATE);
+            }
+        });
+    }
+
+    /**
+     * Total size of the out-of-line data items between the position and
+     * the limit of the given buffer, which is not modified.
+     */
+    static long outOfLineBytes(ByteBuffer msg) {
+        final long[] total = { 0 };
+        scanItems(msg, new ItemVisitor() {
+            void outOfLine(ByteBuffer buf, int index, int headerSize,
+                           int type) {
+                total[0] += itemBytes(buf, index);
+            }
+        });
+        return total[0];
+    }
+
+    /** Size of the data of the item whose type descriptor is at index. */
+    private static long itemBytes(ByteBuffer buf, int index) {
+        int header = buf.getInt(index);
+        long size, number;
+        if((header & BIT_LONGFORM) != 0) {
+            size = buf.getShort(index + 6) & 0xffff;
+            number = buf.getInt(index + 8) & 0xffffffffL;
+        } else {
+            size = (header >> 8) & 0xff;
+            number = (header >> 16) & 0x0fff;
+        }
+        return (size * number + 7) / 8;
+    }
+
+    /**
+     * Deallocate the out-of-line regions of the data items between the
+     * position and the limit of the given buffer, which are mapped in our
+     * address space.
+     */
+    static void deallocateOutOfLine(ByteBuffer msg) {
+        scanItems(msg, new ItemVisitor() {
+            void outOfLine(ByteBuffer buf, int index, int headerSize,
+                           int type) {
+                /* FIXME: hardcoded for 32 bits architectures. */
+                long address = buf.getInt(index + headerSize) & 0xffffffffL;
+                long bytes = itemBytes(buf, index);
+                if(address != 0 && bytes > 0)
+                    Mach.backend.vmDeallocateRegion(address, bytes);
+            }
+        });
+    }
+
+    /**
+     * Whether the data items between the position and the limit of the
+     * given buffer carry any port name.
+     */
+    static boolean hasPorts(ByteBuffer msg) {
+        final boolean[] found = { false };
+        scanItems(msg, new ItemVisitor() {
+            void port(ByteBuffer buf, int index, int type) {
+                int name = buf.getInt(index);
+                if(name != Mach.Port.NULL && name != Mach.Port.DEAD)
+                    found[0] = true;
+            }
+        });
+        return found[0];
+    }
+
+    /**
+     * Collect the port names carried by the data items between the position
+     * and the limit of the given buffer, which is not modified.
+     *
+     * This is used to account for the port rights held by the unread part
+     * of a received message. Out-of-line port arrays are not examined.
+     */
+    static void collectPortNames(ByteBuffer msg,
+                                 final Collection<Integer> names) {
+        scanItems(msg, new ItemVisitor() {
+            void port(ByteBuffer buf, int index, int type) {
+                names.add(buf.getInt(index));
+            }
+        });
+    }
+
     /**
      * Type descriptor template.
      *
@@ -287,6 +459,7 @@ public class MachMsgType {
 
         /* List of types currently in use. Extend as needed. */
         CHAR =              new Template(8, 8, true),
+        STRING_C =          new Template(12, 8, false),
         INTEGER_32 =        new Template(2, 32, false),
         INTEGER_64 =        new Template(11, 64, false),
         MOVE_RECEIVE =      new Template(16, 32, false),
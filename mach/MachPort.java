@@ -1,5 +1,8 @@
 package org.gnu.mach;
 
+import java.lang.ref.WeakReference;
+import java.util.HashMap;
+
 /**
  * Opaque Mach port name.
  *
@@ -14,6 +17,19 @@ package org.gnu.mach;
  *
  * <h3>Deallocation</h3>
  *
+ * Each {@link MachPort} object normally stands for one Mach user
+ * reference, which {@link #deallocate} releases. Send rights received in
+ * messages are the exception: when the same send right is received again
+ * while an object for it is still live, the kernel adds a user reference
+ * to the same name, and {@link MachMsg} returns that same object instead
+ * of a new one. The object then keeps count of both its owners, each of
+ * which must still call {@link #deallocate} once, and of the user
+ * references it holds. These are given back with a single
+ * {@code mach_port_mod_refs()} call when the last owner is done, or as
+ * soon as more than {@link #MAX_SURPLUS} of them pile up, so that a
+ * client which keeps receiving the same right neither makes a system call
+ * per copy nor runs into the kernel's user reference limit.
+ *
  * <h3>Unsafe access</h3>
  *
  * The encapsulated port name can be retreived by unsafe code using the
@@ -94,6 +110,32 @@ public class MachPort {
      */
     private int refCnt;
 
+    /**
+     * Number of owners: one, plus one for each time the same received send
+     * right was merged into this object, minus the deallocations.
+     */
+    private int holders = 1;
+
+    /** Number of Mach user references held for the name. */
+    private int urefs = 1;
+
+    /** Whether this object is registered in {@link #sendRights}. */
+    private boolean interned;
+
+    /**
+     * Set once the name is being taken away, so that no more references
+     * are merged into this object while it waits for the name to be
+     * released.
+     */
+    private boolean dying;
+
+    /** Extra user references kept before they are given back. */
+    public static final int MAX_SURPLUS = 64;
+
+    /* Objects for received send rights, by name. */
+    private static final HashMap<Integer, WeakReference<MachPort>>
+        sendRights = new HashMap<Integer, WeakReference<MachPort>>();
+
     /**
      * Instanciate a new MachPort object for the given name.
      *
@@ -104,6 +146,71 @@ public class MachPort {
     public MachPort(int name) throws Unsafe {
         this.name = name;
         refCnt = 0;
+
+        if(PortAuditor.tracking)
+            PortAuditor.track(this);
+    }
+
+    /**
+     * Return an object for a send right received in a message, which
+     * brings in one user reference. If a live object holds a send right
+     * under the same name, the reference is merged into it and it is
+     * returned; otherwise a new object is created.
+     */
+    static MachPort received(int name) throws Unsafe {
+        if(name == Mach.Port.NULL || name == Mach.Port.DEAD)
+            return new MachPort(name);
+
+        MachPort port;
+        synchronized(sendRights) {
+            WeakReference<MachPort> ref = sendRights.get(name);
+            port = (ref != null) ? ref.get() : null;
+        }
+        if(port != null && port.merge(name))
+            return port;
+
+        port = new MachPort(name);
+        port.interned = true;
+        synchronized(sendRights) {
+            sendRights.put(name, new WeakReference<MachPort>(port));
+        }
+        return port;
+    }
+
+    /* Take one more owner and user reference, unless we have been
+     * cleared in the meantime. */
+    private synchronized boolean merge(int newName) throws Unsafe {
+        if(dying || name != newName)
+            return false;
+
+        holders++;
+        if(++urefs > MAX_SURPLUS + 1) {
+            dropRefs(name, urefs - 1);
+            urefs = 1;
+        }
+        return true;
+    }
+
+    /** Release user references to a send right, with a single call. */
+    private static void dropRefs(int name, int n) throws Unsafe {
+        int task = Mach.taskSelf();
+        if(n == 1) {
+            Mach.Port.deallocate(task, name);
+            return;
+        }
+
+        /* If the port has died, our send right is now a dead name. */
+        if(Mach.Port.modRefs(task, name, Mach.Port.RIGHT_SEND, -n)
+                == Mach.KERN_INVALID_RIGHT)
+            Mach.Port.modRefs(task, name, Mach.Port.RIGHT_DEAD_NAME, -n);
+    }
+
+    /** Add a user reference to a send right or dead name. */
+    private static void addRef(int name) throws Unsafe {
+        int task = Mach.taskSelf();
+        if(Mach.Port.modRefs(task, name, Mach.Port.RIGHT_SEND, 1)
+                == Mach.KERN_INVALID_RIGHT)
+            Mach.Port.modRefs(task, name, Mach.Port.RIGHT_DEAD_NAME, 1);
     }
 
     /**
@@ -121,6 +228,14 @@ public class MachPort {
         return name;
     }
 
+    /**
+     * Peek at the encapsulated port name without acquiring it. The result
+     * may be stale by the time it's used; this is for diagnostics only.
+     */
+    final synchronized int peekName() {
+        return name;
+    }
+
     /**
      * Release a reference acquired through name().
      */
@@ -140,9 +255,45 @@ public class MachPort {
      *
      * If external references to the port name exist, the call will block
      * until they have all been released.
+     *
+     * If the object has other owners, the name is left in place and the
+     * caller is given one of the user references instead.
      */
     @SuppressWarnings("unused")
     public final synchronized int clear() throws Unsafe {
+        if(holders > 1) {
+            if(urefs > 1)
+                urefs--;
+            else
+                addRef(name);
+            holders--;
+            return name;
+        }
+
+        int oldName = take();
+        int n = urefs;
+        urefs = 0;
+        if(n > 1)
+            dropRefs(oldName, n - 1);
+        return oldName;
+    }
+
+    /* Replace the name with MACH_PORT_DEAD and return it. The caller
+     * then owns the user references counted in urefs, which it must
+     * read and reset after this returns: take() may release the monitor
+     * while it waits for the name to be released. */
+    private int take() {
+        /* Received rights under this name now go to a new object. */
+        dying = true;
+        if(interned) {
+            synchronized(sendRights) {
+                WeakReference<MachPort> ref = sendRights.get(name);
+                if(ref != null && (ref.get() == this || ref.get() == null))
+                    sendRights.remove(name);
+            }
+            interned = false;
+        }
+
         if(name != DEAD.name)
             while(refCnt > 0)
                 try {
@@ -153,6 +304,7 @@ public class MachPort {
 
         int oldName = name;
         name = Mach.Port.DEAD;
+        holders = 0;
         return oldName;
     }
 
@@ -161,12 +313,38 @@ public class MachPort {
      *
      * The encapsulated port name is replaced with {@code MACH_PORT_DEAD}.
      * If external references to the port name exist, the call will block
-     * until they have all been released.
+     * until they have all been released. If the object has other owners,
+     * this only gives up the caller's share of it.
      */
     public synchronized void deallocate() {
+        if(holders > 1) {
+            holders--;
+            return;
+        }
+
+        try {
+            int name = take();
+            int n = urefs;
+            urefs = 0;
+            if(n > 0)
+                dropRefs(name, n);
+            MsgObserver.reportPortDeallocated(name);
+        } catch(Unsafe e) {}
+    }
+
+    /**
+     * Destroy the receive right named by this port.
+     *
+     * Unlike {@link #deallocate}, which only drops a user reference, this
+     * destroys the port itself: queued messages are discarded and senders
+     * see a dead name.
+     */
+    public synchronized void destroy() {
         try {
             int name = clear();
-            Mach.Port.deallocate(Mach.taskSelf(), name);
+            Mach.Port.modRefs(Mach.taskSelf(), name, Mach.Port.RIGHT_RECEIVE,
+                              -1);
+            MsgObserver.reportPortDeallocated(name);
         } catch(Unsafe e) {}
     }
 
@@ -176,6 +354,7 @@ public class MachPort {
     public static MachPort allocateReplyPort() {
         try {
             int name = Mach.replyPort();
+            MsgObserver.reportPortAllocated(name, Mach.Port.RIGHT_RECEIVE);
             return new MachPort(name);
         } catch(Unsafe e) {
             return null;
@@ -183,19 +362,23 @@ public class MachPort {
     }
 
     /**
-     * Allocate a new port name.
+     * Allocate a new port name, or return {@link #NULL} on failure.
      */
     public static MachPort allocate(Right right) {
         try {
             int name = Mach.Port.allocate(Mach.taskSelf(), right.ordinal());
+            if(name == Mach.Port.NULL)
+                return NULL;
+            MsgObserver.reportPortAllocated(name, right.ordinal());
             return new MachPort(name);
         } catch(Unsafe e) {
-            return null;
+            return NULL;
         }
     }
 
     /**
-     * Allocate a new receive port right.
+     * Allocate a new receive port right, or return {@link #NULL} on
+     * failure.
      */
     public static MachPort allocate() {
         return allocate(Right.RECEIVE);
@@ -213,6 +396,7 @@ public class MachPort {
         if(name != Mach.Port.DEAD) {
             System.err.println(String.format(
                         "MachPort: port %d was never deallocated", name));
+            holders = 1;
             deallocate();
         }
     }
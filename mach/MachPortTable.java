@@ -0,0 +1,243 @@
+package org.gnu.mach;
+
+import java.util.Arrays;
+
+/**
+ * Compact table of port names.
+ *
+ * A {@link MachPortTable} plays the same role as a collection of
+ * {@link MachPort} objects, for servers which hold rights to a large
+ * number of ports, such as one per client. Instead of one object with its
+ * own monitor per port, the names, external reference counts and flags
+ * are stored in parallel arrays and the ports are designated by
+ * {@code int} handles, which keeps the heap usage down to a few bytes per
+ * port and gives the garbage collector nothing to scan.
+ *
+ * The operations are the same as those of {@link MachPort}, taking a
+ * handle as an extra argument, and have the same semantics. The whole
+ * table is protected by a single lock. {@link MachMsg} has overloads of
+ * its port operations which take a table and a handle.
+ *
+ * Handles are reused once their slot has been freed by {@link #clear} or
+ * {@link #deallocate}. Unlike {@link MachPort} objects, ports left in the
+ * table are not deallocated when it is collected.
+ */
+public class MachPortTable {
+    /** Handle value standing for {@link MachPort#NULL}. */
+    public static final int NONE = -1;
+
+    /* Flags */
+    private static final byte USED = 0x01;
+    private static final byte RECEIVE = 0x02;
+
+    /** Port names; for free slots, the index of the next free slot. */
+    private int[] names;
+    private int[] refCnts;
+    private byte[] flags;
+
+    private int freeList = NONE;
+    private int top;
+    private int count;
+
+    public MachPortTable(int initialCapacity) {
+        initialCapacity = Math.max(initialCapacity, 16);
+        names = new int[initialCapacity];
+        refCnts = new int[initialCapacity];
+        flags = new byte[initialCapacity];
+    }
+
+    public MachPortTable() {
+        this(1024);
+    }
+
+    private void check(int handle) {
+        if(handle < 0 || handle >= top || (flags[handle] & USED) == 0)
+            throw new IllegalArgumentException("invalid port handle "
+                                               + handle);
+    }
+
+    private int newSlot() {
+        int handle;
+        if(freeList != NONE) {
+            handle = freeList;
+            freeList = names[handle];
+        } else {
+            if(top == names.length) {
+                int capacity = 2 * names.length;
+                names = Arrays.copyOf(names, capacity);
+                refCnts = Arrays.copyOf(refCnts, capacity);
+                flags = Arrays.copyOf(flags, capacity);
+            }
+            handle = top++;
+        }
+        count++;
+        return handle;
+    }
+
+    private void freeSlot(int handle) {
+        flags[handle] = 0;
+        refCnts[handle] = 0;
+        names[handle] = freeList;
+        freeList = handle;
+        count--;
+    }
+
+    /**
+     * Add a port name to the table and return its handle. As with
+     * {@link MachPort#MachPort(int)}, this consumes one reference to
+     * {@code name}, which is released by {@link #deallocate}.
+     */
+    public synchronized int add(int name) throws Unsafe {
+        int handle = newSlot();
+        names[handle] = name;
+        flags[handle] = USED;
+        return handle;
+    }
+
+    /**
+     * Add a port name for which we hold the receive right. The port will
+     * be destroyed rather than deallocated by {@link #deallocate}.
+     */
+    public synchronized int addReceive(int name) throws Unsafe {
+        int handle = add(name);
+        flags[handle] |= RECEIVE;
+        return handle;
+    }
+
+    /**
+     * Allocate a new port right and add it to the table. Returns
+     * {@link #NONE} if the allocation failed.
+     */
+    public int allocate(MachPort.Right right) {
+        try {
+            int name = Mach.Port.allocate(Mach.taskSelf(), right.ordinal());
+            if(name == Mach.Port.NULL)
+                return NONE;
+            MsgObserver.reportPortAllocated(name, right.ordinal());
+            return (right == MachPort.Right.RECEIVE) ? addReceive(name)
+                                                     : add(name);
+        } catch(Unsafe e) {
+            return NONE;
+        }
+    }
+
+    /** Allocate a new receive right and add it to the table. */
+    public int allocate() {
+        return allocate(MachPort.Right.RECEIVE);
+    }
+
+    /** The number of ports in the table. */
+    public synchronized int size() {
+        return count;
+    }
+
+    /** Whether {@code handle} designates a port in the table. */
+    public synchronized boolean contains(int handle) {
+        return handle >= 0 && handle < top && (flags[handle] & USED) != 0;
+    }
+
+    /** Whether we hold the receive right for this port. */
+    public synchronized boolean isReceive(int handle) {
+        check(handle);
+        return (flags[handle] & RECEIVE) != 0;
+    }
+
+    /**
+     * Acquire the port name of an entry, as {@link MachPort#name}. Any
+     * deallocation will block until {@link #releaseName} is called.
+     */
+    public synchronized int name(int handle) throws Unsafe {
+        check(handle);
+        refCnts[handle]++;
+        return names[handle];
+    }
+
+    /** Release a port name acquired with {@link #name}. */
+    public synchronized void releaseName(int handle) throws Unsafe {
+        check(handle);
+        assert refCnts[handle] > 0;
+        if(--refCnts[handle] == 0)
+            notifyAll();
+    }
+
+    /**
+     * Remove an entry from the table and return its port name, as
+     * {@link MachPort#clear}: the caller takes over the corresponding
+     * port right. Blocks until all external references to the name have
+     * been released.
+     */
+    public synchronized int clear(int handle) throws Unsafe {
+        check(handle);
+        while(refCnts[handle] > 0) {
+            try {
+                wait();
+            } catch(InterruptedException exc) {
+                /* ignore */
+            }
+            check(handle);
+        }
+
+        int name = names[handle];
+        freeSlot(handle);
+        return name;
+    }
+
+    /**
+     * Deallocate the port right of an entry and remove it from the table.
+     * Receive rights are destroyed, as with {@link MachPort#destroy}.
+     */
+    public void deallocate(int handle) {
+        try {
+            boolean receive;
+            int name;
+            synchronized(this) {
+                receive = isReceive(handle);
+                name = clear(handle);
+            }
+            if(receive)
+                Mach.Port.modRefs(Mach.taskSelf(), name,
+                                  Mach.Port.RIGHT_RECEIVE, -1);
+            else
+                Mach.Port.deallocate(Mach.taskSelf(), name);
+            MsgObserver.reportPortDeallocated(name);
+        } catch(Unsafe e) {}
+    }
+
+    /**
+     * Deallocate all the ports in the table, with one batch operation for
+     * the receive rights and one for the others.
+     */
+    public void deallocateAll() {
+        int[] receive, send;
+        int nreceive = 0, nsend = 0;
+        try {
+            synchronized(this) {
+                int n = top;
+                receive = new int[n];
+                send = new int[n];
+                for(int handle = 0; handle < n; handle++) {
+                    if((flags[handle] & USED) == 0)
+                        continue;
+                    if((flags[handle] & RECEIVE) != 0)
+                        receive[nreceive++] = clear(handle);
+                    else
+                        send[nsend++] = clear(handle);
+                }
+            }
+
+            receive = Arrays.copyOf(receive, nreceive);
+            send = Arrays.copyOf(send, nsend);
+            int[] errors = new int[Math.max(nreceive, nsend)];
+            Mach.Port.modRefsN(Mach.taskSelf(), receive,
+                               Mach.Port.RIGHT_RECEIVE, -1, errors);
+            Mach.Port.deallocateN(Mach.taskSelf(), send, errors);
+        } catch(Unsafe e) {
+            return;
+        }
+
+        for(int name : receive)
+            MsgObserver.reportPortDeallocated(name);
+        for(int name : send)
+            MsgObserver.reportPortDeallocated(name);
+    }
+}
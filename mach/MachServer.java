@@ -0,0 +1,327 @@
+package org.gnu.mach;
+
+import java.nio.ByteBuffer;
+
+/**
+ * Server loop.
+ *
+ * A {@link MachServer} receives requests on a port, usually a port set,
+ * passes them to a {@link Demuxer} and sends back the replies, in the same
+ * way as {@code mach_msg_server()} does in C. The reply to each request is
+ * sent by the same {@code mach_msg()} call which receives the next one.
+ *
+ * Several threads can run the same server loop; each one uses its own
+ * pair of message buffers. Requests are reported to {@link MsgObserver}s
+ * as they are handled.
+ *
+ * The buffers can be taken from a {@link MachMsgArena}, typically a wired
+ * one for servers which need stable latencies. Threads which find the
+ * arena exhausted fall back to ordinary buffers.
+ *
+ * An {@link AdmissionController} can be installed to reject requests
+ * with an early error reply while the server is overloaded.
+ *
+ * A runtime exception thrown by the demuxer is reported on the standard
+ * error stream and answered with an error reply (see
+ * {@link #setFailureCode}) instead of stopping the server loop.
+ */
+public class MachServer implements Runnable {
+    /**
+     * Request handler.
+     */
+    public static interface Demuxer {
+        /**
+         * Handle a request.
+         *
+         * The request has been flipped and is positioned after its header.
+         * The reply has been cleared and its {@code msgh_id} set; it will
+         * be sent to the request's reply port, if there is one, once this
+         * method returns. Following the MIG conventions, the handler should
+         * append the return code and, if it is zero, the results. A
+         * handler can instead pass the request on to another server with
+         * {@link MachMsg#forward}, in which case no reply is sent, unless
+         * the forward failed with the request still holding its reply
+         * port: the handler then appends an error code to the reply.
+         * A handler which can't answer at once can also take the reply
+         * port with {@link MachMsg#takeReplyPort} and send the reply
+         * later, from another thread; no reply is sent here then.
+         *
+         * @param port      The name of the receive right the request
+         *                  arrived on. It carries no reference and is
+         *                  only meant to look up the object the request
+         *                  is addressed to.
+         * @return {@code false} if the request's {@code msgh_id} is not
+         *         recognized, in which case a {@link Mach#MIG_BAD_ID}
+         *         reply is sent instead.
+         */
+        boolean demux(int port, MachMsg request, MachMsg reply)
+            throws TypeCheckException;
+    }
+
+    /** Timeout used to notice {@link #stop} requests, in milliseconds. */
+    private static final long POLL_TIMEOUT = 1000;
+
+    private final MachPort port;
+    private final Demuxer demuxer;
+    private final int bufferSize;
+    private final MachMsgArena arena;
+    private volatile AdmissionController admission;
+    private volatile int failureCode = Mach.MIG_REMOTE_ERROR;
+    private volatile boolean running = true;
+
+    /**
+     * Create a server loop.
+     *
+     * @param port          The port or port set to receive requests on.
+     * @param demuxer       The request handler.
+     * @param bufferSize    The size of the request and reply buffers.
+     */
+    public MachServer(MachPort port, Demuxer demuxer, int bufferSize) {
+        this.port = port;
+        this.demuxer = demuxer;
+        this.bufferSize = bufferSize;
+        this.arena = null;
+    }
+
+    /**
+     * Create a server loop using buffers from an arena. Each thread
+     * running it holds two slots.
+     *
+     * @param port          The port or port set to receive requests on.
+     * @param demuxer       The request handler.
+     * @param arena         Where to take the request and reply buffers.
+     */
+    public MachServer(MachPort port, Demuxer demuxer, MachMsgArena arena) {
+        this.port = port;
+        this.demuxer = demuxer;
+        this.bufferSize = arena.slotSize();
+        this.arena = arena;
+    }
+
+    /** The port or port set this server receives requests on. */
+    public MachPort port() {
+        return port;
+    }
+
+    /**
+     * Install an admission controller, or remove it if {@code admission}
+     * is {@code null}.
+     */
+    public void setAdmissionController(AdmissionController admission) {
+        this.admission = admission;
+    }
+
+    /**
+     * Set the return code sent back when the demuxer throws a
+     * {@link RuntimeException}, {@link Mach#MIG_REMOTE_ERROR} by default.
+     * Servers of the Hurd interfaces would typically use {@code EIO}.
+     */
+    public void setFailureCode(int code) {
+        this.failureCode = code;
+    }
+
+    /**
+     * Ask the server loop to stop. Threads running {@link #run} return
+     * after they have handled their current request, or within about a
+     * second if they are waiting for one.
+     */
+    public void stop() {
+        running = false;
+    }
+
+    /**
+     * Number of messages queued on a receive right, or -1 if it cannot be
+     * determined (for instance, for a port set).
+     */
+    public static int queueDepth(MachPort port) {
+        int[] status = new int[Mach.Port.STATUS_MAX];
+        try {
+            int name = port.name();
+            try {
+                if(Mach.Port.getReceiveStatus(Mach.taskSelf(), name, status)
+                        != 0)
+                    return -1;
+            } finally {
+                port.releaseName();
+            }
+        } catch(Unsafe exc) {}
+        return status[Mach.Port.STATUS_MSGCOUNT];
+    }
+
+    /**
+     * Clear a message whose header rights have already been consumed by
+     * the kernel, without deallocating their now stale names.
+     */
+    private static void forget(MachMsg msg) throws Unsafe {
+        ByteBuffer buf = msg.buf();
+        buf.putInt(8, Mach.Port.NULL);
+        buf.putInt(12, Mach.Port.NULL);
+        msg.clear();
+    }
+
+    /** Replace the contents of a reply with a bare return code. */
+    private static void errorReply(MachMsg reply, int id, int ret) {
+        reply.clear();
+        reply.setId(id + 100);
+        reply.putInt(ret);
+    }
+
+    /** Read back the return code of a reply built by a demuxer. */
+    private static int retCode(MachMsg reply) {
+        try {
+            ByteBuffer buf = reply.buf();
+            return (buf.position() >= 32) ? buf.getInt(28) : 0;
+        } catch(Unsafe exc) {
+            return 0;
+        }
+    }
+
+    /**
+     * Handle the request received in {@code request} and prepare the
+     * reply. Returns {@code true} if there is a reply to send.
+     */
+    private boolean handle(MachMsg request, MachMsg reply) throws Unsafe {
+        request.flip();
+
+        ByteBuffer buf = request.buf();
+        int id = buf.getInt(20);
+        int local = buf.getInt(12);
+
+        /* Notifications and other one-way messages can't be answered
+         * with an error, so they are never shed. */
+        boolean sheddable = buf.getInt(8) != Mach.Port.NULL
+            && (id < Mach.NOTIFY_FIRST || id > Mach.NOTIFY_LAST);
+
+        /* The local port field names our receive right and carries no
+         * reference, so make sure clear() won't try to deallocate it. */
+        buf.putInt(12, Mach.Port.NULL);
+
+        reply.clear();
+        reply.setId(id + 100);
+
+        MsgObserver.reportRequestStarting(id, local);
+        AdmissionController admission = this.admission;
+        long start = System.nanoTime();
+        if(admission != null && sheddable && !admission.admit(local))
+            admission.putReply(reply);
+        else {
+            try {
+                if(!demuxer.demux(local, request, reply))
+                    errorReply(reply, id, Mach.MIG_BAD_ID);
+            } catch(TypeCheckException exc) {
+                errorReply(reply, id, Mach.MIG_TYPE_ERROR);
+            } catch(RuntimeException exc) {
+                /* A bug in one handler shouldn't take the server down. */
+                exc.printStackTrace();
+                errorReply(reply, id, failureCode);
+            }
+            if(admission != null)
+                admission.completed(System.nanoTime() - start);
+        }
+        long end = System.nanoTime();
+        MsgObserver.reportDispatch(id, local, start, end, retCode(reply));
+
+        /* This is zero if the request has been forwarded. */
+        int remoteBits = buf.getInt(0) & 0xff;
+        MachMsgType replyType = null;
+        if(remoteBits == MachMsgType.PORT_SEND_ONCE.name())
+            replyType = MachMsgType.MOVE_SEND_ONCE;
+        else if(remoteBits == MachMsgType.PORT_SEND.name())
+            replyType = MachMsgType.MOVE_SEND;
+
+        if(replyType == null) {
+            request.clear();
+            return false;
+        }
+
+        MachPort replyPort = null;
+        try {
+            replyPort = request.getRemotePort(replyType);
+        } catch(TypeCheckException exc) {
+            assert false;
+        }
+        request.clear();
+        if(replyPort == MachPort.NULL)
+            return false;
+        reply.setRemotePort(replyPort, replyType);
+        return true;
+    }
+
+    /**
+     * Run the server loop until {@link #stop} is called.
+     */
+    public void run() {
+        int[] slots = { MachMsgArena.NONE, MachMsgArena.NONE };
+        if(arena != null) {
+            slots[0] = arena.acquire();
+            slots[1] = arena.acquire();
+        }
+        try {
+            run(buffer(slots[0]), buffer(slots[1]));
+        } finally {
+            for(int slot : slots)
+                if(slot != MachMsgArena.NONE)
+                    arena.release(slot);
+        }
+    }
+
+    private MachMsg buffer(int slot) {
+        return (slot != MachMsgArena.NONE) ? arena.get(slot)
+                                           : new MachMsg(bufferSize);
+    }
+
+    private void run(MachMsg request, MachMsg reply) {
+        boolean haveReply = false;
+
+        try {
+            int rcvName = port.name();
+            try {
+                while(running) {
+                    /* Send the previous reply, if any, and receive the next
+                     * request into the same buffer. */
+                    MachMsg msg = haveReply ? reply : request;
+                    int option = Mach.RCV_MSG | Mach.RCV_TIMEOUT;
+                    if(haveReply)
+                        option |= Mach.SEND_MSG;
+
+                    int err = Mach.msg(msg.buf(), option, rcvName,
+                                       POLL_TIMEOUT, Mach.Port.NULL);
+                    haveReply = false;
+
+                    if(msg == reply) {
+                        reply = request;
+                        request = msg;
+                    }
+
+                    if(err != Mach.MSG_SUCCESS) {
+                        if(Mach.isSendError(err))
+                            /* Drop the rights of a reply we couldn't
+                             * send. */
+                            request.clear();
+                        else if((option & Mach.SEND_MSG) != 0)
+                            /* The reply was sent, and its rights with it,
+                             * but nothing was received over it. */
+                            forget(request);
+                        continue;
+                    }
+
+                    haveReply = handle(request, reply);
+                }
+
+                /* Don't leave the last client hanging. */
+                if(haveReply) {
+                    int err = Mach.msg(reply.buf(), Mach.SEND_MSG,
+                                       Mach.Port.NULL, Mach.MSG_TIMEOUT_NONE,
+                                       Mach.Port.NULL);
+                    if(err == Mach.MSG_SUCCESS)
+                        forget(reply);
+                }
+            } finally {
+                port.releaseName();
+            }
+        } catch(Unsafe exc) {}
+
+        request.clear();
+        reply.clear();
+    }
+}
@@ -0,0 +1,331 @@
+package org.gnu.mach;
+
+import java.io.File;
+import java.io.IOException;
+import java.io.RandomAccessFile;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.MappedByteBuffer;
+import java.nio.channels.FileChannel;
+import java.util.concurrent.atomic.AtomicInteger;
+import java.util.concurrent.atomic.AtomicLong;
+
+/**
+ * Binary capture of IPC traffic.
+ *
+ * While a capture is running, every message sent or received through
+ * {@link Mach#msg} is appended to a memory-mapped file together with a
+ * timestamp, the calling thread, the {@code mach_msg()} options and its
+ * return code. Captures can be read back with {@link Reader}, for instance
+ * to replay production traffic offline.
+ *
+ * <h3>File format</h3>
+ *
+ * All values are in native byte order. The file starts with a
+ * {@link #HEADER_SIZE}-byte header:
+ * <pre>
+ *   0  long   MAGIC
+ *   8  int    VERSION
+ *  12  int    capacity of the index, in entries
+ *  16  long   capacity of the data area, in bytes
+ *  24  long   System.currentTimeMillis() when the capture was started
+ *  32  int    number of records (written when the capture is closed)
+ *  36  int    number of records dropped because the file was full
+ * </pre>
+ * It is followed by the index, an array of {@code long} entries each giving
+ * the offset of a record in the data area plus one (zero marks an unused
+ * entry), in the order the records were started. Entries are filled out
+ * of order and a dropped record leaves its entry unused, so readers skip
+ * unused entries rather than stopping at them. The data area follows,
+ * where each record is 8-bytes aligned and laid out as:
+ * <pre>
+ *   0  int    length of the record without padding, zero if incomplete
+ *   4  int    DIR_SEND or DIR_RECEIVE
+ *   8  long   nanoseconds since the capture was started
+ *  16  long   thread ID
+ *  24  int    mach_msg() options
+ *  28  int    mach_msg() return code
+ *  32         raw message, as sent or received
+ * </pre>
+ *
+ * <h3>Concurrency</h3>
+ *
+ * Space for each record is reserved with an atomic increment and the
+ * record is then filled in without any lock; its length is written last to
+ * mark it complete. When the file is full, further records are dropped
+ * and counted.
+ */
+public final class MsgCapture extends MsgObserver {
+    public static final long MAGIC = 0x48757264436170L;    /* "HurdCap" */
+    public static final int VERSION = 1;
+    public static final int HEADER_SIZE = 64;
+    public static final int RECORD_HEADER_SIZE = 32;
+
+    public static final int DIR_SEND = 1;
+    public static final int DIR_RECEIVE = 2;
+
+    private final RandomAccessFile file;
+    private final MappedByteBuffer map;
+    private final int indexCapacity;
+    private final long dataStart;
+    private final long dataCapacity;
+    private final long startNanos;
+
+    private final AtomicInteger nextIndex = new AtomicInteger();
+    private final AtomicLong nextData = new AtomicLong();
+    private final AtomicInteger dropped = new AtomicInteger();
+
+    /* Position and size of the send record started by msgStarting(), to
+     * be completed by msgCompleted() once the return code is known. */
+    private final ThreadLocal<long[]> pending = new ThreadLocal<long[]>() {
+        @Override
+        protected long[] initialValue() {
+            return new long[] { -1, 0 };
+        }
+    };
+
+    private MsgCapture(File path, int indexCapacity, long dataCapacity)
+        throws IOException
+    {
+        this.indexCapacity = indexCapacity;
+        this.dataCapacity = dataCapacity;
+        dataStart = HEADER_SIZE + 8L * indexCapacity;
+
+        long size = dataStart + dataCapacity;
+        if(size > Integer.MAX_VALUE)
+            throw new IllegalArgumentException("capture file too large");
+
+        file = new RandomAccessFile(path, "rw");
+        file.setLength(0);
+        file.setLength(size);
+        map = file.getChannel().map(FileChannel.MapMode.READ_WRITE, 0, size);
+        map.order(ByteOrder.nativeOrder());
+
+        map.putLong(0, MAGIC);
+        map.putInt(8, VERSION);
+        map.putInt(12, indexCapacity);
+        map.putLong(16, dataCapacity);
+        map.putLong(24, System.currentTimeMillis());
+        startNanos = System.nanoTime();
+    }
+
+    /**
+     * Create the given capture file and start recording all the messages
+     * sent and received by this process into it.
+     *
+     * @param path          The file to write.
+     * @param indexCapacity Maximum number of records.
+     * @param dataCapacity  Maximum total size of the records.
+     */
+    public static MsgCapture start(File path, int indexCapacity,
+                                   long dataCapacity)
+        throws IOException
+    {
+        MsgCapture capture = new MsgCapture(path, indexCapacity, dataCapacity);
+        MsgObserver.add(capture);
+        return capture;
+    }
+
+    /** Stop recording, and finalize and close the capture file. */
+    public void close() throws IOException {
+        MsgObserver.remove(this);
+
+        map.putInt(32, Math.min(nextIndex.get(), indexCapacity));
+        map.putInt(36, dropped.get());
+        map.force();
+        file.close();
+    }
+
+    /** Number of records dropped so far because the file was full. */
+    public int dropped() {
+        return dropped.get();
+    }
+
+    /**
+     * Reserve space for a record and fill in everything but its length and
+     * return code. Returns the record's absolute offset, or -1 if the file
+     * is full.
+     */
+    private long begin(int dir, int option, ByteBuffer msg, int size) {
+        /* Take an index entry first, so that no data space is reserved
+         * for a record which could never be found. */
+        int index = nextIndex.getAndIncrement();
+        if(index >= indexCapacity) {
+            dropped.incrementAndGet();
+            return -1;
+        }
+        int length = (RECORD_HEADER_SIZE + size + 7) & ~7;
+        long offset = nextData.getAndAdd(length);
+        if(offset + length > dataCapacity) {
+            /* The index entry stays zero, and is skipped by readers. */
+            dropped.incrementAndGet();
+            return -1;
+        }
+
+        int pos = (int) (dataStart + offset);
+        map.putInt(pos + 4, dir);
+        map.putLong(pos + 8, System.nanoTime() - startNanos);
+        map.putLong(pos + 16, Thread.currentThread().getId());
+        map.putInt(pos + 24, option);
+
+        ByteBuffer src = msg.duplicate();
+        src.clear();
+        src.limit(size);
+        ByteBuffer dst = map.duplicate();
+        dst.position(pos + RECORD_HEADER_SIZE);
+        dst.put(src);
+
+        map.putLong(HEADER_SIZE + 8 * index, offset + 1);
+        return pos;
+    }
+
+    /* Complete a record started with begin(). */
+    private void commit(long pos, int size, int ret) {
+        map.putInt((int) pos + 28, ret);
+        map.putInt((int) pos, RECORD_HEADER_SIZE + size);
+    }
+
+    @Override
+    public void msgStarting(ByteBuffer msg, int option) {
+        if((option & Mach.SEND_MSG) != 0) {
+            long[] p = pending.get();
+            p[1] = msg.position();
+            p[0] = begin(DIR_SEND, option, msg, (int) p[1]);
+        }
+    }
+
+    @Override
+    public void msgCompleted(ByteBuffer msg, int option, int sendBits,
+                             int sendId, int sendPort, int sendSize,
+                             int rcvName, long timeout, int ret, long start,
+                             long end)
+    {
+        long[] p = pending.get();
+        if(p[0] >= 0) {
+            commit(p[0], (int) p[1], ret);
+            p[0] = -1;
+        }
+
+        if(ret == 0 && (option & Mach.RCV_MSG) != 0) {
+            int size = msg.getInt(4);
+            long pos = begin(DIR_RECEIVE, option, msg, size);
+            if(pos >= 0)
+                commit(pos, size, ret);
+        }
+    }
+
+    /**
+     * A record read from a capture file.
+     */
+    public static class Record {
+        private final int dir;
+        private final long nanos;
+        private final long thread;
+        private final int option;
+        private final int ret;
+        private final byte[] data;
+
+        Record(int dir, long nanos, long thread, int option, int ret,
+               byte[] data)
+        {
+            this.dir = dir;
+            this.nanos = nanos;
+            this.thread = thread;
+            this.option = option;
+            this.ret = ret;
+            this.data = data;
+        }
+
+        /** {@link #DIR_SEND} or {@link #DIR_RECEIVE}. */
+        public int dir() { return dir; }
+
+        /** Nanoseconds since the start of the capture. */
+        public long nanos() { return nanos; }
+
+        public long thread() { return thread; }
+        public int option() { return option; }
+        public int ret() { return ret; }
+
+        /** The raw message. */
+        public byte[] data() { return data; }
+
+        /** The message's {@code msgh_id}. */
+        public int id() {
+            return ByteBuffer.wrap(data).order(ByteOrder.nativeOrder())
+                             .getInt(20);
+        }
+    }
+
+    /**
+     * Sequential reader for capture files.
+     */
+    public static class Reader {
+        private final RandomAccessFile file;
+        private final MappedByteBuffer map;
+        private final int count;
+        private final long dataStart;
+        private final long startMillis;
+        private int next;
+
+        public Reader(File path) throws IOException {
+            file = new RandomAccessFile(path, "r");
+            map = file.getChannel().map(FileChannel.MapMode.READ_ONLY, 0,
+                                        file.length());
+            map.order(ByteOrder.nativeOrder());
+
+            if(map.getLong(0) != MAGIC || map.getInt(8) != VERSION)
+                throw new IOException("not a capture file: " + path);
+
+            int indexCapacity = map.getInt(12);
+            dataStart = HEADER_SIZE + 8L * indexCapacity;
+            startMillis = map.getLong(24);
+
+            /* If the capture was not closed cleanly, read the whole index:
+             * the entries are filled out of order, so there may be records
+             * past the first unused one. */
+            int n = map.getInt(32);
+            count = (n != 0) ? n : indexCapacity;
+        }
+
+        /** {@link System#currentTimeMillis} when the capture started. */
+        public long startMillis() {
+            return startMillis;
+        }
+
+        /** Number of records dropped during the capture. */
+        public int dropped() {
+            return map.getInt(36);
+        }
+
+        /**
+         * Return the next complete record, or {@code null} at the end of
+         * the capture.
+         */
+        public Record next() {
+            while(next < count) {
+                long entry = map.getLong(HEADER_SIZE + 8 * next++);
+                if(entry == 0)
+                    continue;
+
+                int pos = (int) (dataStart + entry - 1);
+                int length = map.getInt(pos);
+                if(length == 0)
+                    continue;
+
+                byte[] data = new byte[length - RECORD_HEADER_SIZE];
+                ByteBuffer src = map.duplicate();
+                src.position(pos + RECORD_HEADER_SIZE);
+                src.get(data);
+
+                return new Record(map.getInt(pos + 4), map.getLong(pos + 8),
+                                  map.getLong(pos + 16), map.getInt(pos + 24),
+                                  map.getInt(pos + 28), data);
+            }
+            return null;
+        }
+
+        public void close() throws IOException {
+            file.close();
+        }
+    }
+}
@@ -0,0 +1,135 @@
+package org.gnu.mach;
+
+import java.util.Map;
+import java.util.HashMap;
+import java.util.concurrent.ConcurrentHashMap;
+import java.util.concurrent.atomic.AtomicLong;
+import java.util.concurrent.atomic.AtomicLongArray;
+
+/**
+ * Striped IPC counters for a single key.
+ *
+ * The key is either a {@code msgh_id} value or a port name, depending on
+ * the {@link MsgStats} table the counters belong to. Most keys are only
+ * ever used by one thread at a time, so the counters start with a single
+ * stripe of cells. When an update finds another thread updating the same
+ * stripe, the number of stripes is doubled, up to a limit set by the
+ * number of processors, and each thread then only updates the stripe
+ * selected by its thread ID, as with {@code LongAdder}. Stripes are only
+ * summed up when a snapshot is taken.
+ */
+final class MsgCounters {
+    /* Layout of the cells for each stripe. */
+    private static final int CALLS = 0;
+    private static final int ERRORS = 1;
+    private static final int BYTES_SENT = 2;
+    private static final int BYTES_RECEIVED = 3;
+    private static final int NANOS = 4;
+    private static final int HISTOGRAM = 5;
+
+    /**
+     * Number of latency histogram buckets. Bucket {@code i} counts calls
+     * which took between 2<sup>i-1</sup> and 2<sup>i</sup> nanoseconds, and
+     * the last bucket collects anything longer.
+     */
+    static final int BUCKETS = 32;
+
+    private static final int CELLS = HISTOGRAM + BUCKETS;
+    private static final int MAX_STRIPES;
+    static {
+        int cpus = Runtime.getRuntime().availableProcessors();
+        MAX_STRIPES = Math.min(16, Integer.highestOneBit(2 * cpus - 1));
+    }
+
+    private final int key;
+
+    /* Each stripe is a separate array, so that growing the table keeps
+     * the existing stripes, and the updates made to them, in place. */
+    private volatile AtomicLongArray[] stripes;
+
+    /* Errors are rare enough that we don't bother striping them. */
+    private final ConcurrentHashMap<Integer, AtomicLong> errorCodes;
+
+    MsgCounters(int key) {
+        this.key = key;
+        stripes = new AtomicLongArray[] { new AtomicLongArray(CELLS) };
+        errorCodes = new ConcurrentHashMap<Integer, AtomicLong>();
+    }
+
+    /** Double the number of stripes, after contention on one of them. */
+    private synchronized void grow(int seen) {
+        AtomicLongArray[] current = stripes;
+        if(current.length != seen || seen >= MAX_STRIPES)
+            return;
+
+        AtomicLongArray[] bigger = new AtomicLongArray[2 * seen];
+        System.arraycopy(current, 0, bigger, 0, seen);
+        for(int i = seen; i < bigger.length; i++)
+            bigger[i] = new AtomicLongArray(CELLS);
+        stripes = bigger;
+    }
+
+    int key() {
+        return key;
+    }
+
+    /** Record one call. */
+    void record(long nanos, int bytesSent, int bytesReceived, int ret) {
+        AtomicLongArray[] current = stripes;
+        int n = current.length;
+        AtomicLongArray cells =
+            current[(int) Thread.currentThread().getId() & (n - 1)];
+        int bucket = Math.min(BUCKETS - 1,
+                              64 - Long.numberOfLeadingZeros(nanos));
+
+        /* A failed compare-and-set means another thread is updating the
+         * same stripe at the same time. */
+        long calls = cells.get(CALLS);
+        if(!cells.compareAndSet(CALLS, calls, calls + 1)) {
+            cells.incrementAndGet(CALLS);
+            if(n < MAX_STRIPES)
+                grow(n);
+        }
+        cells.addAndGet(BYTES_SENT, bytesSent);
+        cells.addAndGet(BYTES_RECEIVED, bytesReceived);
+        cells.addAndGet(NANOS, nanos);
+        cells.incrementAndGet(HISTOGRAM + bucket);
+
+        if(ret != 0) {
+            cells.incrementAndGet(ERRORS);
+
+            AtomicLong count = errorCodes.get(ret);
+            if(count == null) {
+                AtomicLong fresh = new AtomicLong();
+                count = errorCodes.putIfAbsent(ret, fresh);
+                if(count == null)
+                    count = fresh;
+            }
+            count.incrementAndGet();
+        }
+    }
+
+    private static long sum(AtomicLongArray[] current, int field) {
+        long total = 0;
+        for(AtomicLongArray cells : current)
+            total += cells.get(field);
+        return total;
+    }
+
+    /** Take a consistent-enough snapshot of these counters. */
+    MsgStatsMXBean.Entry snapshot() {
+        AtomicLongArray[] current = stripes;
+        long[] histogram = new long[BUCKETS];
+        for(int i = 0; i < BUCKETS; i++)
+            histogram[i] = sum(current, HISTOGRAM + i);
+
+        Map<Integer, Long> errors = new HashMap<Integer, Long>();
+        for(Map.Entry<Integer, AtomicLong> e : errorCodes.entrySet())
+            errors.put(e.getKey(), e.getValue().get());
+
+        return new MsgStatsMXBean.Entry(key, sum(current, CALLS),
+                sum(current, ERRORS), sum(current, BYTES_SENT),
+                sum(current, BYTES_RECEIVED), sum(current, NANOS),
+                histogram, errors);
+    }
+}
@@ -0,0 +1,177 @@
+package org.gnu.mach;
+
+import java.nio.ByteBuffer;
+
+/**
+ * Observer of IPC activity.
+ *
+ * Observers registered with {@link #add} are notified of each
+ * {@link Mach#msg} call, of port allocations and deallocations made
+ * through {@link MachPort}, and of the requests handled by server loops.
+ * They are invoked synchronously by the thread doing the work, so they
+ * should return quickly and must not throw.
+ *
+ * The default implementation of each method does nothing, so that
+ * subclasses only need to override the events they're interested in.
+ */
+public abstract class MsgObserver {
+    /**
+     * Registered observers, or {@code null} if there are none so that
+     * the fast path is a single volatile read. The array is replaced as a
+     * whole when observers are added or removed.
+     */
+    static volatile MsgObserver[] observers;
+
+    /** Register an observer. */
+    public static synchronized void add(MsgObserver observer) {
+        MsgObserver[] old = observers;
+        int n = (old != null) ? old.length : 0;
+        MsgObserver[] list = new MsgObserver[n + 1];
+        if(old != null)
+            System.arraycopy(old, 0, list, 0, n);
+        list[n] = observer;
+        observers = list;
+    }
+
+    /** Unregister an observer. */
+    public static synchronized void remove(MsgObserver observer) {
+        MsgObserver[] old = observers;
+        if(old == null)
+            return;
+
+        int n = 0;
+        MsgObserver[] list = new MsgObserver[old.length];
+        for(MsgObserver o : old)
+            if(o != observer)
+                list[n++] = o;
+
+        if(n == 0) {
+            observers = null;
+        } else {
+            MsgObserver[] trimmed = new MsgObserver[n];
+            System.arraycopy(list, 0, trimmed, 0, n);
+            observers = trimmed;
+        }
+    }
+
+    /**
+     * Called before {@link Mach#msg} enters the kernel. When sending, the
+     * message to be sent is between the start of the buffer and its
+     * current position.
+     */
+    public void msgStarting(ByteBuffer msg, int option) {}
+
+    /**
+     * Called after {@link Mach#msg} returns.
+     *
+     * @param msg       The message buffer. If a message was received
+     *                  ({@code ret} is zero and {@code option} includes
+     *                  {@link Mach#RCV_MSG}), it holds the new message.
+     * @param option    Options passed to {@link Mach#msg}.
+     * @param sendBits  The {@code msgh_bits} of the message sent, if any,
+     *                  from which requests ({@code MAKE_SEND_ONCE} local
+     *                  disposition) can be told from replies
+     *                  ({@code MOVE_SEND_ONCE} remote disposition).
+     * @param sendId    The {@code msgh_id} of the message sent, if any.
+     * @param sendPort  The destination port name of the message sent.
+     * @param sendSize  The size of the message sent.
+     * @param rcvName   The port name received from.
+     * @param timeout   The timeout passed to {@link Mach#msg}.
+     * @param ret       The return code of {@code mach_msg()}.
+     * @param start     {@link System#nanoTime} before the call.
+     * @param end       {@link System#nanoTime} after the call.
+     */
+    public void msgCompleted(ByteBuffer msg, int option, int sendBits,
+                             int sendId, int sendPort, int sendSize,
+                             int rcvName, long timeout, int ret, long start,
+                             long end) {}
+
+    /** Called when a port right is allocated through {@link MachPort}. */
+    public void portAllocated(int name, int right) {}
+
+    /** Called when a port name is deallocated through {@link MachPort}. */
+    public void portDeallocated(int name) {}
+
+    /**
+     * Called by server loops before handling a request.
+     *
+     * @param id        The request's {@code msgh_id}.
+     * @param port      The port name the request was received on.
+     */
+    public void requestStarting(int id, int port) {}
+
+    /**
+     * Called by server loops after handling a request.
+     *
+     * @param id        The request's {@code msgh_id}.
+     * @param port      The port name the request was received on.
+     * @param start     {@link System#nanoTime} before the handler ran.
+     * @param end       {@link System#nanoTime} after the handler ran.
+     * @param ret       The return code sent back to the client.
+     */
+    public void requestDispatched(int id, int port, long start, long end,
+                                  int ret) {}
+
+    /* Notification helpers. */
+
+    /** Instrumented version of {@link Mach#msg}. */
+    static int msg(MsgObserver[] list, ByteBuffer buf, int option,
+                   int rcvName, long timeout, int notify)
+        throws Unsafe
+    {
+        boolean send = (option & Mach.SEND_MSG) != 0;
+        int bits = send ? buf.getInt(0) : 0;
+        int id = send ? buf.getInt(20) : 0;
+        int port = send ? buf.getInt(8) : Mach.Port.NULL;
+        int size = send ? buf.position() : 0;
+
+        for(MsgObserver o : list)
+            o.msgStarting(buf, option);
+
+        long start = System.nanoTime();
+        int ret = Mach.backend.msg(buf, option, rcvName, timeout, notify);
+        long end = System.nanoTime();
+
+        for(MsgObserver o : list)
+            o.msgCompleted(buf, option, bits, id, port, size, rcvName,
+                           timeout, ret, start, end);
+        return ret;
+    }
+
+    static void reportPortAllocated(int name, int right) {
+        MsgObserver[] list = observers;
+        if(list != null)
+            for(MsgObserver o : list)
+                o.portAllocated(name, right);
+    }
+
+    static void reportPortDeallocated(int name) {
+        MsgObserver[] list = observers;
+        if(list != null)
+            for(MsgObserver o : list)
+                o.portDeallocated(name);
+    }
+
+    /**
+     * Report that a server loop is about to handle a request to all the
+     * registered observers. See {@link #requestStarting}.
+     */
+    public static void reportRequestStarting(int id, int port) {
+        MsgObserver[] list = observers;
+        if(list != null)
+            for(MsgObserver o : list)
+                o.requestStarting(id, port);
+    }
+
+    /**
+     * Report a request handled by a server loop to all the registered
+     * observers. See {@link #requestDispatched}.
+     */
+    public static void reportDispatch(int id, int port, long start, long end,
+                                      int ret) {
+        MsgObserver[] list = observers;
+        if(list != null)
+            for(MsgObserver o : list)
+                o.requestDispatched(id, port, start, end, ret);
+    }
+}
@@ -0,0 +1,208 @@
+package org.gnu.mach;
+
+import java.lang.management.ManagementFactory;
+import java.nio.ByteBuffer;
+import java.util.List;
+import java.util.ArrayList;
+import java.util.concurrent.atomic.AtomicReferenceArray;
+import javax.management.JMException;
+import javax.management.ObjectName;
+
+/**
+ * Optional IPC statistics.
+ *
+ * When enabled, each {@link Mach#msg} call records its latency, the number
+ * of bytes sent and received and its return code, both under the
+ * {@code msgh_id} of the message and under the destination port of the
+ * request sent. Receives, including the calls in which a server loop sends
+ * a reply and waits for the next request, are recorded under the request
+ * received and the port it came in on. Replies are not recorded by port,
+ * since their destination is a different reply port for each call.
+ * Requests handled by server loops
+ * are recorded under their {@code msgh_id} as they are reported through
+ * {@link MsgObserver#reportDispatch}.
+ *
+ * The statistics are published as the {@code org.gnu.mach:type=MsgStats}
+ * MXBean. They are disabled by default, and can be enabled with
+ * {@link #enable} or by setting the {@code org.gnu.mach.stats} system
+ * property. Recording never takes a lock: see {@link MsgCounters}.
+ */
+public final class MsgStats extends MsgObserver implements MsgStatsMXBean {
+    /** Number of keys each table can hold before using the overflow. */
+    private static final int TABLE_SIZE = 4096;
+
+    private static final MsgStats instance = new MsgStats();
+    private static boolean registered;
+    private static volatile boolean enabled;
+
+    /**
+     * Lock-free, open-addressed table of counters. Entries are never
+     * removed; {@link MsgStats#reset} replaces whole tables instead.
+     */
+    private static final class Table {
+        private final AtomicReferenceArray<MsgCounters> slots =
+            new AtomicReferenceArray<MsgCounters>(TABLE_SIZE);
+        private final MsgCounters overflow;
+
+        Table(MsgCounters overflow) {
+            this.overflow = overflow;
+        }
+
+        MsgCounters get(int key) {
+            int mask = TABLE_SIZE - 1;
+            int i = (key * 0x9e3779b9) >>> 20 & mask;
+
+            for(int n = 0; n < TABLE_SIZE; n++, i = (i + 1) & mask) {
+                MsgCounters c = slots.get(i);
+                if(c == null) {
+                    c = new MsgCounters(key);
+                    if(slots.compareAndSet(i, null, c))
+                        return c;
+                    c = slots.get(i);
+                }
+                if(c.key() == key)
+                    return c;
+            }
+            return overflow;
+        }
+
+        List<Entry> snapshot() {
+            List<Entry> entries = new ArrayList<Entry>();
+            for(int i = 0; i < TABLE_SIZE; i++) {
+                MsgCounters c = slots.get(i);
+                if(c != null)
+                    entries.add(c.snapshot());
+            }
+            return entries;
+        }
+    }
+
+    private volatile MsgCounters overflow;
+    private volatile Table ids, ports, dispatchIds;
+
+    private MsgStats() {
+        reset();
+    }
+
+    /**
+     * Start recording statistics, and register the MXBean with the
+     * platform MBean server if it's not been done yet.
+     */
+    public static synchronized void enable() {
+        if(!registered) {
+            try {
+                ManagementFactory.getPlatformMBeanServer().registerMBean(
+                        instance, new ObjectName("org.gnu.mach:type=MsgStats"));
+            } catch(JMException exc) {
+                System.err.println("MsgStats: " + exc);
+            }
+            registered = true;
+        }
+        if(!enabled) {
+            MsgObserver.add(instance);
+            enabled = true;
+        }
+    }
+
+    /** Stop recording statistics. */
+    public static synchronized void disable() {
+        if(enabled) {
+            MsgObserver.remove(instance);
+            enabled = false;
+        }
+    }
+
+    /** Return the MXBean instance. */
+    public static MsgStatsMXBean get() {
+        return instance;
+    }
+
+    /* MsgObserver implementation */
+
+    /**
+     * Whether a message sent with the given {@code msgh_bits} is a request
+     * expecting a reply, rather than a reply or a one-way message.
+     */
+    static boolean isRequest(int bits) {
+        return ((bits >> 8) & 0xff) == MachMsgType.MAKE_SEND_ONCE.name();
+    }
+
+    @Override
+    public void msgCompleted(ByteBuffer msg, int option, int sendBits,
+                             int sendId, int sendPort, int sendSize,
+                             int rcvName, long timeout, int ret, long start,
+                             long end)
+    {
+        boolean send = (option & Mach.SEND_MSG) != 0;
+        boolean rcv = (option & Mach.RCV_MSG) != 0;
+        int id, port = Mach.Port.NULL;
+
+        if(send && (!rcv || isRequest(sendBits))) {
+            /* A one-way send or a client RPC. Replies go to send-once
+             * rights, and each client has its own reply port, so they are
+             * not recorded by port. */
+            id = sendId;
+            if((sendBits & 0xff) != MachMsgType.MOVE_SEND_ONCE.name())
+                port = sendPort;
+        } else if(ret == 0) {
+            /* A receive, possibly after sending a reply as server loops
+             * do, recorded under the request received. Only requests come
+             * with a reply port. */
+            id = msg.getInt(20);
+            if(msg.getInt(8) != Mach.Port.NULL)
+                port = msg.getInt(12);
+        } else
+            id = Mach.isSendError(ret) ? sendId : 0;
+
+        int received = 0;
+        if(ret == 0 && rcv)
+            received = msg.getInt(4);
+
+        ids.get(id).record(end - start, sendSize, received, ret);
+        if(port != Mach.Port.NULL)
+            ports.get(port).record(end - start, sendSize, received, ret);
+    }
+
+    @Override
+    public void requestDispatched(int id, int port, long start, long end,
+                                  int ret)
+    {
+        dispatchIds.get(id).record(end - start, 0, 0, ret);
+    }
+
+    /* MsgStatsMXBean implementation */
+
+    public boolean isEnabled() {
+        return enabled;
+    }
+
+    public void setEnabled(boolean enabled) {
+        if(enabled)
+            enable();
+        else
+            disable();
+    }
+
+    public List<Entry> getMessageIds() {
+        return ids.snapshot();
+    }
+
+    public List<Entry> getPorts() {
+        return ports.snapshot();
+    }
+
+    public List<Entry> getDispatchIds() {
+        return dispatchIds.snapshot();
+    }
+
+    public Entry getOverflow() {
+        return overflow.snapshot();
+    }
+
+    public void reset() {
+        overflow = new MsgCounters(0);
+        ids = new Table(overflow);
+        ports = new Table(overflow);
+        dispatchIds = new Table(overflow);
+    }
+}
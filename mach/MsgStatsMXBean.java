@@ -0,0 +1,77 @@
+package org.gnu.mach;
+
+import java.util.List;
+import java.util.Map;
+
+/**
+ * Management interface for {@link MsgStats}.
+ */
+public interface MsgStatsMXBean {
+    /** Whether statistics are being recorded. */
+    boolean isEnabled();
+
+    /** Start or stop recording statistics. */
+    void setEnabled(boolean enabled);
+
+    /** Counters for {@link Mach#msg} calls, by {@code msgh_id}. */
+    List<Entry> getMessageIds();
+
+    /** Counters for {@link Mach#msg} calls, by destination port name. */
+    List<Entry> getPorts();
+
+    /** Counters for requests handled by server loops, by {@code msgh_id}. */
+    List<Entry> getDispatchIds();
+
+    /** Counters for keys which did not fit in the tables above. */
+    Entry getOverflow();
+
+    /** Discard all the statistics recorded so far. */
+    void reset();
+
+    /**
+     * Snapshot of the counters associated with a message ID or port name.
+     */
+    public static class Entry {
+        private final int key;
+        private final long calls;
+        private final long errors;
+        private final long bytesSent;
+        private final long bytesReceived;
+        private final long totalNanos;
+        private final long[] latencyHistogram;
+        private final Map<Integer, Long> errorCodes;
+
+        public Entry(int key, long calls, long errors, long bytesSent,
+                     long bytesReceived, long totalNanos,
+                     long[] latencyHistogram, Map<Integer, Long> errorCodes)
+        {
+            this.key = key;
+            this.calls = calls;
+            this.errors = errors;
+            this.bytesSent = bytesSent;
+            this.bytesReceived = bytesReceived;
+            this.totalNanos = totalNanos;
+            this.latencyHistogram = latencyHistogram;
+            this.errorCodes = errorCodes;
+        }
+
+        /** The {@code msgh_id} value or port name. */
+        public int getKey() { return key; }
+
+        public long getCalls() { return calls; }
+        public long getErrors() { return errors; }
+        public long getBytesSent() { return bytesSent; }
+        public long getBytesReceived() { return bytesReceived; }
+        public long getTotalNanos() { return totalNanos; }
+
+        /**
+         * Latency histogram. Element {@code i} counts the calls which took
+         * between 2<sup>i-1</sup> and 2<sup>i</sup> nanoseconds; the last
+         * element also counts any longer calls.
+         */
+        public long[] getLatencyHistogram() { return latencyHistogram; }
+
+        /** Number of calls which failed, by return code. */
+        public Map<Integer, Long> getErrorCodes() { return errorCodes; }
+    }
+}
@@ -0,0 +1,209 @@
+package org.gnu.mach;
+
+import java.io.File;
+import java.io.FileWriter;
+import java.io.IOException;
+import java.io.Writer;
+import java.lang.management.ManagementFactory;
+import java.nio.ByteBuffer;
+import java.util.Map;
+import java.util.concurrent.ConcurrentHashMap;
+import java.util.concurrent.atomic.AtomicLong;
+import java.util.concurrent.atomic.AtomicLongArray;
+
+/**
+ * Ring buffer of RPC spans, exported as a Chrome trace.
+ *
+ * While tracing, each {@link Mach#msg} call is recorded as a span: a
+ * client RPC (sending a request and waiting for its reply), a one-way send
+ * or a receive, the latter showing where server threads wait, including
+ * the calls in which a server loop sends a reply and waits for the next
+ * request. Requests
+ * handled by server loops are recorded as server spans. Spans carry the
+ * {@code msgh_id}, port name, return code and thread ID.
+ *
+ * Only the most recent spans are kept. {@link #dump} writes them in the
+ * Chrome trace event format, which can be loaded into Perfetto or
+ * {@code chrome://tracing} to see which RPCs overlap and where threads
+ * wait on each other across a stack of translators.
+ */
+public final class MsgTrace extends MsgObserver {
+    /* Span kinds */
+    private static final int RPC = 0;
+    private static final int SEND = 1;
+    private static final int RECEIVE = 2;
+    private static final int SERVER = 3;
+    private static final String[] KIND_NAMES = {
+        "rpc", "send", "receive", "server"
+    };
+
+    private final int mask;
+    private final AtomicLong next = new AtomicLong();
+
+    /* Spans are stored in parallel arrays. Each slot is stamped with the
+     * sequence number of the span it holds once it's complete, so that the
+     * dump can skip slots which are being overwritten. */
+    private final AtomicLongArray stamp;
+    private final long[] start, duration, thread;
+    private final int[] kind, id, port, ret;
+
+    private final Map<Long, String> threadNames =
+        new ConcurrentHashMap<Long, String>();
+    private final Map<Integer, String> idNames =
+        new ConcurrentHashMap<Integer, String>();
+
+    private MsgTrace(int capacity) {
+        int size = Integer.highestOneBit(Math.max(capacity, 2) * 2 - 1);
+        mask = size - 1;
+        stamp = new AtomicLongArray(size);
+        start = new long[size];
+        duration = new long[size];
+        thread = new long[size];
+        kind = new int[size];
+        id = new int[size];
+        port = new int[size];
+        ret = new int[size];
+        for(int i = 0; i < size; i++)
+            stamp.set(i, -1);
+    }
+
+    /**
+     * Start tracing into a new ring buffer holding the given number of
+     * spans (rounded up to a power of two).
+     */
+    public static MsgTrace start(int capacity) {
+        MsgTrace trace = new MsgTrace(capacity);
+        MsgObserver.add(trace);
+        return trace;
+    }
+
+    /** Stop tracing. The spans recorded so far can still be dumped. */
+    public void stop() {
+        MsgObserver.remove(this);
+    }
+
+    /** Set the name to display for spans with the given {@code msgh_id}. */
+    public void setName(int msgId, String name) {
+        idNames.put(msgId, name);
+    }
+
+    private void record(int k, int msgId, int portName, int retCode,
+                        long t0, long t1)
+    {
+        Thread current = Thread.currentThread();
+        long tid = current.getId();
+        if(!threadNames.containsKey(tid))
+            threadNames.put(tid, current.getName());
+
+        long seq = next.getAndIncrement();
+        int i = (int) seq & mask;
+
+        stamp.set(i, -1);
+        kind[i] = k;
+        id[i] = msgId;
+        port[i] = portName;
+        ret[i] = retCode;
+        thread[i] = tid;
+        start[i] = t0;
+        duration[i] = t1 - t0;
+        stamp.set(i, seq);
+    }
+
+    @Override
+    public void msgCompleted(ByteBuffer msg, int option, int sendBits,
+                             int sendId, int sendPort, int sendSize,
+                             int rcvName, long timeout, int ret, long start,
+                             long end)
+    {
+        boolean send = (option & Mach.SEND_MSG) != 0;
+        boolean rcv = (option & Mach.RCV_MSG) != 0;
+
+        /* A server loop sends its reply and waits for the next request in
+         * the same call, which is a receive, not a client RPC. */
+        if(send && rcv && MsgStats.isRequest(sendBits))
+            record(RPC, sendId, sendPort, ret, start, end);
+        else if(send && !rcv)
+            record(SEND, sendId, sendPort, ret, start, end);
+        else if(rcv)
+            record(RECEIVE, ret == 0 ? msg.getInt(20) : 0, rcvName, ret,
+                   start, end);
+    }
+
+    @Override
+    public void requestDispatched(int id, int port, long start, long end,
+                                  int ret)
+    {
+        record(SERVER, id, port, ret, start, end);
+    }
+
+    private static void writeMicros(Writer out, long nanos)
+        throws IOException
+    {
+        out.write(Long.toString(nanos / 1000));
+        out.write('.');
+        out.write(String.format("%03d", Math.abs(nanos % 1000)));
+    }
+
+    /** Write the recorded spans as a Chrome trace JSON document. */
+    public void dump(Writer out) throws IOException {
+        String pid = ManagementFactory.getRuntimeMXBean().getName();
+        pid = pid.replaceAll("@.*", "");
+
+        out.write("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+        boolean first = true;
+
+        for(Map.Entry<Long, String> e : threadNames.entrySet()) {
+            if(!first)
+                out.write(",\n");
+            first = false;
+            out.write(String.format(
+                    "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%s,"
+                    + "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                    pid, e.getKey(), e.getValue().replace("\"", "\\\"")));
+        }
+
+        long end = next.get();
+        long begin = Math.max(0, end - mask - 1);
+        for(long seq = begin; seq < end; seq++) {
+            int i = (int) seq & mask;
+            if(stamp.get(i) != seq)
+                continue;
+
+            int k = kind[i], msgId = id[i], portName = port[i], r = ret[i];
+            long tid = thread[i], t0 = start[i], d = duration[i];
+            if(stamp.get(i) != seq)
+                continue;
+
+            String name = idNames.get(msgId);
+            if(name == null)
+                name = KIND_NAMES[k] + " " + msgId;
+
+            if(!first)
+                out.write(",\n");
+            first = false;
+            out.write(String.format(
+                    "{\"ph\":\"X\",\"name\":\"%s\",\"cat\":\"%s\","
+                    + "\"pid\":%s,\"tid\":%d,\"ts\":",
+                    name, KIND_NAMES[k], pid, tid));
+            writeMicros(out, t0);
+            out.write(",\"dur\":");
+            writeMicros(out, d);
+            out.write(String.format(
+                    ",\"args\":{\"id\":%d,\"port\":%d,\"ret\":%d}}",
+                    msgId, portName, r));
+        }
+
+        out.write("\n]}\n");
+        out.flush();
+    }
+
+    /** Write the recorded spans as a Chrome trace JSON file. */
+    public void dump(File file) throws IOException {
+        Writer out = new FileWriter(file);
+        try {
+            dump(out);
+        } finally {
+            out.close();
+        }
+    }
+}
@@ -0,0 +1,173 @@
+package org.gnu.mach;
+
+import java.util.Collections;
+import java.util.HashSet;
+import java.util.List;
+import java.util.ArrayList;
+import java.util.Map;
+import java.util.Set;
+import java.util.WeakHashMap;
+
+/**
+ * Port leak auditor.
+ *
+ * {@link MachPort#finalize} only notices a leaked right when the object
+ * which held it is collected, and rights held by message items which were
+ * never read are not noticed at all (see the FIXME in {@link
+ * MachMsg#clear}). The auditor instead compares the task's port name space,
+ * as reported by {@code mach_port_names()}, with the names held by live
+ * {@link MachPort} and {@link MachMsg} objects, and reports the rights
+ * nobody accounts for along with their user reference counts.
+ *
+ * Objects can only be accounted for if they were created after
+ * {@link #startTracking} was called. The names in use at that time, which
+ * include the ones held by the C library, are recorded as a baseline and
+ * excluded from the reports. Since rights are constantly received and
+ * released by a busy server, a name showing up in a single report is not
+ * necessarily a leak; one which shows up in successive reports with a
+ * growing reference count is.
+ */
+public final class PortAuditor {
+    /** Checked by the {@link MachPort} and {@link MachMsg} constructors. */
+    static volatile boolean tracking;
+
+    private static final Map<MachPort, Boolean> ports =
+        Collections.synchronizedMap(new WeakHashMap<MachPort, Boolean>());
+    private static final Map<MachMsg, Boolean> msgs =
+        Collections.synchronizedMap(new WeakHashMap<MachMsg, Boolean>());
+    private static Set<Integer> baseline = Collections.emptySet();
+
+    private PortAuditor() {}
+
+    static void track(MachPort port) {
+        ports.put(port, Boolean.TRUE);
+    }
+
+    static void track(MachMsg msg) {
+        msgs.put(msg, Boolean.TRUE);
+    }
+
+    /**
+     * Start tracking {@link MachPort} and {@link MachMsg} objects, and
+     * record the names currently in use as the baseline.
+     */
+    public static synchronized void startTracking() {
+        Set<Integer> names = new HashSet<Integer>();
+        int[] pairs = kernelNames();
+        for(int i = 0; i < pairs.length; i += 2)
+            names.add(pairs[i]);
+
+        baseline = names;
+        tracking = true;
+    }
+
+    /** Stop tracking objects and forget about the tracked ones. */
+    public static synchronized void stopTracking() {
+        tracking = false;
+        ports.clear();
+        msgs.clear();
+    }
+
+    private static int[] kernelNames() {
+        int[] pairs = null;
+        try {
+            pairs = Mach.Port.names(Mach.taskSelf());
+        } catch(Unsafe exc) {}
+        return (pairs != null) ? pairs : new int[0];
+    }
+
+    /**
+     * A port name which is not accounted for.
+     */
+    public static class Orphan {
+        private final int name;
+        private final int type;
+        private final int sendRefs;
+        private final int deadRefs;
+
+        Orphan(int name, int type, int sendRefs, int deadRefs) {
+            this.name = name;
+            this.type = type;
+            this.sendRefs = sendRefs;
+            this.deadRefs = deadRefs;
+        }
+
+        /** The port name. */
+        public int name() { return name; }
+
+        /** The port type bits (see {@code Mach.Port.TYPE_*}). */
+        public int type() { return type; }
+
+        /** User references for the send right, if any. */
+        public int sendRefs() { return sendRefs; }
+
+        /** User references for the dead name, if any. */
+        public int deadRefs() { return deadRefs; }
+
+        @Override
+        public String toString() {
+            StringBuilder sb = new StringBuilder();
+            sb.append(String.format("port %d:", name));
+            if((type & Mach.Port.TYPE_RECEIVE) != 0)
+                sb.append(" receive");
+            if((type & Mach.Port.TYPE_SEND) != 0)
+                sb.append(String.format(" send(%d)", sendRefs));
+            if((type & Mach.Port.TYPE_SEND_ONCE) != 0)
+                sb.append(" send-once");
+            if((type & Mach.Port.TYPE_PORT_SET) != 0)
+                sb.append(" port-set");
+            if((type & Mach.Port.TYPE_DEAD_NAME) != 0)
+                sb.append(String.format(" dead(%d)", deadRefs));
+            return sb.toString();
+        }
+    }
+
+    private static int getRefs(int task, int name, int right) {
+        int[] refs = new int[1];
+        try {
+            if(Mach.Port.getRefs(task, name, right, refs) != 0)
+                return -1;
+        } catch(Unsafe exc) {}
+        return refs[0];
+    }
+
+    /**
+     * Compare the task's port name space with the live objects and return
+     * the names which are not accounted for.
+     */
+    public static synchronized List<Orphan> audit() {
+        /* Collect the names we know about first, so that a right received
+         * in the meantime shows up as live rather than orphaned. */
+        Set<Integer> live = new HashSet<Integer>();
+        synchronized(ports) {
+            for(MachPort port : ports.keySet())
+                live.add(port.peekName());
+        }
+        synchronized(msgs) {
+            for(MachMsg msg : msgs.keySet())
+                msg.collectPortNames(live);
+        }
+
+        int task = 0;
+        try {
+            task = Mach.taskSelf();
+        } catch(Unsafe exc) {}
+
+        List<Orphan> orphans = new ArrayList<Orphan>();
+        int[] pairs = kernelNames();
+        for(int i = 0; i < pairs.length; i += 2) {
+            int name = pairs[i], type = pairs[i + 1];
+            if(name == task || live.contains(name) || baseline.contains(name))
+                continue;
+
+            int sendRefs = 0, deadRefs = 0;
+            if((type & Mach.Port.TYPE_SEND) != 0)
+                sendRefs = getRefs(task, name, Mach.Port.RIGHT_SEND);
+            if((type & Mach.Port.TYPE_DEAD_NAME) != 0)
+                deadRefs = getRefs(task, name, Mach.Port.RIGHT_DEAD_NAME);
+            orphans.add(new Orphan(name, type, sendRefs, deadRefs));
+        }
+
+        return orphans;
+    }
+}
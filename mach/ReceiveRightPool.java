@@ -0,0 +1,112 @@
+package org.gnu.mach;
+
+/**
+ * Stock of pre-allocated receive rights.
+ *
+ * Servers which create a port for each new client object can take them
+ * from a {@link ReceiveRightPool} instead of allocating them one at a
+ * time. The stock is refilled in batches with
+ * {@link Mach.Port#allocateN}, whenever it runs out or explicitly with
+ * {@link #refill}, for instance from a background thread between bursts
+ * of new clients. The names are kept in an {@code int} array, and the
+ * rights only get a {@link MachPort} object or a {@link MachPortTable}
+ * entry when they are handed out.
+ */
+public class ReceiveRightPool {
+    private final int[] stock;
+    private final int[] errors;
+    private int count;
+
+    /**
+     * Create a pool.
+     *
+     * @param capacity  The number of rights allocated by each refill.
+     */
+    public ReceiveRightPool(int capacity) {
+        if(capacity <= 0)
+            throw new IllegalArgumentException();
+        stock = new int[capacity];
+        errors = new int[capacity];
+    }
+
+    /** The number of rights in stock. */
+    public synchronized int available() {
+        return count;
+    }
+
+    /** Fill the stock up to its capacity. Returns the number added. */
+    public synchronized int refill() {
+        int n = stock.length - count;
+        if(n == 0)
+            return 0;
+
+        int[] names = new int[n];
+        try {
+            Mach.Port.allocateN(Mach.taskSelf(), Mach.Port.RIGHT_RECEIVE,
+                                names, errors);
+        } catch(Unsafe exc) {}
+
+        int added = 0;
+        for(int i = 0; i < n; i++)
+            if(names[i] != Mach.Port.NULL) {
+                MsgObserver.reportPortAllocated(names[i],
+                                                Mach.Port.RIGHT_RECEIVE);
+                stock[count++] = names[i];
+                added++;
+            }
+        return added;
+    }
+
+    /** Take a name out of the stock, refilling it if needed. */
+    private synchronized int takeName() {
+        if(count == 0 && refill() == 0)
+            return Mach.Port.NULL;
+        return stock[--count];
+    }
+
+    /**
+     * Take a receive right. Returns {@link MachPort#NULL} if none could
+     * be allocated.
+     */
+    public MachPort take() {
+        int name = takeName();
+        if(name == Mach.Port.NULL)
+            return MachPort.NULL;
+        try {
+            return new MachPort(name);
+        } catch(Unsafe exc) {
+            return MachPort.NULL;
+        }
+    }
+
+    /**
+     * Take a receive right and add it to a table. Returns
+     * {@link MachPortTable#NONE} if none could be allocated.
+     */
+    public int take(MachPortTable table) {
+        int name = takeName();
+        if(name == Mach.Port.NULL)
+            return MachPortTable.NONE;
+        try {
+            return table.addReceive(name);
+        } catch(Unsafe exc) {
+            return MachPortTable.NONE;
+        }
+    }
+
+    /** Destroy all the rights in stock. */
+    public synchronized void clear() {
+        if(count == 0)
+            return;
+
+        int[] names = new int[count];
+        System.arraycopy(stock, 0, names, 0, count);
+        count = 0;
+        try {
+            Mach.Port.modRefsN(Mach.taskSelf(), names,
+                               Mach.Port.RIGHT_RECEIVE, -1, errors);
+        } catch(Unsafe exc) {}
+        for(int name : names)
+            MsgObserver.reportPortDeallocated(name);
+    }
+}
@@ -0,0 +1,243 @@
+package org.gnu.mach;
+
+import java.util.concurrent.ConcurrentLinkedQueue;
+
+/**
+ * Server split into independent shards, one thread each.
+ *
+ * With a single port set served by several threads, any request can
+ * reach any thread, so the objects the requests are addressed to have to
+ * live in a table which all the threads share and lock. A
+ * {@link ShardedServer} instead creates one port set per shard and runs
+ * one {@link MachServer} thread on each. Every receive right is a member
+ * of exactly one port set, so all the requests for a given object are
+ * handled by the same thread, and each {@link Shard} can keep its objects,
+ * caches and buffers in plain unsynchronized structures.
+ *
+ * New objects are placed with {@link #join}, which picks a shard by
+ * hashing a key chosen by the caller, for instance a client identifier so
+ * that all the objects of a client end up on the same shard. The object
+ * is handed over to the shard's thread through a lock-free queue, which
+ * the thread drains before it handles the next request; on the request
+ * path, the only shared state is a volatile read of that queue.
+ */
+public class ShardedServer {
+    /**
+     * Request handler and object table of a shard. Its methods are only
+     * ever called from the shard's thread.
+     */
+    public static abstract class Shard implements MachServer.Demuxer {
+        /**
+         * Take over a new object joined to this shard. This is called
+         * before any request sent to {@code port} is handled.
+         *
+         * @param port  The name of the object's receive right, which is
+         *              what {@link #demux} will receive its requests as.
+         * @param obj   The object passed to {@link ShardedServer#join}.
+         */
+        protected abstract void adopt(int port, Object obj);
+
+        /**
+         * Forget an object passed to {@link #adopt} whose port could not
+         * be moved into the shard's port set after all, so that no request
+         * will come for it. This is called before any request which
+         * follows is handled. The default implementation does nothing.
+         */
+        protected void disown(int port, Object obj) {
+        }
+    }
+
+    /** Creates the shards of a server. */
+    public static interface ShardFactory {
+        Shard create(int index);
+    }
+
+    private static class Joined {
+        final int port;
+        final Object obj;
+        /* Whether this is a tombstone, undoing an earlier entry. */
+        final boolean dropped;
+
+        Joined(int port, Object obj, boolean dropped) {
+            this.port = port;
+            this.obj = obj;
+            this.dropped = dropped;
+        }
+    }
+
+    /* Everything a shard's thread owns. */
+    private static class Worker implements MachServer.Demuxer {
+        final Shard shard;
+        final MachPort portSet;
+        final MachMsgArena arena;
+        final MachServer server;
+        final ConcurrentLinkedQueue<Joined> inbox =
+            new ConcurrentLinkedQueue<Joined>();
+        Thread thread;
+
+        Worker(Shard shard, int bufferSize, boolean wired) {
+            this.shard = shard;
+            portSet = MachPort.allocate(MachPort.Right.PORT_SET);
+            if(portSet == MachPort.NULL)
+                throw new IllegalStateException("cannot allocate a port set");
+            if(wired) {
+                arena = new MachMsgArena(bufferSize, 2, true);
+                server = new MachServer(portSet, this, arena);
+            } else {
+                arena = null;
+                server = new MachServer(portSet, this, bufferSize);
+            }
+        }
+
+        public boolean demux(int port, MachMsg request, MachMsg reply)
+            throws TypeCheckException
+        {
+            if(!inbox.isEmpty()) {
+                Joined joined;
+                while((joined = inbox.poll()) != null)
+                    if(joined.dropped)
+                        shard.disown(joined.port, joined.obj);
+                    else
+                        shard.adopt(joined.port, joined.obj);
+            }
+            return shard.demux(port, request, reply);
+        }
+    }
+
+    private final Worker[] workers;
+
+    /**
+     * Create a sharded server. The shards are not served until
+     * {@link #start} is called.
+     *
+     * @param shards        The number of shards, typically the number of
+     *                      processors.
+     * @param factory       Creates the handler of each shard.
+     * @param bufferSize    The size of the request and reply buffers.
+     * @param wired         Whether each shard takes its buffers from its
+     *                      own wired {@link MachMsgArena}.
+     */
+    public ShardedServer(int shards, ShardFactory factory, int bufferSize,
+                         boolean wired)
+    {
+        if(shards <= 0)
+            throw new IllegalArgumentException();
+
+        workers = new Worker[shards];
+        for(int i = 0; i < shards; i++)
+            workers[i] = new Worker(factory.create(i), bufferSize, wired);
+    }
+
+    /** Create a sharded server with one shard per processor. */
+    public ShardedServer(ShardFactory factory, int bufferSize) {
+        this(Runtime.getRuntime().availableProcessors(), factory, bufferSize,
+             false);
+    }
+
+    /** The number of shards. */
+    public int shards() {
+        return workers.length;
+    }
+
+    /** The handler of a shard. */
+    public Shard shard(int index) {
+        return workers[index].shard;
+    }
+
+    /** The port set of a shard. */
+    public MachPort portSet(int index) {
+        return workers[index].portSet;
+    }
+
+    /** The shard which {@link #join} picks for {@code key}. */
+    public int shardOf(int key) {
+        int h = key * 0x9e3779b9;
+        h ^= h >>> 16;
+        return (h & Integer.MAX_VALUE) % workers.length;
+    }
+
+    /**
+     * Add a receive right to the port set of the shard chosen by
+     * {@code key}. The shard's {@link Shard#adopt} method is called with
+     * {@code obj} in its own thread before the first request on the port
+     * is handled. We keep our reference to the port.
+     *
+     * @return The index of the shard, or -1 if the port could not be
+     *         moved into its port set, in which case the shard's
+     *         {@link Shard#disown} method is called if it had adopted
+     *         {@code obj} already.
+     */
+    public int join(MachPort port, int key, Object obj) {
+        int index = shardOf(key);
+        Worker worker = workers[index];
+        Joined joined = null;
+        boolean moved = false;
+        try {
+            int name = port.name();
+            try {
+                /* Queue the object first, so that it is there by the time
+                 * the first request shows up on the port set. */
+                joined = new Joined(name, obj, false);
+                worker.inbox.add(joined);
+
+                int set = worker.portSet.name();
+                try {
+                    moved = Mach.Port.moveMember(Mach.taskSelf(), name, set)
+                            == Mach.KERN_SUCCESS;
+                } finally {
+                    worker.portSet.releaseName();
+                }
+            } finally {
+                port.releaseName();
+            }
+        } catch(Unsafe exc) {}
+
+        if(moved)
+            return index;
+        if(joined != null && !worker.inbox.remove(joined)) {
+            /* The shard's thread has adopted the object already: have it
+             * drop it again. */
+            worker.inbox.add(new Joined(joined.port, obj, true));
+        }
+        return -1;
+    }
+
+    /** Start one thread per shard. */
+    public synchronized void start() {
+        for(int i = 0; i < workers.length; i++) {
+            Worker worker = workers[i];
+            if(worker.thread != null)
+                continue;
+
+            worker.thread = new Thread(worker.server, "ShardedServer-" + i);
+            worker.thread.setDaemon(true);
+            worker.thread.start();
+        }
+    }
+
+    /**
+     * Stop all the shards, wait for their threads to return, and release
+     * the port sets and buffers. The receive rights which were joined are
+     * left to their owners.
+     */
+    public synchronized void close() {
+        for(Worker worker : workers)
+            worker.server.stop();
+
+        for(Worker worker : workers) {
+            if(worker.thread != null)
+                while(true)
+                    try {
+                        worker.thread.join();
+                        break;
+                    } catch(InterruptedException exc) {
+                        /* ignore */
+                    }
+            worker.portSet.destroy();
+            if(worker.arena != null)
+                try {
+                    worker.arena.close();
+                } catch(Unsafe exc) {}
+        }
+    }
+}
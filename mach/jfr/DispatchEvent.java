@@ -0,0 +1,28 @@
+package org.gnu.mach.jfr;
+
+import jdk.jfr.Category;
+import jdk.jfr.Description;
+import jdk.jfr.Event;
+import jdk.jfr.Label;
+import jdk.jfr.Name;
+import jdk.jfr.Threshold;
+
+/**
+ * A request handled by a server loop.
+ */
+@Name("org.gnu.mach.Dispatch")
+@Label("Mach Request Dispatch")
+@Category({ "GNU Hurd", "Mach IPC" })
+@Description("Handling of an incoming request by a server loop")
+@Threshold("1 ms")
+public class DispatchEvent extends Event {
+    @Label("Message ID")
+    public int id;
+
+    @Label("Port")
+    @Description("Port the request was received on")
+    public int port;
+
+    @Label("Return Code")
+    public int returnCode;
+}
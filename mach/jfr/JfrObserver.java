@@ -0,0 +1,134 @@
+package org.gnu.mach.jfr;
+
+import java.nio.ByteBuffer;
+import org.gnu.mach.Mach;
+import org.gnu.mach.MsgObserver;
+
+/**
+ * Emit JDK Flight Recorder events for Mach IPC.
+ *
+ * Once {@link #install installed}, this observer produces
+ * {@link MsgEvent}, {@link PortEvent} and {@link DispatchEvent} events,
+ * which end up in the same recording as the JVM's own events. By default
+ * only the calls and requests which took more than 1 ms are recorded;
+ * this can be changed with the {@code threshold} setting of the
+ * {@code org.gnu.mach.Msg} and {@code org.gnu.mach.Dispatch} events.
+ *
+ * The observer can also be installed at startup by setting the
+ * {@code org.gnu.mach.jfr} system property.
+ */
+public final class JfrObserver extends MsgObserver {
+    private static final JfrObserver instance = new JfrObserver();
+    private static boolean installed;
+
+    /* Events in progress for the current thread. */
+    private final ThreadLocal<MsgEvent> msgEvent =
+        new ThreadLocal<MsgEvent>();
+    private final ThreadLocal<DispatchEvent> dispatchEvent =
+        new ThreadLocal<DispatchEvent>();
+
+    private JfrObserver() {}
+
+    /** Start emitting events. */
+    public static synchronized void install() {
+        if(!installed) {
+            MsgObserver.add(instance);
+            installed = true;
+        }
+    }
+
+    /** Stop emitting events. */
+    public static synchronized void uninstall() {
+        if(installed) {
+            MsgObserver.remove(instance);
+            installed = false;
+        }
+    }
+
+    @Override
+    public void msgStarting(ByteBuffer msg, int option) {
+        MsgEvent event = new MsgEvent();
+        if(event.isEnabled()) {
+            event.begin();
+            msgEvent.set(event);
+        }
+    }
+
+    @Override
+    public void msgCompleted(ByteBuffer msg, int option, int sendBits,
+                             int sendId, int sendPort, int sendSize,
+                             int rcvName, long timeout, int ret, long start,
+                             long end)
+    {
+        MsgEvent event = msgEvent.get();
+        if(event == null)
+            return;
+        msgEvent.set(null);
+
+        event.end();
+        if(!event.shouldCommit())
+            return;
+
+        boolean received = ret == 0 && (option & Mach.RCV_MSG) != 0;
+        boolean sent = (option & Mach.SEND_MSG) != 0;
+
+        event.option = option;
+        event.id = (sent || !received) ? sendId : msg.getInt(20);
+        event.port = sendPort;
+        event.rcvName = rcvName;
+        event.sendSize = sendSize;
+        event.receiveSize = received ? msg.getInt(4) : 0;
+        event.timeout = timeout;
+        event.returnCode = ret;
+        event.commit();
+    }
+
+    @Override
+    public void portAllocated(int name, int right) {
+        PortEvent event = new PortEvent();
+        if(event.shouldCommit()) {
+            event.name = name;
+            event.allocated = true;
+            event.right = right;
+            event.commit();
+        }
+    }
+
+    @Override
+    public void portDeallocated(int name) {
+        PortEvent event = new PortEvent();
+        if(event.shouldCommit()) {
+            event.name = name;
+            event.allocated = false;
+            event.right = -1;
+            event.commit();
+        }
+    }
+
+    @Override
+    public void requestStarting(int id, int port) {
+        DispatchEvent event = new DispatchEvent();
+        if(event.isEnabled()) {
+            event.begin();
+            dispatchEvent.set(event);
+        }
+    }
+
+    @Override
+    public void requestDispatched(int id, int port, long start, long end,
+                                  int ret)
+    {
+        DispatchEvent event = dispatchEvent.get();
+        if(event == null)
+            return;
+        dispatchEvent.set(null);
+
+        event.end();
+        if(event.shouldCommit()) {
+            event.id = id;
+            event.port = port;
+            event.returnCode = ret;
+            event.commit();
+        }
+    }
+}
@@ -0,0 +1,44 @@
+package org.gnu.mach.jfr;
+
+import jdk.jfr.Category;
+import jdk.jfr.Description;
+import jdk.jfr.Event;
+import jdk.jfr.Label;
+import jdk.jfr.Name;
+import jdk.jfr.Threshold;
+
+/**
+ * A {@code mach_msg()} call made through {@link org.gnu.mach.Mach#msg}.
+ */
+@Name("org.gnu.mach.Msg")
+@Label("Mach Message")
+@Category({ "GNU Hurd", "Mach IPC" })
+@Description("A mach_msg() system call")
+@Threshold("1 ms")
+public class MsgEvent extends Event {
+    @Label("Options")
+    public int option;
+
+    @Label("Message ID")
+    @Description("msgh_id of the message sent, or received if none was sent")
+    public int id;
+
+    @Label("Destination Port")
+    public int port;
+
+    @Label("Receive Port")
+    public int rcvName;
+
+    @Label("Bytes Sent")
+    public int sendSize;
+
+    @Label("Bytes Received")
+    public int receiveSize;
+
+    @Label("Timeout")
+    @Description("Timeout in milliseconds, if any")
+    public long timeout;
+
+    @Label("Return Code")
+    public int returnCode;
+}
@@ -0,0 +1,28 @@
+package org.gnu.mach.jfr;
+
+import jdk.jfr.Category;
+import jdk.jfr.Description;
+import jdk.jfr.Event;
+import jdk.jfr.Label;
+import jdk.jfr.Name;
+
+/**
+ * A port right allocated or deallocated through
+ * {@link org.gnu.mach.MachPort}.
+ */
+@Name("org.gnu.mach.Port")
+@Label("Mach Port")
+@Category({ "GNU Hurd", "Mach IPC" })
+@Description("Allocation or deallocation of a port right")
+public class PortEvent extends Event {
+    @Label("Port Name")
+    public int name;
+
+    @Label("Allocated")
+    @Description("True for an allocation, false for a deallocation")
+    public boolean allocated;
+
+    @Label("Right")
+    @Description("Right allocated (see Mach.Port.RIGHT_*)")
+    public int right;
+}
@@ -0,0 +1,199 @@
+package org.gnu.mach.rpc;
+
+import java.util.Map;
+import java.util.concurrent.ConcurrentHashMap;
+import java.util.concurrent.atomic.AtomicInteger;
+import org.gnu.mach.Mach;
+
+/**
+ * Adaptive limit on the number of outstanding calls to each server.
+ *
+ * A client with many threads can keep thousands of requests queued on a
+ * server which is already slow, which only makes its latency worse for
+ * everybody. An {@link RpcClient} with a {@link ConcurrencyLimiter}
+ * instead keeps, for each destination port name, a limit on the number
+ * of calls in flight, and makes extra calls wait locally for a free slot,
+ * or fail with the overload code if they waited too long.
+ *
+ * The limit follows the round trip times, in the manner of TCP Vegas: the
+ * shortest recent round trip time is taken as the server's unloaded
+ * latency, and the limit is scaled by the ratio between it and the
+ * current round trip time, plus a small allowance for queueing. When a
+ * call fails with the overload code, for instance because the server
+ * shed it with an {@link org.gnu.mach.AdmissionController}, the limit is
+ * halved.
+ *
+ * The state of a destination is dropped once it has had no calls for
+ * {@link #IDLE_EXPIRY} nanoseconds, so that a client talking to many
+ * short-lived ports doesn't accumulate it, and a port name reused for
+ * another server starts afresh. Callers which know that a send right is
+ * gone can drop its state at once with {@link #forget}.
+ */
+public class ConcurrencyLimiter {
+    /** Number of samples after which the unloaded latency is re-learned. */
+    private static final int MIN_RTT_WINDOW = 1000;
+
+    /** How long the state of an idle destination is kept, in nanoseconds. */
+    public static final long IDLE_EXPIRY = 60 * 1000000000L;
+
+    /** Number of lookups between two scans for idle destinations. */
+    private static final int SWEEP_INTERVAL = 1024;
+
+    /** Per-destination state. */
+    final class Limit {
+        private double limit = initialLimit;
+        private int inFlight;
+        private long minRtt = Long.MAX_VALUE;
+        private long rtt;
+        private int samples;
+        private long lastUsed = System.nanoTime();
+
+        synchronized void acquire() throws RpcException {
+            if(inFlight >= (int) limit) {
+                long deadline = System.nanoTime() + maxWait;
+                do {
+                    long left = deadline - System.nanoTime();
+                    if(left <= 0)
+                        throw new RpcException(overloadCode);
+                    try {
+                        wait(left / 1000000, (int) (left % 1000000));
+                    } catch(InterruptedException exc) {
+                        Thread.currentThread().interrupt();
+                        throw new RpcException(overloadCode);
+                    }
+                } while(inFlight >= (int) limit);
+            }
+            inFlight++;
+            lastUsed = System.nanoTime();
+        }
+
+        /** Take a slot if one is free, without waiting. */
+        synchronized boolean tryAcquire() {
+            if(inFlight >= (int) limit)
+                return false;
+            inFlight++;
+            lastUsed = System.nanoTime();
+            return true;
+        }
+
+        synchronized void release(long nanos, int code) {
+            inFlight--;
+            lastUsed = System.nanoTime();
+
+            if(code == overloadCode)
+                limit = Math.max(minLimit, limit / 2);
+            else if(!Mach.isMsgError(code)) {
+                rtt = (rtt == 0) ? nanos : rtt + (nanos - rtt) / 8;
+                if(++samples >= MIN_RTT_WINDOW) {
+                    /* The server may have become faster or slower for
+                     * good; start over from the current average. */
+                    minRtt = rtt;
+                    samples = 0;
+                }
+                minRtt = Math.min(minRtt, nanos);
+
+                double gradient = Math.min(1.0, (double) minRtt / rtt);
+                double target = limit * gradient + Math.sqrt(limit);
+                limit = 0.8 * limit + 0.2 * target;
+                limit = Math.max(minLimit, Math.min(maxLimit, limit));
+            }
+            notifyAll();
+        }
+
+        synchronized int limit() {
+            return (int) limit;
+        }
+
+        synchronized int inFlight() {
+            return inFlight;
+        }
+
+        synchronized boolean idle(long now) {
+            return inFlight == 0 && now - lastUsed > IDLE_EXPIRY;
+        }
+    }
+
+    private final int initialLimit;
+    private final int minLimit;
+    private final int maxLimit;
+    private final long maxWait;
+    private final int overloadCode;
+    private final ConcurrentHashMap<Integer, Limit> limits =
+        new ConcurrentHashMap<Integer, Limit>();
+    private final AtomicInteger lookups = new AtomicInteger();
+
+    /**
+     * Create a limiter.
+     *
+     * @param initialLimit  The limit for a new destination.
+     * @param minLimit      The lowest limit, at least 1.
+     * @param maxLimit      The highest limit.
+     * @param maxWait       How long a call may wait for a slot, in
+     *                      nanoseconds, before it fails.
+     * @param overloadCode  The return code which tells that the server
+     *                      is overloaded, such as {@code EAGAIN}; calls
+     *                      rejected locally fail with it too.
+     */
+    public ConcurrencyLimiter(int initialLimit, int minLimit, int maxLimit,
+                              long maxWait, int overloadCode)
+    {
+        if(minLimit < 1 || initialLimit < minLimit || maxLimit < initialLimit)
+            throw new IllegalArgumentException();
+
+        this.initialLimit = initialLimit;
+        this.minLimit = minLimit;
+        this.maxLimit = maxLimit;
+        this.maxWait = maxWait;
+        this.overloadCode = overloadCode;
+    }
+
+    /** Get the state for a destination port name, creating it if needed. */
+    Limit get(int port) {
+        if(lookups.incrementAndGet() % SWEEP_INTERVAL == 0)
+            sweep();
+
+        Limit limit = limits.get(port);
+        if(limit == null) {
+            Limit newLimit = new Limit();
+            limit = limits.putIfAbsent(port, newLimit);
+            if(limit == null)
+                limit = newLimit;
+        }
+        return limit;
+    }
+
+    /* Drop the destinations which have been idle for too long. A call
+     * which got hold of a dropped Limit just before still completes on
+     * it, unaffected. */
+    private void sweep() {
+        long now = System.nanoTime();
+        for(Map.Entry<Integer, Limit> e : limits.entrySet())
+            if(e.getValue().idle(now))
+                limits.remove(e.getKey(), e.getValue());
+    }
+
+    /** The number of destinations whose state is kept. */
+    public int size() {
+        return limits.size();
+    }
+
+    /** The current limit for a destination port name. */
+    public int limit(int port) {
+        Limit limit = limits.get(port);
+        return (limit != null) ? limit.limit() : initialLimit;
+    }
+
+    /** The number of calls in flight to a destination port name. */
+    public int inFlight(int port) {
+        Limit limit = limits.get(port);
+        return (limit != null) ? limit.inFlight() : 0;
+    }
+
+    /**
+     * Drop the state kept for a port name, for instance once the send
+     * right has been deallocated.
+     */
+    public void forget(int port) {
+        limits.remove(port);
+    }
+}
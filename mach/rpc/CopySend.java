@@ -0,0 +1,13 @@
+package org.gnu.mach.rpc;
+
+import java.lang.annotation.ElementType;
+import java.lang.annotation.Target;
+
+/**
+ * Pass a port as {@code MACH_MSG_TYPE_COPY_SEND}: the receiver gets a new
+ * send right and the sender keeps its own. This is the default for
+ * {@link org.gnu.mach.MachPort} parameters and results, as in MIG.
+ */
+@Target({ ElementType.PARAMETER, ElementType.METHOD })
+public @interface CopySend {
+}
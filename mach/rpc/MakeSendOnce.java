@@ -0,0 +1,12 @@
+package org.gnu.mach.rpc;
+
+import java.lang.annotation.ElementType;
+import java.lang.annotation.Target;
+
+/**
+ * Pass a port as {@code MACH_MSG_TYPE_MAKE_SEND_ONCE}, making a send-once
+ * right from a receive right the sender holds.
+ */
+@Target({ ElementType.PARAMETER, ElementType.METHOD })
+public @interface MakeSendOnce {
+}
@@ -0,0 +1,12 @@
+package org.gnu.mach.rpc;
+
+import java.lang.annotation.ElementType;
+import java.lang.annotation.Target;
+
+/**
+ * Pass a port as {@code MACH_MSG_TYPE_MOVE_RECEIVE}, giving away a receive
+ * right.
+ */
+@Target({ ElementType.PARAMETER, ElementType.METHOD })
+public @interface MoveReceive {
+}
@@ -0,0 +1,13 @@
+package org.gnu.mach.rpc;
+
+import java.lang.annotation.ElementType;
+import java.lang.annotation.Target;
+
+/**
+ * Pass a port as {@code MACH_MSG_TYPE_MOVE_SEND}. The send right is
+ * taken from the {@link org.gnu.mach.MachPort} object, which is left
+ * empty once the message has been built.
+ */
+@Target({ ElementType.PARAMETER, ElementType.METHOD })
+public @interface MoveSend {
+}
@@ -0,0 +1,12 @@
+package org.gnu.mach.rpc;
+
+import java.lang.annotation.ElementType;
+import java.lang.annotation.Target;
+
+/**
+ * Pass a port as {@code MACH_MSG_TYPE_MOVE_SEND_ONCE}, giving away a
+ * send-once right.
+ */
+@Target({ ElementType.PARAMETER, ElementType.METHOD })
+public @interface MoveSendOnce {
+}
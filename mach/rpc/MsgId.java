@@ -0,0 +1,17 @@
+package org.gnu.mach.rpc;
+
+import java.lang.annotation.ElementType;
+import java.lang.annotation.Target;
+
+/**
+ * Message ID of a remote procedure.
+ *
+ * Marks a method of an RPC interface, for which {@link RpcProcessor}
+ * generates a client proxy and a server skeleton. This plays the role of
+ * a {@code routine} in a MIG {@code .defs} file, whose ID is the
+ * subsystem base plus the routine's position.
+ */
+@Target(ElementType.METHOD)
+public @interface MsgId {
+    int value();
+}
@@ -0,0 +1,271 @@
+package org.gnu.mach.rpc;
+
+import java.util.Arrays;
+import java.util.Random;
+import java.util.concurrent.atomic.AtomicInteger;
+import org.gnu.mach.Mach;
+import org.gnu.mach.MachMsg;
+import org.gnu.mach.MachMsgType;
+import org.gnu.mach.MachPort;
+import org.gnu.mach.MachServer;
+import org.gnu.mach.TypeCheckException;
+import org.gnu.mach.Unsafe;
+
+/**
+ * Send rights to several equivalent servers.
+ *
+ * When a service runs as several instances, a client which always talks
+ * to the first one it found leaves the other ones idle. A
+ * {@link ReplicaPool} holds a send right to each instance and picks one
+ * for every call, according to its {@link Policy}, based on the number
+ * of calls each one has outstanding:
+ *
+ * <pre>
+ * ReplicaPool.Replica replica = pool.acquire();
+ * try {
+ *     n = io.write(replica.port(), data, -1);
+ * } finally {
+ *     pool.release(replica);
+ * }
+ * </pre>
+ *
+ * The pool requests a dead-name notification for each right, and a
+ * daemon thread evicts the replicas whose server has gone away as the
+ * notifications arrive. The set of replicas is copied on each change, so
+ * picking one takes no lock.
+ */
+public class ReplicaPool {
+    /** How a replica is picked for each call. */
+    public static enum Policy {
+        /** The replica with the fewest calls in flight. */
+        LEAST_OUTSTANDING,
+        /**
+         * The less loaded of two replicas picked at random, which is
+         * almost as good and doesn't look at all the replicas.
+         */
+        POWER_OF_TWO_CHOICES,
+    }
+
+    /** A server instance in the pool. */
+    public static final class Replica {
+        private final MachPort port;
+        private final int name;
+        private final AtomicInteger outstanding = new AtomicInteger();
+
+        Replica(MachPort port, int name) {
+            this.port = port;
+            this.name = name;
+        }
+
+        /** The send right to the instance. */
+        public MachPort port() {
+            return port;
+        }
+
+        /** The name of the send right, as the key of per-port state. */
+        int name() {
+            return name;
+        }
+
+        /** The number of calls in flight to this instance. */
+        public int outstanding() {
+            return outstanding.get();
+        }
+    }
+
+    private static final Replica[] EMPTY = new Replica[0];
+
+    private final Policy policy;
+    private volatile Replica[] replicas = EMPTY;
+    private final AtomicInteger next = new AtomicInteger();
+    private final ThreadLocal<Random> random = new ThreadLocal<Random>() {
+        protected Random initialValue() {
+            return new Random();
+        }
+    };
+
+    private final MachPort notifyPort;
+    private final int notifyName;
+    private final MachServer notifyServer;
+
+    public ReplicaPool(Policy policy) {
+        this.policy = policy;
+
+        notifyPort = MachPort.allocate();
+        if(notifyPort == MachPort.NULL)
+            throw new IllegalStateException("cannot allocate a port");
+        int name = Mach.Port.NULL;
+        try {
+            name = notifyPort.name();
+            notifyPort.releaseName();
+        } catch(Unsafe exc) {}
+        notifyName = name;
+
+        notifyServer = new MachServer(notifyPort, new MachServer.Demuxer() {
+            public boolean demux(int port, MachMsg request, MachMsg reply)
+                throws TypeCheckException
+            {
+                if(request.getId() != Mach.NOTIFY_DEAD_NAME)
+                    return false;
+                try {
+                    deadName(request.buf().getInt(28));
+                } catch(Unsafe exc) {}
+                return true;
+            }
+        }, 64);
+        Thread thread = new Thread(notifyServer, "ReplicaPool");
+        thread.setDaemon(true);
+        thread.start();
+    }
+
+    /**
+     * Add a replica. The pool takes over the caller's reference to
+     * {@code port}. Returns {@code false}, and deallocates the right, if
+     * the server is already dead, or if the pool already holds a send
+     * right to the same port: send rights to a port share a single name,
+     * so it would otherwise appear twice and only be evicted once.
+     */
+    public boolean add(MachPort port) {
+        int name = Mach.Port.NULL;
+        try {
+            name = port.name();
+            port.releaseName();
+        } catch(Unsafe exc) {}
+
+        /* The replica goes in first, so that the notification finds it
+         * if the server dies as soon as it is requested. */
+        Replica replica = null;
+        synchronized(this) {
+            if(!contains(name)) {
+                Replica[] newReplicas = Arrays.copyOf(replicas,
+                                                      replicas.length + 1);
+                replica = new Replica(port, name);
+                newReplicas[replicas.length] = replica;
+                replicas = newReplicas;
+            }
+        }
+        if(replica == null) {
+            port.deallocate();
+            return false;
+        }
+
+        int[] previous = new int[1];
+        int err = Mach.KERN_INVALID_NAME;
+        try {
+            name = port.name();
+            try {
+                err = Mach.Port.requestNotification(Mach.taskSelf(), name,
+                        Mach.NOTIFY_DEAD_NAME, 0, notifyName,
+                        MachMsgType.MAKE_SEND_ONCE.name(), previous);
+            } finally {
+                port.releaseName();
+            }
+            if(previous[0] != Mach.Port.NULL)
+                Mach.Port.deallocate(Mach.taskSelf(), previous[0]);
+        } catch(Unsafe exc) {}
+
+        if(err != Mach.KERN_SUCCESS) {
+            if(remove(name) == replica)
+                port.deallocate();
+            return false;
+        }
+        return true;
+    }
+
+    /** Whether a replica with the given name is in the pool. */
+    private boolean contains(int name) {
+        for(Replica replica : replicas)
+            if(replica.name == name)
+                return true;
+        return false;
+    }
+
+    /** Remove the replica with the given name, if it is in the pool. */
+    private synchronized Replica remove(int name) {
+        Replica[] current = replicas;
+        for(int i = 0; i < current.length; i++)
+            if(current[i].name == name) {
+                Replica[] newReplicas = new Replica[current.length - 1];
+                System.arraycopy(current, 0, newReplicas, 0, i);
+                System.arraycopy(current, i + 1, newReplicas, i,
+                                 current.length - i - 1);
+                replicas = newReplicas;
+                return current[i];
+            }
+        return null;
+    }
+
+    /* The notification carries its own user reference to the dead name. */
+    private void deadName(int name) throws Unsafe {
+        Replica replica = remove(name);
+        if(replica != null)
+            replica.port.deallocate();
+        Mach.Port.deallocate(Mach.taskSelf(), name);
+    }
+
+    /** The number of live replicas. */
+    public int size() {
+        return replicas.length;
+    }
+
+    /**
+     * Pick a replica for a call and count the call as outstanding until
+     * {@link #release} is called. Returns {@code null} if the pool is
+     * empty.
+     */
+    public Replica acquire() {
+        Replica[] current = replicas;
+        int n = current.length;
+        if(n == 0)
+            return null;
+
+        Replica best;
+        if(n == 1)
+            best = current[0];
+        else if(policy == Policy.POWER_OF_TWO_CHOICES) {
+            Random rnd = random.get();
+            int i = rnd.nextInt(n);
+            int j = rnd.nextInt(n - 1);
+            if(j >= i)
+                j++;
+            best = current[i];
+            if(current[j].outstanding.get() < best.outstanding.get())
+                best = current[j];
+        } else {
+            /* Start from a different replica each time so that ties don't
+             * all go to the first one. */
+            int start = (next.getAndIncrement() & Integer.MAX_VALUE) % n;
+            best = current[start];
+            for(int k = 1; k < n; k++) {
+                Replica r = current[(start + k) % n];
+                if(r.outstanding.get() < best.outstanding.get())
+                    best = r;
+            }
+        }
+
+        best.outstanding.incrementAndGet();
+        return best;
+    }
+
+    /** Mark a call started with {@link #acquire} as completed. */
+    public void release(Replica replica) {
+        replica.outstanding.decrementAndGet();
+    }
+
+    /**
+     * Stop watching for dead names and deallocate all the rights. Calls
+     * still in flight keep their port names until they complete.
+     */
+    public void close() {
+        notifyServer.stop();
+
+        Replica[] current;
+        synchronized(this) {
+            current = replicas;
+            replicas = EMPTY;
+        }
+        for(Replica replica : current)
+            replica.port.deallocate();
+        notifyPort.destroy();
+    }
+}
@@ -0,0 +1,216 @@
+package org.gnu.mach.rpc;
+
+import java.nio.ByteBuffer;
+import org.gnu.mach.Mach;
+import org.gnu.mach.MachMsg;
+import org.gnu.mach.MachMsgType;
+import org.gnu.mach.MachPort;
+import org.gnu.mach.Unsafe;
+
+/**
+ * Client side of remote procedure calls.
+ *
+ * This does what the MIG-generated user stubs do around the encoding of
+ * the arguments: each thread gets its own message buffer and reply port,
+ * the request is sent and the reply received with a single
+ * {@code mach_msg()} call, and the reply's ID and return code are checked.
+ * After a receive error, the reply port is destroyed so that a late reply
+ * can't be mistaken for the answer to the next call.
+ *
+ * The proxies generated by {@link RpcProcessor} go through an
+ * {@link RpcClient}, but it can also be used directly:
+ *
+ * <pre>
+ * MachMsg msg = client.begin();
+ * try {
+ *     msg.setRemotePort(server, MachMsgType.COPY_SEND);
+ *     msg.setId(id);
+ *     msg.putInt(arg);
+ *     client.call(msg);
+ *     return msg.getInt();
+ * } finally {
+ *     msg.clear();
+ * }
+ * </pre>
+ *
+ * A {@link ConcurrencyLimiter} can be installed to bound the number of
+ * calls in flight to each destination.
+ */
+public class RpcClient {
+    /** Default size of the message buffers. */
+    public static final int DEFAULT_BUFFER_SIZE = 8192;
+
+    private static final RpcClient defaultClient =
+        new RpcClient(DEFAULT_BUFFER_SIZE);
+
+    private final int bufferSize;
+
+    private final ThreadLocal<MachMsg> buffers = new ThreadLocal<MachMsg>() {
+        protected MachMsg initialValue() {
+            return new MachMsg(bufferSize);
+        }
+    };
+
+    private final ThreadLocal<MachPort> replyPorts =
+        new ThreadLocal<MachPort>();
+
+    private volatile ConcurrencyLimiter limiter;
+
+    public RpcClient(int bufferSize) {
+        this.bufferSize = bufferSize;
+    }
+
+    /** The client used by proxies created without one. */
+    public static RpcClient getDefault() {
+        return defaultClient;
+    }
+
+    /** The size of the message buffers. */
+    public int bufferSize() {
+        return bufferSize;
+    }
+
+    /**
+     * Install a concurrency limiter, or remove it if {@code limiter} is
+     * {@code null}.
+     */
+    public void setLimiter(ConcurrencyLimiter limiter) {
+        this.limiter = limiter;
+    }
+
+    /** The installed concurrency limiter, if any. */
+    public ConcurrencyLimiter limiter() {
+        return limiter;
+    }
+
+    /**
+     * Start a call. Returns the calling thread's message buffer, cleared,
+     * which should be cleared again once the reply has been read.
+     */
+    public MachMsg begin() {
+        return buffers.get().clear();
+    }
+
+    /** Get the calling thread's reply port, allocating it if needed. */
+    MachPort replyPort() {
+        MachPort port = replyPorts.get();
+        if(port == null) {
+            port = MachPort.allocateReplyPort();
+            replyPorts.set(port);
+        }
+        return port;
+    }
+
+    /**
+     * Destroy the calling thread's reply port, which a late reply may
+     * still be sent to. A new one is allocated by the next call.
+     */
+    void abandonReplyPort(MachPort port) {
+        replyPorts.remove();
+        port.destroy();
+    }
+
+    /**
+     * Send a request and wait for its reply.
+     *
+     * The request's destination, ID and arguments must have been set; the
+     * reply port is added here. On success, {@code msg} holds the reply,
+     * flipped and positioned after its return code. Otherwise it has been
+     * cleared and an {@link RpcException} is thrown with the non-zero
+     * return code, the {@code mach_msg()} error, or
+     * {@link Mach#MIG_REPLY_MISMATCH} or {@link Mach#MIG_TYPE_ERROR} if the
+     * reply is not what was expected.
+     *
+     * If a {@link ConcurrencyLimiter} is installed, the call may first
+     * wait for a slot, and fail with the limiter's overload code if none
+     * becomes free in time.
+     */
+    public void call(MachMsg msg) throws RpcException {
+        ConcurrencyLimiter limiter = this.limiter;
+        if(limiter == null) {
+            transact(msg);
+            return;
+        }
+
+        int dest = Mach.Port.NULL;
+        try { dest = msg.buf().getInt(8); } catch(Unsafe exc) {}
+        ConcurrencyLimiter.Limit limit = limiter.get(dest);
+        try {
+            limit.acquire();
+        } catch(RpcException exc) {
+            msg.clear();
+            throw exc;
+        }
+
+        long start = System.nanoTime();
+        int code = 0;
+        try {
+            transact(msg);
+        } catch(RpcException exc) {
+            code = exc.code();
+            throw exc;
+        } finally {
+            limit.release(System.nanoTime() - start, code);
+        }
+    }
+
+    private void transact(MachMsg msg) throws RpcException {
+        int id = msg.getId();
+        MachPort reply = replyPort();
+        msg.setLocalPort(reply, MachMsgType.MAKE_SEND_ONCE);
+
+        int err = Mach.MSG_SUCCESS;
+        try {
+            ByteBuffer buf = msg.buf();
+            int name = reply.name();
+            try {
+                err = Mach.msg(buf, Mach.SEND_MSG | Mach.RCV_MSG, name,
+                               Mach.MSG_TIMEOUT_NONE, Mach.Port.NULL);
+            } finally {
+                reply.releaseName();
+            }
+
+            if(err != Mach.MSG_SUCCESS) {
+                if(!Mach.isSendError(err)) {
+                    /* The request went out with its rights, but the reply
+                     * may still be on its way: start afresh. */
+                    buf.putInt(8, Mach.Port.NULL);
+                    buf.putInt(12, Mach.Port.NULL);
+                    abandonReplyPort(reply);
+                }
+                msg.clear();
+                throw new RpcException(err);
+            }
+
+            checkReply(msg, id);
+        } catch(Unsafe exc) {}
+    }
+
+    /**
+     * Flip a received reply and check its ID and return code, as described
+     * for {@link #call}.
+     */
+    static void checkReply(MachMsg msg, int id) throws RpcException, Unsafe {
+        ByteBuffer buf = msg.buf();
+        msg.flip();
+
+        /* The local port field names our reply port and carries no
+         * reference, so make sure clear() won't try to deallocate it. */
+        buf.putInt(12, Mach.Port.NULL);
+
+        int err;
+        if(msg.getId() != id + 100)
+            err = Mach.MIG_REPLY_MISMATCH;
+        else if(buf.limit() < 32
+                || buf.getInt(24) != RpcCodec.RETCODE_TYPE)
+            err = Mach.MIG_TYPE_ERROR;
+        else
+            err = buf.getInt(28);
+
+        if(err != 0) {
+            msg.clear();
+            throw new RpcException(err);
+        }
+        buf.position(32);
+    }
+}
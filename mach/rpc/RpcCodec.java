@@ -0,0 +1,72 @@
+package org.gnu.mach.rpc;
+
+import java.nio.ByteBuffer;
+import org.gnu.mach.TypeCheckException;
+
+/**
+ * Helpers for the code generated by {@link RpcProcessor}.
+ *
+ * The generated stubs read and write fixed-size items themselves, with
+ * constant type descriptors and offsets. Only the variable-size items and
+ * the checks which would otherwise be repeated over and over are handled
+ * here.
+ */
+public final class RpcCodec {
+    /** Type descriptor of the return code of a reply. */
+    public static final int RETCODE_TYPE = 0x10012002;
+
+    /** First word of an in-line {@code MACH_MSG_TYPE_CHAR} array. */
+    private static final int CHAR_ARRAY_TYPE = 0x30000000;
+
+    private RpcCodec() {}
+
+    /** Check a type descriptor read from a message. */
+    public static void check(int header, int expected)
+        throws TypeCheckException
+    {
+        if(header != expected)
+            throw new TypeCheckException(String.format(
+                        "Type check error (0x%x instead of 0x%x)",
+                        header, expected));
+    }
+
+    /** Check that a message has been read completely. */
+    public static void checkEnd(ByteBuffer buf) throws TypeCheckException {
+        if(buf.position() != buf.limit())
+            throw new TypeCheckException(String.format(
+                        "Message size is %d, expected %d",
+                        buf.limit(), buf.position()));
+    }
+
+    /** Append an in-line byte array, as {@code MachMsg.putBytes} does. */
+    public static void putBytes(ByteBuffer buf, byte[] data) {
+        buf.putInt(CHAR_ARRAY_TYPE);
+        buf.putShort((short) 8);
+        buf.putShort((short) 8);
+        buf.putInt(data.length);
+        buf.put(data);
+        while(buf.position() % 4 != 0)
+            buf.put((byte) 0);
+    }
+
+    /**
+     * Read an in-line byte array. Out-of-line arrays are not supported
+     * and fail the type check.
+     */
+    public static byte[] getBytes(ByteBuffer buf) throws TypeCheckException {
+        check(buf.getInt(), CHAR_ARRAY_TYPE);
+        if(buf.getShort() != 8 || buf.getShort() != 8)
+            throw new TypeCheckException("Type check error (not a char array)");
+
+        int number = buf.getInt();
+        if(number < 0 || number > buf.remaining())
+            throw new TypeCheckException(String.format(
+                        "Type check error: %d bytes announced, %d left",
+                        number, buf.remaining()));
+
+        byte[] data = new byte[number];
+        buf.get(data);
+        buf.position(Math.min((buf.position() + 3) & ~3, buf.limit()));
+        return data;
+    }
+}
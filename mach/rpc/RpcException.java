@@ -0,0 +1,24 @@
+package org.gnu.mach.rpc;
+
+/**
+ * Failed remote procedure call.
+ *
+ * The code is either the non-zero return code of the reply, such as a
+ * Hurd error number, or the error returned by {@code mach_msg()} if the
+ * call did not go through.
+ */
+public class RpcException extends Exception {
+    static final long serialVersionUID = 6412780351194236471L;
+
+    private final int code;
+
+    public RpcException(int code) {
+        super(String.format("RPC failed (0x%x)", code));
+        this.code = code;
+    }
+
+    /** The return code. */
+    public int code() {
+        return code;
+    }
+}
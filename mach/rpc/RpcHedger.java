@@ -0,0 +1,312 @@
+package org.gnu.mach.rpc;
+
+import java.nio.ByteBuffer;
+import java.util.Arrays;
+import java.util.concurrent.atomic.AtomicLong;
+import org.gnu.mach.Mach;
+import org.gnu.mach.MachMsg;
+import org.gnu.mach.MachMsgType;
+import org.gnu.mach.MachPort;
+import org.gnu.mach.TypeCheckException;
+import org.gnu.mach.Unsafe;
+
+/**
+ * Hedged calls to replicated servers.
+ *
+ * With several instances of a server in a {@link ReplicaPool}, the tail
+ * latency of a client is set by the occasional instance which happens to
+ * be slow. An {@link RpcHedger} sends each request to one replica, and
+ * if no reply has come back after a delay, sends a copy to a second
+ * replica; whichever reply arrives first is returned. Both copies ask for
+ * their reply on the same send-once port, which is destroyed once a
+ * hedged call completes, so that the late reply is discarded by the
+ * kernel instead of being mistaken for the answer to the next call.
+ *
+ * The delay is learned: it is the given percentile of the latencies of
+ * the recent calls, so that only about the slowest calls are hedged. This
+ * is only safe for idempotent requests such as {@code io_read},
+ * {@code io_stat} or {@code dir_lookup}, and only for requests whose body
+ * carries plain data, since port rights and out-of-line memory can't be
+ * sent twice. Use it in the same way as {@link RpcClient}, without
+ * setting the destination, which is picked from the pool:
+ *
+ * <pre>
+ * MachMsg msg = hedger.begin();
+ * try {
+ *     msg.setId(MsgIds.IO_READ);
+ *     msg.putLong(offset);
+ *     msg.putInt(amount);
+ *     hedger.call(msg);
+ *     return msg.getBytes();
+ * } finally {
+ *     msg.clear();
+ * }
+ * </pre>
+ */
+public class RpcHedger {
+    /** Number of recent latencies the delay is computed from. */
+    private static final int WINDOW = 256;
+
+    /** Number of calls between two updates of the delay. */
+    private static final int UPDATE_INTERVAL = 32;
+
+    private final RpcClient client;
+    private final ReplicaPool pool;
+    private final double percentile;
+
+    private final long[] samples = new long[WINDOW];
+    private int next;
+    private int count;
+    private int sinceUpdate;
+    private volatile long delay;
+
+    private final AtomicLong calls = new AtomicLong();
+    private final AtomicLong hedged = new AtomicLong();
+
+    private final ThreadLocal<MachMsg> hedges = new ThreadLocal<MachMsg>() {
+        protected MachMsg initialValue() {
+            return new MachMsg(client.bufferSize());
+        }
+    };
+
+    /**
+     * Create a hedger.
+     *
+     * @param client        The client whose buffers and reply ports are
+     *                      used.
+     * @param pool          The replicas to send the requests to.
+     * @param percentile    The percentile of the latency after which a
+     *                      call is hedged, such as 0.95.
+     * @param initialDelay  The delay used until enough calls have been
+     *                      made to learn it, in nanoseconds.
+     */
+    public RpcHedger(RpcClient client, ReplicaPool pool, double percentile,
+                     long initialDelay)
+    {
+        if(percentile <= 0 || percentile >= 1)
+            throw new IllegalArgumentException();
+
+        this.client = client;
+        this.pool = pool;
+        this.percentile = percentile;
+        this.delay = initialDelay;
+    }
+
+    /** Start a call, as {@link RpcClient#begin}. */
+    public MachMsg begin() {
+        return client.begin();
+    }
+
+    /** The current hedging delay, in nanoseconds. */
+    public long delay() {
+        return delay;
+    }
+
+    /** The number of calls made. */
+    public long calls() {
+        return calls.get();
+    }
+
+    /** The number of calls which were sent to a second replica. */
+    public long hedged() {
+        return hedged.get();
+    }
+
+    private synchronized void record(long nanos) {
+        samples[next] = nanos;
+        next = (next + 1) % WINDOW;
+        if(count < WINDOW)
+            count++;
+        if(++sinceUpdate >= UPDATE_INTERVAL && count >= WINDOW / 4) {
+            sinceUpdate = 0;
+            long[] sorted = Arrays.copyOf(samples, count);
+            Arrays.sort(sorted);
+            delay = sorted[(int) (percentile * (sorted.length - 1))];
+        }
+    }
+
+    /**
+     * Send a request to one of the replicas, and to a second one if it
+     * takes too long, and wait for the first reply. On return, or when an
+     * {@link RpcException} is thrown, {@code msg} is in the same state as
+     * with {@link RpcClient#call}. Fails with {@link Mach#SEND_INVALID_DEST}
+     * if the pool is empty.
+     *
+     * If the client has a {@link ConcurrencyLimiter}, each replica the
+     * request is sent to takes one of its slots: the call waits for a
+     * slot on the first replica as {@link RpcClient#call} does, and is
+     * only hedged if the second replica has a slot free.
+     */
+    public void call(MachMsg msg) throws RpcException {
+        ReplicaPool.Replica first = pool.acquire();
+        if(first == null) {
+            msg.clear();
+            throw new RpcException(Mach.SEND_INVALID_DEST);
+        }
+
+        ConcurrencyLimiter limiter = client.limiter();
+        ConcurrencyLimiter.Limit firstLimit = null;
+        if(limiter != null) {
+            firstLimit = limiter.get(first.name());
+            try {
+                firstLimit.acquire();
+            } catch(RpcException exc) {
+                pool.release(first);
+                msg.clear();
+                throw exc;
+            }
+        }
+        Hedge second = null;
+        calls.incrementAndGet();
+        int code = 0;
+
+        int id = msg.getId();
+        MachPort reply = client.replyPort();
+        msg.setRemotePort(first.port(), MachMsgType.COPY_SEND);
+        msg.setLocalPort(reply, MachMsgType.MAKE_SEND_ONCE);
+
+        long start = System.nanoTime();
+        try {
+            ByteBuffer buf = msg.buf();
+
+            /* Keep a copy of the request in case we have to send it again. */
+            byte[] raw = null;
+            if(pool.size() > 1) {
+                ByteBuffer data = buf.duplicate();
+                data.flip();
+                raw = new byte[data.remaining()];
+                data.get(raw);
+            }
+
+            int err;
+            int name = reply.name();
+            try {
+                if(raw == null)
+                    err = Mach.msg(buf, Mach.SEND_MSG | Mach.RCV_MSG, name,
+                                   Mach.MSG_TIMEOUT_NONE, Mach.Port.NULL);
+                else {
+                    long timeout = Math.max(1, delay / 1000000);
+                    err = Mach.msg(buf, Mach.SEND_MSG | Mach.RCV_MSG
+                                        | Mach.RCV_TIMEOUT,
+                                   name, timeout, Mach.Port.NULL);
+                }
+
+                if(err == Mach.RCV_TIMED_OUT) {
+                    /* The request went out with its header rights. */
+                    buf.putInt(8, Mach.Port.NULL);
+                    buf.putInt(12, Mach.Port.NULL);
+                    msg.clear();
+
+                    second = hedge(id, raw, reply, first, limiter);
+                    err = Mach.msg(buf, Mach.RCV_MSG, name,
+                                   Mach.MSG_TIMEOUT_NONE, Mach.Port.NULL);
+                }
+            } finally {
+                reply.releaseName();
+            }
+
+            if(err != Mach.MSG_SUCCESS) {
+                if(!Mach.isSendError(err)) {
+                    buf.putInt(8, Mach.Port.NULL);
+                    buf.putInt(12, Mach.Port.NULL);
+                    client.abandonReplyPort(reply);
+                }
+                msg.clear();
+                code = err;
+                throw new RpcException(err);
+            }
+
+            record(System.nanoTime() - start);
+            try {
+                RpcClient.checkReply(msg, id);
+            } catch(RpcException exc) {
+                code = exc.code();
+                throw exc;
+            } finally {
+                /* The other replica may still answer. */
+                if(second != null)
+                    client.abandonReplyPort(reply);
+            }
+        } catch(Unsafe exc) {
+        } finally {
+            long end = System.nanoTime();
+            pool.release(first);
+            if(firstLimit != null)
+                firstLimit.release(end - start, code);
+            if(second != null) {
+                pool.release(second.replica);
+                if(second.limit != null)
+                    second.limit.release(end - second.start, code);
+            }
+        }
+    }
+
+    /** A copy of a request sent to a second replica. */
+    private static final class Hedge {
+        final ReplicaPool.Replica replica;
+        final ConcurrencyLimiter.Limit limit;
+        final long start = System.nanoTime();
+
+        Hedge(ReplicaPool.Replica replica, ConcurrencyLimiter.Limit limit) {
+            this.replica = replica;
+            this.limit = limit;
+        }
+    }
+
+    /**
+     * Send a copy of a request to another replica than {@code first}.
+     * Returns the hedge, or {@code null} if the request could not be
+     * hedged.
+     */
+    private Hedge hedge(int id, byte[] raw, MachPort reply,
+                        ReplicaPool.Replica first, ConcurrencyLimiter limiter)
+        throws Unsafe
+    {
+        ReplicaPool.Replica second = pool.acquire();
+        if(second == null)
+            return null;
+        if(second == first) {
+            pool.release(second);
+            return null;
+        }
+
+        /* Don't wait for a slot: the first replica may still answer. */
+        ConcurrencyLimiter.Limit limit = null;
+        if(limiter != null) {
+            limit = limiter.get(second.name());
+            if(!limit.tryAcquire()) {
+                pool.release(second);
+                return null;
+            }
+        }
+
+        MachMsg copy = hedges.get().clear();
+        copy.setRemotePort(second.port(), MachMsgType.COPY_SEND);
+        copy.setLocalPort(reply, MachMsgType.MAKE_SEND_ONCE);
+        copy.setId(id);
+        int err;
+        try {
+            copy.putRawBody(raw);
+            err = Mach.msg(copy.buf(), Mach.SEND_MSG, Mach.Port.NULL,
+                           Mach.MSG_TIMEOUT_NONE, Mach.Port.NULL);
+        } catch(TypeCheckException exc) {
+            err = Mach.SEND_INVALID_DATA;
+        }
+
+        if(err == Mach.MSG_SUCCESS) {
+            ByteBuffer buf = copy.buf();
+            buf.putInt(8, Mach.Port.NULL);
+            buf.putInt(12, Mach.Port.NULL);
+        }
+        copy.clear();
+
+        if(err != Mach.MSG_SUCCESS) {
+            pool.release(second);
+            if(limit != null)
+                limit.release(0, err);
+            return null;
+        }
+        hedged.incrementAndGet();
+        return new Hedge(second, limit);
+    }
+}
@@ -0,0 +1,706 @@
+package org.gnu.mach.rpc;
+
+import java.io.IOException;
+import java.io.Writer;
+import java.util.ArrayList;
+import java.util.HashMap;
+import java.util.LinkedHashMap;
+import java.util.List;
+import java.util.Map;
+import java.util.Set;
+import javax.annotation.processing.AbstractProcessor;
+import javax.annotation.processing.RoundEnvironment;
+import javax.annotation.processing.SupportedAnnotationTypes;
+import javax.lang.model.SourceVersion;
+import javax.lang.model.element.AnnotationMirror;
+import javax.lang.model.element.AnnotationValue;
+import javax.lang.model.element.Element;
+import javax.lang.model.element.ElementKind;
+import javax.lang.model.element.ExecutableElement;
+import javax.lang.model.element.PackageElement;
+import javax.lang.model.element.TypeElement;
+import javax.lang.model.element.VariableElement;
+import javax.lang.model.type.ArrayType;
+import javax.lang.model.type.DeclaredType;
+import javax.lang.model.type.TypeKind;
+import javax.lang.model.type.TypeMirror;
+import javax.tools.Diagnostic;
+
+/**
+ * Annotation processor generating RPC stubs from Java interfaces.
+ *
+ * This does for interfaces declared in Java what MIG does for
+ * {@code .defs} files. Each method of the interface is annotated with its
+ * {@link MsgId}; its first parameter is the {@link org.gnu.mach.MachPort}
+ * the request is sent to, and the other ones are sent in order as the
+ * request's data items. The result, if any, follows the return code in
+ * the reply. For instance:
+ *
+ * <pre>
+ * public interface Io {
+ *     &#64;MsgId(21000)
+ *     int write(&#64;CopySend MachPort io, byte[] data, long offset)
+ *         throws RpcException;
+ * }
+ * </pre>
+ *
+ * The supported types are {@code int} and {@code boolean}
+ * ({@code MACH_MSG_TYPE_INTEGER_32}), {@code long}
+ * ({@code MACH_MSG_TYPE_INTEGER_64}), {@code byte[]} (in-line
+ * {@code MACH_MSG_TYPE_CHAR} arrays) and {@link org.gnu.mach.MachPort},
+ * sent as {@link CopySend} unless another disposition is given. The
+ * methods must declare {@link RpcException}.
+ *
+ * For an interface {@code Io}, this generates {@code IoProxy}, which
+ * implements it by making the calls through an {@link RpcClient}, and
+ * {@code IoSkeleton}, an {@link RpcSkeleton} which dispatches requests to
+ * an implementation. The generated code reads and writes the items
+ * directly, with their type descriptors as constants and, up to the
+ * first variable-size item, at constant offsets; it involves no
+ * reflection at run time.
+ */
+@SupportedAnnotationTypes("org.gnu.mach.rpc.MsgId")
+public class RpcProcessor extends AbstractProcessor {
+    private static final String PKG = "org.gnu.mach.rpc.";
+    private static final String MACH_PORT = "org.gnu.mach.MachPort";
+
+    /* Kinds of items */
+    private static final int INT = 0;
+    private static final int BOOLEAN = 1;
+    private static final int LONG = 2;
+    private static final int BYTES = 3;
+    private static final int PORT = 4;
+
+    /* Type descriptors of the fixed-size items */
+    private static final int INTEGER_32_TYPE = 0x10012002;
+    private static final int INTEGER_64_TYPE = 0x1001400b;
+
+    /**
+     * Port dispositions: the annotation, the type to send the port with,
+     * and the type it is received as.
+     */
+    private static final String[][] DISPOSITIONS = {
+        { "CopySend", "COPY_SEND", "PORT_SEND" },
+        { "MakeSend", "MAKE_SEND", "PORT_SEND" },
+        { "MoveSend", "MOVE_SEND", "PORT_SEND" },
+        { "MakeSendOnce", "MAKE_SEND_ONCE", "PORT_SEND_ONCE" },
+        { "MoveSendOnce", "MOVE_SEND_ONCE", "PORT_SEND_ONCE" },
+        { "MoveReceive", "MOVE_RECEIVE", "PORT_RECEIVE" },
+    };
+
+    /** A data item of a request or reply. */
+    private static class Item {
+        int kind;
+        String type;        /* Java type */
+        String name;        /* Parameter name, or expression to send */
+        int disposition;    /* Index into DISPOSITIONS */
+
+        /** Size of a fixed-size item, including its type descriptor. */
+        int size() {
+            return (kind == LONG) ? 12 : 8;
+        }
+
+        int header() {
+            return (kind == LONG) ? INTEGER_64_TYPE : INTEGER_32_TYPE;
+        }
+
+        boolean fixed() {
+            return kind == INT || kind == BOOLEAN || kind == LONG;
+        }
+    }
+
+    /** A method of an RPC interface. */
+    private static class Routine {
+        String name;
+        int id;
+        Item dest;
+        List<Item> args = new ArrayList<Item>();
+        Item result;        /* null for void */
+        List<String> thrown = new ArrayList<String>();
+    }
+
+    public SourceVersion getSupportedSourceVersion() {
+        return SourceVersion.latestSupported();
+    }
+
+    public boolean process(Set<? extends TypeElement> annotations,
+                           RoundEnvironment env)
+    {
+        TypeElement msgId = processingEnv.getElementUtils()
+                                         .getTypeElement(PKG + "MsgId");
+        if(msgId == null)
+            return false;
+
+        /* Collect the interfaces with annotated methods. */
+        Map<TypeElement, Boolean> ifaces =
+            new LinkedHashMap<TypeElement, Boolean>();
+        for(Element e : env.getElementsAnnotatedWith(msgId)) {
+            Element owner = e.getEnclosingElement();
+            if(owner.getKind() != ElementKind.INTERFACE) {
+                error(e, "@MsgId is only allowed in interfaces");
+                continue;
+            }
+            ifaces.put((TypeElement) owner, Boolean.TRUE);
+        }
+
+        for(TypeElement iface : ifaces.keySet()) {
+            List<Routine> routines = parse(iface);
+            if(routines == null)
+                continue;
+            try {
+                generateProxy(iface, routines);
+                generateSkeleton(iface, routines);
+            } catch(IOException exc) {
+                error(iface, "cannot write stubs: " + exc.getMessage());
+            }
+        }
+        return true;
+    }
+
+    private void error(Element e, String msg) {
+        processingEnv.getMessager().printMessage(Diagnostic.Kind.ERROR,
+                                                 msg, e);
+    }
+
+    /* Parsing */
+
+    /** Find an annotation by its name in the rpc package. */
+    private static AnnotationMirror annotation(Element e, String name) {
+        for(AnnotationMirror m : e.getAnnotationMirrors()) {
+            TypeElement type =
+                (TypeElement) m.getAnnotationType().asElement();
+            if(type.getQualifiedName().contentEquals(PKG + name))
+                return m;
+        }
+        return null;
+    }
+
+    /** The port disposition given by the annotations of an element. */
+    private int disposition(Element e) {
+        int found = -1;
+        for(int i = 0; i < DISPOSITIONS.length; i++)
+            if(annotation(e, DISPOSITIONS[i][0]) != null) {
+                if(found >= 0)
+                    error(e, "conflicting port dispositions");
+                found = i;
+            }
+        return (found >= 0) ? found : 0;
+    }
+
+    /** Classify a type, or return -1 if it is not supported. */
+    private static int kind(TypeMirror t) {
+        switch(t.getKind()) {
+            case INT:
+                return INT;
+            case BOOLEAN:
+                return BOOLEAN;
+            case LONG:
+                return LONG;
+            case ARRAY:
+                if(((ArrayType) t).getComponentType().getKind()
+                        == TypeKind.BYTE)
+                    return BYTES;
+                return -1;
+            case DECLARED:
+                TypeElement e = (TypeElement) ((DeclaredType) t).asElement();
+                if(e.getQualifiedName().contentEquals(MACH_PORT))
+                    return PORT;
+                return -1;
+            default:
+                return -1;
+        }
+    }
+
+    private Item item(Element e, TypeMirror type, String name) {
+        Item item = new Item();
+        item.kind = kind(type);
+        item.type = type.toString();
+        item.name = name;
+        if(item.kind < 0)
+            error(e, "unsupported type " + type);
+        else if(item.kind == PORT)
+            item.disposition = disposition(e);
+        return item;
+    }
+
+    /** Parse the methods of an interface; returns null on error. */
+    private List<Routine> parse(TypeElement iface) {
+        TypeMirror rpcException = processingEnv.getElementUtils()
+            .getTypeElement(PKG + "RpcException").asType();
+        List<Routine> routines = new ArrayList<Routine>();
+        Map<Integer, Routine> ids = new HashMap<Integer, Routine>();
+        boolean ok = true;
+
+        for(Element e : iface.getEnclosedElements()) {
+            if(e.getKind() != ElementKind.METHOD)
+                continue;
+            ExecutableElement m = (ExecutableElement) e;
+            Routine r = new Routine();
+            r.name = m.getSimpleName().toString();
+
+            AnnotationMirror id = annotation(m, "MsgId");
+            if(id == null) {
+                error(m, "RPC interface method without @MsgId");
+                ok = false;
+                continue;
+            }
+            for(AnnotationValue v : id.getElementValues().values())
+                r.id = (Integer) v.getValue();
+            if(ids.containsKey(r.id)) {
+                error(m, "duplicate message ID " + r.id);
+                ok = false;
+            }
+            ids.put(r.id, r);
+
+            if(!m.getTypeParameters().isEmpty()) {
+                error(m, "RPC methods can't be generic");
+                ok = false;
+            }
+
+            List<? extends VariableElement> params = m.getParameters();
+            for(int i = 0; i < params.size(); i++) {
+                VariableElement p = params.get(i);
+                Item item = item(p, p.asType(), p.getSimpleName().toString());
+                if(item.kind < 0)
+                    ok = false;
+                if(i == 0)
+                    r.dest = item;
+                else
+                    r.args.add(item);
+            }
+            if(r.dest == null || r.dest.kind != PORT
+                    || DISPOSITIONS[r.dest.disposition][0]
+                           .equals("MoveReceive")) {
+                error(m, "the first parameter must be the destination port,"
+                         + " passed as a send or send-once right");
+                ok = false;
+            }
+
+            if(m.getReturnType().getKind() != TypeKind.VOID) {
+                r.result = item(m, m.getReturnType(), "result");
+                if(r.result.kind < 0)
+                    ok = false;
+            }
+
+            boolean declared = false;
+            for(TypeMirror t : m.getThrownTypes()) {
+                r.thrown.add(t.toString());
+                if(processingEnv.getTypeUtils().isAssignable(rpcException,
+                                                             t))
+                    declared = true;
+            }
+            if(!declared) {
+                error(m, "RPC methods must throw RpcException");
+                ok = false;
+            }
+
+            routines.add(r);
+        }
+        return ok ? routines : null;
+    }
+
+    /* Code generation */
+
+    /** Accumulates the generated source. */
+    private static class Source {
+        final StringBuilder text = new StringBuilder();
+        int indent;
+
+        void line(String s) {
+            if(s.length() > 0)
+                for(int i = 0; i < indent; i++)
+                    text.append("    ");
+            text.append(s).append('\n');
+        }
+
+        void open(String s) {
+            line(s);
+            indent++;
+        }
+
+        void close(String s) {
+            indent--;
+            line(s);
+        }
+    }
+
+    private static String hex(int value) {
+        return String.format("0x%08x", value);
+    }
+
+    /** The value to send for a fixed-size item. */
+    private static String value(Item item) {
+        return (item.kind == BOOLEAN) ? "(" + item.name + " ? 1 : 0)"
+                                      : item.name;
+    }
+
+    /**
+     * Emit the code appending {@code items} to a message, starting at
+     * offset {@code off}.
+     */
+    private static void encode(Source out, List<Item> items, String msg,
+                               String buf, int off)
+    {
+        for(Item item : items) {
+            String put = (item.kind == LONG) ? ".putLong(" : ".putInt(";
+            if(item.fixed() && off >= 0) {
+                out.line(buf + ".putInt(" + off + ", " + hex(item.header())
+                         + ");");
+                out.line(buf + put + (off + 4) + ", " + value(item) + ");");
+                off += item.size();
+                continue;
+            }
+
+            if(off >= 0) {
+                out.line(buf + ".position(" + off + ");");
+                off = -1;
+            }
+            if(item.fixed()) {
+                out.line(buf + ".putInt(" + hex(item.header()) + ");");
+                out.line(buf + put + value(item) + ");");
+            } else if(item.kind == BYTES) {
+                out.line("RpcCodec.putBytes(" + buf + ", " + item.name + ");");
+            } else {
+                out.line(msg + ".putPort(MachMsgType."
+                         + DISPOSITIONS[item.disposition][1] + ", "
+                         + item.name + ");");
+            }
+        }
+        if(off >= 0)
+            out.line(buf + ".position(" + off + ");");
+    }
+
+    /**
+     * Emit the code reading {@code items} from a message into variables
+     * of the same names, starting at offset {@code off}, and checking that
+     * nothing is left.
+     */
+    private static void decode(Source out, List<Item> items, String msg,
+                               String buf, int off)
+    {
+        for(Item item : items) {
+            String get = (item.kind == LONG) ? ".getLong(" : ".getInt(";
+            String test = (item.kind == BOOLEAN) ? " != 0" : "";
+            if(item.fixed() && off >= 0) {
+                out.line("RpcCodec.check(" + buf + ".getInt(" + off + "), "
+                         + hex(item.header()) + ");");
+                out.line(item.name + " = " + buf + get + (off + 4) + ")"
+                         + test + ";");
+                off += item.size();
+                continue;
+            }
+
+            if(off >= 0) {
+                out.line(buf + ".position(" + off + ");");
+                off = -1;
+            }
+            if(item.fixed()) {
+                out.line("RpcCodec.check(" + buf + ".getInt(), "
+                         + hex(item.header()) + ");");
+                out.line(item.name + " = " + buf + get + ")" + test + ";");
+            } else if(item.kind == BYTES) {
+                out.line(item.name + " = RpcCodec.getBytes(" + buf + ");");
+            } else {
+                out.line(item.name + " = " + msg + ".getPort(MachMsgType."
+                         + DISPOSITIONS[item.disposition][2] + ");");
+            }
+        }
+        if(off >= 0)
+            out.line(buf + ".position(" + off + ");");
+        out.line("RpcCodec.checkEnd(" + buf + ");");
+    }
+
+    private static boolean hasPorts(List<Item> items) {
+        for(Item item : items)
+            if(item.kind == PORT)
+                return true;
+        return false;
+    }
+
+    private static void header(Source out, TypeElement iface,
+                               String[] imports)
+    {
+        out.line("/* Generated by " + RpcProcessor.class.getName()
+                 + " from " + iface.getQualifiedName() + ". */");
+        String pkg = packageName(iface);
+        if(pkg.length() > 0) {
+            out.line("package " + pkg + ";");
+            out.line("");
+        }
+        for(String i : imports)
+            out.line("import " + i + ";");
+        out.line("");
+    }
+
+    private static String packageName(Element e) {
+        while(!(e instanceof PackageElement))
+            e = e.getEnclosingElement();
+        return ((PackageElement) e).getQualifiedName().toString();
+    }
+
+    private static void bufferMethod(Source out) {
+        out.open("private static ByteBuffer buffer(MachMsg msg) {");
+        out.open("try {");
+        out.line("return msg.buf();");
+        out.close("} catch(Unsafe exc) {");
+        out.indent++;
+        out.line("throw new AssertionError(exc);");
+        out.close("}");
+        out.close("}");
+    }
+
+    private static String signature(Routine r) {
+        StringBuilder s = new StringBuilder("public ");
+        s.append((r.result != null) ? r.result.type : "void");
+        s.append(' ').append(r.name).append('(');
+        s.append(r.dest.type).append(' ').append(r.dest.name);
+        for(Item item : r.args)
+            s.append(", ").append(item.type).append(' ').append(item.name);
+        s.append(')');
+        return s.toString();
+    }
+
+    private static String throwsClause(Routine r) {
+        StringBuilder s = new StringBuilder("throws ");
+        for(int i = 0; i < r.thrown.size(); i++)
+            s.append((i > 0) ? ", " : "").append(r.thrown.get(i));
+        return s.toString();
+    }
+
+    private void write(TypeElement iface, String name, Source out)
+        throws IOException
+    {
+        String pkg = packageName(iface);
+        String qname = (pkg.length() > 0) ? pkg + "." + name : name;
+        Writer w = processingEnv.getFiler()
+                                .createSourceFile(qname, iface)
+                                .openWriter();
+        try {
+            w.write(out.text.toString());
+        } finally {
+            w.close();
+        }
+    }
+
+    private void generateProxy(TypeElement iface, List<Routine> routines)
+        throws IOException
+    {
+        String ifaceName = iface.getSimpleName().toString();
+        String name = ifaceName + "Proxy";
+        Source out = new Source();
+        header(out, iface, new String[] {
+            "java.nio.BufferUnderflowException",
+            "java.nio.ByteBuffer",
+            "org.gnu.mach.Mach",
+            "org.gnu.mach.MachMsg",
+            "org.gnu.mach.MachMsgType",
+            "org.gnu.mach.TypeCheckException",
+            "org.gnu.mach.Unsafe",
+            "org.gnu.mach.rpc.RpcClient",
+            "org.gnu.mach.rpc.RpcCodec",
+            "org.gnu.mach.rpc.RpcException",
+        });
+
+        out.line("/** Client proxy for {@link " + ifaceName + "}. */");
+        out.open("public class " + name + " implements "
+                 + iface.getQualifiedName() + " {");
+        out.line("private final RpcClient client;");
+        out.line("");
+        out.open("public " + name + "(RpcClient client) {");
+        out.line("this.client = client;");
+        out.close("}");
+        out.line("");
+        out.open("public " + name + "() {");
+        out.line("this(RpcClient.getDefault());");
+        out.close("}");
+        out.line("");
+        bufferMethod(out);
+
+        for(Routine r : routines) {
+            String mname = DISPOSITIONS[r.dest.disposition][1];
+            out.line("");
+            out.line(signature(r));
+            out.indent++;
+            out.line(throwsClause(r));
+            out.indent--;
+            out.open("{");
+            out.line("MachMsg _msg = client.begin();");
+            out.open("try {");
+            out.line("ByteBuffer _buf = buffer(_msg);");
+            out.line("_msg.setRemotePort(" + r.dest.name + ", MachMsgType."
+                     + mname + ");");
+            out.line("_msg.setId(" + r.id + ");");
+            if(hasPorts(r.args)) {
+                out.open("try {");
+                encode(out, r.args, "_msg", "_buf", 24);
+                out.close("} catch(TypeCheckException exc) {");
+                out.indent++;
+                out.line("throw new AssertionError(exc);");
+                out.close("}");
+            } else {
+                encode(out, r.args, "_msg", "_buf", 24);
+            }
+            out.line("client.call(_msg);");
+            out.line("");
+
+            List<Item> results = new ArrayList<Item>();
+            if(r.result != null) {
+                Item result = new Item();
+                result.kind = r.result.kind;
+                result.type = r.result.type;
+                result.name = "_result";
+                result.disposition = r.result.disposition;
+                results.add(result);
+                out.line(result.type + " _result;");
+            }
+            out.open("try {");
+            decode(out, results, "_msg", "_buf", 32);
+            out.close("} catch(TypeCheckException exc) {");
+            out.indent++;
+            out.line("throw new RpcException(Mach.MIG_TYPE_ERROR);");
+            out.close("} catch(BufferUnderflowException exc) {");
+            out.indent++;
+            out.line("throw new RpcException(Mach.MIG_TYPE_ERROR);");
+            out.close("} catch(IndexOutOfBoundsException exc) {");
+            out.indent++;
+            out.line("throw new RpcException(Mach.MIG_TYPE_ERROR);");
+            out.close("}");
+            if(r.result != null)
+                out.line("return _result;");
+            out.close("} finally {");
+            out.indent++;
+            out.line("_msg.clear();");
+            out.close("}");
+            out.close("}");
+        }
+
+        out.close("}");
+        write(iface, name, out);
+    }
+
+    private void generateSkeleton(TypeElement iface, List<Routine> routines)
+        throws IOException
+    {
+        String ifaceName = iface.getSimpleName().toString();
+        String qname = iface.getQualifiedName().toString();
+        String name = ifaceName + "Skeleton";
+        Source out = new Source();
+        header(out, iface, new String[] {
+            "java.nio.BufferUnderflowException",
+            "java.nio.ByteBuffer",
+            "org.gnu.mach.Mach",
+            "org.gnu.mach.MachMsg",
+            "org.gnu.mach.MachMsgType",
+            "org.gnu.mach.MachPort",
+            "org.gnu.mach.TypeCheckException",
+            "org.gnu.mach.Unsafe",
+            "org.gnu.mach.rpc.RpcCodec",
+            "org.gnu.mach.rpc.RpcException",
+            "org.gnu.mach.rpc.RpcSkeleton",
+        });
+
+        out.line("/** Server skeleton for {@link " + ifaceName + "}. */");
+        out.open("public class " + name + " extends RpcSkeleton<" + qname
+                 + "> {");
+        out.open("public " + name + "(" + qname + " target) {");
+        out.line("super(target);");
+        out.close("}");
+        out.line("");
+        out.open("public " + name + "(RpcSkeleton.Lookup<" + qname
+                 + "> lookup) {");
+        out.line("super(lookup);");
+        out.close("}");
+        out.line("");
+        bufferMethod(out);
+        out.line("");
+
+        out.line("public boolean demux(int port, MachMsg request, "
+                 + "MachMsg reply)");
+        out.indent++;
+        out.line("throws TypeCheckException");
+        out.indent--;
+        out.open("{");
+        out.open("switch(request.getId()) {");
+        for(Routine r : routines) {
+            out.open("case " + r.id + ":");
+            out.line("return " + r.name + "(port, request, reply);");
+            out.indent--;
+        }
+        out.open("default:");
+        out.line("return false;");
+        out.indent--;
+        out.close("}");
+        out.close("}");
+
+        for(Routine r : routines) {
+            /* Rename the arguments so they can't clash with our locals. */
+            List<Item> args = new ArrayList<Item>();
+            StringBuilder call = new StringBuilder("MachPort.NULL");
+            for(int i = 0; i < r.args.size(); i++) {
+                Item arg = new Item();
+                arg.kind = r.args.get(i).kind;
+                arg.type = r.args.get(i).type;
+                arg.name = "arg" + (i + 1);
+                arg.disposition = r.args.get(i).disposition;
+                args.add(arg);
+                call.append(", ").append(arg.name);
+            }
+
+            out.line("");
+            out.line("private boolean " + r.name
+                     + "(int port, MachMsg request, MachMsg reply)");
+            out.indent++;
+            out.line("throws TypeCheckException");
+            out.indent--;
+            out.open("{");
+            out.line("ByteBuffer in = buffer(request);");
+            for(Item arg : args)
+                out.line(arg.type + " " + arg.name + ";");
+            out.open("try {");
+            decode(out, args, "request", "in", 24);
+            out.close("} catch(BufferUnderflowException exc) {");
+            out.indent++;
+            out.line("throw new TypeCheckException(\"Message too short\");");
+            out.close("} catch(IndexOutOfBoundsException exc) {");
+            out.indent++;
+            out.line("throw new TypeCheckException(\"Message too short\");");
+            out.close("}");
+            out.line("");
+
+            out.line(qname + " target = target(port);");
+            out.open("if(target == null) {");
+            out.line("reply.putInt(Mach.MIG_BAD_ARGUMENTS);");
+            out.line("return true;");
+            out.close("}");
+            out.line("");
+
+            if(r.result != null)
+                out.line(r.result.type + " result;");
+            out.open("try {");
+            out.line(((r.result != null) ? "result = " : "")
+                     + "target." + r.name + "(" + call + ");");
+            out.close("} catch(RpcException exc) {");
+            out.indent++;
+            out.line("reply.putInt(exc.code());");
+            out.line("return true;");
+            out.close("}");
+            out.line("");
+
+            /* The return code is just another integer item. */
+            List<Item> results = new ArrayList<Item>();
+            Item retCode = new Item();
+            retCode.kind = INT;
+            retCode.name = "0";
+            results.add(retCode);
+            if(r.result != null)
+                results.add(r.result);
+            out.line("ByteBuffer out = buffer(reply);");
+            encode(out, results, "reply", "out", 24);
+            out.line("return true;");
+            out.close("}");
+        }
+
+        out.close("}");
+        write(iface, name, out);
+    }
+}
@@ -0,0 +1,46 @@
+package org.gnu.mach.rpc;
+
+import org.gnu.mach.MachServer;
+
+/**
+ * Base class of the server skeletons generated by {@link RpcProcessor}.
+ *
+ * A skeleton is a {@link MachServer.Demuxer} which decodes the requests
+ * of an RPC interface, calls the corresponding method of the object the
+ * request is addressed to and encodes the reply. The object is found by
+ * a {@link Lookup} from the name of the port the request arrived on, the
+ * way MIG's {@code intran} functions look up Hurd port objects; the
+ * destination parameter of the interface methods is always
+ * {@link org.gnu.mach.MachPort#NULL} on the server side.
+ *
+ * A method can fail by throwing an {@link RpcException}, whose code is
+ * sent back as the return code. Requests for an unknown object get a
+ * {@link org.gnu.mach.Mach#MIG_BAD_ARGUMENTS} reply.
+ */
+public abstract class RpcSkeleton<T> implements MachServer.Demuxer {
+    /** Maps the receive right a request arrived on to an object. */
+    public static interface Lookup<T> {
+        /** Returns {@code null} if the port is not one of ours. */
+        T lookup(int port);
+    }
+
+    private final Lookup<T> lookup;
+
+    protected RpcSkeleton(Lookup<T> lookup) {
+        this.lookup = lookup;
+    }
+
+    /** Serve all the requests with the same object. */
+    protected RpcSkeleton(final T target) {
+        this(new Lookup<T>() {
+            public T lookup(int port) {
+                return target;
+            }
+        });
+    }
+
+    /** Find the object a request is addressed to. */
+    protected T target(int port) {
+        return lookup.lookup(port);
+    }
+}
@@ -0,0 +1,118 @@
+package org.gnu.test;
+
+import org.gnu.mach.BlockCache;
+
+/**
+ * Storing blocks in a {@link BlockCache} and replacing the least
+ * recently used ones.
+ */
+public class BlockCacheTest {
+    private static final int SIZE = 16;
+    private static final int BLOCKS = 4;
+
+    private static byte[] data(int key, int length) {
+        byte[] data = new byte[length];
+        for(int i = 0; i < length; i++)
+            data[i] = (byte) (key * 31 + i);
+        return data;
+    }
+
+    /* Check that a key is cached with the data stored by data(). */
+    private static void cached(BlockCache cache, int key, int length) {
+        int block = cache.lookup(key);
+        Check.check(block != BlockCache.NONE, "key " + key + " cached");
+        Check.equal(length, cache.length(block), "block length");
+        byte[] got = new byte[length];
+        cache.get(block, 0, got, 0, length);
+        byte[] expected = data(key, length);
+        for(int i = 0; i < length; i++)
+            Check.equal(expected[i], got[i], "block contents");
+    }
+
+    private static void lru() {
+        BlockCache cache = new BlockCache(SIZE, BLOCKS);
+        Check.equal(BLOCKS, cache.capacity(), "capacity");
+        for(int key = 0; key < BLOCKS; key++)
+            cache.put(key, data(key, SIZE), 0, SIZE);
+        Check.equal(BLOCKS, cache.size(), "blocks in use");
+        Check.equal(0, cache.evictions(), "evictions");
+
+        /* A lookup makes key 0 the most recently used, so key 1 goes. */
+        cached(cache, 0, SIZE);
+        cache.put(BLOCKS, data(BLOCKS, SIZE), 0, SIZE);
+        Check.equal(1, cache.evictions(), "evictions");
+        Check.equal(BlockCache.NONE, cache.lookup(1), "evicted key");
+        cached(cache, 0, SIZE);
+        cached(cache, 2, SIZE);
+        cached(cache, 3, SIZE);
+        cached(cache, BLOCKS, SIZE);
+
+        /* The order is now 4 3 2 0, from the most recently used. */
+        cache.put(10, data(10, SIZE), 0, SIZE);
+        cache.put(11, data(11, SIZE), 0, SIZE);
+        Check.equal(BlockCache.NONE, cache.lookup(0), "evicted key");
+        Check.equal(BlockCache.NONE, cache.lookup(2), "evicted key");
+        cached(cache, 3, SIZE);
+        Check.equal(3, cache.evictions(), "evictions");
+        Check.equal(BLOCKS, cache.size(), "blocks in use");
+    }
+
+    /* Storing under a cached key replaces its block in place. */
+    private static void replace() {
+        BlockCache cache = new BlockCache(SIZE, BLOCKS);
+        for(int key = 0; key < BLOCKS; key++)
+            cache.put(key, data(key, SIZE), 0, SIZE);
+        int block = cache.lookup(0);
+
+        byte[] data = data(0, 5);
+        Check.equal(block, cache.put(0, data, 0, 5), "block replaced");
+        Check.equal(0, cache.evictions(), "evictions");
+        Check.equal(BLOCKS, cache.size(), "blocks in use");
+        cached(cache, 0, 5);
+
+        /* It is now the most recently used. */
+        cache.put(1, data(1, SIZE), 0, SIZE);
+        cache.put(BLOCKS, data(BLOCKS, SIZE), 0, SIZE);
+        Check.equal(BlockCache.NONE, cache.lookup(2), "evicted key");
+        cached(cache, 0, 5);
+
+        try {
+            cache.get(block, 0, new byte[SIZE], 0, SIZE);
+            Check.fail("read past the end of a block");
+        } catch(IndexOutOfBoundsException exc) {
+            /* expected */
+        }
+        try {
+            cache.put(5, new byte[SIZE + 1], 0, SIZE + 1);
+            Check.fail("block larger than the block size");
+        } catch(IllegalArgumentException exc) {
+            /* expected */
+        }
+    }
+
+    private static void counts() {
+        BlockCache cache = new BlockCache(SIZE, BLOCKS);
+        cache.put(1, data(1, SIZE), 0, SIZE);
+        long hits = cache.hits(), misses = cache.misses();
+        cache.lookup(1);
+        cache.lookup(2);
+        cache.lookup(1);
+        Check.equal(hits + 2, cache.hits(), "hits");
+        Check.equal(misses + 1, cache.misses(), "misses");
+
+        cache.clear();
+        Check.equal(0, cache.size(), "blocks after clear");
+        Check.equal(BlockCache.NONE, cache.lookup(1), "key after clear");
+        for(int key = 0; key < BLOCKS; key++)
+            cache.put(key, data(key, SIZE), 0, SIZE);
+        Check.equal(0, cache.evictions(), "evictions after clear");
+        cached(cache, 0, SIZE);
+    }
+
+    public static void main(String argv[]) {
+        lru();
+        replace();
+        counts();
+        Check.done(BlockCacheTest.class);
+    }
+}
@@ -0,0 +1,347 @@
+package org.gnu.test;
+
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import org.gnu.hurd.CachingTranslator;
+import org.gnu.hurd.Io;
+import org.gnu.hurd.IoProxy;
+import org.gnu.hurd.MsgIds;
+import org.gnu.mach.MachMsg;
+import org.gnu.mach.MachMsgType;
+import org.gnu.mach.MachPort;
+import org.gnu.mach.MachServer;
+import org.gnu.mach.TypeCheckException;
+import org.gnu.mach.rpc.RpcClient;
+import org.gnu.mach.rpc.RpcException;
+
+/**
+ * A {@link CachingTranslator} in front of a backend made of a directory
+ * holding one file: reads, stats and lookups are answered from the cache
+ * until the backend reports a change.
+ */
+public class CachingTranslatorTest {
+    private static final int BLOCK_SIZE = 1024;
+    private static final int FILE_SIZE = 3000;
+    private static final int NAME_SIZE = 1024;
+    private static final int STAT_INTS = 32;
+    private static final int S_IFDIR = 0040000;
+    private static final int S_IFREG = 0100000;
+    private static final int FS_RETRY_NORMAL = 1;
+
+    /* Non-null change kinds, from <hurd/hurd_types.h> */
+    private static final int FILE_CHANGED_WRITE = 1;
+    private static final int DIR_CHANGED_NEW = 1;
+
+    /**
+     * The backend filesystem. The translator is attached to the node
+     * port, and gets restricted ports to the root directory from it,
+     * whose lookups all return the file.
+     */
+    private static class Backend implements MachServer.Demuxer {
+        final MachPort node = MachPort.allocate();
+        final MachPort root = MachPort.allocate();
+        final MachPort file = MachPort.allocate();
+        final int rootName;
+
+        final byte[] data = new byte[FILE_SIZE];
+        MachPort control;
+        MachPort dirNotify;
+        MachPort fileNotify;
+        int reads;
+        int stats;
+        int lookups;
+
+        Backend() throws Exception {
+            rootName = Check.name(root);
+            for(int i = 0; i < FILE_SIZE; i++)
+                data[i] = (byte) i;
+        }
+
+        private byte[] stat(int mode, long size) {
+            ByteBuffer stat = ByteBuffer.allocate(4 * STAT_INTS);
+            stat.order(ByteOrder.nativeOrder());
+            stat.putInt(7 * 4, mode);
+            stat.putLong(11 * 4, size);
+            return stat.array();
+        }
+
+        public synchronized boolean demux(int port, MachMsg request,
+                                          MachMsg reply)
+            throws TypeCheckException
+        {
+            switch(request.getId()) {
+                case MsgIds.FILE_SET_TRANSLATOR:
+                    request.getInt();           /* passive_flags */
+                    request.getInt();           /* active_flags */
+                    request.getInt();           /* oldtrans_flags */
+                    request.getBytes();         /* passive */
+                    control = request.getPort(MachMsgType.PORT_SEND);
+                    reply.putInt(0);
+                    return true;
+
+                case MsgIds.IO_RESTRICT_AUTH:
+                    reply.putInt(0);
+                    reply.putPort(MachMsgType.MAKE_SEND, root);
+                    return true;
+
+                case MsgIds.IO_STAT:
+                    stats++;
+                    reply.putInt(0);
+                    reply.putBytes(MachMsgType.INTEGER_32.withNumber(
+                                       STAT_INTS),
+                                   (port == rootName)
+                                   ? stat(S_IFDIR, 0)
+                                   : stat(S_IFREG, FILE_SIZE));
+                    return true;
+
+                case MsgIds.DIR_NOTICE_CHANGES:
+                    if(dirNotify != null)
+                        dirNotify.deallocate();
+                    dirNotify = request.getPort(MachMsgType.PORT_SEND);
+                    reply.putInt(0);
+                    return true;
+
+                case MsgIds.FILE_NOTICE_CHANGES:
+                    if(fileNotify != null)
+                        fileNotify.deallocate();
+                    fileNotify = request.getPort(MachMsgType.PORT_SEND);
+                    reply.putInt(0);
+                    return true;
+
+                case MsgIds.DIR_LOOKUP:
+                    lookups++;
+                    reply.putInt(0);
+                    reply.putInt(FS_RETRY_NORMAL);
+                    reply.putBytes(MachMsgType.STRING_C.withNumber(NAME_SIZE),
+                                   new byte[NAME_SIZE]);
+                    reply.putPort(MachMsgType.MAKE_SEND, file);
+                    return true;
+
+                case MsgIds.IO_READ:
+                    reads++;
+                    int offset = (int) request.getLong();
+                    int amount = request.getInt();
+                    amount = Math.max(0, Math.min(amount, FILE_SIZE - offset));
+                    byte[] out = new byte[amount];
+                    System.arraycopy(data, offset, out, 0, amount);
+                    reply.putInt(0);
+                    reply.putBytes(out);
+                    return true;
+
+                default:
+                    return false;
+            }
+        }
+    }
+
+    private static final RpcClient client = RpcClient.getDefault();
+    private static final Io io = new IoProxy();
+
+    /* Call fsys_getroot on the translator's control port. */
+    private static MachPort getRoot(MachPort control) throws Exception {
+        MachPort dotdot = MachPort.allocate();
+        MachMsg msg = client.begin();
+        try {
+            msg.setRemotePort(control, MachMsgType.COPY_SEND);
+            msg.setId(MsgIds.FSYS_GETROOT);
+            msg.putPort(MachMsgType.MAKE_SEND, dotdot);
+            msg.putBytes(MachMsgType.INTEGER_32.withNumber(1), new byte[4]);
+            msg.putBytes(MachMsgType.INTEGER_32.withNumber(1), new byte[4]);
+            msg.putInt(0);                      /* flags */
+            client.call(msg);
+            Check.equal(FS_RETRY_NORMAL, msg.getInt(), "retry of getroot");
+            msg.getBytes(MachMsgType.STRING_C, NAME_SIZE);
+            return msg.getPort(MachMsgType.PORT_SEND);
+        } finally {
+            msg.clear();
+            dotdot.destroy();
+        }
+    }
+
+    private static MachPort lookup(MachPort dir, String name)
+        throws Exception
+    {
+        byte[] path = new byte[NAME_SIZE];
+        System.arraycopy(name.getBytes("US-ASCII"), 0, path, 0,
+                         name.length());
+        MachMsg msg = client.begin();
+        try {
+            msg.setRemotePort(dir, MachMsgType.COPY_SEND);
+            msg.setId(MsgIds.DIR_LOOKUP);
+            msg.putBytes(MachMsgType.STRING_C.withNumber(NAME_SIZE), path);
+            msg.putInt(0);                      /* flags */
+            msg.putInt(0);                      /* mode */
+            client.call(msg);
+            Check.equal(FS_RETRY_NORMAL, msg.getInt(), "retry of lookup");
+            msg.getBytes(MachMsgType.STRING_C, NAME_SIZE);
+            return msg.getPort(MachMsgType.PORT_SEND);
+        } finally {
+            msg.clear();
+        }
+    }
+
+    /* The size in the attributes of a file. */
+    private static long stat(MachPort file) throws Exception {
+        MachMsg msg = client.begin();
+        try {
+            msg.setRemotePort(file, MachMsgType.COPY_SEND);
+            msg.setId(MsgIds.IO_STAT);
+            client.call(msg);
+            byte[] stat = msg.getBytes(MachMsgType.INTEGER_32, STAT_INTS);
+            return ByteBuffer.wrap(stat).order(ByteOrder.nativeOrder())
+                             .getLong(11 * 4);
+        } finally {
+            msg.clear();
+        }
+    }
+
+    /* Send file_changed or dir_changed to the translator. */
+    private static void changed(MachPort notify, int id, int change)
+        throws RpcException
+    {
+        MachMsg msg = client.begin();
+        try {
+            msg.setRemotePort(notify, MachMsgType.COPY_SEND);
+            msg.setId(id);
+            msg.putInt(1);                      /* tickno */
+            msg.putInt(change);
+            msg.putLong(0);                     /* start */
+            msg.putLong(-1);                    /* end */
+            client.call(msg);
+        } finally {
+            msg.clear();
+        }
+    }
+
+    private static void checkData(Backend backend, byte[] got, int offset,
+                                  int length)
+    {
+        Check.equal(length, got.length, "bytes read");
+        synchronized(backend) {
+            for(int i = 0; i < length; i++)
+                Check.equal(backend.data[offset + i], got[i], "data read");
+        }
+    }
+
+    /* The port the backend got for the translator's control, and for
+     * the change notifications of the directory and the file. */
+    private static MachPort control(Backend b) {
+        synchronized(b) {
+            return b.control;
+        }
+    }
+
+    private static MachPort dirNotify(Backend b) {
+        synchronized(b) {
+            return b.dirNotify;
+        }
+    }
+
+    private static MachPort fileNotify(Backend b) {
+        synchronized(b) {
+            return b.fileNotify;
+        }
+    }
+
+    private static int reads(Backend b) {
+        synchronized(b) {
+            return b.reads;
+        }
+    }
+
+    private static int stats(Backend b) {
+        synchronized(b) {
+            return b.stats;
+        }
+    }
+
+    private static int lookups(Backend b) {
+        synchronized(b) {
+            return b.lookups;
+        }
+    }
+
+    public static void main(String argv[]) throws Exception {
+        Backend backend = new Backend();
+        MachPort[] ports = { backend.node, backend.root, backend.file };
+        MachServer[] servers = new MachServer[ports.length];
+        Thread[] threads = new Thread[ports.length];
+        for(int i = 0; i < ports.length; i++) {
+            servers[i] = new MachServer(ports[i], backend, 8192);
+            threads[i] = Check.serve(servers[i]);
+        }
+
+        CachingTranslator translator =
+            new CachingTranslator(Check.makeSend(backend.root), BLOCK_SIZE,
+                                  16);
+        MachPort node = Check.makeSend(backend.node);
+        Check.equal(0, translator.attach(node), "attach");
+        node.deallocate();
+
+        MachPort root = getRoot(control(backend));
+        MachPort file = lookup(root, "file");
+        Check.check(fileNotify(backend) != null, "file changes requested");
+
+        /* Reads: the first block comes from the backend, once. */
+        checkData(backend, io.read(file, 0, 100), 0, 100);
+        Check.equal(1, reads(backend), "backend reads");
+        checkData(backend, io.read(file, 10, 200), 10, 200);
+        Check.equal(1, reads(backend), "backend reads after a hit");
+
+        /* A read across blocks stops at the first missing one. */
+        checkData(backend, io.read(file, 1000, 100), 1000, 24);
+        checkData(backend, io.read(file, 1024, 100), 1024, 100);
+        Check.equal(2, reads(backend), "backend reads");
+
+        /* The attributes were fetched with the node. */
+        int stats = stats(backend);
+        Check.equal(FILE_SIZE, stat(file), "file size");
+        Check.equal(stats, stats(backend), "backend stats after a hit");
+
+        /* A change to the file drops both. */
+        synchronized(backend) {
+            backend.data[5] = 42;
+        }
+        changed(fileNotify(backend), MsgIds.FILE_CHANGED, FILE_CHANGED_WRITE);
+        checkData(backend, io.read(file, 0, 100), 0, 100);
+        Check.equal(3, reads(backend), "backend reads after a change");
+        Check.equal(FILE_SIZE, stat(file), "file size");
+        Check.equal(stats + 1, stats(backend), "backend stats after a change");
+        checkData(backend, io.read(file, 0, 100), 0, 100);
+        Check.equal(3, reads(backend), "backend reads after a hit");
+
+        /* A null change drops nothing. */
+        changed(fileNotify(backend), MsgIds.FILE_CHANGED, 0);
+        io.read(file, 0, 100);
+        Check.equal(3, reads(backend), "backend reads after a null change");
+
+        /* Lookups are cached per open of the directory, until it
+         * changes. */
+        Check.equal(1, lookups(backend), "backend lookups");
+        MachPort again = lookup(root, "file");
+        Check.equal(1, lookups(backend), "backend lookups after a hit");
+        checkData(backend, io.read(again, 0, 100), 0, 100);
+        Check.equal(3, reads(backend), "reads shared by the opens");
+        again.deallocate();
+
+        changed(dirNotify(backend), MsgIds.DIR_CHANGED, DIR_CHANGED_NEW);
+        again = lookup(root, "file");
+        Check.equal(2, lookups(backend), "backend lookups after a change");
+        again.deallocate();
+        again = lookup(root, "file");
+        Check.equal(2, lookups(backend), "backend lookups after a hit");
+        again.deallocate();
+
+        file.deallocate();
+        root.deallocate();
+        translator.stop();
+        for(int i = 0; i < ports.length; i++) {
+            Check.stop(servers[i], threads[i]);
+            ports[i].destroy();
+        }
+        control(backend).deallocate();
+        dirNotify(backend).deallocate();
+        fileNotify(backend).deallocate();
+        Check.done(CachingTranslatorTest.class);
+    }
+}
@@ -0,0 +1,162 @@
+package org.gnu.test;
+
+import java.nio.ByteBuffer;
+import org.gnu.mach.Mach;
+import org.gnu.mach.MachMsg;
+import org.gnu.mach.MachMsgType;
+import org.gnu.mach.MachPort;
+import org.gnu.mach.MachServer;
+import org.gnu.mach.TypeCheckException;
+import org.gnu.mach.Unsafe;
+
+/**
+ * Checks shared by the behaviour tests in this directory.
+ *
+ * Each test is a program run by {@code make check} on the Java kernel
+ * model, with {@code -Dorg.gnu.mach.backend=java}, so that it needs
+ * neither the Hurd nor the native library. The first failed check prints
+ * its description and a stack trace and exits with a non-zero status.
+ */
+public class Check {
+    private static int checks;
+
+    public static void check(boolean cond, String what) {
+        checks++;
+        if(!cond)
+            fail(what);
+    }
+
+    public static void equal(long expected, long actual, String what) {
+        checks++;
+        if(actual != expected)
+            fail(what + ": expected " + expected + ", got " + actual);
+    }
+
+    public static void fail(String what) {
+        System.err.println("FAILED: " + what);
+        new Throwable().printStackTrace();
+        System.exit(1);
+    }
+
+    /**
+     * Report success and exit, whatever server threads are left.
+     */
+    public static void done(Class<?> test) {
+        System.out.println(test.getName() + ": " + checks + " checks passed");
+        System.exit(0);
+    }
+
+    /** The number of names in our port name space. */
+    public static int names() throws Unsafe {
+        return Mach.Port.names(Mach.taskSelf()).length / 2;
+    }
+
+    /** The type bits of a name, or 0 if it is not in use. */
+    public static int type(int name) throws Unsafe {
+        int[] names = Mach.Port.names(Mach.taskSelf());
+        for(int i = 0; i < names.length; i += 2)
+            if(names[i] == name)
+                return names[i + 1];
+        return 0;
+    }
+
+    /** The number of user references we hold for a right. */
+    public static int refs(int name, int right) throws Unsafe {
+        int[] refs = new int[1];
+        if(Mach.Port.getRefs(Mach.taskSelf(), name, right, refs)
+                != Mach.KERN_SUCCESS)
+            return 0;
+        return refs[0];
+    }
+
+    /** The name of a port. */
+    public static int name(MachPort port) throws Unsafe {
+        int name = port.name();
+        port.releaseName();
+        return name;
+    }
+
+    /**
+     * Send a message without waiting for room in the queue. If it is
+     * sent, the message is cleared.
+     */
+    public static int send(MachMsg msg) throws Unsafe {
+        int err = Mach.msg(msg.buf(), Mach.SEND_MSG | Mach.SEND_TIMEOUT,
+                           Mach.Port.NULL, 0, Mach.Port.NULL);
+        if(err == Mach.MSG_SUCCESS) {
+            /* The header rights went with the message. */
+            ByteBuffer buf = msg.buf();
+            buf.putInt(8, Mach.Port.NULL);
+            buf.putInt(12, Mach.Port.NULL);
+            msg.clear();
+        }
+        return err;
+    }
+
+    /** Send an empty message to a port of ours. */
+    public static int send(MachPort port, int id) throws Unsafe {
+        MachMsg msg = new MachMsg(64);
+        msg.setRemotePort(port, MachMsgType.MAKE_SEND);
+        msg.setId(id);
+        int err = send(msg);
+        msg.clear();
+        return err;
+    }
+
+    /** Receive a message into {@code msg}, and flip it. */
+    public static int receive(MachMsg msg, MachPort port, long timeout)
+        throws Unsafe
+    {
+        msg.clear();
+        int err = Mach.msg(msg.buf(), Mach.RCV_MSG | Mach.RCV_TIMEOUT,
+                           port.name(), timeout, Mach.Port.NULL);
+        port.releaseName();
+        if(err == Mach.MSG_SUCCESS) {
+            msg.flip();
+            /* This names our receive right, and carries no reference. */
+            msg.buf().putInt(12, Mach.Port.NULL);
+        }
+        return err;
+    }
+
+    /**
+     * Make a send right to a port of ours and get it out of a message, as
+     * a client would hand it to us.
+     */
+    public static MachPort makeSend(MachPort port)
+        throws Unsafe, TypeCheckException
+    {
+        MachPort via = MachPort.allocate();
+        MachMsg msg = new MachMsg(256);
+        msg.setRemotePort(via, MachMsgType.MAKE_SEND);
+        msg.setId(1);
+        msg.putPort(MachMsgType.MAKE_SEND, port);
+        equal(Mach.MSG_SUCCESS, send(msg), "send a send right");
+        equal(Mach.MSG_SUCCESS, receive(msg, via, 1000),
+              "receive a send right");
+        MachPort send = msg.getPort(MachMsgType.PORT_SEND);
+        msg.clear();
+        via.destroy();
+        return send;
+    }
+
+    /** Run a server in a new daemon thread. */
+    public static Thread serve(MachServer server) {
+        Thread thread = new Thread(server);
+        thread.setDaemon(true);
+        thread.start();
+        return thread;
+    }
+
+    /** Stop a server started with {@link #serve} and wait for it. */
+    public static void stop(MachServer server, Thread thread) {
+        server.stop();
+        while(true)
+            try {
+                thread.join();
+                break;
+            } catch(InterruptedException exc) {
+                /* ignore */
+            }
+    }
+}
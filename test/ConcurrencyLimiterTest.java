@@ -0,0 +1,151 @@
+package org.gnu.test;
+
+import java.util.concurrent.Semaphore;
+import org.gnu.hurd.Errno;
+import org.gnu.mach.MachMsg;
+import org.gnu.mach.MachMsgType;
+import org.gnu.mach.MachPort;
+import org.gnu.mach.MachServer;
+import org.gnu.mach.TypeCheckException;
+import org.gnu.mach.rpc.ConcurrencyLimiter;
+import org.gnu.mach.rpc.RpcClient;
+import org.gnu.mach.rpc.RpcException;
+
+/**
+ * The policies of a {@link ConcurrencyLimiter}: the limit stays within
+ * its bounds, is halved by overload replies, makes extra calls fail once
+ * they waited too long, and is dropped by {@link
+ * ConcurrencyLimiter#forget}.
+ */
+public class ConcurrencyLimiterTest {
+    private static final int ID = 1000;
+    private static final int OVERLOAD = Errno.EAGAIN;
+
+    /* A request holding this code waits for the gate to open. */
+    private static final int BLOCK = -1;
+
+    private static final Semaphore gate = new Semaphore(0);
+
+    /* Replies with the code in the request. */
+    private static final MachServer.Demuxer DEMUXER =
+        new MachServer.Demuxer() {
+            public boolean demux(int name, MachMsg request, MachMsg reply)
+                throws TypeCheckException
+            {
+                if(request.getId() != ID)
+                    return false;
+                int code = request.getInt();
+                if(code == BLOCK) {
+                    gate.acquireUninterruptibly();
+                    code = 0;
+                }
+                reply.putInt(code);
+                return true;
+            }
+        };
+
+    /* Make a call, and return its code. */
+    private static int call(RpcClient client, MachPort port, int code) {
+        MachMsg msg = client.begin();
+        try {
+            msg.setRemotePort(port, MachMsgType.MAKE_SEND);
+            msg.setId(ID);
+            msg.putInt(code);
+            client.call(msg);
+            return 0;
+        } catch(RpcException exc) {
+            return exc.code();
+        } finally {
+            msg.clear();
+        }
+    }
+
+    private static void arguments() {
+        try {
+            new ConcurrencyLimiter(1, 0, 4, 0, OVERLOAD);
+            Check.fail("limiter with a minimum limit of 0");
+        } catch(IllegalArgumentException exc) {
+            /* expected */
+        }
+        try {
+            new ConcurrencyLimiter(8, 1, 4, 0, OVERLOAD);
+            Check.fail("limiter starting above its maximum");
+        } catch(IllegalArgumentException exc) {
+            /* expected */
+        }
+    }
+
+    private static void bounds(MachPort port, int name) {
+        ConcurrencyLimiter limiter =
+            new ConcurrencyLimiter(4, 2, 16, 1000000000L, OVERLOAD);
+        RpcClient client = new RpcClient(256);
+        client.setLimiter(limiter);
+
+        Check.equal(4, limiter.limit(name), "limit of a new destination");
+        for(int i = 0; i < 200; i++) {
+            Check.equal(0, call(client, port, 0), "call within the limit");
+            int limit = limiter.limit(name);
+            Check.check(limit >= 2 && limit <= 16, "limit within bounds");
+        }
+        Check.equal(0, limiter.inFlight(name), "calls in flight");
+        Check.equal(1, limiter.size(), "destinations");
+
+        /* Overload replies halve the limit, down to the minimum. */
+        int limit = limiter.limit(name);
+        Check.equal(OVERLOAD, call(client, port, OVERLOAD), "overload");
+        Check.equal(Math.max(2, limit / 2), limiter.limit(name),
+                    "limit after an overload");
+        for(int i = 0; i < 5; i++)
+            call(client, port, OVERLOAD);
+        Check.equal(2, limiter.limit(name), "limit after overloads");
+
+        limiter.forget(name);
+        Check.equal(0, limiter.size(), "destinations after forget");
+        Check.equal(4, limiter.limit(name), "limit after forget");
+    }
+
+    /* With the only slot taken, a call fails locally after maxWait. */
+    private static void waiting(final MachPort port, int name)
+        throws Exception
+    {
+        ConcurrencyLimiter limiter =
+            new ConcurrencyLimiter(1, 1, 1, 50000000L, OVERLOAD);
+        final RpcClient client = new RpcClient(256);
+        client.setLimiter(limiter);
+        final int[] code = new int[1];
+
+        Thread thread = new Thread() {
+            public void run() {
+                code[0] = call(client, port, BLOCK);
+            }
+        };
+        thread.start();
+        while(limiter.inFlight(name) == 0)
+            Thread.sleep(1);
+
+        Check.equal(OVERLOAD, call(client, port, 0), "call over the limit");
+        Check.equal(1, limiter.inFlight(name), "calls in flight");
+
+        gate.release();
+        thread.join();
+        Check.equal(0, code[0], "call holding the slot");
+        Check.equal(0, limiter.inFlight(name), "calls in flight");
+        Check.equal(0, call(client, port, 0), "call with a free slot");
+    }
+
+    public static void main(String argv[]) throws Exception {
+        arguments();
+
+        MachPort port = MachPort.allocate();
+        MachServer server = new MachServer(port, DEMUXER, 256);
+        Thread thread = Check.serve(server);
+        int name = Check.name(port);
+
+        bounds(port, name);
+        waiting(port, name);
+
+        Check.stop(server, thread);
+        port.destroy();
+        Check.done(ConcurrencyLimiterTest.class);
+    }
+}
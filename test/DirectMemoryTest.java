@@ -0,0 +1,120 @@
+package org.gnu.test;
+
+import org.gnu.mach.DirectMemory;
+import org.gnu.mach.DirectMemoryLimitException;
+import org.gnu.mach.MachMsg;
+import org.gnu.mach.MachMsgArena;
+
+/**
+ * Accounting and limits of the direct memory held by message buffers,
+ * and its release when they are collected or closed.
+ */
+public class DirectMemoryTest {
+    private static final int SIZE = 3000;
+
+    /**
+     * Collect garbage until the buffers we dropped are accounted for, and
+     * return whether usage went down to {@code used} in time.
+     */
+    private static boolean collect(long used) throws InterruptedException {
+        for(int i = 0; i < 250; i++) {
+            if(DirectMemory.used() <= used)
+                return true;
+            System.gc();
+            Thread.sleep(20);
+        }
+        return false;
+    }
+
+    private static void accounting() throws Exception {
+        long base = DirectMemory.used();
+        int c = DirectMemory.sizeClass(SIZE);
+        long buffers = DirectMemory.classBuffers(c);
+        long bytes = DirectMemory.classBytes(c);
+
+        MachMsg msg = new MachMsg(SIZE);
+        Check.equal(base + SIZE, DirectMemory.used(), "bytes in use");
+        Check.check(DirectMemory.peak() >= base + SIZE, "peak usage");
+        Check.equal(buffers + 1, DirectMemory.classBuffers(c),
+                    "buffers in the size class");
+        Check.equal(bytes + SIZE, DirectMemory.classBytes(c),
+                    "bytes in the size class");
+
+        msg.clear();
+        msg = null;
+        Check.check(collect(base), "collected buffer released");
+        Check.equal(buffers, DirectMemory.classBuffers(c),
+                    "buffers in the size class");
+    }
+
+    private static void limit() throws Exception {
+        long base = DirectMemory.used();
+        long failures = DirectMemory.failures();
+        DirectMemory.setLimit(base + SIZE + SIZE / 2);
+        DirectMemory.setMaxWait(0);
+
+        MachMsg held = new MachMsg(SIZE);
+        try {
+            new MachMsg(SIZE);
+            Check.fail("allocation over the limit");
+        } catch(DirectMemoryLimitException exc) {
+            /* expected */
+        }
+        try {
+            new MachMsgArena(SIZE, 1);
+            Check.fail("arena over the limit");
+        } catch(DirectMemoryLimitException exc) {
+            /* expected */
+        }
+        Check.equal(failures + 2, DirectMemory.failures(), "failures");
+        Check.equal(base + SIZE, DirectMemory.used(),
+                    "bytes in use after failures");
+
+        /* A waiting allocation gets the memory of collected buffers. */
+        held.clear();
+        held = null;
+        DirectMemory.setMaxWait(5000);
+        MachMsg msg = new MachMsg(SIZE);
+        Check.equal(base + SIZE, DirectMemory.used(),
+                    "bytes in use after waiting");
+        msg.clear();
+
+        DirectMemory.setLimit(0);
+        DirectMemory.setMaxWait(0);
+    }
+
+    private static void wired() throws Exception {
+        long used = DirectMemory.used();
+        long pinned = DirectMemory.pinned();
+        long wired = DirectMemory.wired();
+
+        MachMsgArena arena = new MachMsgArena(250, 4, true);
+        Check.equal(256, arena.slotSize(), "rounded slot size");
+        Check.check(arena.isWired(), "arena wired by the model");
+        Check.equal(used + 1024, DirectMemory.used(), "bytes in use");
+        Check.equal(pinned + 1024, DirectMemory.pinned(), "pinned bytes");
+        Check.equal(wired + 1024, DirectMemory.wired(), "wired bytes");
+
+        int slot = arena.acquire();
+        try {
+            arena.close();
+            Check.fail("arena closed with a slot in use");
+        } catch(IllegalStateException exc) {
+            /* expected */
+        }
+        arena.release(slot);
+        arena.close();
+        Check.equal(used, DirectMemory.used(), "bytes in use after close");
+        Check.equal(pinned, DirectMemory.pinned(), "pinned bytes");
+        Check.equal(wired, DirectMemory.wired(), "wired bytes");
+        Check.equal(MachMsgArena.NONE, arena.acquire(),
+                    "slot acquired from a closed arena");
+    }
+
+    public static void main(String argv[]) throws Exception {
+        accounting();
+        limit();
+        wired();
+        Check.done(DirectMemoryTest.class);
+    }
+}
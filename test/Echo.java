@@ -0,0 +1,32 @@
+package org.gnu.test;
+
+import org.gnu.mach.MachPort;
+import org.gnu.mach.rpc.MakeSend;
+import org.gnu.mach.rpc.MsgId;
+import org.gnu.mach.rpc.RpcException;
+
+/**
+ * An RPC interface covering the types supported by
+ * {@link org.gnu.mach.rpc.RpcProcessor}, for {@link RpcCodecTest}.
+ */
+public interface Echo {
+    @MsgId(3000)
+    int add(MachPort echo, int a, int b) throws RpcException;
+
+    @MsgId(3001)
+    long negate(MachPort echo, long value) throws RpcException;
+
+    @MsgId(3002)
+    boolean even(MachPort echo, int value) throws RpcException;
+
+    @MsgId(3003)
+    byte[] reverse(MachPort echo, byte[] data) throws RpcException;
+
+    /** Return the name of the received port, and deallocate it. */
+    @MsgId(3004)
+    int name(MachPort echo, @MakeSend MachPort port) throws RpcException;
+
+    /** Fail with {@code code}. */
+    @MsgId(3005)
+    void fail(MachPort echo, int code) throws RpcException;
+}
@@ -0,0 +1,156 @@
+package org.gnu.test;
+
+import org.gnu.mach.KernelModel;
+import org.gnu.mach.Mach;
+import org.gnu.mach.MachMsg;
+import org.gnu.mach.MachMsgType;
+import org.gnu.mach.MachPort;
+import org.gnu.mach.MachServer;
+import org.gnu.mach.TypeCheckException;
+import org.gnu.mach.rpc.RpcClient;
+
+/**
+ * The Java kernel model: round trips through a {@link MachServer}, user
+ * references, no-senders notifications, dead names, queue limits and
+ * receive timeouts.
+ */
+public class KernelModelTest {
+    private static final int ID = 1000;
+
+    private static void roundTrip() throws Exception {
+        MachPort port = MachPort.allocate();
+        MachServer server = new MachServer(port, new MachServer.Demuxer() {
+            public boolean demux(int name, MachMsg request, MachMsg reply)
+                throws TypeCheckException
+            {
+                if(request.getId() != ID)
+                    return false;
+                int value = request.getInt();
+                reply.putInt(0);
+                reply.putInt(value + 1);
+                return true;
+            }
+        }, 256);
+        Thread thread = Check.serve(server);
+
+        RpcClient client = RpcClient.getDefault();
+        for(int i = 0; i < 100; i++) {
+            MachMsg msg = client.begin();
+            try {
+                msg.setRemotePort(port, MachMsgType.MAKE_SEND);
+                msg.setId(ID);
+                msg.putInt(i);
+                client.call(msg);
+                Check.equal(i + 1, msg.getInt(), "reply value");
+            } finally {
+                msg.clear();
+            }
+        }
+
+        Check.stop(server, thread);
+        port.destroy();
+    }
+
+    private static void noSenders() throws Exception {
+        MachPort port = MachPort.allocate();
+        MachPort notify = MachPort.allocate();
+        int name = Check.name(port);
+
+        MachPort send = Check.makeSend(port);
+        Check.equal(name, Check.name(send), "send right name");
+        Check.equal(1, Check.refs(name, Mach.Port.RIGHT_SEND),
+                    "send right references");
+
+        Check.equal(Mach.KERN_SUCCESS,
+                    Mach.Port.requestNotification(Mach.taskSelf(), name,
+                            Mach.NOTIFY_NO_SENDERS, 0, Check.name(notify),
+                            MachMsgType.MAKE_SEND_ONCE.name(), new int[1]),
+                    "request a no-senders notification");
+        MachMsg msg = new MachMsg(256);
+        Check.equal(Mach.RCV_TIMED_OUT, Check.receive(msg, notify, 10),
+                    "no notification while a send right exists");
+
+        send.deallocate();
+        Check.equal(0, Check.refs(name, Mach.Port.RIGHT_SEND),
+                    "send right references");
+        Check.equal(Mach.MSG_SUCCESS, Check.receive(msg, notify, 1000),
+                    "no-senders notification");
+        Check.equal(Mach.NOTIFY_NO_SENDERS, msg.getId(), "notification id");
+
+        int[] status = new int[Mach.Port.STATUS_MAX];
+        Mach.Port.getReceiveStatus(Mach.taskSelf(), name, status);
+        Check.equal(status[Mach.Port.STATUS_MSCOUNT], msg.getInt(),
+                    "make-send count");
+        msg.clear();
+
+        notify.destroy();
+        port.destroy();
+    }
+
+    private static void deadName() throws Exception {
+        MachPort port = MachPort.allocate();
+        MachPort send = Check.makeSend(port);
+        int name = Check.name(send);
+
+        port.destroy();
+        Check.check((Check.type(name) & Mach.Port.TYPE_DEAD_NAME) != 0,
+                    "send right turned into a dead name");
+
+        MachMsg msg = new MachMsg(64);
+        msg.setRemotePort(send, MachMsgType.COPY_SEND);
+        msg.setId(ID);
+        Check.equal(Mach.SEND_INVALID_DEST, Check.send(msg),
+                    "send to a dead name");
+        msg.clear();
+
+        send.deallocate();
+        Check.equal(0, Check.type(name), "dead name deallocated");
+    }
+
+    private static void queueLimit() throws Exception {
+        MachPort port = MachPort.allocate();
+        for(int i = 0; i < KernelModel.QLIMIT_DEFAULT; i++)
+            Check.equal(Mach.MSG_SUCCESS, Check.send(port, ID),
+                        "send below the queue limit");
+        Check.equal(Mach.SEND_TIMED_OUT, Check.send(port, ID),
+                    "send to a full queue");
+        Check.equal(KernelModel.QLIMIT_DEFAULT, MachServer.queueDepth(port),
+                    "queue depth");
+
+        MachMsg msg = new MachMsg(64);
+        Check.equal(Mach.MSG_SUCCESS, Check.receive(msg, port, 0),
+                    "receive from a full queue");
+        msg.clear();
+        Check.equal(Mach.MSG_SUCCESS, Check.send(port, ID),
+                    "send after a receive");
+
+        /* The queued messages go with the port. */
+        port.destroy();
+    }
+
+    private static void receiveTimeout() throws Exception {
+        MachPort port = MachPort.allocate();
+        MachMsg msg = new MachMsg(64);
+        Check.equal(Mach.RCV_TIMED_OUT, Check.receive(msg, port, 20),
+                    "receive from an empty queue");
+        msg.clear();
+        port.destroy();
+    }
+
+    public static void main(String argv[]) throws Exception {
+        Check.check(Mach.backend() instanceof KernelModel,
+                    "running on the kernel model");
+
+        /* The client's reply port stays allocated. */
+        roundTrip();
+        int names = Check.names();
+
+        noSenders();
+        deadName();
+        queueLimit();
+        receiveTimeout();
+        Check.equal(names, Check.names(), "names left over");
+
+        Check.done(KernelModelTest.class);
+    }
+}
@@ -0,0 +1,96 @@
+package org.gnu.test;
+
+import org.gnu.mach.MachMsg;
+import org.gnu.mach.MachMsgArena;
+
+/**
+ * Acquiring and releasing the slots of a {@link MachMsgArena}.
+ */
+public class MachMsgArenaTest {
+    private static final int SLOTS = 4;
+
+    private static void slots() throws Exception {
+        MachMsgArena arena = new MachMsgArena(256, SLOTS);
+        int[] slots = new int[SLOTS];
+        for(int i = 0; i < SLOTS; i++) {
+            slots[i] = arena.acquire();
+            Check.check(slots[i] != MachMsgArena.NONE, "slot acquired");
+            for(int j = 0; j < i; j++)
+                Check.check(slots[j] != slots[i], "distinct slots");
+        }
+        Check.equal(SLOTS, arena.inUse(), "slots in use");
+        Check.equal(MachMsgArena.NONE, arena.acquire(),
+                    "slot acquired from a full arena");
+
+        /* A released slot comes back with its message cleared. */
+        MachMsg msg = arena.get(slots[0]);
+        msg.setId(1234);
+        msg.putInt(42);
+        arena.release(slots[0]);
+        Check.equal(SLOTS - 1, arena.inUse(), "slots in use");
+        try {
+            arena.get(slots[0]);
+            Check.fail("message of a released slot");
+        } catch(IllegalArgumentException exc) {
+            /* expected */
+        }
+        try {
+            arena.release(slots[0]);
+            Check.fail("slot released twice");
+        } catch(IllegalArgumentException exc) {
+            /* expected */
+        }
+        Check.equal(SLOTS - 1, arena.inUse(), "slots in use");
+
+        int slot = arena.acquire();
+        Check.equal(slots[0], slot, "released slot acquired again");
+        Check.check(arena.get(slot) == msg, "message kept with its slot");
+        Check.equal(0, msg.getId(), "message id cleared");
+        Check.equal(24, msg.buf().position(), "message body cleared");
+
+        for(int i = 0; i < SLOTS; i++)
+            arena.release(slots[i]);
+        Check.equal(0, arena.inUse(), "slots in use");
+    }
+
+    /* Threads acquiring and releasing slots never share one. */
+    private static void concurrent() throws Exception {
+        final MachMsgArena arena = new MachMsgArena(64, 2);
+        final boolean[] owned = new boolean[arena.capacity()];
+        final int[] errors = new int[1];
+
+        Thread[] threads = new Thread[4];
+        for(int t = 0; t < threads.length; t++) {
+            threads[t] = new Thread() {
+                public void run() {
+                    for(int i = 0; i < 10000; i++) {
+                        int slot = arena.acquire();
+                        if(slot == MachMsgArena.NONE)
+                            continue;
+                        synchronized(owned) {
+                            if(owned[slot])
+                                errors[0]++;
+                            owned[slot] = true;
+                        }
+                        synchronized(owned) {
+                            owned[slot] = false;
+                        }
+                        arena.release(slot);
+                    }
+                }
+            };
+            threads[t].start();
+        }
+        for(Thread thread : threads)
+            thread.join();
+
+        Check.equal(0, errors[0], "slots acquired twice");
+        Check.equal(0, arena.inUse(), "slots in use");
+    }
+
+    public static void main(String argv[]) throws Exception {
+        slots();
+        concurrent();
+        Check.done(MachMsgArenaTest.class);
+    }
+}
@@ -0,0 +1,104 @@
+package org.gnu.test;
+
+import org.gnu.mach.Mach;
+import org.gnu.mach.MachMsg;
+import org.gnu.mach.MachMsgType;
+import org.gnu.mach.MachPort;
+import org.gnu.mach.MachPortTable;
+
+/**
+ * Allocating, passing and deallocating ports held in a
+ * {@link MachPortTable}, one at a time and all at once.
+ */
+public class MachPortTableTest {
+    private static final int PORTS = 40;
+
+    private static int name(MachPortTable table, int handle)
+        throws Exception
+    {
+        int name = table.name(handle);
+        table.releaseName(handle);
+        return name;
+    }
+
+    private static void allocate() throws Exception {
+        int names = Check.names();
+        MachPortTable table = new MachPortTable(16);
+        int[] handles = new int[PORTS];
+        for(int i = 0; i < PORTS; i++) {
+            handles[i] = table.allocate();
+            Check.check(handles[i] != MachPortTable.NONE, "port allocated");
+            Check.check(table.contains(handles[i]), "port in the table");
+            Check.check(table.isReceive(handles[i]), "receive right");
+        }
+        Check.equal(PORTS, table.size(), "ports in the table");
+        Check.equal(names + PORTS, Check.names(), "names in use");
+
+        int first = name(table, handles[0]);
+        Check.check((Check.type(first) & Mach.Port.TYPE_RECEIVE) != 0,
+                    "receive right named by the table");
+
+        /* Freed handles are reused. */
+        int third = name(table, handles[3]);
+        table.deallocate(handles[3]);
+        Check.check(!table.contains(handles[3]), "deallocated port");
+        Check.equal(0, Check.type(third), "receive right destroyed");
+        Check.equal(PORTS - 1, table.size(), "ports in the table");
+        try {
+            table.isReceive(handles[3]);
+            Check.fail("deallocated handle used");
+        } catch(IllegalArgumentException exc) {
+            /* expected */
+        }
+        Check.equal(handles[3], table.allocate(), "handle reused");
+
+        table.deallocateAll();
+        Check.equal(0, table.size(), "ports in the table");
+        Check.equal(names, Check.names(), "names left over");
+        Check.equal(0, Check.type(first), "receive right destroyed");
+    }
+
+    /* Send rights passed in messages are deallocated, not destroyed. */
+    private static void sendRights() throws Exception {
+        int names = Check.names();
+        MachPortTable table = new MachPortTable();
+        int recv = table.allocate();
+        int name = name(table, recv);
+
+        MachPort via = MachPort.allocate();
+        MachMsg msg = new MachMsg(256);
+        msg.setRemotePort(via, MachMsgType.MAKE_SEND);
+        msg.setId(1);
+        msg.putPort(MachMsgType.MAKE_SEND, table, recv);
+        msg.putPort(MachMsgType.MAKE_SEND, table, recv);
+        Check.equal(Mach.MSG_SUCCESS, Check.send(msg), "send rights sent");
+        Check.equal(Mach.MSG_SUCCESS, Check.receive(msg, via, 1000),
+                    "send rights received");
+        int send1 = msg.getPort(MachMsgType.PORT_SEND, table);
+        int send2 = msg.getPort(MachMsgType.PORT_SEND, table);
+        msg.clear();
+        via.destroy();
+
+        Check.check(send1 != send2, "one handle per received right");
+        Check.check(!table.isReceive(send1), "send right");
+        Check.equal(name, name(table, send1), "send right name");
+        Check.equal(2, Check.refs(name, Mach.Port.RIGHT_SEND),
+                    "send right references");
+
+        table.deallocate(send1);
+        Check.equal(1, Check.refs(name, Mach.Port.RIGHT_SEND),
+                    "send right references");
+        Check.check((Check.type(name) & Mach.Port.TYPE_RECEIVE) != 0,
+                    "receive right kept");
+
+        table.deallocateAll();
+        Check.equal(0, Check.type(name), "port deallocated");
+        Check.equal(names, Check.names(), "names left over");
+    }
+
+    public static void main(String argv[]) throws Exception {
+        allocate();
+        sendRights();
+        Check.done(MachPortTableTest.class);
+    }
+}
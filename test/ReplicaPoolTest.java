@@ -0,0 +1,129 @@
+package org.gnu.test;
+
+import org.gnu.mach.MachPort;
+import org.gnu.mach.rpc.ReplicaPool;
+
+/**
+ * Picking replicas from a {@link ReplicaPool} by their outstanding
+ * calls, and evicting those whose server dies.
+ */
+public class ReplicaPoolTest {
+    private static final int CALLS = 30;
+
+    private static MachPort[] servers(int n) {
+        MachPort[] ports = new MachPort[n];
+        for(int i = 0; i < n; i++)
+            ports[i] = MachPort.allocate();
+        return ports;
+    }
+
+    private static ReplicaPool pool(ReplicaPool.Policy policy,
+                                    MachPort[] servers)
+        throws Exception
+    {
+        ReplicaPool pool = new ReplicaPool(policy);
+        Check.check(pool.acquire() == null, "replica of an empty pool");
+        for(MachPort server : servers)
+            Check.check(pool.add(Check.makeSend(server)), "replica added");
+        Check.check(!pool.add(Check.makeSend(servers[0])),
+                    "same replica added twice");
+        Check.equal(servers.length, pool.size(), "replicas");
+        return pool;
+    }
+
+    /* Wait for the pool to evict dead replicas down to n. */
+    private static void evicted(ReplicaPool pool, int n) throws Exception {
+        for(int i = 0; i < 100 && pool.size() > n; i++)
+            Thread.sleep(10);
+        Check.equal(n, pool.size(), "replicas left");
+    }
+
+    private static void leastOutstanding() throws Exception {
+        MachPort[] servers = servers(3);
+        ReplicaPool pool = pool(ReplicaPool.Policy.LEAST_OUTSTANDING,
+                                servers);
+
+        ReplicaPool.Replica[] calls = new ReplicaPool.Replica[CALLS];
+        for(int i = 0; i < CALLS; i++)
+            calls[i] = pool.acquire();
+        Check.check(calls[0] != calls[1] && calls[1] != calls[2]
+                    && calls[0] != calls[2], "each replica picked");
+        for(int i = 0; i < 3; i++)
+            Check.equal(CALLS / 3, calls[i].outstanding(),
+                        "calls spread evenly");
+
+        /* The replica whose calls complete gets the next ones. */
+        ReplicaPool.Replica idle = calls[1];
+        pool.release(idle);
+        pool.release(idle);
+        Check.check(pool.acquire() == idle, "least loaded replica picked");
+        Check.check(pool.acquire() == idle, "least loaded replica picked");
+        for(int i = 0; i < CALLS; i++)
+            pool.release(calls[i]);
+        for(int i = 0; i < 3; i++)
+            Check.equal(0, calls[i].outstanding(), "calls completed");
+
+        /* A replica whose server goes away is evicted. */
+        int name = Check.name(servers[0]);
+        ReplicaPool.Replica dead = null;
+        for(int i = 0; i < 3; i++)
+            if(Check.name(calls[i].port()) == name)
+                dead = calls[i];
+        Check.check(dead != null, "replica of the first server");
+        servers[0].destroy();
+        evicted(pool, 2);
+        Check.equal(0, Check.type(name), "dead name released");
+        for(int i = 0; i < CALLS; i++) {
+            ReplicaPool.Replica replica = pool.acquire();
+            Check.check(replica != dead, "dead replica picked");
+            pool.release(replica);
+        }
+
+        /* So is one added after its server died. */
+        MachPort port = MachPort.allocate();
+        MachPort send = Check.makeSend(port);
+        name = Check.name(send);
+        port.destroy();
+        pool.add(send);
+        evicted(pool, 2);
+        Check.equal(0, Check.type(name), "dead name released");
+
+        pool.close();
+        Check.equal(0, pool.size(), "replicas after close");
+        Check.check(pool.acquire() == null, "replica of a closed pool");
+        for(int i = 1; i < 3; i++)
+            servers[i].destroy();
+    }
+
+    /* With two replicas, both choices are compared every time. */
+    private static void powerOfTwoChoices() throws Exception {
+        MachPort[] servers = servers(2);
+        ReplicaPool pool = pool(ReplicaPool.Policy.POWER_OF_TWO_CHOICES,
+                                servers);
+
+        ReplicaPool.Replica[] calls = new ReplicaPool.Replica[CALLS];
+        for(int i = 0; i < CALLS; i++) {
+            calls[i] = pool.acquire();
+            int first = calls[0].outstanding();
+            Check.check(Math.abs(2 * first - (i + 1)) <= 1,
+                        "less loaded replica picked");
+        }
+        for(ReplicaPool.Replica replica : calls)
+            Check.equal(CALLS / 2, replica.outstanding(),
+                        "calls spread evenly");
+        for(ReplicaPool.Replica replica : calls)
+            pool.release(replica);
+
+        pool.close();
+        for(MachPort server : servers)
+            server.destroy();
+    }
+
+    public static void main(String argv[]) throws Exception {
+        int names = Check.names();
+        leastOutstanding();
+        powerOfTwoChoices();
+        Check.equal(names, Check.names(), "names left over");
+        Check.done(ReplicaPoolTest.class);
+    }
+}
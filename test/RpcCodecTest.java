@@ -0,0 +1,135 @@
+package org.gnu.test;
+
+import org.gnu.hurd.Errno;
+import org.gnu.mach.Mach;
+import org.gnu.mach.MachPort;
+import org.gnu.mach.MachServer;
+import org.gnu.mach.Unsafe;
+import org.gnu.mach.rpc.RpcException;
+import org.gnu.mach.rpc.RpcSkeleton;
+
+/**
+ * Round trips through the stubs generated by
+ * {@link org.gnu.mach.rpc.RpcProcessor} for {@link Echo}: the values of
+ * every supported type, return codes thrown by the server, and requests
+ * for an unknown object.
+ */
+public class RpcCodecTest {
+    private static final Echo IMPL = new Echo() {
+        public int add(MachPort echo, int a, int b) {
+            return a + b;
+        }
+
+        public long negate(MachPort echo, long value) {
+            return -value;
+        }
+
+        public boolean even(MachPort echo, int value) {
+            return value % 2 == 0;
+        }
+
+        public byte[] reverse(MachPort echo, byte[] data) {
+            byte[] result = new byte[data.length];
+            for(int i = 0; i < data.length; i++)
+                result[i] = data[data.length - 1 - i];
+            return result;
+        }
+
+        public int name(MachPort echo, MachPort port) throws RpcException {
+            if(port == MachPort.NULL)
+                throw new RpcException(Errno.EINVAL);
+            try {
+                return Check.name(port);
+            } catch(Unsafe exc) {
+                return Mach.Port.NULL;
+            } finally {
+                port.deallocate();
+            }
+        }
+
+        public void fail(MachPort echo, int code) throws RpcException {
+            throw new RpcException(code);
+        }
+    };
+
+    private static void values(Echo echo, MachPort dest) throws Exception {
+        Check.equal(5, echo.add(dest, 2, 3), "int arguments");
+        Check.equal(-1, echo.add(dest, Integer.MAX_VALUE, Integer.MIN_VALUE),
+                    "int arguments");
+        Check.equal(-(1L << 40), echo.negate(dest, 1L << 40), "long argument");
+        Check.check(echo.even(dest, 4), "boolean result");
+        Check.check(!echo.even(dest, 7), "boolean result");
+
+        /* Both even and odd lengths, since data is padded to words. */
+        for(int n = 0; n <= 9; n++) {
+            byte[] data = new byte[n];
+            for(int i = 0; i < n; i++)
+                data[i] = (byte) (i + 1);
+            byte[] result = echo.reverse(dest, data);
+            Check.equal(n, result.length, "byte array length");
+            for(int i = 0; i < n; i++)
+                Check.equal(n - i, result[i], "byte array contents");
+        }
+    }
+
+    private static void ports(Echo echo, MachPort dest) throws Exception {
+        MachPort port = MachPort.allocate();
+        int name = Check.name(port);
+        Check.equal(name, echo.name(dest, port), "port argument");
+        Check.equal(0, Check.refs(name, Mach.Port.RIGHT_SEND),
+                    "send right released by the server");
+        port.destroy();
+    }
+
+    private static void errors(Echo echo, MachPort dest) throws Exception {
+        try {
+            echo.fail(dest, Errno.EIO);
+            Check.fail("call returned despite an error");
+        } catch(RpcException exc) {
+            Check.equal(Errno.EIO, exc.code(), "error code");
+        }
+
+        /* The failed call did not disturb the next one. */
+        Check.equal(3, echo.add(dest, 1, 2), "call after an error");
+    }
+
+    private static void unknown() throws Exception {
+        MachPort port = MachPort.allocate();
+        MachServer server = new MachServer(port,
+            new EchoSkeleton(new RpcSkeleton.Lookup<Echo>() {
+                public Echo lookup(int name) {
+                    return null;
+                }
+            }), 8192);
+        Thread thread = Check.serve(server);
+        MachPort dest = Check.makeSend(port);
+        try {
+            new EchoProxy().add(dest, 1, 2);
+            Check.fail("call to an unknown object");
+        } catch(RpcException exc) {
+            Check.equal(Mach.MIG_BAD_ARGUMENTS, exc.code(), "error code");
+        }
+        dest.deallocate();
+        Check.stop(server, thread);
+        port.destroy();
+    }
+
+    public static void main(String argv[]) throws Exception {
+        MachPort port = MachPort.allocate();
+        MachServer server = new MachServer(port, new EchoSkeleton(IMPL),
+                                           8192);
+        Thread thread = Check.serve(server);
+        MachPort dest = Check.makeSend(port);
+
+        Echo echo = new EchoProxy();
+        values(echo, dest);
+        ports(echo, dest);
+        errors(echo, dest);
+        dest.deallocate();
+        Check.stop(server, thread);
+        port.destroy();
+
+        unknown();
+        Check.done(RpcCodecTest.class);
+    }
+}
@@ -0,0 +1,130 @@
+package org.gnu.test;
+
+import org.gnu.mach.Mach;
+import org.gnu.mach.MachMsg;
+import org.gnu.mach.MachPort;
+import org.gnu.mach.MachServer;
+import org.gnu.mach.TypeCheckException;
+import org.gnu.mach.rpc.ReplicaPool;
+import org.gnu.mach.rpc.RpcClient;
+import org.gnu.mach.rpc.RpcException;
+import org.gnu.mach.rpc.RpcHedger;
+
+/**
+ * Hedged calls to a fast and a slow replica: which calls are hedged,
+ * which reply wins, and how the delay is learned.
+ */
+public class RpcHedgerTest {
+    private static final int ID = 1000;
+
+    /* How long the slow replica takes, in milliseconds. */
+    private static final int SLOW = 200;
+
+    private static volatile boolean slow;
+
+    /* Replies with its index, after a while if it is the slow one. */
+    private static MachServer.Demuxer replica(final int index) {
+        return new MachServer.Demuxer() {
+            public boolean demux(int name, MachMsg request, MachMsg reply)
+                throws TypeCheckException
+            {
+                if(request.getId() != ID)
+                    return false;
+                if(index == 1 && slow)
+                    try {
+                        Thread.sleep(SLOW);
+                    } catch(InterruptedException exc) {
+                        /* ignore */
+                    }
+                reply.putInt(0);
+                reply.putInt(index);
+                return true;
+            }
+        };
+    }
+
+    /* Make a call, and return the index of the replica which answered. */
+    private static int call(RpcHedger hedger) throws RpcException {
+        MachMsg msg = hedger.begin();
+        try {
+            msg.setId(ID);
+            hedger.call(msg);
+            return msg.getInt();
+        } finally {
+            msg.clear();
+        }
+    }
+
+    private static void arguments() throws Exception {
+        RpcClient client = new RpcClient(256);
+        ReplicaPool pool = new ReplicaPool(
+                ReplicaPool.Policy.LEAST_OUTSTANDING);
+        try {
+            new RpcHedger(client, pool, 1.0, 0);
+            Check.fail("hedger at the 100th percentile");
+        } catch(IllegalArgumentException exc) {
+            /* expected */
+        }
+
+        RpcHedger hedger = new RpcHedger(client, pool, 0.9, 1000000L);
+        try {
+            call(hedger);
+            Check.fail("call with no replica");
+        } catch(RpcException exc) {
+            Check.equal(Mach.SEND_INVALID_DEST, exc.code(), "error code");
+        }
+        pool.close();
+    }
+
+    public static void main(String argv[]) throws Exception {
+        arguments();
+
+        MachPort[] ports = new MachPort[2];
+        MachServer[] servers = new MachServer[2];
+        Thread[] threads = new Thread[2];
+        ReplicaPool pool = new ReplicaPool(
+                ReplicaPool.Policy.LEAST_OUTSTANDING);
+        for(int i = 0; i < 2; i++) {
+            ports[i] = MachPort.allocate();
+            servers[i] = new MachServer(ports[i], replica(i), 256);
+            threads[i] = Check.serve(servers[i]);
+            pool.add(Check.makeSend(ports[i]));
+        }
+        RpcClient client = new RpcClient(256);
+
+        /* Calls faster than the delay teach the hedger a shorter one. */
+        long initial = 1000000000L;
+        RpcHedger hedger = new RpcHedger(client, pool, 0.9, initial);
+        for(int i = 0; i < 128; i++)
+            call(hedger);
+        Check.equal(128, hedger.calls(), "calls");
+        Check.check(hedger.delay() < initial, "delay learned");
+
+        /* The calls picking the slow replica first are hedged, and
+         * answered by the fast one. The pool's rotation counts the
+         * hedges too, so the calls after the first hedged one all start
+         * on the slow replica. */
+        slow = true;
+        hedger = new RpcHedger(client, pool, 0.9, 20000000L);
+        for(int i = 0; i < 4; i++)
+            Check.equal(0, call(hedger), "reply of the fast replica");
+        Check.equal(4, hedger.calls(), "calls");
+        Check.check(hedger.hedged() >= 3, "calls to the slow replica hedged");
+
+        /* The late replies were dropped with their reply ports, and
+         * the slow replica answers its next calls itself. */
+        slow = false;
+        Thread.sleep(6 * SLOW);
+        int answers = 0;
+        for(int i = 0; i < 4; i++)
+            answers += call(hedger);
+        Check.equal(2, answers, "replies of the slow replica");
+
+        pool.close();
+        for(int i = 0; i < 2; i++) {
+            Check.stop(servers[i], threads[i]);
+            ports[i].destroy();
+        }
+        Check.done(RpcHedgerTest.class);
+    }
+}
@@ -0,0 +1,70 @@
+package org.gnu.test;
+
+import org.gnu.mach.Mach;
+import org.gnu.mach.MachPort;
+
+/**
+ * Coalescing of the send rights received under the same name into one
+ * {@link MachPort} object, and the release of their user references.
+ */
+public class SendRightTest {
+    private static final int TIMES = 3 * MachPort.MAX_SURPLUS;
+
+    private static void coalesce() throws Exception {
+        MachPort port = MachPort.allocate();
+        int name = Check.name(port);
+
+        MachPort send = Check.makeSend(port);
+        for(int i = 1; i < TIMES; i++)
+            Check.check(Check.makeSend(port) == send,
+                        "same object for the same send right");
+        int refs = Check.refs(name, Mach.Port.RIGHT_SEND);
+        Check.check(refs >= 1 && refs <= MachPort.MAX_SURPLUS + 1,
+                    "surplus references given back");
+
+        /* Each owner gives up its share; the last one the right. */
+        for(int i = 1; i < TIMES; i++) {
+            send.deallocate();
+            Check.check(Check.refs(name, Mach.Port.RIGHT_SEND) > 0,
+                        "send right kept for the other owners");
+        }
+        send.deallocate();
+        Check.equal(0, Check.refs(name, Mach.Port.RIGHT_SEND),
+                    "send right released by the last owner");
+
+        /* A right received after that gets a new object. */
+        MachPort again = Check.makeSend(port);
+        Check.check(again != send, "new object after deallocation");
+        Check.equal(1, Check.refs(name, Mach.Port.RIGHT_SEND),
+                    "send right references");
+        again.deallocate();
+        port.destroy();
+    }
+
+    /* clear() on a shared object hands over one reference. */
+    private static void clear() throws Exception {
+        MachPort port = MachPort.allocate();
+        int name = Check.name(port);
+        MachPort send = Check.makeSend(port);
+        Check.makeSend(port);
+
+        Check.equal(name, send.clear(), "name of a shared send right");
+        Check.equal(name, Check.name(send), "name kept for the other owner");
+        Check.check(Check.refs(name, Mach.Port.RIGHT_SEND) >= 2,
+                    "references of both owners");
+        Mach.Port.deallocate(Mach.taskSelf(), name);
+
+        send.deallocate();
+        Check.equal(0, Check.refs(name, Mach.Port.RIGHT_SEND),
+                    "send right released");
+        port.destroy();
+    }
+
+    public static void main(String argv[]) throws Exception {
+        int names = Check.names();
+        coalesce();
+        clear();
+        Check.equal(names, Check.names(), "names left over");
+        Check.done(SendRightTest.class);
+    }
+}
@@ -0,0 +1,133 @@
+package org.gnu.test;
+
+import java.util.HashMap;
+import org.gnu.mach.Mach;
+import org.gnu.mach.MachMsg;
+import org.gnu.mach.MachMsgType;
+import org.gnu.mach.MachPort;
+import org.gnu.mach.ShardedServer;
+import org.gnu.mach.TypeCheckException;
+import org.gnu.mach.rpc.RpcClient;
+
+/**
+ * Placing objects on the shards of a {@link ShardedServer}: adoption in
+ * the shard's thread before the first request, stable placement, and
+ * joins which fail.
+ */
+public class ShardedServerTest {
+    private static final int ID = 1000;
+    private static final int SHARDS = 4;
+    private static final int PORTS = 16;
+
+    /* Replies with its index, the object of the port and its number of
+     * objects, and checks that it is only called from one thread. */
+    private static class TestShard extends ShardedServer.Shard {
+        final int index;
+        final HashMap<Integer, Object> objects =
+            new HashMap<Integer, Object>();
+        Thread thread;
+        volatile int wrongThread;
+
+        TestShard(int index) {
+            this.index = index;
+        }
+
+        private void checkThread() {
+            if(thread == null)
+                thread = Thread.currentThread();
+            else if(thread != Thread.currentThread())
+                wrongThread++;
+        }
+
+        protected void adopt(int port, Object obj) {
+            checkThread();
+            objects.put(port, obj);
+        }
+
+        protected void disown(int port, Object obj) {
+            checkThread();
+            objects.remove(port);
+        }
+
+        public boolean demux(int port, MachMsg request, MachMsg reply)
+            throws TypeCheckException
+        {
+            checkThread();
+            if(request.getId() != ID)
+                return false;
+            Object obj = objects.get(port);
+            reply.putInt(0);
+            reply.putInt(index);
+            reply.putInt((obj != null) ? (Integer) obj : -1);
+            reply.putInt(objects.size());
+            return true;
+        }
+    }
+
+    /* The index, object and object count returned by a shard. */
+    private static int[] call(MachPort port) throws Exception {
+        RpcClient client = RpcClient.getDefault();
+        MachMsg msg = client.begin();
+        try {
+            msg.setRemotePort(port, MachMsgType.MAKE_SEND);
+            msg.setId(ID);
+            client.call(msg);
+            return new int[] { msg.getInt(), msg.getInt(), msg.getInt() };
+        } finally {
+            msg.clear();
+        }
+    }
+
+    public static void main(String argv[]) throws Exception {
+        ShardedServer server = new ShardedServer(SHARDS,
+            new ShardedServer.ShardFactory() {
+                public ShardedServer.Shard create(int index) {
+                    return new TestShard(index);
+                }
+            }, 256, false);
+        Check.equal(SHARDS, server.shards(), "shards");
+        server.start();
+
+        MachPort[] ports = new MachPort[PORTS];
+        int[] shards = new int[PORTS];
+        int[] counts = new int[SHARDS];
+        for(int i = 0; i < PORTS; i++) {
+            ports[i] = MachPort.allocate();
+            shards[i] = server.join(ports[i], i, Integer.valueOf(i));
+            Check.equal(server.shardOf(i), shards[i], "shard of the key");
+            Check.equal(shards[i], server.shardOf(i), "stable placement");
+            counts[shards[i]]++;
+        }
+
+        /* Every object is there by the time its first request comes. */
+        for(int i = 0; i < PORTS; i++) {
+            int[] reply = call(ports[i]);
+            Check.equal(shards[i], reply[0], "shard handling the request");
+            Check.equal(i, reply[1], "object adopted before the request");
+            Check.equal(counts[shards[i]], reply[2], "objects of the shard");
+        }
+
+        /* A name which is not a receive right can't join; whatever the
+         * shard did with the object is undone before the next request. */
+        MachPort dead = MachPort.allocate(MachPort.Right.DEAD_NAME);
+        Check.equal(-1, server.join(dead, 0, Integer.valueOf(-2)),
+                    "join of a dead name");
+        dead.deallocate();
+        int[] reply = call(ports[0]);
+        Check.equal(counts[shards[0]], reply[2], "objects of the shard");
+
+        server.close();
+        for(int i = 0; i < SHARDS; i++)
+            Check.equal(0, ((TestShard) server.shard(i)).wrongThread,
+                        "shard called from another thread");
+
+        /* The receive rights are left to us. */
+        for(MachPort port : ports) {
+            Check.check((Check.type(Check.name(port))
+                         & Mach.Port.TYPE_RECEIVE) != 0,
+                        "receive right kept after close");
+            port.destroy();
+        }
+        Check.done(ShardedServerTest.class);
+    }
+}
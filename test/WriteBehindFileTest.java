@@ -0,0 +1,194 @@
+package org.gnu.test;
+
+import java.util.ArrayList;
+import java.util.Arrays;
+import java.util.List;
+import java.util.concurrent.Semaphore;
+import org.gnu.hurd.Errno;
+import org.gnu.hurd.Io;
+import org.gnu.hurd.IoSkeleton;
+import org.gnu.hurd.WriteBehindFile;
+import org.gnu.mach.Mach;
+import org.gnu.mach.MachPort;
+import org.gnu.mach.MachServer;
+import org.gnu.mach.rpc.RpcException;
+
+/**
+ * Merging and ordering the writes buffered by a {@link WriteBehindFile},
+ * against a file server which can hold a write while more are buffered.
+ */
+public class WriteBehindFileTest {
+    private static final int FILE_SIZE = 32768;
+
+    /* Writes at this offset fail. */
+    private static final long BAD_OFFSET = FILE_SIZE - 1;
+
+    /* The file, and the log of the writes as offset and length pairs. */
+    private static final byte[] contents = new byte[FILE_SIZE];
+    private static final List<long[]> log = new ArrayList<long[]>();
+
+    /* If set, the next write signals entered and waits for the gate. */
+    private static volatile boolean hold;
+    private static final Semaphore entered = new Semaphore(0);
+    private static final Semaphore gate = new Semaphore(0);
+
+    private static final Io server = new Io() {
+        public int write(MachPort io, byte[] data, long offset)
+            throws RpcException
+        {
+            if(hold) {
+                hold = false;
+                entered.release();
+                gate.acquireUninterruptibly();
+            }
+            if(offset == BAD_OFFSET)
+                throw new RpcException(Errno.EIO);
+            synchronized(contents) {
+                System.arraycopy(data, 0, contents, (int) offset,
+                                 data.length);
+                log.add(new long[] { offset, data.length });
+            }
+            return data.length;
+        }
+
+        public byte[] read(MachPort io, long offset, int amount) {
+            synchronized(contents) {
+                return Arrays.copyOfRange(contents, (int) offset,
+                                          (int) offset + amount);
+            }
+        }
+
+        public long seek(MachPort io, long offset, int whence)
+            throws RpcException
+        {
+            throw new RpcException(Errno.EOPNOTSUPP);
+        }
+
+        public int readable(MachPort io) {
+            return 0;
+        }
+    };
+
+    private static byte[] fill(int length, int value) {
+        byte[] data = new byte[length];
+        Arrays.fill(data, (byte) value);
+        return data;
+    }
+
+    /* The writes logged since the last call, and clear the log. */
+    private static long[][] writes() {
+        synchronized(contents) {
+            long[][] writes = log.toArray(new long[log.size()][]);
+            log.clear();
+            return writes;
+        }
+    }
+
+    private static void checkWrite(long[] write, long offset, int length) {
+        Check.equal(offset, write[0], "offset of a write");
+        Check.equal(length, write[1], "length of a write");
+    }
+
+    private static void checkContents(byte[] got, byte[] expected) {
+        Check.equal(expected.length, got.length, "bytes read");
+        for(int i = 0; i < expected.length; i++)
+            Check.equal(expected[i], got[i], "file contents");
+    }
+
+    /*
+     * While the flusher is held writing a range, writes overlapping it go
+     * to a new range, merged with each other, and are written after it.
+     */
+    private static void merging(WriteBehindFile file) throws Exception {
+        hold = true;
+        file.write(fill(100, 1), 0);
+        entered.acquireUninterruptibly();
+
+        file.write(fill(100, 2), 50);
+        file.write(fill(50, 3), 150);
+        file.write(fill(10, 4), 120);
+        Check.equal(150, file.dirtyBytes(), "dirty bytes after merging");
+        file.write(fill(10, 5), 1000);
+        Check.equal(160, file.dirtyBytes(), "dirty bytes");
+        Check.equal(5, file.writes(), "writes");
+
+        gate.release();
+        file.flush();
+        Check.equal(0, file.dirtyBytes(), "dirty bytes after flush");
+        long[][] writes = writes();
+        Check.equal(3, writes.length, "io_write calls");
+        checkWrite(writes[0], 0, 100);
+        checkWrite(writes[1], 50, 150);
+        checkWrite(writes[2], 1000, 10);
+
+        /* The file is as if the writes had been made in order. */
+        byte[] expected = new byte[1010];
+        Arrays.fill(expected, 0, 50, (byte) 1);
+        Arrays.fill(expected, 50, 150, (byte) 2);
+        Arrays.fill(expected, 120, 130, (byte) 4);
+        Arrays.fill(expected, 150, 200, (byte) 3);
+        Arrays.fill(expected, 1000, 1010, (byte) 5);
+        checkContents(file.read(0, 1010), expected);
+    }
+
+    /* Adjacent ranges are only merged while they fit in one write. */
+    private static void chunks(WriteBehindFile file) throws Exception {
+        hold = true;
+        file.write(fill(1, 6), 0);
+        entered.acquireUninterruptibly();
+
+        file.write(fill(8000, 7), 10000);
+        file.write(fill(200, 8), 18000);
+        file.write(fill(100, 9), 10000 - 100);
+        gate.release();
+        file.flush();
+
+        long[][] writes = writes();
+        Check.equal(3, writes.length, "io_write calls");
+        checkWrite(writes[1], 10000 - 100, 8100);
+        checkWrite(writes[2], 18000, 200);
+        byte[] got = file.read(18000 - 1, 2);
+        Check.equal(7, got[0], "end of the first range");
+        Check.equal(8, got[1], "start of the second range");
+    }
+
+    /* A failed write is reported by the next flush, once. */
+    private static void errors(WriteBehindFile file) throws Exception {
+        file.write(fill(1, 10), BAD_OFFSET);
+        try {
+            file.flush();
+            Check.fail("failed write not reported");
+        } catch(RpcException exc) {
+            Check.equal(Errno.EIO, exc.code(), "error code");
+        }
+        file.flush();
+        writes();
+    }
+
+    public static void main(String argv[]) throws Exception {
+        MachPort port = MachPort.allocate();
+        MachServer ioServer = new MachServer(port, new IoSkeleton(server),
+                                             16384);
+        Thread thread = Check.serve(ioServer);
+        int name = Check.name(port);
+
+        WriteBehindFile file = new WriteBehindFile(Check.makeSend(port));
+        merging(file);
+        chunks(file);
+        errors(file);
+
+        file.close();
+        Check.equal(0, Check.refs(name, Mach.Port.RIGHT_SEND),
+                    "file port released");
+        try {
+            file.write(fill(1, 0), 0);
+            Check.fail("write after close");
+        } catch(IllegalStateException exc) {
+            /* expected */
+        }
+
+        Check.stop(ioServer, thread);
+        port.destroy();
+        Check.done(WriteBehindFileTest.class);
+    }
+}